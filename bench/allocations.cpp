@@ -0,0 +1,80 @@
+// Counts the heap allocations made by read() and write() on the corpora of
+// the codec benchmark, per message.
+//
+//     cmake -S . -B build && cmake --build build
+//     ./build/bench/msgplus_bench_allocations
+//
+// - allocs, bytes: the number and total size of the allocations.
+// - peak: the largest amount of memory held at once, including the result.
+//
+// read() decodes from a memory_reader into a fresh value; write() encodes
+// into a memory_writer whose buffer is already large enough.
+#define MSGPLUS_IMPLEMENT_ALLOCATION_HOOKS
+#include "corpora.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+
+namespace msg = msgplus;
+using bench::corpus;
+
+namespace
+{
+
+void report(const corpus& c, const char* op, const msg::allocation_stats& s)
+{
+    const auto n = static_cast<double>(c.messages.size());
+    std::printf("%-8s %-6s %12.1f %14.1f %12zu %10.2f\n", c.name, op,
+            static_cast<double>(s.allocations) / n,
+            static_cast<double>(s.bytes_allocated) / n,
+            s.peak_live_bytes,
+            static_cast<double>(s.allocations) / static_cast<double>(c.objects));
+}
+
+void run(const corpus& c)
+{
+    msg::allocation_stats reads;
+    msg::memory_reader r(c.encoded);
+    for(std::size_t i=0; i<c.messages.size(); ++i)
+    {
+        std::optional<msg::value> v;
+        const auto s = msg::count_allocations([&] {v = msg::read(r);});
+        if( ! v.has_value())
+        {
+            std::fprintf(stderr, "failed to decode %s\n", c.name);
+            std::exit(EXIT_FAILURE);
+        }
+        reads.allocations     += s.allocations;
+        reads.bytes_allocated += s.bytes_allocated;
+        reads.peak_live_bytes  = std::max(reads.peak_live_bytes, s.peak_live_bytes);
+    }
+    report(c, "read", reads);
+
+    msg::memory_writer w(c.encoded.size());
+    const auto writes = msg::count_allocations([&] {
+            for(const auto& m : c.messages) {msg::write(w, m);}
+        });
+    report(c, "write", writes);
+}
+
+} // anonymous
+
+int main()
+{
+    if( ! msg::allocation_counting_available())
+    {
+        std::fprintf(stderr, "the allocation hooks are not installed\n");
+        return EXIT_FAILURE;
+    }
+    const auto corpora = bench::make_corpora();
+
+    std::printf("%-8s %-6s %12s %14s %12s %10s\n", "corpus", "op",
+            "allocs/msg", "bytes/msg", "peak", "allocs/obj");
+    for(const auto& c : corpora)
+    {
+        run(c);
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Measures the throughput of read() and write() on generated corpora, for
+// each kind of reader and writer.
+//
+//     cmake -S . -B build && cmake --build build
+//     ./build/bench/msgplus_bench_codec [seconds per case]
+//
+// A corpus is a sequence of messages encoded back to back. MB/s is the size
+// of the encoded corpus; objects are msgpack objects, so a map of n pairs and
+// its contents count as 2n + 1.
+#include "corpora.hpp"
+#include "timing.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <vector>
+
+namespace msg = msgplus;
+using bench::corpus;
+
+namespace
+{
+
+// the fastest of the runs of `f` within `budget` seconds (at least 3)
+template<typename F>
+double fastest_run(const double budget, F&& f)
+{
+    double best  = 1e300;
+    double total = 0.0;
+    for(std::size_t i=0; i<3 || total < budget; ++i)
+    {
+        const double t = bench::seconds(f);
+        best   = std::min(best, t);
+        total += t;
+    }
+    return best;
+}
+
+void report(const corpus& c, const char* op, const char* io, const double seconds)
+{
+    std::printf("%-8s %-6s %-14s %10.1f MB/s %10.2f Mobj/s\n", c.name, op, io,
+            static_cast<double>(c.encoded.size()) / seconds / 1e6,
+            static_cast<double>(c.objects) / seconds / 1e6);
+}
+
+template<msg::Reader R>
+void read_all(R& reader, msg::decoder& dec, const corpus& c)
+{
+    for(std::size_t i=0; i<c.messages.size(); ++i)
+    {
+        if( ! dec.read(reader).has_value())
+        {
+            std::fprintf(stderr, "failed to decode %s\n", c.name);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+}
+
+template<msg::Writer W>
+void write_all(W& writer, const corpus& c)
+{
+    for(const auto& m : c.messages)
+    {
+        if( ! msg::write(writer, m))
+        {
+            std::fprintf(stderr, "failed to encode %s\n", c.name);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void run(const corpus& c, const double budget, const std::filesystem::path& tmp)
+{
+    msg::decoder dec;
+
+    report(c, "read", "memory_reader", fastest_run(budget, [&] {
+            msg::memory_reader r(c.encoded);
+            read_all(r, dec, c);
+        }));
+
+    {
+        msg::file_writer w(tmp);
+        w.write_bytes(c.encoded.data(), c.encoded.size());
+    }
+    report(c, "read", "file_reader", fastest_run(budget, [&] {
+            msg::file_reader r(tmp);
+            read_all(r, dec, c);
+        }));
+
+    msg::memory_writer mw(c.encoded.size());
+    report(c, "write", "memory_writer", fastest_run(budget, [&] {
+            mw.clear();
+            write_all(mw, c);
+        }));
+
+    report(c, "write", "file_writer", fastest_run(budget, [&] {
+            msg::file_writer w(tmp);
+            write_all(w, c);
+        }));
+}
+
+} // anonymous
+
+int main(int argc, char** argv)
+{
+    const double budget = 1 < argc ? std::atof(argv[1]) : 0.5;
+    const auto   tmp    = std::filesystem::temp_directory_path() / "msgplus_bench_codec.msg";
+
+    const auto corpora = bench::make_corpora();
+    for(const auto& c : corpora)
+    {
+        std::printf("# %s: %zu messages, %zu bytes, %zu objects\n",
+                c.name, c.messages.size(), c.encoded.size(), c.objects);
+    }
+    for(const auto& c : corpora)
+    {
+        run(c, budget, tmp);
+    }
+    std::filesystem::remove(tmp);
+    return 0;
+}
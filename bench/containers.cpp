@@ -0,0 +1,232 @@
+// Compares flat_map and ordered_map (with the sorted and the hashed index)
+// with std::map and std::unordered_map, in ns per element.
+//
+//     cmake -S . -B build && cmake --build build
+//     ./build/bench/msgplus_bench_containers [max size, default 1000000]
+//
+// - ins/sort, ins/rand: inserting keys one by one in increasing and in
+//   random order. `-` marks the cases that take quadratic time.
+// - bulk: constructing from a vector of pairs.
+// - find/hit, find/miss: looking up keys that are and are not in the map.
+// - iterate, copy, destroy: visiting, copying and destroying the whole map.
+//
+// Small maps are measured many times over, so that every case processes
+// about a million elements.
+#include "timing.hpp"
+
+#include <msgplus.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace msg = msgplus;
+using bench::seconds;
+
+namespace
+{
+
+constexpr std::size_t elements_per_case = 1'000'000;
+constexpr std::size_t num_queries       = 1'000'000;
+constexpr std::size_t quadratic_limit   = 1 << 16;
+
+std::uint64_t sink = 0;
+
+constexpr std::uint64_t mix(std::uint64_t x) noexcept // a bijection
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+template<typename Map>
+concept insertion_ordered = requires(Map& m, typename Map::key_type k) {
+    m.emplace_back(k, typename Map::mapped_type{});
+};
+
+template<typename Map, typename Key>
+void insert_one(Map& m, const Key& k, const std::uint64_t v)
+{
+    if constexpr(insertion_ordered<Map>)
+    {
+        m.emplace_back(k, v);
+    }
+    else
+    {
+        m.emplace(k, v);
+    }
+}
+
+template<typename Map, typename Key>
+Map bulk_construct(const std::vector<std::pair<Key, std::uint64_t>>& kvs)
+{
+    if constexpr(insertion_ordered<Map>)
+    {
+        return Map(typename Map::container_type(kvs.begin(), kvs.end()));
+    }
+    else
+    {
+        return Map(kvs.begin(), kvs.end());
+    }
+}
+
+template<typename Key>
+struct dataset
+{
+    std::vector<std::pair<Key, std::uint64_t>> kvs;    // in increasing order of key
+    std::vector<std::pair<Key, std::uint64_t>> random; // the same, shuffled
+    std::vector<Key>                           hits;
+    std::vector<Key>                           misses;
+};
+
+template<typename Key, typename MakeKey>
+dataset<Key> make_dataset(const std::size_t n, MakeKey make_key)
+{
+    std::mt19937_64 rng(n);
+    dataset<Key> d;
+    d.kvs.reserve(n);
+    for(std::size_t i=0; i<n; ++i)
+    {
+        d.kvs.emplace_back(make_key(mix(i)), i + 1);
+    }
+    std::sort(d.kvs.begin(), d.kvs.end());
+    d.random = d.kvs;
+    std::shuffle(d.random.begin(), d.random.end(), rng);
+
+    d.hits.reserve(num_queries);
+    d.misses.reserve(num_queries);
+    for(std::size_t i=0; i<num_queries; ++i)
+    {
+        d.hits.push_back(d.kvs[rng() % n].first);
+        d.misses.push_back(make_key(mix(n + rng() % n)));
+    }
+    return d;
+}
+
+// `quadratic` if inserting in random order takes O(n) per element
+template<typename Map, typename Key>
+void run(const char* name, const bool quadratic, const dataset<Key>& d)
+{
+    const std::size_t n    = d.kvs.size();
+    const std::size_t reps = std::max<std::size_t>(1, elements_per_case / n);
+    const double      elems = static_cast<double>(reps * n);
+    const auto per_elem  = [elems](const double t) {return t / elems * 1e9;};
+    const auto per_query = [](const double t) {return t / static_cast<double>(num_queries) * 1e9;};
+
+    std::vector<Map> maps;
+    maps.reserve(reps);
+
+    double ins_sorted = 0.0;
+    {
+        maps.resize(reps);
+        ins_sorted = per_elem(seconds([&] {
+                for(auto& m : maps)
+                {
+                    for(const auto& [k, v] : d.kvs) {insert_one(m, k, v);}
+                }
+            }));
+        maps.clear();
+    }
+
+    double ins_random = -1.0;
+    double destroy    = 0.0;
+    if( ! quadratic || n <= quadratic_limit)
+    {
+        maps.resize(reps);
+        ins_random = per_elem(seconds([&] {
+                for(auto& m : maps)
+                {
+                    for(const auto& [k, v] : d.random) {insert_one(m, k, v);}
+                }
+            }));
+        destroy = per_elem(seconds([&] {maps.clear();}));
+    }
+
+    const double bulk = per_elem(seconds([&] {
+            for(std::size_t i=0; i<reps; ++i)
+            {
+                maps.push_back(bulk_construct<Map>(d.random));
+            }
+        }));
+    if(ins_random < 0.0)
+    {
+        destroy = per_elem(seconds([&] {maps.clear();}));
+    }
+    else
+    {
+        maps.clear();
+    }
+
+    const Map map = bulk_construct<Map>(d.random);
+
+    const double find_hit = per_query(seconds([&] {
+            for(const auto& k : d.hits) {sink += map.find(k)->second;}
+        }));
+    const double find_miss = per_query(seconds([&] {
+            for(const auto& k : d.misses) {sink += (map.find(k) == map.end()) ? 1 : 0;}
+        }));
+    const double iterate = per_elem(seconds([&] {
+            for(std::size_t i=0; i<reps; ++i)
+            {
+                for(const auto& kv : map) {sink += kv.second;}
+            }
+        }));
+    const double copy = per_elem(seconds([&] {
+            for(std::size_t i=0; i<reps; ++i) {maps.push_back(map);}
+        }));
+    maps.clear();
+
+    char random_str[16] = "-";
+    if(0.0 <= ins_random)
+    {
+        std::snprintf(random_str, sizeof(random_str), "%.1f", ins_random);
+    }
+    std::printf("%9zu %-18s %9.1f %9s %9.1f %9.1f %9.1f %9.2f %9.1f %9.1f\n", n, name,
+            ins_sorted, random_str, bulk, find_hit, find_miss, iterate, copy, destroy);
+}
+
+template<typename Key, typename MakeKey>
+void run_all(const char* key_name, const std::vector<std::size_t>& sizes, MakeKey make_key)
+{
+    std::printf("# key = %s, ns per element\n", key_name);
+    std::printf("%9s %-18s %9s %9s %9s %9s %9s %9s %9s %9s\n", "size", "container",
+            "ins/sort", "ins/rand", "bulk", "find/hit", "find/miss", "iterate", "copy", "destroy");
+    for(const auto n : sizes)
+    {
+        const auto d = make_dataset<Key>(n, make_key);
+
+        using V = std::uint64_t;
+        run<std::map<Key, V>>          ("std::map",           false, d);
+        run<std::unordered_map<Key, V>>("std::unordered_map", false, d);
+        run<msg::flat_map<Key, V>>     ("flat_map",           true,  d);
+        run<msg::ordered_map<Key, V>>  ("ordered_map",        true,  d);
+        run<msg::ordered_map<Key, V, std::less<Key>, std::allocator<std::pair<Key, V>>, 16,
+            msg::hashed_index<>>>      ("ordered_map/hash",   false, d);
+    }
+}
+
+} // anonymous
+
+int main(int argc, char** argv)
+{
+    const std::size_t max_size = 1 < argc ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+
+    std::vector<std::size_t> sizes;
+    for(const std::size_t n : {4u, 16u, 64u, 256u, 1'024u, 16'384u, 262'144u, 1'000'000u, 10'000'000u})
+    {
+        if(n <= max_size) {sizes.push_back(n);}
+    }
+
+    run_all<std::uint64_t>("uint64", sizes, [](std::uint64_t x) {return x;});
+    run_all<std::string>  ("string", sizes, [](std::uint64_t x) {return "key-" + std::to_string(x);});
+
+    if(sink == 0) {std::printf("(unexpected)\n");}
+    return 0;
+}
@@ -0,0 +1,210 @@
+// The corpora shared by the codec benchmarks.
+#ifndef MSGPLUS_BENCH_CORPORA_HPP
+#define MSGPLUS_BENCH_CORPORA_HPP
+
+#include <msgplus.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+
+namespace msg = msgplus;
+
+struct corpus
+{
+    const char*             name;
+    std::vector<msg::value> messages;
+    std::vector<std::byte>  encoded;
+    std::size_t             objects = 0;
+};
+
+inline std::size_t count_objects(const msg::value& root)
+{
+    std::size_t n = 0;
+    std::vector<const msg::value*> stack{std::addressof(root)};
+    while( ! stack.empty())
+    {
+        const auto* v = stack.back();
+        stack.pop_back();
+        n += 1;
+        if(const auto* arr = v->try_array())
+        {
+            for(const auto& e : *arr) {stack.push_back(std::addressof(e));}
+        }
+        else if(const auto* map = v->try_map())
+        {
+            for(const auto& [k, e] : *map)
+            {
+                stack.push_back(std::addressof(k));
+                stack.push_back(std::addressof(e));
+            }
+        }
+    }
+    return n;
+}
+
+inline std::string random_string(std::mt19937_64& rng, const std::size_t min_len, const std::size_t max_len)
+{
+    const auto len = min_len + rng() % (max_len - min_len + 1);
+    std::string s(len, ' ');
+    for(auto& c : s) {c = static_cast<char>('a' + rng() % 26);}
+    return s;
+}
+
+// a page of records, as returned by a typical JSON-style API
+inline corpus make_api(std::mt19937_64& rng)
+{
+    const std::size_t records = 2'000;
+    msg::array_type data;
+    data.reserve(records);
+    for(std::size_t i=0; i<records; ++i)
+    {
+        msg::array_type tags;
+        const auto num_tags = rng() % 5;
+        for(std::size_t j=0; j<num_tags; ++j)
+        {
+            tags.push_back(msg::value(random_string(rng, 3, 8)));
+        }
+        msg::map_type address;
+        address.emplace_back(msg::value("street"), msg::value(random_string(rng, 8, 20)));
+        address.emplace_back(msg::value("city"),   msg::value(random_string(rng, 4, 12)));
+        address.emplace_back(msg::value("zip"),    msg::value(random_string(rng, 5, 5)));
+
+        msg::map_type record;
+        record.emplace_back(msg::value("id"),      msg::value(static_cast<std::uint64_t>(i)));
+        record.emplace_back(msg::value("name"),    msg::value(random_string(rng, 4, 16)));
+        record.emplace_back(msg::value("email"),   msg::value(random_string(rng, 10, 24)));
+        record.emplace_back(msg::value("active"),  msg::value(rng() % 2 == 0));
+        record.emplace_back(msg::value("score"),   msg::value(static_cast<double>(rng() % 10'000) / 100.0));
+        record.emplace_back(msg::value("tags"),    msg::value(std::move(tags)));
+        record.emplace_back(msg::value("address"), msg::value(std::move(address)));
+        data.push_back(msg::value(std::move(record)));
+    }
+    msg::map_type page;
+    page.emplace_back(msg::value("page"),  msg::value(1));
+    page.emplace_back(msg::value("total"), msg::value(records));
+    page.emplace_back(msg::value("data"),  msg::value(std::move(data)));
+
+    corpus c{"api", {}, {}, 0};
+    c.messages.push_back(msg::value(std::move(page)));
+    return c;
+}
+
+// long arrays of floats and of integers of mixed widths
+inline corpus make_numeric(std::mt19937_64& rng)
+{
+    const std::size_t n = 256 * 1024;
+    msg::array_type floats;
+    msg::array_type ints;
+    floats.reserve(n);
+    ints.reserve(n);
+    std::normal_distribution<double> dist(0.0, 1000.0);
+    for(std::size_t i=0; i<n; ++i)
+    {
+        floats.push_back(msg::value(dist(rng)));
+        const auto bits = 8 * (1 + rng() % 8); // 8 to 64 bit magnitudes
+        const auto x = static_cast<std::int64_t>(rng() >> (64 - bits + 1));
+        ints.push_back(msg::value(rng() % 2 == 0 ? x : -x));
+    }
+    corpus c{"numeric", {}, {}, 0};
+    c.messages.push_back(msg::value(std::move(floats)));
+    c.messages.push_back(msg::value(std::move(ints)));
+    return c;
+}
+
+inline corpus make_blobs(std::mt19937_64& rng)
+{
+    corpus c{"blobs", {}, {}, 0};
+    for(std::size_t i=0; i<64; ++i)
+    {
+        msg::bin_type blob(64 * 1024);
+        for(auto& b : blob) {b = static_cast<std::byte>(rng());}
+        c.messages.push_back(msg::value(std::move(blob)));
+    }
+    return c;
+}
+
+// arrays and maps nested 500 levels deep
+inline corpus make_deep(std::mt19937_64& rng)
+{
+    corpus c{"deep", {}, {}, 0};
+    for(std::size_t i=0; i<200; ++i)
+    {
+        msg::value v(static_cast<std::uint64_t>(rng() % 1000));
+        for(std::size_t d=0; d<500; ++d)
+        {
+            if(d % 2 == 0)
+            {
+                msg::array_type arr;
+                arr.push_back(msg::value(d));
+                arr.push_back(std::move(v));
+                v = msg::value(std::move(arr));
+            }
+            else
+            {
+                msg::map_type map;
+                map.emplace_back(msg::value("k"), std::move(v));
+                v = msg::value(std::move(map));
+            }
+        }
+        c.messages.push_back(std::move(v));
+    }
+    return c;
+}
+
+// many messages of a few tens of bytes, like a stream of events
+inline corpus make_tiny(std::mt19937_64& rng)
+{
+    static const char* const ops[] = {"get", "set", "del", "inc"};
+
+    corpus c{"tiny", {}, {}, 0};
+    for(std::size_t i=0; i<200'000; ++i)
+    {
+        msg::map_type m;
+        m.emplace_back(msg::value("op"), msg::value(ops[rng() % 4]));
+        m.emplace_back(msg::value("k"),  msg::value(static_cast<std::uint64_t>(rng() % 100'000)));
+        m.emplace_back(msg::value("v"),  msg::value(static_cast<double>(rng() % 1'000) * 0.5));
+        c.messages.push_back(msg::value(std::move(m)));
+    }
+    return c;
+}
+
+inline void encode_corpus(corpus& c)
+{
+    msg::memory_writer w;
+    for(const auto& m : c.messages)
+    {
+        if( ! msg::write(w, m))
+        {
+            std::fprintf(stderr, "failed to encode %s\n", c.name);
+            std::exit(EXIT_FAILURE);
+        }
+        c.objects += count_objects(m);
+    }
+    c.encoded = w.release();
+}
+
+// generates all the corpora, encoded
+inline std::vector<corpus> make_corpora()
+{
+    std::mt19937_64 rng(42);
+    std::vector<corpus> corpora;
+    corpora.push_back(make_api(rng));
+    corpora.push_back(make_numeric(rng));
+    corpora.push_back(make_blobs(rng));
+    corpora.push_back(make_deep(rng));
+    corpora.push_back(make_tiny(rng));
+    for(auto& c : corpora)
+    {
+        encode_corpus(c);
+    }
+    return corpora;
+}
+
+} // bench
+#endif // MSGPLUS_BENCH_CORPORA_HPP
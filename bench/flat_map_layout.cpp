@@ -0,0 +1,83 @@
+// Compares the lookup speed of flat_map (an array of pairs) with
+// split_flat_map in the sorted and the eytzinger layouts.
+//
+//     cmake -S . -B build && cmake --build build
+//     ./build/bench/msgplus_bench_flat_map_layout
+#include "timing.hpp"
+
+#include <msgplus.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace msg = msgplus;
+
+template<typename F>
+double ns_per_op(const std::size_t ops, F&& f)
+{
+    return bench::seconds(std::forward<F>(f)) * 1e9 / static_cast<double>(ops);
+}
+
+template<typename Map, typename Key>
+double lookup(const Map& map, const std::vector<Key>& queries)
+{
+    std::uint64_t sum = 0;
+    const auto t = ns_per_op(queries.size(), [&] {
+            for(const auto& q : queries)
+            {
+                if constexpr(requires {*map.find(q);} && ! requires {map.find(q)->second;})
+                {
+                    sum += *map.find(q); // split_flat_map returns a pointer
+                }
+                else
+                {
+                    sum += map.find(q)->second;
+                }
+            }
+        });
+    if(sum == 0) {std::printf("(unexpected)\n");}
+    return t;
+}
+
+template<typename Key, typename MakeKey>
+void run(const char* name, const std::size_t n, MakeKey make_key)
+{
+    std::mt19937_64 rng(n);
+    std::vector<std::pair<Key, std::uint64_t>> kvs;
+    kvs.reserve(n);
+    for(std::size_t i=0; i<n; ++i)
+    {
+        kvs.emplace_back(make_key(rng()), i + 1);
+    }
+    std::vector<Key> queries;
+    const std::size_t num_queries = 1'000'000;
+    queries.reserve(num_queries);
+    for(std::size_t i=0; i<num_queries; ++i)
+    {
+        queries.push_back(kvs[rng() % n].first);
+    }
+
+    const msg::flat_map<Key, std::uint64_t> pairs(kvs.begin(), kvs.end());
+    const msg::split_flat_map<Key, std::uint64_t> sorted(kvs.begin(), kvs.end());
+    const msg::split_flat_map<Key, std::uint64_t, std::less<Key>,
+          msg::flat_map_layout::eytzinger> eytzinger(kvs.begin(), kvs.end());
+
+    std::printf("%-8s n = %9zu: flat_map %6.1f ns, split sorted %6.1f ns, split eytzinger %6.1f ns\n",
+            name, n, lookup(pairs, queries), lookup(sorted, queries), lookup(eytzinger, queries));
+}
+
+int main()
+{
+    for(const std::size_t n : {1'000u, 100'000u, 1'000'000u, 10'000'000u})
+    {
+        run<std::uint64_t>("uint64", n, [](std::uint64_t x) {return x;});
+    }
+    for(const std::size_t n : {1'000u, 100'000u, 1'000'000u})
+    {
+        run<std::string>("string", n, [](std::uint64_t x) {return "key-" + std::to_string(x);});
+    }
+    return 0;
+}
@@ -0,0 +1,251 @@
+// Measures the latency of read() and write() of small messages, one message
+// at a time, on one thread and on many threads at once.
+//
+//     cmake -S . -B build && cmake --build build
+//     ./build/bench/msgplus_bench_latency [threads] [messages per thread]
+//
+// The messages are RPC-like maps of 50 to 500 bytes. Each thread decodes
+// them from a memory_reader and encodes them to a memory_writer, reusing its
+// decoder, encoder and writer. A decoded value is destroyed after its time
+// is taken.
+//
+// Latencies are in ticks of the time stamp counter on x86-64 (reference
+// cycles, which do not follow the frequency scaling of the core) and of
+// steady_clock elsewhere, and are also shown in ns.
+#include "corpora.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <latch>
+#include <random>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define MSGPLUS_BENCH_HAS_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MSGPLUS_BENCH_HAS_RDTSC 1
+#endif
+
+namespace msg = msgplus;
+using bench::random_string;
+
+namespace
+{
+
+using ticks_type = std::uint64_t;
+
+ticks_type now_ticks() noexcept
+{
+#if defined(MSGPLUS_BENCH_HAS_RDTSC)
+    return __rdtsc();
+#else
+    return static_cast<ticks_type>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+double ticks_per_ns()
+{
+    const auto t0 = now_ticks();
+    const auto c0 = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    const auto t1 = now_ticks();
+    const auto c1 = std::chrono::steady_clock::now();
+    return static_cast<double>(t1 - t0) /
+        static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(c1 - c0).count());
+}
+
+std::size_t encoded_size(const msg::value& v)
+{
+    msg::memory_writer w;
+    msg::write(w, v);
+    return w.size();
+}
+
+// a request of about `target` bytes:
+// {"id": 123, "method": "...", "meta": {...}, "params": [...]}
+msg::value make_message(std::mt19937_64& rng, const std::size_t target)
+{
+    msg::map_type meta;
+    meta.emplace_back(msg::value("trace"), msg::value(random_string(rng, 8, 16)));
+    meta.emplace_back(msg::value("retry"), msg::value(rng() % 2 == 0));
+
+    msg::map_type m;
+    m.emplace_back(msg::value("id"),     msg::value(static_cast<std::uint64_t>(rng() % 1'000'000)));
+    m.emplace_back(msg::value("method"), msg::value(random_string(rng, 4, 12)));
+    m.emplace_back(msg::value("meta"),   msg::value(std::move(meta)));
+    m.emplace_back(msg::value("params"), msg::value(msg::array_type{}));
+
+    msg::value v(std::move(m));
+    while(encoded_size(v) < target)
+    {
+        auto& params = v.as_map().at(msg::value("params")).as_array();
+        switch(rng() % 4)
+        {
+            case 0: {params.push_back(msg::value(static_cast<std::int64_t>(rng() % 100'000) - 50'000)); break;}
+            case 1: {params.push_back(msg::value(static_cast<double>(rng() % 10'000) / 16.0)); break;}
+            case 2: {params.push_back(msg::value(random_string(rng, 3, 24))); break;}
+            default:
+            {
+                msg::map_type kv;
+                kv.emplace_back(msg::value(random_string(rng, 1, 6)), msg::value(rng() % 1'000));
+                params.push_back(msg::value(std::move(kv)));
+                break;
+            }
+        }
+    }
+    return v;
+}
+
+struct message
+{
+    msg::value             v;
+    std::vector<std::byte> encoded;
+};
+
+std::vector<message> make_messages(const std::size_t n, const std::uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    std::vector<message> ms;
+    ms.reserve(n);
+    for(std::size_t i=0; i<n; ++i)
+    {
+        auto v = make_message(rng, 50 + rng() % 450);
+        msg::memory_writer w;
+        msg::write(w, v);
+        ms.push_back(message{std::move(v), w.release()});
+    }
+    return ms;
+}
+
+struct latencies
+{
+    std::vector<ticks_type> read;
+    std::vector<ticks_type> write;
+};
+
+void measure(const std::vector<message>& ms, latencies& out)
+{
+    msg::decoder       dec;
+    msg::encoder       enc;
+    msg::memory_writer w(1024);
+
+    out.read .reserve(ms.size());
+    out.write.reserve(ms.size());
+    for(const auto& m : ms)
+    {
+        msg::memory_reader r(m.encoded);
+        const auto t0 = now_ticks();
+        auto v = dec.read(r);
+        const auto t1 = now_ticks();
+        if( ! v.has_value())
+        {
+            std::fprintf(stderr, "failed to decode\n");
+            std::exit(EXIT_FAILURE);
+        }
+        out.read.push_back(t1 - t0);
+    }
+    for(const auto& m : ms)
+    {
+        w.clear();
+        const auto t0 = now_ticks();
+        const bool ok = enc.write(w, m.v);
+        const auto t1 = now_ticks();
+        if( ! ok)
+        {
+            std::fprintf(stderr, "failed to encode\n");
+            std::exit(EXIT_FAILURE);
+        }
+        out.write.push_back(t1 - t0);
+    }
+}
+
+// runs `measure` on `num_threads` threads at once, each on its own messages
+latencies run(const std::vector<std::vector<message>>& inputs, const std::size_t num_threads)
+{
+    std::vector<latencies> results(num_threads);
+    {
+        std::latch start(static_cast<std::ptrdiff_t>(num_threads));
+        std::vector<std::jthread> threads;
+        for(std::size_t i=0; i<num_threads; ++i)
+        {
+            threads.emplace_back([&, i] {
+                    latencies warmup;
+                    measure(inputs[i], warmup);
+                    start.arrive_and_wait();
+                    measure(inputs[i], results[i]);
+                });
+        }
+    }
+    latencies all;
+    for(auto& r : results)
+    {
+        all.read .insert(all.read .end(), r.read .begin(), r.read .end());
+        all.write.insert(all.write.end(), r.write.begin(), r.write.end());
+    }
+    return all;
+}
+
+ticks_type percentile(const std::vector<ticks_type>& sorted, const double p)
+{
+    const auto i = static_cast<std::size_t>(p * static_cast<double>(sorted.size() - 1));
+    return sorted[i];
+}
+
+void report(const char* op, const std::size_t num_threads, std::vector<ticks_type> ts,
+            const double tpn)
+{
+    std::sort(ts.begin(), ts.end());
+    const auto p50  = percentile(ts, 0.5);
+    const auto p99  = percentile(ts, 0.99);
+    const auto p999 = percentile(ts, 0.999);
+    std::printf("%-6s %7zu %9llu %9llu %9llu %9llu %9.0f %9.0f %9.0f\n", op, num_threads,
+            static_cast<unsigned long long>(p50),  static_cast<unsigned long long>(p99),
+            static_cast<unsigned long long>(p999), static_cast<unsigned long long>(ts.back()),
+            static_cast<double>(p50) / tpn, static_cast<double>(p99) / tpn,
+            static_cast<double>(p999) / tpn);
+}
+
+} // anonymous
+
+int main(int argc, char** argv)
+{
+    const std::size_t max_threads = 1 < argc ? std::strtoull(argv[1], nullptr, 10) :
+        std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t num_messages = 2 < argc ? std::strtoull(argv[2], nullptr, 10) : 100'000;
+    if(max_threads == 0 || num_messages == 0)
+    {
+        std::fprintf(stderr, "usage: %s [threads] [messages per thread], both at least 1\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::vector<message>> inputs;
+    std::size_t total_bytes = 0;
+    for(std::size_t i=0; i<max_threads; ++i)
+    {
+        inputs.push_back(make_messages(num_messages, i + 1));
+    }
+    for(const auto& m : inputs.front()) {total_bytes += m.encoded.size();}
+
+    const double tpn = ticks_per_ns();
+    std::printf("# %zu messages per thread, %.0f bytes on average, %.2f ticks/ns\n",
+            num_messages, static_cast<double>(total_bytes) / static_cast<double>(num_messages), tpn);
+    std::printf("%-6s %7s %9s %9s %9s %9s %9s %9s %9s\n", "op", "threads",
+            "p50", "p99", "p99.9", "max", "p50 ns", "p99 ns", "p99.9 ns");
+
+    std::vector<std::size_t> thread_counts{1};
+    if(1 < max_threads) {thread_counts.push_back(max_threads);}
+    for(const auto n : thread_counts)
+    {
+        auto ls = run(inputs, n);
+        report("read",  n, std::move(ls.read),  tpn);
+        report("write", n, std::move(ls.write), tpn);
+    }
+    return 0;
+}
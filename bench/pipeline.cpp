@@ -0,0 +1,87 @@
+// Compares decoding a stream of documents with a decoder on one thread and
+// with pipelined_decoder on a number of threads.
+//
+//     cmake -S . -B build && cmake --build build
+//     ./build/bench/msgplus_bench_pipeline [max threads] [repeats]
+//
+// The stream is the corpora of the codec benchmark, concatenated `repeats`
+// times (default 4), read from a file.
+#include "corpora.hpp"
+#include "timing.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+namespace msg = msgplus;
+using bench::seconds;
+
+namespace
+{
+
+void check(const std::size_t n, const std::size_t expected, const bool ok)
+{
+    if(n != expected || ! ok)
+    {
+        std::fprintf(stderr, "decoded %zu documents out of %zu\n", n, expected);
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+void report(const char* name, const std::size_t threads, const std::size_t bytes, const double t)
+{
+    std::printf("%-18s %7zu %10.1f MB/s\n", name, threads, static_cast<double>(bytes) / t / 1e6);
+}
+
+} // anonymous
+
+int main(int argc, char** argv)
+{
+    const std::size_t max_threads = 1 < argc ? std::strtoull(argv[1], nullptr, 10) :
+        std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t repeats = 2 < argc ? std::strtoull(argv[2], nullptr, 10) : 4;
+    const auto tmp = std::filesystem::temp_directory_path() / "msgplus_bench_pipeline.msg";
+
+    std::size_t num_docs  = 0;
+    std::size_t num_bytes = 0;
+    {
+        const auto corpora = bench::make_corpora();
+        msg::file_writer w(tmp);
+        for(std::size_t i=0; i<repeats; ++i)
+        {
+            for(const auto& c : corpora)
+            {
+                w.write_bytes(c.encoded.data(), c.encoded.size());
+                num_docs  += c.messages.size();
+                num_bytes += c.encoded.size();
+            }
+        }
+    }
+    std::printf("# %zu documents, %zu bytes\n", num_docs, num_bytes);
+    std::printf("%-18s %7s %15s\n", "decoder", "threads", "throughput");
+
+    report("decoder", 1, num_bytes, seconds([&] {
+            msg::file_reader r(tmp);
+            msg::decoder dec;
+            std::size_t n = 0;
+            while( ! r.is_eof() && dec.read(r).has_value()) {++n;}
+            check(n, num_docs, true);
+        }));
+
+    for(std::size_t threads = 1; threads <= max_threads; threads *= 2)
+    {
+        report("pipelined_decoder", threads, num_bytes, seconds([&] {
+                msg::file_reader r(tmp);
+                msg::pipeline_options opts;
+                opts.threads = threads;
+                msg::pipelined_decoder<msg::file_reader> p(r, opts);
+                std::size_t n = 0;
+                while(p.next().has_value()) {++n;}
+                check(n, num_docs, p.is_ok());
+            }));
+    }
+    std::filesystem::remove(tmp);
+    return 0;
+}
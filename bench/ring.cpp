@@ -0,0 +1,125 @@
+// Measures handing messages from one thread to another, through an
+// spsc_ring and through a mutex-protected deque of encoded buffers.
+//
+//     cmake -S . -B build && cmake --build build
+//     ./build/bench/msgplus_bench_ring [ring capacity, default 65536]
+//
+// The producer encodes the messages of the `tiny` and `api` corpora of the
+// codec benchmark, and the consumer decodes them.
+#include "corpora.hpp"
+#include "timing.hpp"
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace msg = msgplus;
+using bench::corpus;
+using bench::seconds;
+
+namespace
+{
+
+void check(const corpus& c, const std::size_t n)
+{
+    if(n != c.messages.size())
+    {
+        std::fprintf(stderr, "received %zu messages out of %zu\n", n, c.messages.size());
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+void report(const corpus& c, const char* name, const double t)
+{
+    std::printf("%-8s %-12s %10.1f MB/s %10.3f Mmsg/s\n", c.name, name,
+            static_cast<double>(c.encoded.size()) / t / 1e6,
+            static_cast<double>(c.messages.size()) / t / 1e6);
+}
+
+double through_ring(const corpus& c, const std::size_t capacity)
+{
+    return seconds([&] {
+            msg::spsc_ring ring(capacity);
+            std::thread producer([&] {
+                    msg::ring_writer w(ring);
+                    msg::encoder enc;
+                    for(const auto& m : c.messages) {enc.write(w, m);}
+                    w.close();
+                });
+
+            msg::ring_reader r(ring);
+            msg::decoder dec;
+            std::size_t n = 0;
+            while( ! r.is_eof() && dec.read(r).has_value()) {++n;}
+            producer.join();
+            check(c, n);
+        });
+}
+
+double through_deque(const corpus& c)
+{
+    return seconds([&] {
+            std::mutex mtx;
+            std::condition_variable cv;
+            std::deque<std::vector<std::byte>> queue;
+            bool done = false;
+
+            std::thread producer([&] {
+                    msg::encoder enc;
+                    for(const auto& m : c.messages)
+                    {
+                        msg::memory_writer w;
+                        enc.write(w, m);
+                        {
+                            std::lock_guard<std::mutex> lock(mtx);
+                            queue.push_back(w.release());
+                        }
+                        cv.notify_one();
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        done = true;
+                    }
+                    cv.notify_one();
+                });
+
+            msg::decoder dec;
+            std::size_t n = 0;
+            while(true)
+            {
+                std::vector<std::byte> buf;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait(lock, [&] {return done || ! queue.empty();});
+                    if(queue.empty()) {break;}
+                    buf = std::move(queue.front());
+                    queue.pop_front();
+                }
+                msg::memory_reader r(buf);
+                if(dec.read(r).has_value()) {++n;}
+            }
+            producer.join();
+            check(c, n);
+        });
+}
+
+} // anonymous
+
+int main(int argc, char** argv)
+{
+    const std::size_t capacity = 1 < argc ? std::strtoull(argv[1], nullptr, 10) : 65536;
+
+    for(const auto& c : bench::make_corpora())
+    {
+        if(c.name != std::string_view("tiny") && c.name != std::string_view("api")) {continue;}
+
+        report(c, "spsc_ring",    through_ring(c, capacity));
+        report(c, "mutex+deque",  through_deque(c));
+    }
+    return 0;
+}
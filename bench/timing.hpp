@@ -0,0 +1,22 @@
+// The timing helpers shared by the benchmarks.
+#ifndef MSGPLUS_BENCH_TIMING_HPP
+#define MSGPLUS_BENCH_TIMING_HPP
+
+#include <chrono>
+#include <utility>
+
+namespace bench
+{
+
+// the wall-clock time that `f()` takes, in seconds
+template<typename F>
+double seconds(F&& f)
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::forward<F>(f)();
+    const auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(stop - start).count();
+}
+
+} // bench
+#endif // MSGPLUS_BENCH_TIMING_HPP
@@ -21,12 +21,24 @@
 
 // IWYU pragma: begin_exports
 #include "msgplus/flat_map.hpp"
+#include "msgplus/split_flat_map.hpp"
 #include "msgplus/ordered_map.hpp"
+#include "msgplus/small_vector.hpp"
+#include "msgplus/ext.hpp"
 #include "msgplus/value.hpp"
+#include "msgplus/stats.hpp"
+#include "msgplus/hash.hpp"
+#include "msgplus/shared_value.hpp"
 #include "msgplus/reader.hpp"
 #include "msgplus/read.hpp"
+#include "msgplus/path.hpp"
+#include "msgplus/projection.hpp"
+#include "msgplus/patch.hpp"
+#include "msgplus/pipeline.hpp"
 #include "msgplus/writer.hpp"
+#include "msgplus/ring.hpp"
 #include "msgplus/write.hpp"
+#include "msgplus/allocation_stats.hpp"
 // IWYU pragma: end_exports
 
 #endif//MSGPLUS_HPP
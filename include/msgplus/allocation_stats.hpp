@@ -0,0 +1,242 @@
+#ifndef MSGPLUS_ALLOCATION_STATS_HPP
+#define MSGPLUS_ALLOCATION_STATS_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+// Opt-in counting of heap allocations.
+//
+// The counting is done by replacements of the global operator new and delete.
+// To install them, define `MSGPLUS_IMPLEMENT_ALLOCATION_HOOKS` in exactly one
+// translation unit of the program before including this header:
+//
+// ```cpp
+// #define MSGPLUS_IMPLEMENT_ALLOCATION_HOOKS
+// #include <msgplus.hpp>
+//
+// const auto stats = msgplus::count_allocations([&] { v = msgplus::read(reader); });
+// ```
+//
+// Only the allocations made by the current thread inside an allocation_scope
+// are counted. Outside of a scope, the hooks cost a thread-local flag check.
+// Every allocation carries a small header that remembers its size, so the
+// hooks are for measurement builds, not for production.
+
+namespace msgplus
+{
+
+struct allocation_stats
+{
+    std::size_t allocations     = 0;
+    std::size_t deallocations   = 0;
+    std::size_t bytes_allocated = 0;
+    std::size_t bytes_freed     = 0;
+    // the largest net amount of memory held at any point since the start,
+    // not counting what was allocated before it
+    std::size_t peak_live_bytes = 0;
+};
+
+namespace detail
+{
+
+struct allocation_counter
+{
+    bool             active = false;
+    allocation_stats stats;
+    std::int64_t     live   = 0; // may be negative if memory from before is freed
+};
+
+inline thread_local allocation_counter current_allocations;
+
+// set by the translation unit that implements the hooks
+inline bool allocation_hooks_installed = false;
+
+inline void record_allocation(const std::size_t n) noexcept
+{
+    auto& c = current_allocations;
+    if( ! c.active) {return;}
+
+    c.stats.allocations     += 1;
+    c.stats.bytes_allocated += n;
+    c.live                  += static_cast<std::int64_t>(n);
+    if(0 < c.live)
+    {
+        c.stats.peak_live_bytes = std::max(c.stats.peak_live_bytes,
+                                           static_cast<std::size_t>(c.live));
+    }
+    return;
+}
+
+inline void record_deallocation(const std::size_t n) noexcept
+{
+    auto& c = current_allocations;
+    if( ! c.active) {return;}
+
+    c.stats.deallocations += 1;
+    c.stats.bytes_freed   += n;
+    c.live                -= static_cast<std::int64_t>(n);
+    return;
+}
+
+} // detail
+
+// true if the hooks are linked into the program. If not, scopes count nothing.
+inline bool allocation_counting_available() noexcept
+{
+    return detail::allocation_hooks_installed;
+}
+
+// Counts the allocations of this thread while it is alive. Scopes can be
+// nested; what an inner scope counts is also counted by the outer one.
+class allocation_scope
+{
+  public:
+
+    allocation_scope() noexcept
+        : outer_(std::exchange(detail::current_allocations, detail::allocation_counter{}))
+    {
+        detail::current_allocations.active = true;
+    }
+    ~allocation_scope() noexcept
+    {
+        const auto inner = detail::current_allocations;
+        detail::current_allocations = outer_;
+
+        auto& c = detail::current_allocations;
+        if( ! c.active) {return;}
+
+        const auto peak = c.live + static_cast<std::int64_t>(inner.stats.peak_live_bytes);
+        if(0 < peak)
+        {
+            c.stats.peak_live_bytes = std::max(c.stats.peak_live_bytes,
+                                               static_cast<std::size_t>(peak));
+        }
+        c.stats.allocations     += inner.stats.allocations;
+        c.stats.deallocations   += inner.stats.deallocations;
+        c.stats.bytes_allocated += inner.stats.bytes_allocated;
+        c.stats.bytes_freed     += inner.stats.bytes_freed;
+        c.live                  += inner.live;
+    }
+
+    allocation_scope(const allocation_scope&) = delete;
+    allocation_scope(allocation_scope&&)      = delete;
+    allocation_scope& operator=(const allocation_scope&) = delete;
+    allocation_scope& operator=(allocation_scope&&)      = delete;
+
+    // what has been counted so far
+    allocation_stats stats() const noexcept {return detail::current_allocations.stats;}
+
+  private:
+
+    detail::allocation_counter outer_;
+};
+
+// runs `f` and returns the allocations it made on this thread
+template<typename F>
+allocation_stats count_allocations(F&& f)
+{
+    allocation_scope scope;
+    std::forward<F>(f)();
+    return scope.stats();
+}
+
+} // msgplus
+#endif // MSGPLUS_ALLOCATION_STATS_HPP
+
+#if defined(MSGPLUS_IMPLEMENT_ALLOCATION_HOOKS) && ! defined(MSGPLUS_ALLOCATION_HOOKS_IMPLEMENTED)
+#define MSGPLUS_ALLOCATION_HOOKS_IMPLEMENTED
+
+#include <cstdlib>
+#if defined(_MSC_VER)
+#include <malloc.h> // _aligned_malloc, _aligned_free
+#endif
+
+namespace msgplus
+{
+namespace detail
+{
+
+// The size of a block is stored in a header of `align` bytes in front of it.
+inline void* counted_allocate(const std::size_t n, const std::size_t align) noexcept
+{
+    const std::size_t header = std::max(align, std::size_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+    const std::size_t total  = header + (n + header - 1) / header * header;
+    while(true)
+    {
+#if defined(_MSC_VER)
+        void* base = _aligned_malloc(total, header);
+#else
+        void* base = std::aligned_alloc(header, total);
+#endif
+        if(base != nullptr)
+        {
+            auto* block = static_cast<std::byte*>(base) + header;
+            *reinterpret_cast<std::size_t*>(block - sizeof(std::size_t)) = n;
+            record_allocation(n);
+            return block;
+        }
+        const auto handler = std::get_new_handler();
+        if( ! handler) {return nullptr;}
+        try
+        {
+            handler();
+        }
+        catch(...)
+        {
+            return nullptr;
+        }
+    }
+}
+
+inline void counted_deallocate(void* p, const std::size_t align) noexcept
+{
+    if(p == nullptr) {return;}
+
+    const std::size_t header = std::max(align, std::size_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+    auto* block = static_cast<std::byte*>(p);
+    record_deallocation(*reinterpret_cast<std::size_t*>(block - sizeof(std::size_t)));
+#if defined(_MSC_VER)
+    _aligned_free(block - header);
+#else
+    std::free(block - header);
+#endif
+    return;
+}
+
+inline void* counted_allocate_or_throw(const std::size_t n, const std::size_t align)
+{
+    if(void* p = counted_allocate(n, align)) {return p;}
+    throw std::bad_alloc();
+}
+
+inline const bool allocation_hooks_registered = (allocation_hooks_installed = true);
+
+} // detail
+} // msgplus
+
+void* operator new  (std::size_t n) {return msgplus::detail::counted_allocate_or_throw(n, 0);}
+void* operator new[](std::size_t n) {return msgplus::detail::counted_allocate_or_throw(n, 0);}
+void* operator new  (std::size_t n, std::align_val_t a) {return msgplus::detail::counted_allocate_or_throw(n, static_cast<std::size_t>(a));}
+void* operator new[](std::size_t n, std::align_val_t a) {return msgplus::detail::counted_allocate_or_throw(n, static_cast<std::size_t>(a));}
+void* operator new  (std::size_t n, const std::nothrow_t&) noexcept {return msgplus::detail::counted_allocate(n, 0);}
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept {return msgplus::detail::counted_allocate(n, 0);}
+void* operator new  (std::size_t n, std::align_val_t a, const std::nothrow_t&) noexcept {return msgplus::detail::counted_allocate(n, static_cast<std::size_t>(a));}
+void* operator new[](std::size_t n, std::align_val_t a, const std::nothrow_t&) noexcept {return msgplus::detail::counted_allocate(n, static_cast<std::size_t>(a));}
+
+void operator delete  (void* p) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete[](void* p) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete  (void* p, std::size_t) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete[](void* p, std::size_t) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete  (void* p, const std::nothrow_t&) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete  (void* p, std::align_val_t a) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+void operator delete[](void* p, std::align_val_t a) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+void operator delete  (void* p, std::size_t, std::align_val_t a) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+void operator delete[](void* p, std::size_t, std::align_val_t a) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+void operator delete  (void* p, std::align_val_t a, const std::nothrow_t&) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+void operator delete[](void* p, std::align_val_t a, const std::nothrow_t&) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+
+#endif // MSGPLUS_IMPLEMENT_ALLOCATION_HOOKS
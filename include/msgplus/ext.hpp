@@ -0,0 +1,336 @@
+#ifndef MSGPLUS_EXT_HPP
+#define MSGPLUS_EXT_HPP
+
+#include <algorithm>
+#include <array>
+#include <compare>
+#include <concepts>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+// Converts the payload of an extension to an object of `value_type` and back.
+//
+// ```cpp
+// struct point_codec
+// {
+//     using value_type = point;
+//     std::optional<point> decode(std::span<const std::byte> payload) const;
+//     std::size_t encoded_size(const point& p) const;
+//     bool encode(const point& p, std::span<std::byte> out) const; // out.size() == encoded_size(p)
+//
+//     // optional. compares two objects without encoding them. It must agree
+//     // with the comparison of their encoded payloads.
+//     std::strong_ordering compare(const point& a, const point& b) const;
+// };
+// ```
+template<typename C>
+concept ExtCodec = std::copy_constructible<C> &&
+    requires(const C& c, const typename C::value_type& x,
+             std::span<const std::byte> in, std::span<std::byte> out) {
+    {c.decode(in)}          -> std::same_as<std::optional<typename C::value_type>>;
+    {c.encoded_size(x)}     -> std::convertible_to<std::size_t>;
+    {c.encode(x, out)}      -> std::convertible_to<bool>;
+};
+
+namespace detail
+{
+
+// a distinct address for each type, to identify the object without RTTI
+template<typename T>
+struct type_tag
+{
+    static constexpr char id = 0;
+};
+
+struct typed_ext_model_base
+{
+    virtual ~typed_ext_model_base() = default;
+
+    virtual const void* tag()       const noexcept = 0;
+    virtual const void* codec_tag() const noexcept = 0;
+    virtual const void* object()    const noexcept = 0;
+    virtual std::size_t encoded_size() const = 0;
+    virtual bool        encode(std::span<std::byte> out) const = 0;
+
+    // unordered if the codec cannot compare the objects
+    virtual std::partial_ordering compare(const typed_ext_model_base& rhs) const = 0;
+};
+
+template<ExtCodec C>
+struct typed_ext_model final : typed_ext_model_base
+{
+    typed_ext_model(C c, typename C::value_type x)
+        : codec(std::move(c)), obj(std::move(x))
+    {}
+
+    const void* tag()       const noexcept override {return std::addressof(type_tag<typename C::value_type>::id);}
+    const void* codec_tag() const noexcept override {return std::addressof(type_tag<C>::id);}
+    const void* object()    const noexcept override {return std::addressof(obj);}
+    std::size_t encoded_size() const override {return codec.encoded_size(obj);}
+    bool encode(std::span<std::byte> out) const override {return codec.encode(obj, out);}
+
+    std::partial_ordering compare(const typed_ext_model_base& rhs) const override
+    {
+        if constexpr(requires {{codec.compare(obj, obj)} -> std::convertible_to<std::strong_ordering>;})
+        {
+            if(rhs.codec_tag() == this->codec_tag())
+            {
+                return codec.compare(obj, static_cast<const typed_ext_model&>(rhs).obj);
+            }
+        }
+        return std::partial_ordering::unordered;
+    }
+
+    [[no_unique_address]] C codec;
+    typename C::value_type  obj;
+};
+
+// The encoded payload of a typed_ext. It is encoded into a buffer on the
+// stack if it fits, so that comparing and hashing small objects does not
+// allocate. Empty and not `ok()` if the codec fails to encode the object,
+// including by throwing, or if a large payload cannot be allocated.
+class typed_ext_payload
+{
+  public:
+
+    static constexpr std::size_t inline_size = 128;
+
+    explicit typed_ext_payload(const typed_ext_model_base& m) noexcept
+    {
+        try
+        {
+            const std::size_t n = m.encoded_size();
+            std::span<std::byte> out;
+            if(n <= inline_size)
+            {
+                out = std::span<std::byte>(this->buf_).first(n);
+            }
+            else
+            {
+                this->heap_.resize(n);
+                out = this->heap_;
+            }
+            if(m.encode(out))
+            {
+                this->bytes_ = out;
+                this->ok_    = true;
+            }
+        }
+        catch(...)
+        {
+            // the same as a failure to encode
+        }
+    }
+    ~typed_ext_payload() = default;
+    typed_ext_payload(const typed_ext_payload&) = delete;
+    typed_ext_payload(typed_ext_payload&&)      = delete;
+    typed_ext_payload& operator=(const typed_ext_payload&) = delete;
+    typed_ext_payload& operator=(typed_ext_payload&&)      = delete;
+
+    std::span<const std::byte> bytes() const noexcept {return bytes_;}
+    bool                       ok()    const noexcept {return ok_;}
+
+  private:
+
+    std::array<std::byte, inline_size> buf_;
+    std::vector<std::byte>             heap_;
+    std::span<const std::byte>         bytes_;
+    bool                               ok_ = false;
+};
+
+} // detail
+
+// An extension object decoded by a codec registered in an `ext_registry`.
+//
+// The object is immutable and shared between copies, like the nodes of
+// `shared_value`. It keeps its codec, so it is written back in the same
+// format. Two typed_exts are compared by their type and encoded payload, or
+// by the codec if it provides `compare`. Payloads of up to
+// `detail::typed_ext_payload::inline_size` bytes are compared and hashed
+// without allocation.
+//
+// The comparisons do not throw, since `value`'s do not. If the codec throws
+// or fails to encode an object, the object sorts before the ones that
+// encode, and is equal only to its own copies.
+class typed_ext
+{
+  public:
+
+    template<ExtCodec C>
+    typed_ext(const std::int8_t type, typename C::value_type obj, C codec)
+        : type_(type),
+          obj_(std::make_shared<const detail::typed_ext_model<C>>(std::move(codec), std::move(obj)))
+    {}
+    ~typed_ext() = default;
+    typed_ext(const typed_ext&) = default;
+    typed_ext(typed_ext&&)      = default;
+    typed_ext& operator=(const typed_ext&) = default;
+    typed_ext& operator=(typed_ext&&)      = default;
+
+    std::int8_t type() const noexcept {return type_;}
+
+    // nullptr if the object is not a T
+    template<typename T>
+    T const* get() const noexcept
+    {
+        if(this->obj_->tag() != std::addressof(detail::type_tag<T>::id))
+        {
+            return nullptr;
+        }
+        return static_cast<T const*>(this->obj_->object());
+    }
+
+    std::size_t encoded_size() const {return obj_->encoded_size();}
+
+    // `out.size()` must be `encoded_size()`
+    bool encode(std::span<std::byte> out) const {return obj_->encode(out);}
+
+    // the encoded payload. empty if the codec fails to encode the object.
+    std::vector<std::byte> payload() const
+    {
+        std::vector<std::byte> retval(this->encoded_size());
+        if( ! this->encode(retval))
+        {
+            retval.clear();
+        }
+        return retval;
+    }
+
+    // calls `f` with the encoded payload, which is not allocated if it is
+    // small. it is empty if the object cannot be encoded.
+    template<typename F>
+    decltype(auto) visit_payload(F&& f) const
+    {
+        const detail::typed_ext_payload p(*this->obj_);
+        return std::forward<F>(f)(p.bytes());
+    }
+
+    bool operator==(const typed_ext& rhs) const noexcept {return this->order(rhs) == 0;}
+    bool operator!=(const typed_ext& rhs) const noexcept {return !(*this == rhs);}
+    bool operator< (const typed_ext& rhs) const noexcept {return this->order(rhs) <  0;}
+    bool operator<=(const typed_ext& rhs) const noexcept {return !(rhs < *this);}
+    bool operator> (const typed_ext& rhs) const noexcept {return   rhs < *this ;}
+    bool operator>=(const typed_ext& rhs) const noexcept {return !(*this < rhs);}
+
+  private:
+
+    std::strong_ordering order(const typed_ext& rhs) const noexcept
+    {
+        if(this->type_ != rhs.type_) {return this->type_ <=> rhs.type_;}
+        if(this->obj_  == rhs.obj_)  {return std::strong_ordering::equal;}
+        try
+        {
+            const auto c = this->obj_->compare(*rhs.obj_);
+            if(c != std::partial_ordering::unordered)
+            {
+                return c < 0 ? std::strong_ordering::less :
+                       c > 0 ? std::strong_ordering::greater : std::strong_ordering::equal;
+            }
+        }
+        catch(...)
+        {
+            // compare the payloads instead
+        }
+
+        const detail::typed_ext_payload lhs_payload(*this->obj_);
+        const detail::typed_ext_payload rhs_payload(*rhs.obj_);
+        if(lhs_payload.ok() && rhs_payload.ok())
+        {
+            const auto l = lhs_payload.bytes();
+            const auto r = rhs_payload.bytes();
+            return std::lexicographical_compare_three_way(l.begin(), l.end(), r.begin(), r.end());
+        }
+        if(lhs_payload.ok() != rhs_payload.ok())
+        {
+            return lhs_payload.ok() ? std::strong_ordering::greater : std::strong_ordering::less;
+        }
+        // neither can be encoded. distinct objects are ordered by address.
+        return std::compare_three_way{}(this->obj_.get(), rhs.obj_.get());
+    }
+
+    std::int8_t                                        type_;
+    std::shared_ptr<const detail::typed_ext_model_base> obj_;
+};
+
+// A set of codecs, one for each extension type id.
+//
+// A decoder that is given a registry decodes the extensions of the registered
+// types into `typed_ext`s, directly from the reader when it provides
+// `read_view()`, and without a payload vector otherwise. Other extensions
+// remain `ext_type`. If a codec fails to decode a payload, the payload is kept
+// as an `ext_type` too.
+//
+// A registered codec takes precedence over the built-in timestamp (-1).
+class ext_registry
+{
+  public:
+
+    using decode_function = std::function<
+        std::optional<typed_ext>(std::int8_t, std::span<const std::byte>)>;
+
+  public:
+
+    ext_registry() = default;
+    ~ext_registry() = default;
+    ext_registry(const ext_registry&) = default;
+    ext_registry(ext_registry&&)      = default;
+    ext_registry& operator=(const ext_registry&) = default;
+    ext_registry& operator=(ext_registry&&)      = default;
+
+    // replaces the codec of `type` if there already is one
+    template<ExtCodec C>
+    ext_registry& add(const std::int8_t type, C codec)
+    {
+        this->codecs_[slot(type)] = [codec = std::move(codec)](
+            const std::int8_t t, std::span<const std::byte> payload) -> std::optional<typed_ext>
+        {
+            auto obj = codec.decode(payload);
+            if( ! obj.has_value())
+            {
+                return std::nullopt;
+            }
+            return typed_ext(t, std::move(obj.value()), codec);
+        };
+        return *this;
+    }
+
+    void remove(const std::int8_t type)
+    {
+        this->codecs_[slot(type)] = nullptr;
+    }
+
+    bool contains(const std::int8_t type) const noexcept
+    {
+        return static_cast<bool>(this->codecs_[slot(type)]);
+    }
+
+    // nullptr if `type` has no codec
+    decode_function const* find(const std::int8_t type) const noexcept
+    {
+        const auto& f = this->codecs_[slot(type)];
+        return f ? std::addressof(f) : nullptr;
+    }
+
+  private:
+
+    static std::size_t slot(const std::int8_t type) noexcept
+    {
+        return static_cast<std::uint8_t>(type);
+    }
+
+  private:
+
+    std::array<decode_function, 256> codecs_;
+};
+
+} // msgplus
+#endif // MSGPLUS_EXT_HPP
@@ -2,13 +2,46 @@
 #define MSGPLUS_FLAT_MAP_HPP
 
 #include <algorithm>
+#include <array>
+#include <concepts>
+#include <iterator>
+#include <optional>
 #include <stdexcept>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#include <cassert>
+
 namespace msgplus
 {
 
+namespace detail
+{
+
+// With a transparent comparator, `k` is used as is. Otherwise it is
+// converted into a Key (that is a no-op if it already is one).
+template<typename Key, typename Cmp, typename K>
+decltype(auto) lookup_key(const K& k)
+{
+    if constexpr(std::same_as<K, Key> || requires {typename Cmp::is_transparent;})
+    {
+        return (k);
+    }
+    else
+    {
+        return Key(k);
+    }
+}
+
+} // detail
+
+// indicates that the input is already sorted and has no duplicate keys
+struct sorted_unique_t { explicit sorted_unique_t() = default; };
+inline constexpr sorted_unique_t sorted_unique{};
+
+// If the input has duplicate keys, the first one is kept, as repeated
+// `insert`s do. `insert_or_assign` keeps the last one instead.
 template<typename Key, typename Value, typename Cmp = std::less<Key>,
          typename Allocator = std::allocator<std::pair<Key, Value>>>
 class flat_map
@@ -58,8 +91,9 @@ class flat_map
              allocator_type alloc = allocator_type{})
         : cmp_(std::move(cmp)), container_(std::move(init), std::move(alloc))
     {
-        std::sort(this->container_.begin(), this->container_.end(),
-                  value_compare{cmp_});
+        std::stable_sort(this->container_.begin(), this->container_.end(),
+                         value_compare{cmp_});
+        this->deduplicate(false);
     }
     template<typename InputIter>
     flat_map(InputIter begin, InputIter end,
@@ -67,8 +101,26 @@ class flat_map
              allocator_type alloc = allocator_type{})
         : cmp_(std::move(cmp)), container_(begin, end, std::move(alloc))
     {
-        std::sort(this->container_.begin(), this->container_.end(),
-                  value_compare{cmp_});
+        std::stable_sort(this->container_.begin(), this->container_.end(),
+                         value_compare{cmp_});
+        this->deduplicate(false);
+    }
+
+    // The input must be sorted by `cmp` and have no duplicate keys. It is
+    // taken as is, without sorting.
+    flat_map(sorted_unique_t, container_type sorted,
+             key_compare cmp = key_compare{})
+        : cmp_(std::move(cmp)), container_(std::move(sorted))
+    {
+        assert(this->is_sorted_unique());
+    }
+    template<typename InputIter>
+    flat_map(sorted_unique_t, InputIter begin, InputIter end,
+             key_compare cmp = key_compare{},
+             allocator_type alloc = allocator_type{})
+        : cmp_(std::move(cmp)), container_(begin, end, std::move(alloc))
+    {
+        assert(this->is_sorted_unique());
     }
 
     bool      empty()    const noexcept {return this->container_.empty()   ;}
@@ -77,6 +129,9 @@ class flat_map
 
     void clear() {return this->container_.clear();}
 
+    size_type capacity() const noexcept {return this->container_.capacity();}
+    void reserve(const size_type n) {this->container_.reserve(n);}
+
     iterator       begin()        noexcept {return this->container_.begin();}
     iterator       end()          noexcept {return this->container_.end();}
     const_iterator begin()  const noexcept {return this->container_.begin();}
@@ -85,13 +140,13 @@ class flat_map
     const_iterator cend()   const noexcept {return this->container_.cend();}
 
     template<typename K>
-    bool contains(const K& k)
+    bool contains(const K& k) const
     {
-        return std::binary_search(this->container_.begin(), this->container_.end(), k);
+        return this->find(k) != this->end();
     }
 
     template<typename K>
-    size_type count(const K& k)
+    size_type count(const K& k) const
     {
         if(this->contains(k)) {return 1;} else {return 0;}
     }
@@ -99,7 +154,7 @@ class flat_map
     mapped_type& operator[](key_type k)
     {
         const auto found = this->lower_bound(k);
-        if(found < this->end() && found->first == k)
+        if(this->is_equivalent(found, k))
         {
             return found->second;
         }
@@ -112,81 +167,83 @@ class flat_map
     template<typename K>
     mapped_type& at(const K& k)
     {
-        const auto found = this->lower_bound(k);
-        if(found < this->end() && found->first == k)
-        {
-            return found->second;
-        }
-        else
+        const auto found = this->find(k);
+        if(found == this->end())
         {
             throw std::out_of_range("flat_map::at()");
         }
+        return found->second;
     }
     template<typename K>
     mapped_type const& at(const K& k) const
     {
-        const auto found = this->lower_bound(k);
-        if(found < this->end() && found->first == k)
-        {
-            return found->second;
-        }
-        else
+        const auto found = this->find(k);
+        if(found == this->end())
         {
             throw std::out_of_range("flat_map::at()");
         }
+        return found->second;
     }
 
     template<typename K>
     iterator find(const K& k)
     {
-        const auto found = this->lower_bound(k);
-        if(found < this->end() && found->first == k)
-        {
-            return found;
-        }
-        else
-        {
-            return this->end();
-        }
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        const auto found = this->lower_bound(key);
+        return this->is_equivalent(found, key) ? found : this->end();
     }
     template<typename K>
     const_iterator find(const K& k) const
     {
-        const auto found = this->lower_bound(k);
-        if(found < this->end() && found->first == k)
-        {
-            return found;
-        }
-        else
-        {
-            return this->end();
-        }
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        const auto found = this->lower_bound(key);
+        return this->is_equivalent(found, key) ? found : this->end();
     }
 
     template<typename K>
     iterator lower_bound(const K& k)
     {
-        return std::lower_bound(this->begin(), this->end(), k,
-            [](const value_type& v, const key_type& k) {return v.first < k;});
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        return std::lower_bound(this->begin(), this->end(), key,
+            [this](const value_type& v, const auto& x) {return this->cmp_(v.first, x);});
     }
     template<typename K>
     const_iterator lower_bound(const K& k) const
     {
-        return std::lower_bound(this->begin(), this->end(), k,
-            [](const value_type& v, const key_type& k) {return v.first < k;});
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        return std::lower_bound(this->begin(), this->end(), key,
+            [this](const value_type& v, const auto& x) {return this->cmp_(v.first, x);});
     }
 
     template<typename K>
     iterator upper_bound(const K& k)
     {
-        return std::upper_bound(this->begin(), this->end(), k,
-            [](const value_type& v, const key_type& k) {return v.first < k;});
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        return std::upper_bound(this->begin(), this->end(), key,
+            [this](const auto& x, const value_type& v) {return this->cmp_(x, v.first);});
     }
     template<typename K>
     const_iterator upper_bound(const K& k) const
     {
-        return std::upper_bound(this->begin(), this->end(), k,
-            [](const value_type& v, const key_type& k) {return v.first < k;});
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        return std::upper_bound(this->begin(), this->end(), key,
+            [this](const auto& x, const value_type& v) {return this->cmp_(x, v.first);});
+    }
+
+    // Looks up a batch of keys sorted by the comparator, writing the iterator
+    // to each key (or end()) to `out` in the same order. The keys are searched
+    // in groups whose binary searches run interleaved, so that their cache
+    // misses overlap instead of queuing behind each other, and each group
+    // starts from where the previous one ended.
+    template<std::forward_iterator KeyIter, typename OutputIter>
+    OutputIter find_sorted(KeyIter first, KeyIter last, OutputIter out)
+    {
+        return this->find_sorted_impl(this->begin(), this->end(), first, last, out);
+    }
+    template<std::forward_iterator KeyIter, typename OutputIter>
+    OutputIter find_sorted(KeyIter first, KeyIter last, OutputIter out) const
+    {
+        return this->find_sorted_impl(this->begin(), this->end(), first, last, out);
     }
 
     template<typename ... Args>
@@ -198,32 +255,96 @@ class flat_map
     std::pair<iterator, bool> insert(value_type v)
     {
         const auto found = this->lower_bound(v.first);
-        if(found < this->end() && found->first == v.first)
+        if(this->is_equivalent(found, v.first))
         {
             return std::make_pair(found, false);
         }
         else
         {
-            const auto idx = std::distance(container_.begin(), found);
-            container_.insert(std::move(v));
-            return std::make_pair(std::next(this->container_.begin(), idx), true);
+            return std::make_pair(container_.insert(found, std::move(v)), true);
+        }
+    }
+
+    // Inserts many elements at once: appends them, sorts only the new ones,
+    // merges the two sorted runs and removes duplicates, in O(m log m + n)
+    // instead of O(n) per element. Keys that already exist are not changed.
+    template<typename InputIter>
+    void insert(InputIter first, InputIter last)
+    {
+        this->bulk_insert(first, last, false);
+    }
+    void insert(std::initializer_list<value_type> init)
+    {
+        this->bulk_insert(init.begin(), init.end(), false);
+    }
+
+    // Same as `insert`, but the new element replaces the existing one, and
+    // the last one wins among the new elements.
+    template<typename InputIter>
+    void insert_or_assign(InputIter first, InputIter last)
+    {
+        this->bulk_insert(first, last, true);
+    }
+
+    // Moves the elements of `other` whose keys are not in this map, in
+    // O(n + m). The others remain in `other`, like std::map::merge.
+    void merge(flat_map& other)
+    {
+        container_type merged(this->container_.get_allocator());
+        container_type rest(other.container_.get_allocator());
+        merged.reserve(this->size() + other.size());
+
+        auto lhs = this->container_.begin();
+        auto rhs = other.container_.begin();
+        while(lhs != this->container_.end() && rhs != other.container_.end())
+        {
+            if(this->cmp_(lhs->first, rhs->first))
+            {
+                merged.push_back(std::move(*lhs++));
+            }
+            else if(this->cmp_(rhs->first, lhs->first))
+            {
+                merged.push_back(std::move(*rhs++));
+            }
+            else
+            {
+                merged.push_back(std::move(*lhs++));
+                rest.push_back(std::move(*rhs++));
+            }
         }
+        std::move(lhs, this->container_.end(),  std::back_inserter(merged));
+        std::move(rhs, other.container_.end(), std::back_inserter(merged));
+
+        this->container_ = std::move(merged);
+        other.container_ = std::move(rest);
+        return;
+    }
+    void merge(flat_map&& other)
+    {
+        this->merge(other);
     }
 
-    void erase(const_iterator i)
+    iterator erase(iterator i)
+    {
+        return this->container_.erase(i);
+    }
+    iterator erase(const_iterator i)
     {
-        this->container_.erase(i);
+        return this->container_.erase(i);
     }
-    void erase(key_type k)
+    template<typename K>
+    size_type erase(const K& k)
     {
         const auto found = this->find(k);
-        if(found != this->end())
+        if(found == this->end())
         {
-            this->container_.erase(found);
+            return 0;
         }
+        this->container_.erase(found);
+        return 1;
     }
 
-    key_compare   key_comp()   const {return key_compare{};}
+    key_compare   key_comp()   const {return cmp_;}
     value_compare value_comp() const {return value_compare{this->key_comp()};}
 
     bool operator==(const flat_map& rhs) const noexcept {return this->container_ == rhs.container_;}
@@ -241,6 +362,131 @@ class flat_map
         return;
     }
 
+  private:
+
+    template<typename InputIter>
+    void bulk_insert(InputIter first, InputIter last, const bool keep_last)
+    {
+        const auto old_size = static_cast<difference_type>(this->container_.size());
+        this->container_.insert(this->container_.end(), first, last);
+
+        const auto mid = std::next(this->container_.begin(), old_size);
+        std::stable_sort(mid, this->container_.end(), value_compare{cmp_});
+        std::inplace_merge(this->container_.begin(), mid, this->container_.end(),
+                           value_compare{cmp_}); // stable: old ones come first
+        this->deduplicate(keep_last);
+    }
+
+    // removes the duplicates of a sorted container in one pass. With
+    // `keep_last`, the last of equivalent elements remains.
+    void deduplicate(const bool keep_last)
+    {
+        if(this->container_.empty()) {return;}
+
+        auto out = this->container_.begin();
+        for(auto in = std::next(out); in != this->container_.end(); ++in)
+        {
+            if(this->cmp_(out->first, in->first))
+            {
+                ++out;
+                if(out != in) {*out = std::move(*in);}
+            }
+            else if(keep_last)
+            {
+                *out = std::move(*in);
+            }
+        }
+        this->container_.erase(std::next(out), this->container_.end());
+    }
+
+    template<typename Iterator, typename KeyIter, typename OutputIter>
+    OutputIter find_sorted_impl(Iterator lo, const Iterator end,
+                                KeyIter first, KeyIter last, OutputIter out) const
+    {
+        constexpr std::size_t group_size = 16;
+
+        assert(std::is_sorted(first, last, [this](const auto& lhs, const auto& rhs) {
+                return this->cmp_(detail::lookup_key<key_type, key_compare>(lhs),
+                                  detail::lookup_key<key_type, key_compare>(rhs));
+            }));
+
+        // If the comparator is not transparent, the keys of a group are
+        // converted into Key once, not on each comparison.
+        constexpr bool converts = ! std::is_reference_v<
+            decltype(detail::lookup_key<key_type, key_compare>(*first))>;
+        struct no_keys {};
+        using converted_keys = std::conditional_t<converts,
+              std::array<std::optional<key_type>, group_size>, no_keys>;
+
+        std::array<KeyIter,  group_size> keys;
+        std::array<Iterator, group_size> base;
+        [[maybe_unused]] converted_keys  converted;
+
+        const auto key = [&](const std::size_t i) -> decltype(auto) {
+            if constexpr(converts) {return (*converted[i]);}
+            else {return detail::lookup_key<key_type, key_compare>(*keys[i]);}
+        };
+        const auto less = [&](const value_type& v, const std::size_t i) {
+            return this->cmp_(v.first, key(i));
+        };
+
+        while(first != last)
+        {
+            std::size_t n_keys = 0;
+            for(; n_keys < group_size && first != last; ++n_keys, ++first)
+            {
+                keys[n_keys] = first;
+                base[n_keys] = lo;
+                if constexpr(converts) {converted[n_keys].emplace(*first);}
+            }
+
+            // branch-free lower_bound of all the keys in lockstep, so that the
+            // cache misses of different keys overlap
+            auto len = std::distance(lo, end);
+            while(1 < len)
+            {
+                const auto half = len / 2;
+                for(std::size_t i=0; i<n_keys; ++i)
+                {
+#if defined(__GNUC__)
+                    __builtin_prefetch(std::addressof(*std::next(base[i], half / 2)));
+                    __builtin_prefetch(std::addressof(*std::next(base[i], half + half / 2)));
+#endif
+                    base[i] = less(*std::next(base[i], half), i) ?
+                              std::next(base[i], half) : base[i];
+                }
+                len -= half;
+            }
+            for(std::size_t i=0; i<n_keys; ++i)
+            {
+                if(len == 1 && less(*base[i], i))
+                {
+                    ++base[i];
+                }
+                *out = this->is_equivalent(base[i], key(i)) ? base[i] : end;
+                ++out;
+            }
+            // the keys are sorted, so the next ones are not before this
+            lo = base[n_keys - 1];
+        }
+        return out;
+    }
+
+    bool is_sorted_unique() const
+    {
+        return std::adjacent_find(this->container_.begin(), this->container_.end(),
+            [this](const value_type& lhs, const value_type& rhs) {
+                return ! this->cmp_(lhs.first, rhs.first);
+            }) == this->container_.end();
+    }
+
+    // `found` is the lower_bound of `k`
+    template<typename Iterator, typename K>
+    bool is_equivalent(const Iterator found, const K& k) const
+    {
+        return found != this->container_.end() && ! this->cmp_(k, found->first);
+    }
+
   private:
 
     [[no_unique_address]] key_compare cmp_;
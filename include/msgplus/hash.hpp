@@ -0,0 +1,278 @@
+#ifndef MSGPLUS_HASH_HPP
+#define MSGPLUS_HASH_HPP
+
+#include "value.hpp"
+
+#include <bit>
+#include <concepts>
+#include <functional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+namespace detail
+{
+
+// the finalizer of splitmix64
+constexpr std::uint64_t hash_mix(std::uint64_t x) noexcept
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+// order-dependent, so that [a, b] and [b, a] are hashed differently
+constexpr std::uint64_t hash_combine(std::uint64_t seed, std::uint64_t h) noexcept
+{
+    return hash_mix(seed * 0x9E3779B97F4A7C15ull + h);
+}
+
+constexpr std::uint64_t hash_type(const type_t t) noexcept
+{
+    return hash_mix(static_cast<std::uint64_t>(t) + 1);
+}
+
+inline std::uint64_t hash_bytes(const type_t t, std::string_view bytes) noexcept
+{
+    return hash_combine(hash_type(t), std::hash<std::string_view>{}(bytes));
+}
+inline std::uint64_t hash_bytes(const type_t t, std::span<const std::byte> bytes) noexcept
+{
+    return hash_bytes(t, std::string_view(
+            reinterpret_cast<const char*>(bytes.data()), bytes.size()));
+}
+
+inline std::uint64_t hash_int(const std::int64_t x) noexcept
+{
+    return hash_combine(hash_type(type_t::int_t), static_cast<std::uint64_t>(x));
+}
+inline std::uint64_t hash_uint(const std::uint64_t x) noexcept
+{
+    return hash_combine(hash_type(type_t::uint_t), x);
+}
+
+inline std::uint64_t hash_timestamp(const timestamp_type& x) noexcept
+{
+    return hash_combine(hash_type(type_t::timestamp_t),
+                        static_cast<std::uint64_t>(x.time_since_epoch().count()));
+}
+
+template<std::floating_point T>
+std::uint64_t hash_float(const type_t t, T x) noexcept
+{
+    if(x == T(0)) {x = T(0);} // -0.0 == +0.0
+    if constexpr(sizeof(T) == sizeof(std::uint32_t))
+    {
+        return hash_combine(hash_type(t), std::bit_cast<std::uint32_t>(x));
+    }
+    else
+    {
+        return hash_combine(hash_type(t), std::bit_cast<std::uint64_t>(x));
+    }
+}
+
+// arrays and maps start from this and fold the hashes of their elements in
+inline std::uint64_t hash_container(const type_t t, const std::size_t size) noexcept
+{
+    return hash_combine(hash_type(t), size);
+}
+
+// hash of anything but a non-empty array or map
+inline std::uint64_t hash_leaf(const value& v) noexcept
+{
+    using enum type_t;
+    switch(v.type())
+    {
+        case nil_t     : {return hash_type(nil_t);}
+        case bool_t    : {return hash_combine(hash_type(bool_t), v.as_bool() ? 1 : 0);}
+        case int_t     : {return hash_int(v.as_int());}
+        case uint_t    : {return hash_uint(v.as_uint());}
+        case float32_t : {return hash_float(float32_t, v.as_float32());}
+        case float64_t : {return hash_float(float64_t, v.as_float64());}
+        case str_t     : {return hash_bytes(str_t, v.as_str());}
+        case bin_t     : {return hash_bytes(bin_t, v.as_bin());}
+        case array_t   : {return hash_container(array_t, v.as_array().size());}
+        case map_t     : {return hash_container(map_t,   v.as_map().size());}
+        case ext_t     :
+        {
+            return hash_combine(hash_bytes(ext_t, v.as_ext().second),
+                                static_cast<std::uint8_t>(v.as_ext().first));
+        }
+        case timestamp_t: {return hash_timestamp(v.as_timestamp());}
+        case typed_ext_t:
+        {
+            const auto h = v.as_typed_ext().visit_payload([](std::span<const std::byte> p) {
+                    return hash_bytes(typed_ext_t, p);
+                });
+            return hash_combine(h, static_cast<std::uint8_t>(v.as_typed_ext().type()));
+        }
+        default:         {return 0;}
+    }
+}
+
+} // detail
+
+// Hash of a value, consistent with `value::operator==`. Nested arrays and maps
+// are traversed without recursion.
+//
+// It is transparent: strings and integers are hashed as if they were
+// converted into a value, so hashed containers can be searched by them
+// without constructing a temporary value.
+struct value_hash
+{
+    using is_transparent = void;
+
+    std::size_t operator()(const value& v) const
+    {
+        if( ! v.has_elements())
+        {
+            return detail::hash_leaf(v);
+        }
+
+        struct frame
+        {
+            const value*               container;
+            std::uint64_t              hash;
+            array_type::const_iterator array_cur;
+            map_type::const_iterator   map_cur;
+            bool                       key_hashed;
+        };
+        const auto open = [](const value& c) {
+            frame f{std::addressof(c), detail::hash_leaf(c), {}, {}, false};
+            if(c.is_array()) {f.array_cur = c.as_array().begin();}
+            else             {f.map_cur   = c.as_map().begin();}
+            return f;
+        };
+
+        std::vector<frame> stack;
+        stack.push_back(open(v));
+        while(true)
+        {
+            auto& top = stack.back();
+            const value* next = nullptr;
+            if(top.container->is_array())
+            {
+                if(top.array_cur != top.container->as_array().end())
+                {
+                    next = std::addressof(*top.array_cur++);
+                }
+            }
+            else if(top.map_cur != top.container->as_map().end())
+            {
+                if( ! top.key_hashed)
+                {
+                    next = std::addressof(top.map_cur->first);
+                    top.key_hashed = true;
+                }
+                else
+                {
+                    next = std::addressof(top.map_cur->second);
+                    top.key_hashed = false;
+                    ++top.map_cur;
+                }
+            }
+
+            if(next == nullptr) // `top` is done
+            {
+                const auto h = top.hash;
+                stack.pop_back();
+                if(stack.empty())
+                {
+                    return h;
+                }
+                stack.back().hash = detail::hash_combine(stack.back().hash, h);
+            }
+            else if(next->has_elements())
+            {
+                stack.push_back(open(*next)); // `top` is invalidated
+            }
+            else
+            {
+                top.hash = detail::hash_combine(top.hash, detail::hash_leaf(*next));
+            }
+        }
+    }
+
+    template<detail::value_string_key K>
+    std::size_t operator()(const K& k) const noexcept
+    {
+        return detail::hash_bytes(type_t::str_t, std::string_view(k));
+    }
+    template<detail::value_int_key K>
+    std::size_t operator()(const K& k) const noexcept
+    {
+        return detail::hash_int(static_cast<std::int64_t>(k));
+    }
+    template<detail::value_uint_key K>
+    std::size_t operator()(const K& k) const noexcept
+    {
+        return detail::hash_uint(static_cast<std::uint64_t>(k));
+    }
+};
+
+// `operator==` that also compares a value with strings and integers
+struct value_equal
+{
+    using is_transparent = void;
+
+    bool operator()(const value& lhs, const value& rhs) const noexcept
+    {
+        return lhs == rhs;
+    }
+
+    template<detail::value_string_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        return lhs.is_str() && lhs.as_str() == std::string_view(rhs);
+    }
+    template<detail::value_int_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        return lhs.is_int() && lhs.as_int() == static_cast<std::int64_t>(rhs);
+    }
+    template<detail::value_uint_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        return lhs.is_uint() && lhs.as_uint() == static_cast<std::uint64_t>(rhs);
+    }
+    template<typename K>
+        requires detail::value_string_key<K> || detail::value_int_key<K> ||
+                 detail::value_uint_key<K>
+    bool operator()(const K& lhs, const value& rhs) const noexcept
+    {
+        return (*this)(rhs, lhs);
+    }
+};
+
+template<typename T>
+using unordered_value_map = std::unordered_map<value, T, value_hash, value_equal>;
+
+using unordered_value_set = std::unordered_set<value, value_hash, value_equal>;
+
+// an ordered_map from values, indexed by a hash table instead of sorted keys
+template<typename T>
+using hashed_value_map = ordered_map<value, T, value_less,
+    std::allocator<std::pair<value, T>>, 16, hashed_index<value_hash, value_equal>>;
+
+} // msgplus
+
+template<>
+struct std::hash<msgplus::value>
+{
+    std::size_t operator()(const msgplus::value& v) const
+    {
+        return msgplus::value_hash{}(v);
+    }
+};
+
+#endif // MSGPLUS_HASH_HPP
@@ -1,20 +1,534 @@
 #ifndef MSGPLUS_ORDERED_MAP_HPP
 #define MSGPLUS_ORDERED_MAP_HPP
 
-#include "flat_map.hpp"
-
 #include <algorithm>
+#include <compare>
+#include <concepts>
+#include <functional>
+#include <iterator>
+#include <memory>
 #include <stdexcept>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 #include <cassert>
+#include <cstdint>
 
 namespace msgplus
 {
 
+template<typename Key, typename Val, typename Cmp, typename Allocator,
+         std::size_t LinearSearchThreshold, typename Index>
+class ordered_map;
+
+namespace detail
+{
+
+// Positions of the elements of an ordered_map, sorted by their keys.
+template<typename Key, typename Cmp, typename Allocator>
+class sorted_position_index
+{
+  public:
+
+    using size_type = std::size_t;
+
+    struct lookup
+    {
+        bool      exists;
+        size_type position; // of the element, if it exists
+        size_type hint;     // passed to `insert` to add the key
+    };
+
+    // if keys can be searched by types other than Key
+    static constexpr bool is_transparent = requires {typename Cmp::is_transparent;};
+
+  public:
+
+    template<typename K1, typename K2>
+    static bool equal(const K1& lhs, const K2& rhs)
+    {
+        const Cmp cmp{};
+        return ! cmp(lhs, rhs) && ! cmp(rhs, lhs);
+    }
+
+    template<typename Container, typename K>
+    lookup find(const Container& c, const K& k) const
+    {
+        const Cmp cmp{};
+        const auto slot = std::lower_bound(this->positions_.begin(), this->positions_.end(), k,
+            [&c, &cmp](const size_type i, const K& key) {
+                return cmp(c[i].first, key);
+            });
+        const auto hint = static_cast<size_type>(slot - this->positions_.begin());
+        if(slot != this->positions_.end() && ! cmp(k, c[*slot].first))
+        {
+            return lookup{true, *slot, hint};
+        }
+        return lookup{false, c.size(), hint};
+    }
+
+    // `c` has no tombstones. throws std::out_of_range if there are duplicate keys
+    template<typename Container>
+    void build(const Container& c)
+    {
+        const Cmp cmp{};
+        this->positions_.resize(c.size());
+        for(size_type i=0; i<c.size(); ++i)
+        {
+            this->positions_[i] = i;
+        }
+        std::sort(this->positions_.begin(), this->positions_.end(),
+            [&c, &cmp](const size_type lhs, const size_type rhs) {
+                return cmp(c[lhs].first, c[rhs].first);
+            });
+
+        const auto dup = std::adjacent_find(this->positions_.begin(), this->positions_.end(),
+            [&c, &cmp](const size_type lhs, const size_type rhs) {
+                return ! cmp(c[lhs].first, c[rhs].first);
+            });
+        if(dup != this->positions_.end())
+        {
+            this->positions_.clear();
+            throw std::out_of_range("ordered_map: value already exists");
+        }
+    }
+
+    // `c[pos]` has just been inserted. `hint` is from `find` before that.
+    template<typename Container>
+    void insert(const Container&, const size_type hint, const size_type pos)
+    {
+        this->positions_.insert(this->positions_.begin() +
+                static_cast<std::ptrdiff_t>(hint), pos);
+    }
+
+    // `c[pos]` is about to be erased. `hint` is from `find` of its key.
+    template<typename Container>
+    void erase(const Container&, const size_type hint, [[maybe_unused]] const size_type pos)
+    {
+        assert(this->positions_[hint] == pos);
+        this->positions_.erase(this->positions_.begin() + static_cast<std::ptrdiff_t>(hint));
+    }
+
+    // the elements that were at [first, last) have been moved by `delta`
+    template<typename Container>
+    void shift(const Container&, const size_type first, const size_type last,
+               const std::ptrdiff_t delta)
+    {
+        for(auto& i : this->positions_)
+        {
+            if(first <= i && i < last) {i = static_cast<size_type>(static_cast<std::ptrdiff_t>(i) + delta);}
+        }
+    }
+
+    // removes the positions of the elements that have been erased
+    template<typename Marks>
+    void erase_marked(const Marks& erased)
+    {
+        std::erase_if(this->positions_, [&erased](const size_type i) {return erased[i];});
+    }
+
+    // the element at `i` has been moved to `moved_to[i]`
+    template<typename Positions>
+    void renumber(const Positions& moved_to)
+    {
+        for(auto& i : this->positions_)
+        {
+            i = moved_to[i];
+        }
+    }
+
+    void reserve(const size_type n) {positions_.reserve(n);}
+    void clear() noexcept {positions_.clear();}
+    void swap(sorted_position_index& other) noexcept {positions_.swap(other.positions_);}
+
+  private:
+
+    std::vector<size_type, typename std::allocator_traits<Allocator>::template
+        rebind_alloc<size_type>> positions_;
+};
+
+// Positions of the elements of an ordered_map in an open-addressing hash
+// table with Robin Hood probing.
+template<typename Key, typename Hash, typename KeyEqual, typename Allocator>
+class hashed_position_index
+{
+  public:
+
+    using size_type = std::size_t;
+
+    struct lookup
+    {
+        bool      exists;
+        size_type position; // of the element, if it exists
+        size_type hint;     // the hash of the key
+    };
+
+    // if keys can be searched by types other than Key
+    static constexpr bool is_transparent =
+        requires {typename Hash::is_transparent; typename KeyEqual::is_transparent;};
+
+  public:
+
+    template<typename K1, typename K2>
+    static bool equal(const K1& lhs, const K2& rhs)
+    {
+        return KeyEqual{}(lhs, rhs);
+    }
+
+    template<typename Container, typename K>
+    lookup find(const Container& c, const K& k) const
+    {
+        const size_type h = spread(Hash{}(k));
+        if(this->slots_.empty())
+        {
+            return lookup{false, c.size(), h};
+        }
+        const size_type mask = this->slots_.size() - 1;
+        size_type i    = h & mask;
+        size_type dist = 1;
+        while(true)
+        {
+            const auto& s = this->slots_[i];
+            if(s.distance < dist) // empty, or a key that would have been after `k`
+            {
+                return lookup{false, c.size(), h};
+            }
+            if(s.hash == h && KeyEqual{}(c[s.position].first, k))
+            {
+                return lookup{true, s.position, h};
+            }
+            i = (i + 1) & mask;
+            dist += 1;
+        }
+    }
+
+    // `c` has no tombstones. throws std::out_of_range if there are duplicate keys
+    template<typename Container>
+    void build(const Container& c)
+    {
+        this->clear();
+        this->reserve(c.size());
+        for(size_type i=0; i<c.size(); ++i)
+        {
+            const auto found = this->find(c, c[i].first);
+            if(found.exists)
+            {
+                this->clear();
+                throw std::out_of_range("ordered_map: value already exists");
+            }
+            this->place(slot{i, found.hint, 1});
+        }
+    }
+
+    // `c[pos]` has just been inserted. `hint` is from `find` before that.
+    template<typename Container>
+    void insert(const Container&, const size_type hint, const size_type pos)
+    {
+        this->reserve(this->count_ + 1);
+        this->place(slot{pos, hint, 1});
+    }
+
+    // `c[pos]` is about to be erased. `hint` is from `find` of its key.
+    template<typename Container>
+    void erase(const Container&, const size_type hint, const size_type pos)
+    {
+        const size_type mask = this->slots_.size() - 1;
+        size_type i = hint & mask;
+        while(this->slots_[i].position != pos || this->slots_[i].distance == 0)
+        {
+            i = (i + 1) & mask;
+        }
+        this->remove_at(i);
+    }
+
+    // The elements that were at [first, last) have been moved by `delta`.
+    // A few elements are looked up by their keys; many are renumbered in a
+    // pass over the table.
+    template<typename Container>
+    void shift(const Container& c, const size_type first, const size_type last,
+               const std::ptrdiff_t delta)
+    {
+        if((last - first) * 4 < this->slots_.size())
+        {
+            const size_type mask = this->slots_.size() - 1;
+            for(size_type k=0; k<last-first; ++k)
+            {
+                // in the order that does not make two of them share a position
+                const size_type from = (0 < delta) ? last - 1 - k : first + k;
+                const size_type to   = static_cast<size_type>(static_cast<std::ptrdiff_t>(from) + delta);
+                const size_type h    = spread(Hash{}(c[to].first));
+                size_type i = h & mask;
+                while(this->slots_[i].distance == 0 || this->slots_[i].position != from ||
+                      this->slots_[i].hash != h)
+                {
+                    i = (i + 1) & mask;
+                }
+                this->slots_[i].position = to;
+            }
+            return;
+        }
+        for(auto& s : this->slots_)
+        {
+            if(s.distance != 0 && first <= s.position && s.position < last)
+            {
+                s.position = static_cast<size_type>(static_cast<std::ptrdiff_t>(s.position) + delta);
+            }
+        }
+    }
+
+    // removes the positions of the elements that have been erased
+    template<typename Marks>
+    void erase_marked(const Marks& erased)
+    {
+        for(size_type i=0; i<this->slots_.size(); )
+        {
+            const auto& s = this->slots_[i];
+            if(s.distance != 0 && erased[s.position])
+            {
+                this->remove_at(i); // the next one may have moved to `i`
+                continue;
+            }
+            i += 1;
+        }
+    }
+
+    // the element at `i` has been moved to `moved_to[i]`
+    template<typename Positions>
+    void renumber(const Positions& moved_to)
+    {
+        for(auto& s : this->slots_)
+        {
+            if(s.distance != 0) {s.position = moved_to[s.position];}
+        }
+    }
+
+    // makes room for `n` keys, keeping the load factor at most 7/8
+    void reserve(const size_type n)
+    {
+        if(n * 8 <= this->slots_.size() * 7)
+        {
+            return;
+        }
+        size_type capacity = 16;
+        while(capacity * 7 < n * 8)
+        {
+            capacity *= 2;
+        }
+        slots_type old(capacity);
+        old.swap(this->slots_);
+        this->count_ = 0;
+        for(const auto& s : old)
+        {
+            if(s.distance != 0)
+            {
+                this->place(slot{s.position, s.hash, 1});
+            }
+        }
+    }
+    void clear() noexcept
+    {
+        slots_.clear();
+        count_ = 0;
+    }
+    void swap(hashed_position_index& other) noexcept
+    {
+        using std::swap;
+        swap(slots_, other.slots_);
+        swap(count_, other.count_);
+    }
+
+  private:
+
+    // Only the low bits of a hash select the home slot, and some hashes, such
+    // as std::hash of integers, leave them poorly distributed.
+    static size_type spread(const size_type h) noexcept
+    {
+        const std::uint64_t x = static_cast<std::uint64_t>(h) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_type>(x ^ (x >> 32));
+    }
+
+    struct slot
+    {
+        size_type position = 0;
+        size_type hash     = 0;
+        size_type distance = 0; // 1 + distance from the home slot. 0 if empty
+    };
+    using slots_type = std::vector<slot,
+        typename std::allocator_traits<Allocator>::template rebind_alloc<slot>>;
+
+    // backward shift deletion: no tombstones are left behind
+    void remove_at(size_type i)
+    {
+        const size_type mask = this->slots_.size() - 1;
+        while(true)
+        {
+            const size_type next = (i + 1) & mask;
+            if(this->slots_[next].distance <= 1)
+            {
+                this->slots_[i] = slot{};
+                break;
+            }
+            this->slots_[i] = this->slots_[next];
+            this->slots_[i].distance -= 1;
+            i = next;
+        }
+        this->count_ -= 1;
+    }
+
+    void place(slot s)
+    {
+        const size_type mask = this->slots_.size() - 1;
+        size_type i = s.hash & mask;
+        while(this->slots_[i].distance != 0)
+        {
+            if(this->slots_[i].distance < s.distance) // take from the rich
+            {
+                std::swap(this->slots_[i], s);
+            }
+            i = (i + 1) & mask;
+            s.distance += 1;
+        }
+        this->slots_[i] = s;
+        this->count_ += 1;
+    }
+
+  private:
+
+    slots_type slots_;
+    size_type  count_ = 0;
+};
+
+// Marks the slots of an ordered_map where elements have been erased.
+template<typename Allocator>
+using ordered_map_marks = std::vector<bool,
+      typename std::allocator_traits<Allocator>::template rebind_alloc<bool>>;
+
+// Iterates over the elements of an ordered_map in order, skipping the
+// tombstones. `marks_` is null if the map had none when it was made.
+// Iterators compare by the positions of their elements.
+template<typename T, typename Marks, bool IsConst>
+class ordered_map_iterator
+{
+  public:
+
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type        = T;
+    using difference_type   = std::ptrdiff_t;
+    using pointer           = std::conditional_t<IsConst, const T*, T*>;
+    using reference         = std::conditional_t<IsConst, const T&, T&>;
+
+  public:
+
+    ordered_map_iterator() = default;
+    ordered_map_iterator(pointer ptr, pointer base, const Marks* marks) noexcept
+        : ptr_(ptr), base_(base), marks_(marks)
+    {}
+
+    // iterator -> const_iterator
+    template<bool C> requires(IsConst && ! C)
+    ordered_map_iterator(const ordered_map_iterator<T, Marks, C>& other) noexcept
+        : ptr_(other.ptr_), base_(other.base_), marks_(other.marks_)
+    {}
+
+    reference operator*()  const noexcept {return *ptr_;}
+    pointer   operator->() const noexcept {return ptr_;}
+
+    ordered_map_iterator& operator++() noexcept
+    {
+        ++ptr_;
+        if(marks_)
+        {
+            const auto last = base_ + marks_->size();
+            while(ptr_ != last && (*marks_)[static_cast<std::size_t>(ptr_ - base_)]) {++ptr_;}
+        }
+        return *this;
+    }
+    ordered_map_iterator operator++(int) noexcept
+    {
+        auto tmp = *this;
+        ++(*this);
+        return tmp;
+    }
+    ordered_map_iterator& operator--() noexcept
+    {
+        --ptr_;
+        if(marks_)
+        {
+            while((*marks_)[static_cast<std::size_t>(ptr_ - base_)]) {--ptr_;}
+        }
+        return *this;
+    }
+    ordered_map_iterator operator--(int) noexcept
+    {
+        auto tmp = *this;
+        --(*this);
+        return tmp;
+    }
+
+    friend bool operator==(const ordered_map_iterator& lhs, const ordered_map_iterator& rhs) noexcept
+    {
+        return lhs.ptr_ == rhs.ptr_;
+    }
+    friend std::strong_ordering operator<=>(const ordered_map_iterator& lhs,
+                                            const ordered_map_iterator& rhs) noexcept
+    {
+        return std::compare_three_way{}(lhs.ptr_, rhs.ptr_);
+    }
+
+  private:
+
+    template<typename, typename, bool>
+    friend class ordered_map_iterator;
+    template<typename, typename, typename, typename, std::size_t, typename>
+    friend class msgplus::ordered_map;
+
+    pointer      ptr_   = nullptr;
+    pointer      base_  = nullptr; // the first slot
+    const Marks* marks_ = nullptr;
+};
+
+// K can be used to search a map of Key without being converted into Key
+template<typename K, typename Key, typename Index>
+concept transparent_key = Index::is_transparent && ( ! std::same_as<K, Key>);
+
+} // detail
+
+// Index policies of ordered_map.
+//
+// `sorted_index` binary-searches positions sorted by `Cmp`. `hashed_index`
+// looks positions up in a hash table, which is faster for large maps; `Cmp`
+// is then unused. Both keep the elements in insertion order.
+struct sorted_index
+{
+    template<typename Key, typename Cmp, typename Allocator>
+    using type = detail::sorted_position_index<Key, Cmp, Allocator>;
+};
+
+template<typename Hash = void, typename KeyEqual = void>
+struct hashed_index
+{
+    template<typename Key, typename Cmp, typename Allocator>
+    using type = detail::hashed_position_index<Key,
+        std::conditional_t<std::is_void_v<Hash>,     std::hash<Key>,     Hash>,
+        std::conditional_t<std::is_void_v<KeyEqual>, std::equal_to<Key>, KeyEqual>,
+        Allocator>;
+};
+
+// A map that keeps the insertion order of its elements.
+//
+// Maps smaller than `LinearSearchThreshold` are searched linearly and have no
+// index. When a map grows to the threshold, an index of the kind `Index` is
+// built and used for the rest of its lifetime, unless it shrinks again.
+//
+// Erasing an element leaves a tombstone in its place, so that the others do
+// not move. The tombstones are skipped by the iterators, reused by `insert`,
+// and removed at once when they outnumber the elements. Inserting and
+// erasing invalidate the iterators.
 template<typename Key, typename Val, typename Cmp = std::less<Key>,
-         typename Allocator = std::allocator<std::pair<Key, Val>>>
+         typename Allocator = std::allocator<std::pair<Key, Val>>,
+         std::size_t LinearSearchThreshold = 16,
+         typename Index = sorted_index>
 class ordered_map
 {
   public:
@@ -32,23 +546,38 @@ class ordered_map
     using pointer         = typename container_type::pointer;
     using const_reference = typename container_type::const_reference;
     using const_pointer   = typename container_type::const_pointer;
-    using iterator        = typename container_type::iterator;
-    using const_iterator  = typename container_type::const_iterator;
+    using iterator        = detail::ordered_map_iterator<value_type,
+                                detail::ordered_map_marks<Allocator>, false>;
+    using const_iterator  = detail::ordered_map_iterator<value_type,
+                                detail::ordered_map_marks<Allocator>, true>;
     using size_type       = typename container_type::size_type;
     using difference_type = typename container_type::difference_type;
 
-    using key_index_map = flat_map<key_type, size_type, key_compare, typename
-        std::allocator_traits<allocator_type>::template rebind_alloc<std::pair<key_type, size_type>>
-          >;
+    static constexpr std::size_t linear_search_threshold = LinearSearchThreshold;
+
+    // positions in `container_`, searchable by the keys at those positions
+    using key_index_type = typename Index::template type<Key, Cmp, allocator_type>;
 
   public:
 
     ordered_map() = default;
     ~ordered_map() = default;
-    ordered_map(const ordered_map&) = default;
     ordered_map(ordered_map&&)      = default;
-    ordered_map& operator=(const ordered_map&) = default;
-    ordered_map& operator=(ordered_map&&)      = default;
+    ordered_map& operator=(ordered_map&&) = default;
+
+    ordered_map(const ordered_map& other)
+        : container_(other.container_),
+          extras_(other.extras_ ? std::make_unique<extras>(*other.extras_) : nullptr)
+    {}
+    ordered_map& operator=(const ordered_map& other)
+    {
+        if(this != std::addressof(other))
+        {
+            ordered_map tmp(other);
+            this->swap(tmp);
+        }
+        return *this;
+    }
 
     template<typename InputIterator>
     ordered_map(InputIterator first, InputIterator last)
@@ -64,66 +593,89 @@ class ordered_map
     }
     ordered_map& operator=(std::initializer_list<value_type> v)
     {
-        this->container_ = std::move(v);
-        this->construct_index();
+        ordered_map tmp(std::move(v));
+        this->swap(tmp);
         return *this;
     }
 
-    iterator       begin()        noexcept {return container_.begin();}
-    iterator       end()          noexcept {return container_.end();}
-    const_iterator begin()  const noexcept {return container_.begin();}
-    const_iterator end()    const noexcept {return container_.end();}
-    const_iterator cbegin() const noexcept {return container_.cbegin();}
-    const_iterator cend()   const noexcept {return container_.cend();}
+    // Takes the elements at once and sorts the index once, in O(n log n).
+    // Throws std::out_of_range if a key appears more than once.
+    explicit ordered_map(container_type v)
+        : container_(std::move(v))
+    {
+        this->construct_index();
+    }
+
+    iterator       begin()        noexcept {return this->iterator_at(this->first());}
+    iterator       end()          noexcept {return this->iterator_at(container_.size());}
+    const_iterator begin()  const noexcept {return this->iterator_at(this->first());}
+    const_iterator end()    const noexcept {return this->iterator_at(container_.size());}
+    const_iterator cbegin() const noexcept {return this->begin();}
+    const_iterator cend()   const noexcept {return this->end();}
 
-    bool        empty()    const noexcept {return container_.empty();}
-    std::size_t size()     const noexcept {return container_.size();}
+    bool        empty()    const noexcept {return this->size() == 0;}
+    std::size_t size()     const noexcept
+    {
+        return container_.size() - (extras_ ? extras_->count : 0);
+    }
     std::size_t max_size() const noexcept {return container_.max_size();}
+    std::size_t capacity() const noexcept {return container_.capacity();}
 
-    void clear() {container_.clear();}
+    void reserve(const size_type n)
+    {
+        container_.reserve(n);
+        if(linear_search_threshold <= n)
+        {
+            this->extra().index.reserve(n);
+        }
+    }
+
+    void clear() noexcept
+    {
+        container_.clear();
+        extras_.reset();
+    }
 
     void push_back(value_type v)
     {
-        if(this->contains(v.first))
+        const auto found = this->locate(v.first);
+        if(found.exists)
         {
             throw std::out_of_range("ordered_map: value already exists");
         }
-        this->key_index_[v.first] = this->container_.size();
-        container_.push_back(std::move(v));
+        this->append(std::move(v));
+        this->index_inserted(found.hint, this->container_.size() - 1);
     }
     void emplace_back(key_type k, mapped_type v)
     {
-        if(this->contains(k))
+        const auto found = this->locate(k);
+        if(found.exists)
         {
             throw std::out_of_range("ordered_map: value already exists");
         }
-        this->key_index_[k] = this->container_.size();
-        container_.emplace_back(std::move(k), std::move(v));
+        this->append(value_type(std::move(k), std::move(v)));
+        this->index_inserted(found.hint, this->container_.size() - 1);
     }
     void pop_back()
     {
         if(this->empty()) {return;}
 
-        this->key_index_.erase(container_.back().first);
-        container_.pop_back();
+        const auto found = this->locate(container_.back().first);
+        assert(found.exists);
+        this->erase_at(found);
     }
 
+    // Moves the elements between `pos` and the nearest tombstone, if any, to
+    // make room. Without tombstones, the following elements are moved.
     void insert(const_iterator pos, value_type kv)
     {
-        if(this->contains(kv.first))
+        const auto found = this->locate(kv.first);
+        if(found.exists)
         {
             throw std::out_of_range("ordered_map: value already exists");
         }
-
-        const auto index = std::distance(this->container_.cbegin(), pos);
-        for(auto iter=pos; iter != this->cend(); ++iter)
-        {
-            assert(index <= this->key_index_.at(iter->first));
-            this->key_index_.at(iter->first) += 1;
-        }
-        this->key_index_[kv.first] = index;
-
-        container_.insert(pos, std::move(kv));
+        const auto index = this->place(this->slot_index(pos), std::move(kv));
+        this->index_inserted(found.hint, index);
         return;
     }
     void emplace(const_iterator pos, key_type k, mapped_type v)
@@ -132,6 +684,76 @@ class ordered_map
         return;
     }
 
+    // Erasing an element leaves a tombstone, so it takes amortized O(1)
+    // time besides the update of the index.
+    iterator erase(iterator pos)
+    {
+        return this->erase(const_iterator(pos));
+    }
+    iterator erase(const_iterator pos)
+    {
+        const auto found = this->locate(pos->first);
+        assert(found.exists);
+        return this->erase_at(found);
+    }
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        const auto from = this->slot_index(first);
+        const auto to   = this->slot_index(last);
+        if(from == to)
+        {
+            return this->iterator_at(from);
+        }
+        this->mark_tombstones();
+        const bool indexed = this->is_indexed();
+        for(size_type i=from; i<to; ++i)
+        {
+            if( ! this->extras_->erased[i]) {this->bury(i);}
+        }
+        return this->iterator_at(this->index_erased(indexed, to));
+    }
+    size_type erase(const key_type& k)
+    {
+        const auto found = this->locate(k);
+        if( ! found.exists)
+        {
+            return 0;
+        }
+        this->erase_at(found);
+        return 1;
+    }
+
+    // removes all the elements that satisfy `pred`, and updates the index
+    // in a single pass
+    template<typename Pred>
+    friend size_type erase_if(ordered_map& m, Pred pred)
+    {
+        if(m.empty()) {return 0;}
+
+        m.mark_tombstones();
+        const bool indexed = m.is_indexed();
+        size_type n = 0;
+        try
+        {
+            for(size_type i=m.first(); i<m.container_.size(); ++i)
+            {
+                if( ! m.extras_->erased[i] && pred(m.container_[i]))
+                {
+                    m.bury(i);
+                    n += 1;
+                }
+            }
+        }
+        catch(...)
+        {
+            m.index_erased(indexed, 0);
+            throw;
+        }
+        if(n != 0) {m.index_erased(indexed, 0);}
+        else       {m.tidy(0);} // drops the marks
+        return n;
+    }
+
     std::size_t count(const key_type& key) const
     {
         return this->contains(key) ? 1 : 0;
@@ -140,33 +762,23 @@ class ordered_map
     {
         return this->find(key) != this->end();
     }
-    iterator find(const key_type& key) noexcept
+    iterator find(const key_type& key)
     {
-        const auto index = this->key_index_.find(key);
-        if(index == this->key_index_.end())
+        const auto found = this->locate(key);
+        if( ! found.exists)
         {
             return this->end();
         }
-        assert(index->second < this->size());
-
-        const auto found = std::next(this->begin(), index->second);
-        assert(found->first == key);
-
-        return found;
+        return this->iterator_at(found.position);
     }
-    const_iterator find(const key_type& key) const noexcept
+    const_iterator find(const key_type& key) const
     {
-        const auto index = this->key_index_.find(key);
-        if(index == this->key_index_.end())
+        const auto found = this->locate(key);
+        if( ! found.exists)
         {
             return this->end();
         }
-        assert(index->second < this->size());
-
-        const auto found = std::next(this->begin(), index->second);
-        assert(found->first == key);
-
-        return found;
+        return this->iterator_at(found.position);
     }
 
     mapped_type&       at(const key_type& k)
@@ -188,17 +800,71 @@ class ordered_map
         return iter->second;
     }
 
+    // Heterogeneous lookup. Available if the comparator (or the hash and the
+    // equality of hashed_index) is transparent, like value_less.
+    template<detail::transparent_key<Key, key_index_type> K>
+    std::size_t count(const K& key) const
+    {
+        return this->contains(key) ? 1 : 0;
+    }
+    template<detail::transparent_key<Key, key_index_type> K>
+    bool contains(const K& key) const
+    {
+        return this->locate(key).exists;
+    }
+    template<detail::transparent_key<Key, key_index_type> K>
+    iterator find(const K& key)
+    {
+        const auto found = this->locate(key);
+        if( ! found.exists)
+        {
+            return this->end();
+        }
+        return this->iterator_at(found.position);
+    }
+    template<detail::transparent_key<Key, key_index_type> K>
+    const_iterator find(const K& key) const
+    {
+        const auto found = this->locate(key);
+        if( ! found.exists)
+        {
+            return this->end();
+        }
+        return this->iterator_at(found.position);
+    }
+    template<detail::transparent_key<Key, key_index_type> K>
+    mapped_type& at(const K& k)
+    {
+        const auto found = this->locate(k);
+        if( ! found.exists)
+        {
+            throw std::out_of_range("ordered_map: no such element");
+        }
+        return this->container_[found.position].second;
+    }
+    template<detail::transparent_key<Key, key_index_type> K>
+    mapped_type const& at(const K& k) const
+    {
+        const auto found = this->locate(k);
+        if( ! found.exists)
+        {
+            throw std::out_of_range("ordered_map: no such element");
+        }
+        return this->container_[found.position].second;
+    }
+
     mapped_type& operator[](const key_type& k)
     {
-        const auto iter = this->find(k);
-        if(iter == this->end())
+        const auto found = this->locate(k);
+        if( ! found.exists)
         {
-            this->container_.emplace_back(k, mapped_type{});
+            this->append(value_type(k, mapped_type{}));
+            this->index_inserted(found.hint, this->container_.size() - 1);
             return this->container_.back().second;
         }
         else
         {
-            return iter->second;
+            return this->container_[found.position].second;
         }
     }
 
@@ -215,37 +881,398 @@ class ordered_map
         }
     }
 
-    void swap(ordered_map& other)
+    void swap(ordered_map& other) noexcept
     {
         container_.swap(other.container_);
+        extras_.swap(other.extras_);
     }
 
-    bool operator==(const ordered_map& rhs) const noexcept {return this->container_ == rhs.container_;}
-    bool operator!=(const ordered_map& rhs) const noexcept {return this->container_ != rhs.container_;}
-    bool operator< (const ordered_map& rhs) const noexcept {return this->container_ <  rhs.container_;}
-    bool operator<=(const ordered_map& rhs) const noexcept {return this->container_ <= rhs.container_;}
-    bool operator> (const ordered_map& rhs) const noexcept {return this->container_ >  rhs.container_;}
-    bool operator>=(const ordered_map& rhs) const noexcept {return this->container_ >= rhs.container_;}
+    bool operator==(const ordered_map& rhs) const noexcept
+    {
+        return this->size() == rhs.size() && std::equal(this->begin(), this->end(), rhs.begin());
+    }
+    bool operator< (const ordered_map& rhs) const noexcept
+    {
+        return std::lexicographical_compare(this->begin(), this->end(), rhs.begin(), rhs.end());
+    }
+    bool operator!=(const ordered_map& rhs) const noexcept {return !(*this == rhs);}
+    bool operator<=(const ordered_map& rhs) const noexcept {return !(rhs < *this);}
+    bool operator> (const ordered_map& rhs) const noexcept {return   rhs < *this ;}
+    bool operator>=(const ordered_map& rhs) const noexcept {return !(*this < rhs);}
 
   private:
 
+    using lookup = typename key_index_type::lookup;
+
+    // The index and the places where elements have been erased. They are
+    // allocated together, only when the map is indexed or has tombstones, so
+    // that a small map without erasures is no larger than its vector and a
+    // null pointer, and iterating over it checks nothing.
+    struct extras
+    {
+        key_index_type index;
+        detail::ordered_map_marks<Allocator> erased; // one for each slot, or none
+        size_type count = 0; // of the tombstones
+        size_type first = 0; // the position of the first element
+    };
+
+    extras& extra()
+    {
+        if( ! this->extras_)
+        {
+            this->extras_ = std::make_unique<extras>();
+        }
+        return *this->extras_;
+    }
+
+    bool is_indexed() const noexcept
+    {
+        return linear_search_threshold <= this->size();
+    }
+    bool has_tombstones() const noexcept
+    {
+        return this->extras_ && ! this->extras_->erased.empty();
+    }
+    bool is_erased(const size_type i) const noexcept
+    {
+        return this->has_tombstones() && this->extras_->erased[i];
+    }
+    size_type first() const noexcept
+    {
+        return this->extras_ ? this->extras_->first : 0;
+    }
+    // the marks live on the heap, so that the iterators survive a swap like
+    // those of a vector
+    iterator iterator_at(const size_type i) noexcept
+    {
+        return iterator(this->container_.data() + i, this->container_.data(),
+                        this->has_tombstones() ? std::addressof(this->extras_->erased) : nullptr);
+    }
+    const_iterator iterator_at(const size_type i) const noexcept
+    {
+        return const_iterator(this->container_.data() + i, this->container_.data(),
+                              this->has_tombstones() ? std::addressof(this->extras_->erased) : nullptr);
+    }
+    size_type slot_index(const const_iterator pos) const noexcept
+    {
+        return static_cast<size_type>(pos.ptr_ - this->container_.data());
+    }
+
+    // throws std::out_of_range if there are duplicate keys
     void construct_index()
     {
-        this->key_index_.clear();
+        if( ! this->is_indexed())
+        {
+            if(this->extras_) {this->extras_->index.clear();}
+            for(size_type i=this->first(); i<this->container_.size(); ++i)
+            {
+                if(this->is_erased(i)) {continue;}
+                for(size_type j=this->first(); j<i; ++j)
+                {
+                    if( ! this->is_erased(j) &&
+                        key_index_type::equal(this->container_[i].first,
+                                              this->container_[j].first))
+                    {
+                        throw std::out_of_range("ordered_map: value already exists");
+                    }
+                }
+            }
+            return;
+        }
+        if(this->has_tombstones())
+        {
+            this->compact(0);
+        }
+        this->extra().index.build(this->container_);
+    }
+
+    template<typename K>
+    lookup locate(const K& k) const
+    {
+        if( ! this->is_indexed())
+        {
+            for(size_type i=this->first(); i<this->container_.size(); ++i)
+            {
+                if( ! this->is_erased(i) && key_index_type::equal(this->container_[i].first, k))
+                {
+                    return lookup{true, i, 0};
+                }
+            }
+            return lookup{false, this->container_.size(), 0};
+        }
+        return this->extras_->index.find(this->container_, k);
+    }
+
+    // appends an element after the last slot
+    void append(value_type&& kv)
+    {
+        if( ! this->has_tombstones())
+        {
+            this->container_.push_back(std::move(kv));
+            return;
+        }
+        this->extras_->erased.push_back(false); // before the element, which cannot be undone
+        try
+        {
+            this->container_.push_back(std::move(kv));
+        }
+        catch(...)
+        {
+            this->extras_->erased.pop_back();
+            throw;
+        }
+    }
+
+    // allocates the tombstones before anything is erased
+    void mark_tombstones()
+    {
+        if( ! this->has_tombstones())
+        {
+            this->extra().erased.resize(this->container_.size(), false);
+        }
+    }
+
+    // forgets the marks after the last tombstone has gone. the index is kept
+    // if the map is still large enough to have one.
+    void drop_tombstones() noexcept
+    {
+        this->extras_->count = 0;
+        this->extras_->first = 0;
+        if( ! this->is_indexed())
+        {
+            this->extras_.reset();
+            return;
+        }
+        detail::ordered_map_marks<Allocator>().swap(this->extras_->erased);
+    }
+
+    // destroys the element at `i` and leaves a tombstone. the index is not
+    // updated.
+    void bury(const size_type i)
+    {
+        {
+            value_type erased(std::move(this->container_[i]));
+        }
+        this->extras_->erased[i] = true;
+        this->extras_->count += 1;
+    }
+
+    iterator erase_at(const lookup& found)
+    {
+        const bool last = (found.position + 1 == this->container_.size());
+        if( ! last)
+        {
+            this->mark_tombstones();
+        }
+        const bool indexed = this->is_indexed();
+        if(indexed)
+        {
+            this->extras_->index.erase(this->container_, found.hint, found.position);
+        }
+        if(last && ! this->has_tombstones()) // like pop_back, no tombstone is needed
+        {
+            this->container_.pop_back();
+            if(indexed && ! this->is_indexed())
+            {
+                this->extras_.reset();
+            }
+            return this->end();
+        }
+        this->bury(found.position);
+        if(indexed && ! this->is_indexed())
+        {
+            this->extras_->index.clear();
+        }
+
+        size_type next = found.position + 1;
+        while(next < this->container_.size() && this->extras_->erased[next])
+        {
+            next += 1;
+        }
+        return this->iterator_at(this->tidy(next));
+    }
+
+    // updates the index after elements are buried at once. returns the
+    // position of the slot `next` after that.
+    size_type index_erased(const bool was_indexed, const size_type next)
+    {
+        if(was_indexed)
+        {
+            if(this->is_indexed())
+            {
+                this->extras_->index.erase_marked(this->extras_->erased);
+            }
+            else
+            {
+                this->extras_->index.clear();
+            }
+        }
+        return this->tidy(next);
+    }
+
+    // Drops the tombstones at both ends, and compacts the slots if most of
+    // them are tombstones. Returns the position of the slot `next` after that.
+    size_type tidy(size_type next)
+    {
+        if(this->empty())
+        {
+            this->clear();
+            return 0;
+        }
+        auto& t = *this->extras_;
+        while(t.erased.back())
+        {
+            this->container_.pop_back();
+            t.erased.pop_back();
+            t.count -= 1;
+        }
+        while(t.erased[t.first])
+        {
+            t.first += 1;
+        }
+        next = std::min(next, this->container_.size());
+
+        if(t.count == 0)
+        {
+            this->drop_tombstones();
+        }
+        else if(this->size() < t.count)
+        {
+            return this->compact(next);
+        }
+        return next;
+    }
+
+    // Removes all the tombstones, keeping the order. Returns the position of
+    // the slot `keep` after that.
+    size_type compact(const size_type keep)
+    {
+        std::vector<size_type> moved_to;
+        if(this->is_indexed())
+        {
+            moved_to.resize(this->container_.size());
+        }
+        size_type n    = 0;
+        size_type kept = 0;
         for(size_type i=0; i<this->container_.size(); ++i)
         {
-            this->key_index_[this->container_[i].first] = i;
+            if(i == keep) {kept = n;}
+            if(this->extras_->erased[i]) {continue;}
+
+            if( ! moved_to.empty()) {moved_to[i] = n;}
+            if(i != n) {this->container_[n] = std::move(this->container_[i]);}
+            n += 1;
+        }
+        if(this->container_.size() <= keep) {kept = n;}
+
+        this->container_.erase(this->container_.begin() + static_cast<difference_type>(n),
+                               this->container_.end());
+        this->drop_tombstones();
+        if( ! moved_to.empty())
+        {
+            this->extras_->index.renumber(moved_to);
+        }
+        return kept;
+    }
+
+    // Puts `kv` in front of the slot `at`. It reuses the nearest tombstone,
+    // moving the elements in between by one, and the index is updated for
+    // the moved ones. Returns the position of `kv`.
+    size_type place(const size_type at, value_type&& kv)
+    {
+        const bool indexed = this->is_indexed();
+        if(at == this->container_.size())
+        {
+            this->append(std::move(kv));
+            return at;
+        }
+        if( ! this->has_tombstones())
+        {
+            this->container_.insert(this->container_.begin() + static_cast<difference_type>(at),
+                                    std::move(kv));
+            if(indexed)
+            {
+                this->extras_->index.shift(this->container_, at, this->container_.size() - 1, 1);
+            }
+            return at;
+        }
+
+        auto& t = *this->extras_;
+        size_type hole = at;
+        if(0 < at && t.erased[at - 1])
+        {
+            hole = at - 1;
+        }
+        else // find the nearest tombstone on either side
+        {
+            for(size_type d=1; ; ++d)
+            {
+                if(at + d < this->container_.size() && t.erased[at + d])
+                {
+                    const auto gap = at + d;
+                    std::move_backward(this->container_.begin() + static_cast<difference_type>(at),
+                                       this->container_.begin() + static_cast<difference_type>(gap),
+                                       this->container_.begin() + static_cast<difference_type>(gap + 1));
+                    if(indexed)
+                    {
+                        this->extras_->index.shift(this->container_, at, gap, 1);
+                    }
+                    t.erased[gap] = false;
+                    hole = at;
+                    break;
+                }
+                if(d + 1 <= at && t.erased[at - 1 - d])
+                {
+                    const auto gap = at - 1 - d;
+                    std::move(this->container_.begin() + static_cast<difference_type>(gap + 1),
+                              this->container_.begin() + static_cast<difference_type>(at),
+                              this->container_.begin() + static_cast<difference_type>(gap));
+                    if(indexed)
+                    {
+                        this->extras_->index.shift(this->container_, gap + 1, at, -1);
+                    }
+                    t.erased[gap] = false;
+                    hole = at - 1;
+                    t.first = std::min(t.first, gap);
+                    break;
+                }
+            }
+        }
+        this->container_[hole] = std::move(kv);
+        t.erased[hole] = false;
+        t.count -= 1;
+        t.first  = std::min(t.first, hole);
+        return hole;
+    }
+
+    // updates the index after an element is inserted at `index`. `hint` is
+    // the one `locate` returned before the insertion.
+    void index_inserted(const size_type hint, const size_type index)
+    {
+        if(this->has_tombstones() && this->extras_->count == 0)
+        {
+            this->drop_tombstones(); // the last tombstone has been reused
+        }
+        if( ! this->is_indexed())
+        {
+            return;
+        }
+        if(this->size() == linear_search_threshold)
+        {
+            this->construct_index(); // reached the threshold just now
+            return;
         }
+        this->extras_->index.insert(this->container_, hint, index);
     }
 
   private:
 
-    key_index_map  key_index_;
     container_type container_;
+    std::unique_ptr<extras> extras_; // null if there is neither an index nor a tombstone
 };
 
-template<typename K, typename V, typename A>
-void swap(ordered_map<K,V,A>& lhs, ordered_map<K,V,A>& rhs)
+template<typename K, typename V, typename C, typename A, std::size_t N, typename I>
+void swap(ordered_map<K,V,C,A,N,I>& lhs, ordered_map<K,V,C,A,N,I>& rhs) noexcept
 {
     lhs.swap(rhs);
     return;
@@ -0,0 +1,406 @@
+#ifndef MSGPLUS_PATCH_HPP
+#define MSGPLUS_PATCH_HPP
+
+#include "value.hpp"
+#include "reader.hpp"
+#include "read.hpp"
+#include "writer.hpp"
+#include "write.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+// A list of edits that turns one value into another.
+//
+// The location of an edit is a list of keys from the root: a map is indexed
+// by a key of the map, and an array by a uint. An empty location means the
+// root itself.
+//
+// - `set`    replaces the element at the location, or appends a new entry if
+//            the location is a key that the map does not have.
+// - `remove` erases the element at the location.
+// - `insert` inserts an element into an array before the index.
+//
+// A patch can be converted to a value and back, so it can be sent as msgpack.
+// The format is an array of `[op, [keys...]]` for remove and
+// `[op, [keys...], value]` for set and insert, where op is 0, 1, 2 for set,
+// remove and insert.
+class patch
+{
+  public:
+
+    enum class op_t : std::uint8_t
+    {
+        set    = 0,
+        remove = 1,
+        insert = 2,
+    };
+
+    struct operation
+    {
+        op_t               op;
+        std::vector<value> location;
+        value              element; // nil for remove
+    };
+
+    using container_type = std::vector<operation>;
+    using iterator       = typename container_type::iterator;
+    using const_iterator = typename container_type::const_iterator;
+
+  public:
+
+    patch() = default;
+    ~patch() = default;
+    patch(const patch&) = default;
+    patch(patch&&)      = default;
+    patch& operator=(const patch&) = default;
+    patch& operator=(patch&&)      = default;
+
+    void set(std::vector<value> location, value element)
+    {
+        this->ops_.push_back(operation{op_t::set, std::move(location), std::move(element)});
+    }
+    void remove(std::vector<value> location)
+    {
+        this->ops_.push_back(operation{op_t::remove, std::move(location), value{}});
+    }
+    void insert(std::vector<value> location, value element)
+    {
+        this->ops_.push_back(operation{op_t::insert, std::move(location), std::move(element)});
+    }
+
+    iterator       begin()        noexcept {return ops_.begin();}
+    iterator       end()          noexcept {return ops_.end();}
+    const_iterator begin()  const noexcept {return ops_.begin();}
+    const_iterator end()    const noexcept {return ops_.end();}
+    const_iterator cbegin() const noexcept {return ops_.cbegin();}
+    const_iterator cend()   const noexcept {return ops_.cend();}
+
+    bool        empty() const noexcept {return ops_.empty();}
+    std::size_t size()  const noexcept {return ops_.size();}
+
+    value to_value() const
+    {
+        array_type retval;
+        retval.reserve(this->ops_.size());
+        for(const auto& o : this->ops_)
+        {
+            array_type entry;
+            entry.reserve(3);
+            entry.push_back(value(static_cast<std::uint8_t>(o.op)));
+            entry.push_back(value(o.location));
+            if(o.op != op_t::remove)
+            {
+                entry.push_back(o.element);
+            }
+            retval.push_back(value(std::move(entry)));
+        }
+        return value(std::move(retval));
+    }
+
+    // returns nullopt if `v` is not in the format of `to_value()`
+    static std::optional<patch> from_value(value v)
+    {
+        if( ! v.is_array())
+        {
+            return std::nullopt;
+        }
+        patch retval;
+        retval.ops_.reserve(v.as_array().size());
+        for(auto& entry : v.as_array())
+        {
+            if( ! entry.is_array() || entry.as_array().size() < 2)
+            {
+                return std::nullopt;
+            }
+            auto& e = entry.as_array();
+            const auto* op = e[0].try_uint();
+            if( ! op || 2 < *op || ! e[1].is_array())
+            {
+                return std::nullopt;
+            }
+            const auto kind = static_cast<op_t>(*op);
+            if(e.size() != (kind == op_t::remove ? 2 : 3))
+            {
+                return std::nullopt;
+            }
+            retval.ops_.push_back(operation{kind, std::move(e[1].as_array()),
+                    kind == op_t::remove ? value{} : std::move(e[2])});
+        }
+        return retval;
+    }
+
+  private:
+
+    container_type ops_;
+};
+
+namespace detail
+{
+
+// the keys of `b` are those of `a` that are not removed, in the same order,
+// followed by the new keys
+inline bool keeps_key_order(const map_type& a, const map_type& b)
+{
+    auto last      = a.begin();
+    bool appending = false;
+    for(const auto& [key, elem] : b)
+    {
+        const auto found = a.find(key);
+        if(found == a.end())
+        {
+            appending = true;
+            continue;
+        }
+        if(appending || found < last)
+        {
+            return false;
+        }
+        last = found;
+    }
+    return true;
+}
+
+inline std::vector<value> extend(const std::vector<value>& location, value key)
+{
+    std::vector<value> retval;
+    retval.reserve(location.size() + 1);
+    retval.insert(retval.end(), location.begin(), location.end());
+    retval.push_back(std::move(key));
+    return retval;
+}
+
+// the parent of the element at `location`; nullptr if it does not exist
+inline value* find_parent(value& root, const std::vector<value>& location)
+{
+    value* current = std::addressof(root);
+    for(std::size_t i=0; i+1 < location.size(); ++i)
+    {
+        const auto& key = location[i];
+        if(auto* map = current->try_map())
+        {
+            const auto found = map->find(key);
+            if(found == map->end()) {return nullptr;}
+            current = std::addressof(found->second);
+        }
+        else if(auto* arr = current->try_array())
+        {
+            const auto* idx = key.try_uint();
+            if( ! idx || arr->size() <= *idx) {return nullptr;}
+            current = std::addressof((*arr)[*idx]);
+        }
+        else
+        {
+            return nullptr;
+        }
+    }
+    return current;
+}
+
+} // detail
+
+// Computes a patch that turns `a` into `b`. Arrays are compared element-wise
+// after their common prefix and suffix are removed, so that an insertion or a
+// removal in the middle becomes a single operation. Nested values are visited
+// without recursion.
+inline patch diff(const value& a, const value& b)
+{
+    struct task
+    {
+        const value*       a;
+        const value*       b;
+        std::vector<value> location;
+    };
+
+    patch retval;
+    std::vector<task> stack;
+    stack.push_back(task{std::addressof(a), std::addressof(b), {}});
+    while( ! stack.empty())
+    {
+        auto t = std::move(stack.back());
+        stack.pop_back();
+
+        const auto* aarr = t.a->try_array();
+        const auto* barr = t.b->try_array();
+        const auto* amap = t.a->try_map();
+        const auto* bmap = t.b->try_map();
+
+        if(aarr && barr)
+        {
+            const auto& x = *aarr;
+            const auto& y = *barr;
+            std::size_t head = 0;
+            while(head < x.size() && head < y.size() && x[head] == y[head])
+            {
+                ++head;
+            }
+            std::size_t tail = 0;
+            while(tail < x.size() - head && tail < y.size() - head &&
+                  x[x.size() - tail - 1] == y[y.size() - tail - 1])
+            {
+                ++tail;
+            }
+            const std::size_t xlen   = x.size() - head - tail;
+            const std::size_t ylen   = y.size() - head - tail;
+            const std::size_t common = std::min(xlen, ylen);
+
+            // removed from the back so that the indices stay valid
+            for(std::size_t i=xlen; common < i; --i)
+            {
+                retval.remove(detail::extend(t.location, value(head + i - 1)));
+            }
+            for(std::size_t i=common; i < ylen; ++i)
+            {
+                retval.insert(detail::extend(t.location, value(head + i)), y[head + i]);
+            }
+            for(std::size_t i=common; 0 < i; --i)
+            {
+                const auto idx = head + i - 1;
+                stack.push_back(task{std::addressof(x[idx]), std::addressof(y[idx]),
+                        detail::extend(t.location, value(idx))});
+            }
+        }
+        else if(amap && bmap)
+        {
+            if( ! detail::keeps_key_order(*amap, *bmap))
+            {
+                retval.set(std::move(t.location), *t.b);
+                continue;
+            }
+            for(const auto& [key, elem] : *amap)
+            {
+                if( ! bmap->contains(key))
+                {
+                    retval.remove(detail::extend(t.location, key));
+                }
+            }
+            for(const auto& [key, elem] : *bmap)
+            {
+                const auto found = amap->find(key);
+                if(found == amap->end())
+                {
+                    retval.set(detail::extend(t.location, key), elem);
+                }
+                else
+                {
+                    stack.push_back(task{std::addressof(found->second),
+                            std::addressof(elem), detail::extend(t.location, key)});
+                }
+            }
+        }
+        else if(*t.a != *t.b)
+        {
+            retval.set(std::move(t.location), *t.b);
+        }
+    }
+    return retval;
+}
+
+// Applies `p` to `v`. Returns false if an operation refers to an element that
+// does not exist; the operations before it are left applied.
+inline bool apply(const patch& p, value& v)
+{
+    for(const auto& o : p)
+    {
+        if(o.location.empty())
+        {
+            if(o.op != patch::op_t::set) {return false;}
+            v = o.element;
+            continue;
+        }
+
+        auto* parent = detail::find_parent(v, o.location);
+        if( ! parent) {return false;}
+        const auto& key = o.location.back();
+
+        if(auto* map = parent->try_map())
+        {
+            const auto found = map->find(key);
+            switch(o.op)
+            {
+                case patch::op_t::set:
+                {
+                    if(found == map->end())
+                    {
+                        map->emplace_back(key, o.element);
+                    }
+                    else
+                    {
+                        found->second = o.element;
+                    }
+                    break;
+                }
+                case patch::op_t::remove:
+                {
+                    if(found == map->end()) {return false;}
+                    map->erase(found);
+                    break;
+                }
+                default:
+                {
+                    return false; // maps have no positions to insert at
+                }
+            }
+        }
+        else if(auto* arr = parent->try_array())
+        {
+            const auto* idx = key.try_uint();
+            if( ! idx) {return false;}
+            const auto i = *idx;
+            switch(o.op)
+            {
+                case patch::op_t::set:
+                {
+                    if(arr->size() <= i) {return false;}
+                    (*arr)[i] = o.element;
+                    break;
+                }
+                case patch::op_t::remove:
+                {
+                    if(arr->size() <= i) {return false;}
+                    arr->erase(arr->begin() + static_cast<std::ptrdiff_t>(i));
+                    break;
+                }
+                case patch::op_t::insert:
+                {
+                    if(arr->size() < i) {return false;}
+                    arr->insert(arr->begin() + static_cast<std::ptrdiff_t>(i), o.element);
+                    break;
+                }
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<Writer W>
+bool write(W& writer, const patch& p)
+{
+    return msgplus::write(writer, p.to_value());
+}
+
+template<Reader R>
+std::optional<patch> read_patch(R& reader)
+{
+    auto v = msgplus::read(reader);
+    if( ! v.has_value())
+    {
+        return std::nullopt;
+    }
+    return patch::from_value(std::move(v.value()));
+}
+
+} // msgplus
+#endif // MSGPLUS_PATCH_HPP
@@ -0,0 +1,352 @@
+#ifndef MSGPLUS_PATH_HPP
+#define MSGPLUS_PATH_HPP
+
+#include "value.hpp"
+#include "reader.hpp"
+#include "read.hpp"
+
+#include <limits>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+#include <cstring>
+
+namespace msgplus
+{
+
+// A location in a value, written like a JSON Pointer (RFC 6901), e.g.
+// `path("/orders/3/price")`. `~1` and `~0` in a segment stand for `/` and `~`.
+//
+// A path is parsed once and then can be evaluated repeatedly, either on a
+// value or on encoded msgpack, where the objects that are not on the path are
+// skipped instead of decoded.
+//
+// A segment matches a map key that is a string equal to it. If the segment is
+// a non-negative integer, it also matches an integer key of the same value
+// and selects an element of an array.
+class path
+{
+  public:
+
+    struct segment
+    {
+        std::string                  name;
+        value                        key;   // `name` as a str, to look up maps
+        std::optional<std::uint64_t> index; // `name` as a non-negative integer
+
+        bool matches(const value& k) const noexcept
+        {
+            if(const auto* s = k.try_str())
+            {
+                return *s == this->name;
+            }
+            if( ! this->index.has_value())
+            {
+                return false;
+            }
+            if(const auto* u = k.try_uint())
+            {
+                return *u == this->index.value();
+            }
+            if(const auto* i = k.try_int())
+            {
+                return 0 <= *i && static_cast<std::uint64_t>(*i) == this->index.value();
+            }
+            return false;
+        }
+    };
+
+  public:
+
+    path() = default;
+    ~path() = default;
+    path(const path&) = default;
+    path(path&&)      = default;
+    path& operator=(const path&) = default;
+    path& operator=(path&&)      = default;
+
+    // throws std::invalid_argument if `pointer` is not a valid JSON Pointer
+    explicit path(std::string_view pointer)
+    {
+        if(pointer.empty()) {return;} // the root
+
+        if(pointer.front() != '/')
+        {
+            throw std::invalid_argument("msgplus::path: path must start with '/'");
+        }
+        pointer.remove_prefix(1);
+
+        while(true)
+        {
+            const auto end = pointer.find('/');
+            this->segments_.push_back(make_segment(pointer.substr(0, end)));
+            if(end == std::string_view::npos)
+            {
+                break;
+            }
+            pointer.remove_prefix(end + 1);
+        }
+    }
+
+    bool        empty() const noexcept {return segments_.empty();}
+    std::size_t size()  const noexcept {return segments_.size();}
+
+    std::vector<segment> const& segments() const noexcept {return segments_;}
+
+    // returns nullptr if `v` has nothing at this path
+    value const* find(const value& v) const
+    {
+        const value* current = std::addressof(v);
+        for(const auto& seg : this->segments_)
+        {
+            current = find_child(*current, seg);
+            if( ! current) {return nullptr;}
+        }
+        return current;
+    }
+    value* find(value& v) const
+    {
+        return const_cast<value*>(this->find(std::as_const(v)));
+    }
+
+    // Finds the element in an encoded object, and returns the bytes that
+    // encode the element.
+    std::optional<std::span<const std::byte>>
+    find_encoded(std::span<const std::byte> encoded) const
+    {
+        memory_reader reader(encoded);
+        std::size_t rest = 0;
+        if( ! this->seek(reader, rest)) {return std::nullopt;}
+
+        const auto first = reader.position();
+        if( ! msgplus::skip(reader)) {return std::nullopt;}
+
+        return encoded.subspan(first, reader.position() - first);
+    }
+
+    // Reads one object from `reader` and returns its element at this path.
+    // Only the element is decoded; the rest of the object is skipped. The
+    // whole object is consumed even if it has no such element.
+    template<Reader R>
+    std::optional<value> read(R& reader) const
+    {
+        std::size_t rest = 0;
+        if( ! this->seek(reader, rest))
+        {
+            detail::skip_objects(reader, rest);
+            return std::nullopt;
+        }
+
+        auto v = msgplus::read(reader);
+        if( ! v.has_value() || ! detail::skip_objects(reader, rest))
+        {
+            return std::nullopt;
+        }
+        return v;
+    }
+
+  private:
+
+    static segment make_segment(std::string_view token)
+    {
+        segment seg;
+        for(std::size_t i=0; i<token.size(); ++i)
+        {
+            if(token[i] != '~')
+            {
+                seg.name += token[i];
+                continue;
+            }
+            if(i+1 < token.size() && token[i+1] == '0')
+            {
+                seg.name += '~';
+            }
+            else if(i+1 < token.size() && token[i+1] == '1')
+            {
+                seg.name += '/';
+            }
+            else
+            {
+                throw std::invalid_argument("msgplus::path: invalid escape sequence");
+            }
+            i += 1;
+        }
+        seg.key = value(seg.name);
+
+        if( ! seg.name.empty() && seg.name.size() <= 20 &&
+            seg.name.find_first_not_of("0123456789") == std::string::npos)
+        {
+            std::uint64_t idx = 0;
+            bool overflow = false;
+            for(const char c : seg.name)
+            {
+                const std::uint64_t digit = static_cast<std::uint64_t>(c - '0');
+                if((std::numeric_limits<std::uint64_t>::max() - digit) / 10 < idx)
+                {
+                    overflow = true;
+                    break;
+                }
+                idx = idx * 10 + digit;
+            }
+            if( ! overflow) {seg.index = idx;}
+        }
+        return seg;
+    }
+
+    static value const* find_child(const value& v, const segment& seg)
+    {
+        if(const auto* map = v.try_map())
+        {
+            if(const auto found = map->find(seg.key); found != map->end())
+            {
+                return std::addressof(found->second);
+            }
+            if(seg.index.has_value())
+            {
+                if(const auto found = map->find(value(seg.index.value()));
+                        found != map->end())
+                {
+                    return std::addressof(found->second);
+                }
+                if(seg.index.value() <= static_cast<std::uint64_t>(
+                            std::numeric_limits<std::int64_t>::max()))
+                {
+                    const auto i = static_cast<std::int64_t>(seg.index.value());
+                    if(const auto found = map->find(value(i)); found != map->end())
+                    {
+                        return std::addressof(found->second);
+                    }
+                }
+            }
+            return nullptr;
+        }
+        if(const auto* arr = v.try_array())
+        {
+            if(seg.index.has_value() && seg.index.value() < arr->size())
+            {
+                return std::addressof((*arr)[seg.index.value()]);
+            }
+            return nullptr;
+        }
+        return nullptr;
+    }
+
+    // Reads a map key and checks if it matches `seg`. String keys are compared
+    // without being decoded into a value.
+    template<Reader R>
+    static std::optional<bool> read_key(R& reader, const segment& seg)
+    {
+        const auto b = reader.read_byte();
+        if( ! b.has_value()) {return std::nullopt;}
+        const auto tag = static_cast<std::uint8_t>(b.value());
+
+        std::optional<std::size_t> len;
+        bool is_str = true;
+        if     ((tag & 0b1110'0000) == 0b1010'0000) {len = tag & 0b0001'1111;}
+        else if(tag == 0xD9) {len = detail::read_as_big_endian<std::uint8_t >(reader);}
+        else if(tag == 0xDA) {len = detail::read_as_big_endian<std::uint16_t>(reader);}
+        else if(tag == 0xDB) {len = detail::read_as_big_endian<std::uint32_t>(reader);}
+        else                 {is_str = false;}
+
+        if(is_str)
+        {
+            if( ! len.has_value()) {return std::nullopt;}
+            if(len.value() != seg.name.size())
+            {
+                if( ! detail::skip_bytes(reader, len.value())) {return std::nullopt;}
+                return false;
+            }
+            if constexpr(requires {reader.read_view(len.value());})
+            {
+                const auto bytes = reader.read_view(len.value());
+                if( ! bytes.has_value()) {return std::nullopt;}
+                return std::memcmp(bytes.value().data(), seg.name.data(), seg.name.size()) == 0;
+            }
+            else
+            {
+                const auto bytes = reader.read_bytes(len.value());
+                if( ! bytes.has_value()) {return std::nullopt;}
+                return std::memcmp(bytes.value().data(), seg.name.data(), seg.name.size()) == 0;
+            }
+        }
+
+        auto head = detail::read_head(reader, tag);
+        if( ! head.has_value()) {return std::nullopt;}
+        if(head.value().size != 0) // a map or an array as a key
+        {
+            if( ! detail::skip_objects(reader, head.value().size)) {return std::nullopt;}
+            return false;
+        }
+        return seg.matches(head.value().v);
+    }
+
+    // Advances `reader` to the beginning of the element at this path. `rest`
+    // is increased by the number of objects that follow the element in the
+    // enclosing containers. If there is no such element, it returns false
+    // after skipping the innermost container.
+    template<Reader R>
+    bool seek(R& reader, std::size_t& rest) const
+    {
+        for(const auto& seg : this->segments_)
+        {
+            const auto b = reader.read_byte();
+            if( ! b.has_value()) {return false;}
+            const auto tag = static_cast<std::uint8_t>(b.value());
+
+            const bool is_map = ((tag & 0b1111'0000) == 0b1000'0000) ||
+                                tag == 0xDE || tag == 0xDF;
+            const bool is_arr = ((tag & 0b1111'0000) == 0b1001'0000) ||
+                                tag == 0xDC || tag == 0xDD;
+
+            std::size_t count = 0;
+            if( ! detail::skip_after_tag(reader, tag, count)) {return false;}
+
+            if(is_map)
+            {
+                bool found = false;
+                while(count != 0)
+                {
+                    const auto matched = read_key(reader, seg);
+                    if( ! matched.has_value()) {return false;}
+                    count -= 2;
+                    if(matched.value())
+                    {
+                        found = true;
+                        break;
+                    }
+                    if( ! detail::skip_objects(reader, 1)) {return false;}
+                }
+                if( ! found)
+                {
+                    return false;
+                }
+                rest += count;
+            }
+            else if(is_arr && seg.index.has_value() && seg.index.value() < count)
+            {
+                const auto idx = static_cast<std::size_t>(seg.index.value());
+                if( ! detail::skip_objects(reader, idx)) {return false;}
+                rest += count - idx - 1;
+            }
+            else
+            {
+                detail::skip_objects(reader, count);
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+
+    std::vector<segment> segments_;
+};
+
+} // msgplus
+#endif // MSGPLUS_PATH_HPP
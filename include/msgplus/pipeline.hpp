@@ -0,0 +1,405 @@
+#ifndef MSGPLUS_PIPELINE_HPP
+#define MSGPLUS_PIPELINE_HPP
+
+#include "value.hpp"
+#include "ext.hpp"
+#include "reader.hpp"
+#include "read.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+struct pipeline_options
+{
+    // the number of decoding threads. 0 means one less than the number of
+    // hardware threads, and at least 1.
+    std::size_t threads = 0;
+
+    // the number of bytes read from the source at once. Documents found in a
+    // block are decoded together.
+    std::size_t block_size = 1024 * 1024;
+
+    // the maximum number of blocks that have been read but not yet consumed,
+    // including the ones being decoded. The reading stops while it is reached.
+    // 0 means twice the number of threads.
+    std::size_t max_blocks = 0;
+
+    // a document larger than this is an error, so that a corrupted length
+    // does not make the reading thread buffer the whole input.
+    std::size_t max_document_size = std::numeric_limits<std::size_t>::max();
+
+    std::size_t         max_depth = decoder::default_max_depth;
+    const ext_registry* exts      = nullptr; // not owned
+};
+
+namespace detail
+{
+
+// Reads up to `out.size()` bytes. Fewer bytes are read only at the end of
+// the input, or if the reader fails.
+template<Reader R>
+std::size_t read_some(R& reader, std::span<std::byte> out)
+{
+    if constexpr(requires {{reader.read_some(out)} -> std::convertible_to<std::size_t>;})
+    {
+        std::size_t n = 0;
+        while(n < out.size())
+        {
+            const std::size_t m = reader.read_some(out.subspan(n));
+            if(m == 0) {break;}
+            n += m;
+        }
+        return n;
+    }
+    else
+    {
+        std::size_t n = 0;
+        for(; n < out.size(); ++n)
+        {
+            const auto b = reader.read_byte();
+            if( ! b.has_value()) {break;}
+            out[n] = b.value();
+        }
+        return n;
+    }
+}
+
+} // detail
+
+// Decodes a stream of concatenated msgpack documents on multiple threads.
+//
+// A reading thread reads blocks from the reader, finds the boundaries of the
+// complete documents in each block by skipping over them, and hands the
+// blocks to the decoding threads. `next()` returns the documents in the
+// order of the input. At most `max_blocks` blocks are buffered; when the
+// consumer is slower than the decoders, the reading waits for it.
+//
+// The reader is used only by the reading thread and must outlive the
+// pipeline. The destructor stops the threads, after the reading thread
+// returns from the read in progress, if any.
+//
+// ```cpp
+// msg::file_reader reader("records.msg");
+// msg::pipelined_decoder<msg::file_reader> pipeline(reader);
+// while(auto v = pipeline.next())
+// {
+//     // ...
+// }
+// if( ! pipeline.is_ok()) { /* broken input */ }
+// ```
+template<Reader R>
+class pipelined_decoder
+{
+  public:
+
+    explicit pipelined_decoder(R& reader, const pipeline_options& opts = pipeline_options{})
+        : reader_(reader), opts_(opts)
+    {
+        if(opts_.threads == 0)
+        {
+            const std::size_t hw = std::thread::hardware_concurrency();
+            opts_.threads = std::max<std::size_t>(1, hw - std::min<std::size_t>(hw, 1));
+        }
+        if(opts_.max_blocks == 0)
+        {
+            opts_.max_blocks = 2 * opts_.threads;
+        }
+        opts_.block_size = std::max<std::size_t>(1, opts_.block_size);
+
+        slots_.resize(opts_.max_blocks);
+
+        workers_.reserve(opts_.threads);
+        try
+        {
+            for(std::size_t i=0; i<opts_.threads; ++i)
+            {
+                workers_.emplace_back([this] {this->run_worker();});
+            }
+            io_thread_ = std::thread([this] {this->run_io();});
+        }
+        catch(...) // a thread could not be started
+        {
+            this->stop();
+            throw;
+        }
+    }
+    ~pipelined_decoder()
+    {
+        this->stop();
+    }
+
+    pipelined_decoder(const pipelined_decoder&) = delete;
+    pipelined_decoder(pipelined_decoder&&)      = delete;
+    pipelined_decoder& operator=(const pipelined_decoder&) = delete;
+    pipelined_decoder& operator=(pipelined_decoder&&)      = delete;
+
+    // The next document. nullopt at the end of the input, or if the input
+    // cannot be decoded. An exception thrown while decoding a document is
+    // rethrown here, in its place. Once it has returned nullopt, it always
+    // does.
+    std::optional<value> next()
+    {
+        while(true)
+        {
+            if(pos_ < current_.values.size())
+            {
+                return std::move(current_.values[pos_++]);
+            }
+            if(finished_)
+            {
+                return std::nullopt;
+            }
+            if(current_.exception)
+            {
+                finished_ = true;
+                ok_       = false;
+                std::rethrow_exception(current_.exception);
+            }
+            if( ! current_.ok)
+            {
+                finished_ = true;
+                ok_       = false;
+                return std::nullopt;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                auto& slot = slots_[next_out_ % slots_.size()];
+                out_cv_.wait(lock, [&] {
+                        return slot.has_value() || (io_done_ && next_out_ == next_seq_);
+                    });
+                if( ! slot.has_value())
+                {
+                    finished_ = true;
+                    return std::nullopt;
+                }
+                current_ = std::move(slot.value());
+                slot.reset();
+                next_out_ += 1;
+                in_flight_ -= 1;
+            }
+            io_cv_.notify_one();
+            pos_ = 0;
+        }
+    }
+
+    // false if the input was broken or could not be read
+    bool is_ok() const noexcept {return ok_;}
+
+    pipeline_options const& options() const noexcept {return opts_;}
+
+  private:
+
+    // stops and joins the threads that have been started
+    void stop() noexcept
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stopped_ = true;
+        }
+        io_cv_  .notify_all();
+        work_cv_.notify_all();
+        if(io_thread_.joinable()) {io_thread_.join();}
+        for(auto& w : workers_) {w.join();}
+    }
+
+    struct batch
+    {
+        std::uint64_t                                    seq = 0;
+        std::vector<std::byte>                           data;
+        std::vector<std::pair<std::size_t, std::size_t>> docs; // offset and size
+        bool                                             ok  = true; // false if the input breaks after `docs`
+        std::exception_ptr                               exception;
+    };
+    struct result
+    {
+        std::vector<value> values;
+        bool               ok = true;
+        std::exception_ptr exception;
+    };
+
+    // Scans `buf` from `pos` for complete documents. Returns the position of
+    // the first byte that is not part of a complete document, and sets `ok`
+    // to false if the document there is invalid, not just incomplete.
+    std::size_t scan(const std::vector<std::byte>& buf, std::size_t pos,
+                     batch& b, bool& ok) const
+    {
+        ok = true;
+        while(pos < buf.size())
+        {
+            memory_reader r(std::span<const std::byte>(buf).subspan(pos));
+            if( ! skip(r))
+            {
+                ok = ! r.is_ok() && (buf.size() - pos) <= opts_.max_document_size;
+                break;
+            }
+            if(opts_.max_document_size < r.position())
+            {
+                ok = false;
+                break;
+            }
+            b.docs.emplace_back(pos, r.position());
+            pos += r.position();
+        }
+        return pos;
+    }
+
+    void run_io()
+    {
+        std::vector<std::byte> buf; // starts with the incomplete document of the last block
+        while(true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                io_cv_.wait(lock, [&] {return stopped_ || in_flight_ < opts_.max_blocks;});
+                if(stopped_) {return;}
+            }
+
+            batch b;
+            bool  last = false;
+            try
+            {
+                // read at least as much as is pending, so that a document
+                // larger than a block is rescanned only a few times
+                const std::size_t pending = buf.size();
+                const std::size_t want    = std::max(opts_.block_size, pending);
+                buf.resize(pending + want);
+                const std::size_t n = detail::read_some(reader_,
+                        std::span<std::byte>(buf.data() + pending, want));
+                buf.resize(pending + n);
+
+                bool valid = true;
+                const std::size_t end = this->scan(buf, 0, b, valid);
+
+                const bool eof = (n < want);
+                if( ! valid || (eof && (end != buf.size() || ! reader_.is_eof())))
+                {
+                    b.ok = false; // broken, truncated or unreadable
+                }
+                last = eof || ! b.ok;
+
+                std::vector<std::byte> rest(buf.begin() + static_cast<std::ptrdiff_t>(end), buf.end());
+                buf.resize(end);
+                b.data = std::move(buf);
+                buf    = std::move(rest);
+            }
+            catch(...)
+            {
+                b.docs.clear();
+                b.ok        = false;
+                b.exception = std::current_exception();
+                last        = true;
+            }
+
+            if(b.docs.empty() && b.ok && ! last)
+            {
+                continue; // no complete document yet
+            }
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                b.seq = next_seq_++;
+                in_flight_ += 1;
+                work_.push_back(std::move(b));
+                if(last) {io_done_ = true;}
+            }
+            work_cv_.notify_one();
+            if(last)
+            {
+                work_cv_.notify_all();
+                out_cv_.notify_all();
+                return;
+            }
+        }
+    }
+
+    void run_worker()
+    {
+        decoder dec(opts_.max_depth);
+        dec.set_ext_codecs(opts_.exts);
+        while(true)
+        {
+            batch b;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                work_cv_.wait(lock, [&] {return stopped_ || io_done_ || ! work_.empty();});
+                if(stopped_ || work_.empty()) {return;}
+                b = std::move(work_.front());
+                work_.pop_front();
+            }
+
+            result res;
+            res.ok        = b.ok;
+            res.exception = b.exception;
+            try
+            {
+                res.values.reserve(b.docs.size());
+                for(const auto& [offset, size] : b.docs)
+                {
+                    memory_reader r(std::span<const std::byte>(b.data).subspan(offset, size));
+                    auto v = dec.read(r);
+                    if( ! v.has_value())
+                    {
+                        res.ok = false;
+                        break;
+                    }
+                    res.values.push_back(std::move(v.value()));
+                }
+            }
+            catch(...)
+            {
+                res.exception = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                slots_[b.seq % slots_.size()] = std::move(res);
+            }
+            out_cv_.notify_all();
+        }
+    }
+
+  private:
+
+    R&               reader_;
+    pipeline_options opts_;
+
+    std::mutex              mtx_;
+    std::condition_variable io_cv_;   // a block can be read
+    std::condition_variable work_cv_; // a block can be decoded
+    std::condition_variable out_cv_;  // a block has been decoded
+
+    // guarded by mtx_
+    std::deque<batch>                  work_;
+    std::vector<std::optional<result>> slots_;         // decoded blocks, at `seq % max_blocks`
+    std::uint64_t                      next_seq_  = 0; // of the next block read
+    std::uint64_t                      next_out_  = 0; // of the next block consumed
+    std::size_t                        in_flight_ = 0; // blocks read but not consumed
+    bool                               io_done_   = false;
+    bool                               stopped_   = false;
+
+    // used by the consumer only
+    result      current_;
+    std::size_t pos_      = 0;
+    bool        finished_ = false;
+    bool        ok_       = true;
+
+    std::vector<std::thread> workers_;
+    std::thread              io_thread_;
+};
+
+} // msgplus
+#endif // MSGPLUS_PIPELINE_HPP
@@ -0,0 +1,152 @@
+#ifndef MSGPLUS_PROJECTION_HPP
+#define MSGPLUS_PROJECTION_HPP
+
+#include "value.hpp"
+#include "reader.hpp"
+#include "read.hpp"
+#include "path.hpp"
+
+#include <algorithm>
+#include <initializer_list>
+#include <string_view>
+#include <vector>
+
+namespace msgplus
+{
+
+// A set of paths to be decoded, stored as a tree of segments.
+//
+// `read(reader, proj)` decodes only the map entries on the paths and skips
+// the others without allocating anything for them. Everything under the end
+// of a path is decoded. A projection applies to every element of an array, so
+// `/orders/price` keeps `price` of each element of `orders`; unlike `path`, a
+// segment never selects an array element by its index.
+//
+// ```cpp
+// const msgplus::projection proj{"/id", "/orders/price"};
+// const auto v = msgplus::read(reader, proj);
+// ```
+class projection
+{
+  public:
+
+    // selects nothing
+    projection() = default;
+    ~projection() = default;
+    projection(const projection&) = default;
+    projection(projection&&)      = default;
+    projection& operator=(const projection&) = default;
+    projection& operator=(projection&&)      = default;
+
+    projection(std::initializer_list<std::string_view> paths)
+    {
+        for(const auto& p : paths)
+        {
+            this->add(path(p));
+        }
+    }
+    explicit projection(const std::vector<path>& paths)
+    {
+        for(const auto& p : paths)
+        {
+            this->add(p);
+        }
+    }
+
+    projection& add(const path& p)
+    {
+        projection* node = this;
+        for(const auto& seg : p.segments())
+        {
+            if(node->keeps_all_) {return *this;}
+            node = std::addressof(node->make_child(seg));
+        }
+        node->keeps_all_ = true;
+        node->children_.clear();
+        return *this;
+    }
+
+    bool keeps_all() const noexcept {return keeps_all_;}
+
+    // the projection applied to the value of `key`; nullptr if not selected
+    projection const* find(const value& key) const;
+
+  private:
+
+    projection& make_child(const path::segment& seg);
+
+  private:
+
+    struct child;
+
+    bool               keeps_all_ = false;
+    std::vector<child> children_; // sorted by seg.name
+};
+
+struct projection::child
+{
+    path::segment seg;
+    projection    sub;
+};
+
+inline projection const* projection::find(const value& key) const
+{
+    if(const auto* s = key.try_str())
+    {
+        const auto found = std::lower_bound(
+            this->children_.begin(), this->children_.end(), std::string_view(*s),
+            [](const child& c, std::string_view k) {return c.seg.name < k;});
+
+        if(found != this->children_.end() && found->seg.name == *s)
+        {
+            return std::addressof(found->sub);
+        }
+        return nullptr;
+    }
+    for(const auto& c : this->children_) // integer keys
+    {
+        if(c.seg.matches(key))
+        {
+            return std::addressof(c.sub);
+        }
+    }
+    return nullptr;
+}
+
+inline projection& projection::make_child(const path::segment& seg)
+{
+    const auto found = std::lower_bound(
+        this->children_.begin(), this->children_.end(), std::string_view(seg.name),
+        [](const child& c, std::string_view k) {return c.seg.name < k;});
+
+    if(found != this->children_.end() && found->seg.name == seg.name)
+    {
+        return found->sub;
+    }
+    return this->children_.insert(found, child{seg, projection{}})->sub;
+}
+
+static_assert(Projection<projection>);
+
+template<Reader R, Projection P>
+std::optional<value> read(R& reader, const P& proj)
+{
+    decoder dec;
+    return dec.read(reader, proj);
+}
+
+template<Reader R, Projection P>
+std::optional<value> read(R& reader, decoder& dec, const P& proj)
+{
+    return dec.read(reader, proj);
+}
+
+template<Reader R, Projection P, CodecStats S>
+std::optional<value> read(R& reader, const P& proj, S& stats)
+{
+    decoder dec;
+    return dec.read(reader, proj, stats);
+}
+
+} // msgplus
+#endif // MSGPLUS_PROJECTION_HPP
@@ -2,9 +2,15 @@
 #define MSGPLUS_READ_HPP
 
 #include "value.hpp"
+#include "ext.hpp"
 #include "reader.hpp"
+#include "small_vector.hpp"
+#include "stats.hpp"
 
+#include <array>
 #include <bit>
+#include <chrono>
+#include <limits>
 #include <cstring>
 
 namespace msgplus
@@ -48,33 +54,188 @@ std::optional<T> read_as_big_endian(R& reader)
 }
 } // detail
 
-// forward decl
-template<Reader R>
-std::optional<value> read(R& reader);
-
 namespace detail
 {
 
+// Reads a bin or ext payload. A short one is copied into the inline buffer
+// of bin_type without going through a std::vector.
+template<Reader R>
+std::optional<bin_type> read_payload(R& reader, const std::size_t len)
+{
+    if constexpr(requires {reader.read_view(len);})
+    {
+        const auto bytes = reader.read_view(len);
+        if( ! bytes.has_value()) {return std::nullopt;}
+        return bin_type(bytes.value().begin(), bytes.value().end());
+    }
+    else
+    {
+        if(len <= bin_type::inline_capacity)
+        {
+            bin_type retval(len);
+            for(auto& b : retval)
+            {
+                const auto x = reader.read_byte();
+                if( ! x.has_value()) {return std::nullopt;}
+                b = x.value();
+            }
+            return retval;
+        }
+        auto bytes = reader.read_bytes(len);
+        if( ! bytes.has_value()) {return std::nullopt;}
+        return bin_type(std::move(bytes.value())); // adopts the buffer
+    }
+}
+
 template<Reader R>
 std::optional<value> read_bin(R& reader, std::optional<std::size_t> len)
 {
     if( ! len.has_value()) {return std::nullopt;}
 
-    auto v = reader.read_bytes(len.value());
+    auto v = read_payload(reader, len.value());
     if( ! v.has_value()) {return std::nullopt;}
 
     return value(std::move(v.value()));
 }
 
+template<typename T, std::size_t N>
+T load_big_endian(const std::array<std::byte, N>& bytes, const std::size_t offset) noexcept
+{
+    T x = 0;
+    for(std::size_t i=0; i<sizeof(T); ++i)
+    {
+        x = static_cast<T>((x << 8) | static_cast<T>(bytes[offset + i]));
+    }
+    return x;
+}
+
+// Converts the payload of a timestamp extension. Returns nullopt if it is
+// malformed or the time cannot be represented in `timestamp_type`.
+template<std::size_t N>
+std::optional<timestamp_type> decode_timestamp(const std::array<std::byte, N>& payload) noexcept
+{
+    std::int64_t  sec  = 0;
+    std::uint32_t nsec = 0;
+    if constexpr(N == 4) // timestamp 32
+    {
+        sec = load_big_endian<std::uint32_t>(payload, 0);
+    }
+    else if constexpr(N == 8) // timestamp 64
+    {
+        const auto data = load_big_endian<std::uint64_t>(payload, 0);
+        nsec = static_cast<std::uint32_t>(data >> 34);
+        sec  = static_cast<std::int64_t>(data & 0x3'FFFF'FFFFull);
+    }
+    else // timestamp 96
+    {
+        static_assert(N == 12);
+        nsec = load_big_endian<std::uint32_t>(payload, 0);
+        sec  = static_cast<std::int64_t>(load_big_endian<std::uint64_t>(payload, 4));
+    }
+
+    constexpr std::int64_t giga = 1'000'000'000;
+    if(giga <= nsec) {return std::nullopt;}
+
+    // count = hi * 1e9 + lo, where lo has the same sign as hi, so that the
+    // range check is symmetric
+    const std::int64_t hi = sec < 0 ? sec + 1 : sec;
+    const std::int64_t lo = sec < 0 ? std::int64_t(nsec) - giga : std::int64_t(nsec);
+
+    constexpr auto max_count = std::numeric_limits<std::int64_t>::max();
+    constexpr auto min_count = std::numeric_limits<std::int64_t>::min();
+    if(hi < min_count / giga || max_count / giga < hi ||
+       (hi == max_count / giga && max_count % giga < lo) ||
+       (hi == min_count / giga && lo < min_count % giga))
+    {
+        return std::nullopt;
+    }
+    return timestamp_type(std::chrono::nanoseconds(hi * giga + lo));
+}
+
+// Reads the payload of a timestamp extension into a stack buffer. If it is
+// not a valid timestamp, it is returned as an ordinary ext.
+template<std::size_t N, Reader R>
+std::optional<value> read_timestamp(R& reader, const std::int8_t type)
+{
+    const auto payload = reader.template read_bytes<N>();
+    if( ! payload.has_value()) {return std::nullopt;}
+
+    if(const auto ts = decode_timestamp(payload.value()))
+    {
+        return value(ts.value());
+    }
+    return value(std::make_pair(type, bin_type(payload.value().begin(), payload.value().end())));
+}
+
+// Reads the payload of an extension that has a codec. It is passed to the
+// codec as a view of the reader's buffer if possible, or through a stack
+// buffer if it is small.
 template<Reader R>
-std::optional<value> read_ext(R& reader, std::optional<std::size_t> len)
+std::optional<value> read_typed_ext(R& reader, const std::size_t len, const std::int8_t type,
+                                    const ext_registry::decode_function& decode)
+{
+    const auto convert = [&](std::span<const std::byte> payload) {
+        if(auto obj = decode(type, payload))
+        {
+            return value(std::move(obj.value()));
+        }
+        return value(std::make_pair(type, bin_type(payload.begin(), payload.end())));
+    };
+
+    if constexpr(requires {reader.read_view(len);})
+    {
+        const auto payload = reader.read_view(len);
+        if( ! payload.has_value()) {return std::nullopt;}
+        return std::optional<value>(convert(payload.value()));
+    }
+    else
+    {
+        std::array<std::byte, 64> buf;
+        if(len <= buf.size())
+        {
+            for(std::size_t i=0; i<len; ++i)
+            {
+                const auto b = reader.read_byte();
+                if( ! b.has_value()) {return std::nullopt;}
+                buf[i] = b.value();
+            }
+            return std::optional<value>(convert(std::span<const std::byte>(buf.data(), len)));
+        }
+        const auto payload = reader.read_bytes(len);
+        if( ! payload.has_value()) {return std::nullopt;}
+        return std::optional<value>(convert(payload.value()));
+    }
+}
+
+template<Reader R>
+std::optional<value> read_ext(R& reader, std::optional<std::size_t> len,
+                              const ext_registry* exts = nullptr)
 {
     if( ! len.has_value()) {return std::nullopt;}
 
     auto type = detail::read_as_big_endian<std::int8_t>(reader);
     if( ! type.has_value()) {return std::nullopt;}
 
-    auto v = reader.read_bytes(len.value());
+    if(exts != nullptr)
+    {
+        if(const auto* decode = exts->find(type.value()))
+        {
+            return read_typed_ext(reader, len.value(), type.value(), *decode);
+        }
+    }
+
+    if(type.value() == -1) // timestamp
+    {
+        switch(len.value())
+        {
+            case  4: {return read_timestamp< 4>(reader, type.value());}
+            case  8: {return read_timestamp< 8>(reader, type.value());}
+            case 12: {return read_timestamp<12>(reader, type.value());}
+            default: {break;}
+        }
+    }
+
+    auto v = read_payload(reader, len.value());
     if( ! v.has_value()) {return std::nullopt;}
 
     return value(std::make_pair(type.value(), std::move(v.value())));
@@ -85,125 +246,609 @@ std::optional<value> read_str(R& reader, std::optional<std::size_t> len)
 {
     if( ! len.has_value()) {return std::nullopt;}
 
-    auto v = reader.read_bytes(len.value());
-    if( ! v.has_value()) {return std::nullopt;}
+    // A view is checked against the input before the string is allocated,
+    // so it is preferred to `read_into()`.
+    if constexpr(requires {reader.read_view(len.value());})
+    {
+        const auto bytes = reader.read_view(len.value());
+        if( ! bytes.has_value()) {return std::nullopt;}
+        return value(std::string(reinterpret_cast<const char*>(bytes.value().data()),
+                                 bytes.value().size()));
+    }
+    else if constexpr(requires(std::span<std::byte> out) {{reader.read_into(out)} -> std::convertible_to<bool>;})
+    {
+        std::string s(len.value(), '\0');
+        if( ! reader.read_into(std::as_writable_bytes(std::span<char>(s)))) {return std::nullopt;}
+        return value(std::move(s));
+    }
+    else
+    {
+        auto v = reader.read_bytes(len.value());
+        if( ! v.has_value()) {return std::nullopt;}
 
-    std::string s(len.value(), '\0');
-    std::transform(v.value().begin(), v.value().end(), s.begin(),
-        [](const std::byte b) -> char { return std::bit_cast<char>(b); });
+        std::string s(len.value(), '\0');
+        std::transform(v.value().begin(), v.value().end(), s.begin(),
+            [](const std::byte b) -> char { return std::bit_cast<char>(b); });
 
-    return value(std::move(s));
+        return value(std::move(s));
+    }
 }
 
-template<Reader R>
-std::optional<value> read_array(R& reader, std::optional<std::size_t> len)
+
+// Header of a msgpack object. Scalars are read entirely into `v`.
+// For arrays and maps, `v` holds an empty container and `size` is the number
+// of objects that follow it (a map of n pairs is followed by 2n objects).
+struct object_head
+{
+    value       v;
+    std::size_t size;
+};
+
+inline std::optional<object_head> read_array_head(std::optional<std::size_t> len)
 {
     if( ! len.has_value()) {return std::nullopt;}
 
-    std::vector<value> vs;
+    array_type vs;
     vs.reserve(len.value());
-    for(std::size_t i=0; i<len.value(); ++i)
-    {
-        auto elem = read(reader);
-        if( ! elem.has_value()) {return std::nullopt;}
-        vs.push_back(std::move(elem.value()));
-    }
-    return value(vs);
+    return object_head{value(std::move(vs)), len.value()};
 }
 
-template<Reader R>
-std::optional<value> read_map(R& reader, std::optional<std::size_t> len)
+inline std::optional<object_head> read_map_head(std::optional<std::size_t> len)
 {
     if( ! len.has_value()) {return std::nullopt;}
 
-    ordered_map<value, value> vs;
-    for(std::size_t i=0; i<len.value(); ++i)
-    {
-        auto key = read(reader);
-        if( ! key.has_value()) {return std::nullopt;}
+    return object_head{value(map_type{}), len.value() * 2};
+}
 
-        auto elem = read(reader);
-        if( ! elem.has_value()) {return std::nullopt;}
+inline std::optional<object_head> read_scalar(std::optional<value> v)
+{
+    if( ! v.has_value()) {return std::nullopt;}
 
-        vs.emplace_back(std::move(key.value()), std::move(elem.value()));
+    return object_head{std::move(v.value()), 0};
+}
+
+// `exts` is the codecs for extensions. nullptr if there is none.
+template<Reader R>
+std::optional<object_head> read_head(R& reader, const std::uint8_t tag,
+                                     const ext_registry* exts = nullptr)
+{
+    if(tag <= 0x7F) // positive fixint
+    {
+        return object_head{value(tag), 0};
+    }
+    else if(0xE0 <= tag) // negative fixint
+    {
+        const auto fixint = std::bit_cast<std::int8_t>(tag);
+        return object_head{value(fixint), 0};
+    }
+    else if((tag & 0b1110'0000) == 0b1010'0000) // fixstr
+    {
+        const auto len = tag & 0b0001'1111;
+        return read_scalar(read_str(reader, len));
+    }
+    else if((tag & 0b1111'0000) == 0b1001'0000) // fixarray
+    {
+        const auto len = tag & 0b0000'1111;
+        return read_array_head(len);
+    }
+    else if((tag & 0b1111'0000) == 0b1000'0000) // fixmap
+    {
+        const auto len = tag & 0b0000'1111;
+        return read_map_head(len);
+    }
+
+    switch(tag)
+    {
+        case 0xC0: {return object_head{value(nil_type{}), 0};}
+        //   0xC1: {never used}
+        case 0xC2: {return object_head{value(false), 0};}
+        case 0xC3: {return object_head{value(true), 0};}
+        case 0xC4: {return read_scalar(read_bin(reader, read_as_big_endian<std::uint8_t >(reader)));}
+        case 0xC5: {return read_scalar(read_bin(reader, read_as_big_endian<std::uint16_t>(reader)));}
+        case 0xC6: {return read_scalar(read_bin(reader, read_as_big_endian<std::uint32_t>(reader)));}
+        case 0xC7: {return read_scalar(read_ext(reader, read_as_big_endian<std::uint8_t >(reader), exts));}
+        case 0xC8: {return read_scalar(read_ext(reader, read_as_big_endian<std::uint16_t>(reader), exts));}
+        case 0xC9: {return read_scalar(read_ext(reader, read_as_big_endian<std::uint32_t>(reader), exts));}
+        case 0xCA: {return read_scalar(read_as_big_endian<float32_type >(reader));}
+        case 0xCB: {return read_scalar(read_as_big_endian<float64_type >(reader));}
+        case 0xCC: {return read_scalar(read_as_big_endian<std::uint8_t >(reader));}
+        case 0xCD: {return read_scalar(read_as_big_endian<std::uint16_t>(reader));}
+        case 0xCE: {return read_scalar(read_as_big_endian<std::uint32_t>(reader));}
+        case 0xCF: {return read_scalar(read_as_big_endian<std::uint64_t>(reader));}
+        case 0xD0: {return read_scalar(read_as_big_endian<std::int8_t  >(reader));}
+        case 0xD1: {return read_scalar(read_as_big_endian<std::int16_t >(reader));}
+        case 0xD2: {return read_scalar(read_as_big_endian<std::int32_t >(reader));}
+        case 0xD3: {return read_scalar(read_as_big_endian<std::int64_t >(reader));}
+        case 0xD4: {return read_scalar(read_ext(reader,  1, exts));}
+        case 0xD5: {return read_scalar(read_ext(reader,  2, exts));}
+        case 0xD6: {return read_scalar(read_ext(reader,  4, exts));}
+        case 0xD7: {return read_scalar(read_ext(reader,  8, exts));}
+        case 0xD8: {return read_scalar(read_ext(reader, 16, exts));}
+        case 0xD9: {return read_scalar(read_str(reader, read_as_big_endian<std::uint8_t >(reader)));}
+        case 0xDA: {return read_scalar(read_str(reader, read_as_big_endian<std::uint16_t>(reader)));}
+        case 0xDB: {return read_scalar(read_str(reader, read_as_big_endian<std::uint32_t>(reader)));}
+        case 0xDC: {return read_array_head(read_as_big_endian<std::uint16_t>(reader));}
+        case 0xDD: {return read_array_head(read_as_big_endian<std::uint32_t>(reader));}
+        case 0xDE: {return read_map_head(read_as_big_endian<std::uint16_t>(reader));}
+        case 0xDF: {return read_map_head(read_as_big_endian<std::uint32_t>(reader));}
+        default: return std::nullopt;
     }
-    return value(vs);
 }
 
-} // detail
+template<Reader R>
+std::optional<object_head> read_head(R& reader, const ext_registry* exts = nullptr)
+{
+    const auto b = reader.read_byte();
+    if( ! b.has_value()) {return std::nullopt;}
+
+    return read_head(reader, static_cast<std::uint8_t>(b.value()), exts);
+}
 
 template<Reader R>
-std::optional<value> read(R& reader)
+bool skip_bytes(R& reader, std::size_t n)
 {
-    if(const auto b = reader.read_byte())
+    if constexpr(requires {{reader.skip_bytes(n)} -> std::convertible_to<bool>;})
     {
-        const auto tag = static_cast<std::uint8_t>(b.value());
-        if(tag <= 0x7F) // positive fixint
+        return reader.skip_bytes(n);
+    }
+    else
+    {
+        for(; 64 <= n; n -= 64)
         {
-            return value(tag);
+            if( ! reader.template read_bytes<64>().has_value()) {return false;}
         }
-        else if(0xE0 <= tag) // negative fixint
+        for(; 0 < n; n -= 1)
         {
-            const auto fixint = std::bit_cast<std::int8_t>(tag);
-            return value(fixint);
+            if( ! reader.read_byte().has_value()) {return false;}
         }
-        else if((tag & 0b1110'0000) == 0b1010'0000) // fixstr
+        return true;
+    }
+}
+
+template<Reader R>
+bool skip_len(R& reader, std::optional<std::size_t> len)
+{
+    return len.has_value() && skip_bytes(reader, len.value());
+}
+
+inline bool add_len(std::size_t& count, std::optional<std::size_t> len, const std::size_t factor)
+{
+    if( ! len.has_value()) {return false;}
+    count += len.value() * factor;
+    return true;
+}
+
+// Skips the rest of an object whose tag has already been read. The number of
+// objects contained in it (the elements of an array or the keys and values of
+// a map) are added to `count`.
+template<Reader R>
+bool skip_after_tag(R& reader, const std::uint8_t tag, std::size_t& count)
+{
+    if(tag <= 0x7F || 0xE0 <= tag) // fixint
+    {
+        return true;
+    }
+    else if((tag & 0b1110'0000) == 0b1010'0000) // fixstr
+    {
+        return skip_bytes(reader, tag & 0b0001'1111);
+    }
+    else if((tag & 0b1111'0000) == 0b1001'0000) // fixarray
+    {
+        count += tag & 0b0000'1111;
+        return true;
+    }
+    else if((tag & 0b1111'0000) == 0b1000'0000) // fixmap
+    {
+        count += (tag & 0b0000'1111) * 2;
+        return true;
+    }
+
+    switch(tag)
+    {
+        case 0xC0: {return true;}
+        //   0xC1: {never used}
+        case 0xC2: {return true;}
+        case 0xC3: {return true;}
+        case 0xC4: {return skip_len(reader, read_as_big_endian<std::uint8_t >(reader));}
+        case 0xC5: {return skip_len(reader, read_as_big_endian<std::uint16_t>(reader));}
+        case 0xC6: {return skip_len(reader, read_as_big_endian<std::uint32_t>(reader));}
+        case 0xC7: {return skip_len(reader, read_as_big_endian<std::uint8_t >(reader)) && skip_bytes(reader, 1);}
+        case 0xC8: {return skip_len(reader, read_as_big_endian<std::uint16_t>(reader)) && skip_bytes(reader, 1);}
+        case 0xC9: {return skip_len(reader, read_as_big_endian<std::uint32_t>(reader)) && skip_bytes(reader, 1);}
+        case 0xCA: {return skip_bytes(reader, 4);}
+        case 0xCB: {return skip_bytes(reader, 8);}
+        case 0xCC: {return skip_bytes(reader, 1);}
+        case 0xCD: {return skip_bytes(reader, 2);}
+        case 0xCE: {return skip_bytes(reader, 4);}
+        case 0xCF: {return skip_bytes(reader, 8);}
+        case 0xD0: {return skip_bytes(reader, 1);}
+        case 0xD1: {return skip_bytes(reader, 2);}
+        case 0xD2: {return skip_bytes(reader, 4);}
+        case 0xD3: {return skip_bytes(reader, 8);}
+        case 0xD4: {return skip_bytes(reader, 1 +  1);}
+        case 0xD5: {return skip_bytes(reader, 1 +  2);}
+        case 0xD6: {return skip_bytes(reader, 1 +  4);}
+        case 0xD7: {return skip_bytes(reader, 1 +  8);}
+        case 0xD8: {return skip_bytes(reader, 1 + 16);}
+        case 0xD9: {return skip_len(reader, read_as_big_endian<std::uint8_t >(reader));}
+        case 0xDA: {return skip_len(reader, read_as_big_endian<std::uint16_t>(reader));}
+        case 0xDB: {return skip_len(reader, read_as_big_endian<std::uint32_t>(reader));}
+        case 0xDC: {return add_len(count, read_as_big_endian<std::uint16_t>(reader), 1);}
+        case 0xDD: {return add_len(count, read_as_big_endian<std::uint32_t>(reader), 1);}
+        case 0xDE: {return add_len(count, read_as_big_endian<std::uint16_t>(reader), 2);}
+        case 0xDF: {return add_len(count, read_as_big_endian<std::uint32_t>(reader), 2);}
+        default: return false;
+    }
+}
+
+// Skips `count` objects, including everything nested in them.
+template<Reader R>
+bool skip_objects(R& reader, std::size_t count)
+{
+    while(count != 0)
+    {
+        const auto b = reader.read_byte();
+        if( ! b.has_value()) {return false;}
+
+        count -= 1;
+        if( ! skip_after_tag(reader, static_cast<std::uint8_t>(b.value()), count))
         {
-            const auto len = tag & 0b0001'1111;
-            return detail::read_str(reader, len);
+            return false;
         }
-        else if((tag & 0b1111'0000) == 0b1001'0000) // fixarray
+    }
+    return true;
+}
+
+// Forwards to a reader and counts the bytes read, for stats.
+template<Reader R>
+class counting_reader
+{
+  public:
+
+    explicit counting_reader(R& r) noexcept: reader_(r), count_(0) {}
+
+    std::size_t count() const noexcept {return count_;}
+
+    bool is_ok()  const {return reader_.is_ok();}
+    bool is_eof() const {return reader_.is_eof();}
+
+    std::optional<std::byte> read_byte()
+    {
+        auto b = reader_.read_byte();
+        if(b.has_value()) {count_ += 1;}
+        return b;
+    }
+    template<std::size_t N>
+    std::optional<std::array<std::byte, N>> read_bytes()
+    {
+        auto bs = reader_.template read_bytes<N>();
+        if(bs.has_value()) {count_ += N;}
+        return bs;
+    }
+    std::optional<std::vector<std::byte>> read_bytes(std::size_t n)
+    {
+        auto bs = reader_.read_bytes(n);
+        if(bs.has_value()) {count_ += n;}
+        return bs;
+    }
+    std::optional<std::span<const std::byte>> read_view(std::size_t n)
+        requires requires(R& r) {r.read_view(n);}
+    {
+        auto bs = reader_.read_view(n);
+        if(bs.has_value()) {count_ += n;}
+        return bs;
+    }
+    bool read_into(std::span<std::byte> out)
+        requires requires(R& r) {{r.read_into(out)} -> std::convertible_to<bool>;}
+    {
+        const bool ok = reader_.read_into(out);
+        if(ok) {count_ += out.size();}
+        return ok;
+    }
+    bool skip_bytes(std::size_t n)
+        requires requires(R& r) {{r.skip_bytes(n)} -> std::convertible_to<bool>;}
+    {
+        const bool ok = reader_.skip_bytes(n);
+        if(ok) {count_ += n;}
+        return ok;
+    }
+
+  private:
+
+    R&          reader_;
+    std::size_t count_;
+};
+
+} // detail
+
+// A projection selects the parts of a map to be decoded. Map entries that are
+// not selected are skipped without being decoded.
+//
+// - `p.find(key)` returns the projection that applies to the value of `key`,
+//   or nullptr if the entry is not selected.
+// - `p.keeps_all()` returns true if `p` selects everything under it.
+//
+// A projection applies to each element of an array, and it does not apply to
+// scalars.
+template<typename P>
+concept Projection = requires(const P& p, const value& key) {
+    {p.find(key)}    -> std::convertible_to<const P*>;
+    {p.keeps_all()}  -> std::convertible_to<bool>;
+};
+
+namespace detail
+{
+struct no_projection
+{
+    no_projection const* find(const value&) const noexcept {return nullptr;}
+    bool keeps_all() const noexcept {return true;}
+};
+static_assert(Projection<no_projection>);
+} // detail
+
+// Decodes values without recursion. Containers that are being filled are kept
+// on an explicit stack, so the nesting depth of the input is bounded by
+// `max_depth()` instead of the size of the call stack. The stack keeps its
+// capacity between calls; reuse a decoder to avoid reallocating it.
+class decoder
+{
+  public:
+
+    static constexpr std::size_t default_max_depth = 1024;
+
+  public:
+
+    decoder() = default;
+    ~decoder() = default;
+    decoder(const decoder&) = default;
+    decoder(decoder&&)      = default;
+    decoder& operator=(const decoder&) = default;
+    decoder& operator=(decoder&&)      = default;
+
+    explicit decoder(const std::size_t max_depth): max_depth_(max_depth) {}
+
+    std::size_t max_depth() const noexcept {return max_depth_;}
+    void set_max_depth(const std::size_t d) noexcept {max_depth_ = d;}
+
+    // Codecs for extension types. The registry is not owned and must outlive
+    // the reads. nullptr (the default) decodes every extension as `ext_type`.
+    ext_registry const* ext_codecs() const noexcept {return exts_;}
+    void set_ext_codecs(const ext_registry* exts) noexcept {exts_ = exts;}
+
+    template<Reader R>
+    std::optional<value> read(R& reader)
+    {
+        no_stats stats;
+        return this->read_impl<detail::no_projection>(reader, nullptr, stats);
+    }
+
+    template<Reader R, Projection P>
+    std::optional<value> read(R& reader, const P& proj)
+    {
+        no_stats stats;
+        return this->read_impl<P>(reader,
+                proj.keeps_all() ? nullptr : std::addressof(proj), stats);
+    }
+
+    // counts what is decoded into `stats`
+    template<Reader R, CodecStats S>
+    std::optional<value> read(R& reader, S& stats)
+    {
+        return this->read_impl<detail::no_projection>(reader, nullptr, stats);
+    }
+
+    template<Reader R, Projection P, CodecStats S>
+    std::optional<value> read(R& reader, const P& proj, S& stats)
+    {
+        return this->read_impl<P>(reader,
+                proj.keeps_all() ? nullptr : std::addressof(proj), stats);
+    }
+
+  private:
+
+    template<typename P, Reader R, CodecStats S>
+    std::optional<value> read_impl(R& reader, const P* proj, S& stats)
+    {
+        if constexpr(S::enabled)
         {
-            const auto len = tag & 0b0000'1111;
-            return detail::read_array(reader, len);
+            detail::call_timer<S> timer(stats);
+            detail::counting_reader<R> counter(reader);
+            return this->read_loop(counter, proj, stats);
         }
-        else if((tag & 0b1111'0000) == 0b1000'0000) // fixmap
+        else
         {
-            const auto len = tag & 0b0000'1111;
-            return detail::read_map(reader, len);
+            return this->read_loop(reader, proj, stats);
         }
+    }
+
+    // `proj == nullptr` means that everything is decoded
+    template<typename P, Reader R, CodecStats S>
+    std::optional<value> read_loop(R& reader, const P* proj, S& stats)
+    {
+        constexpr bool projected = ! std::same_as<P, detail::no_projection>;
+
+        this->stack_.clear();
 
-        switch(tag)
+        while(true)
         {
-            case 0xC0: {return value(nil_type{});}
-            //   0xC1: {never used}
-            case 0xC2: {return value(false);}
-            case 0xC3: {return value(true);}
-            case 0xC4: {return detail::read_bin(reader, detail::read_as_big_endian<std::uint8_t >(reader));}
-            case 0xC5: {return detail::read_bin(reader, detail::read_as_big_endian<std::uint16_t>(reader));}
-            case 0xC6: {return detail::read_bin(reader, detail::read_as_big_endian<std::uint32_t>(reader));}
-            case 0xC7: {return detail::read_ext(reader, detail::read_as_big_endian<std::uint8_t >(reader));}
-            case 0xC8: {return detail::read_ext(reader, detail::read_as_big_endian<std::uint16_t>(reader));}
-            case 0xC9: {return detail::read_ext(reader, detail::read_as_big_endian<std::uint32_t>(reader));}
-            case 0xCA: {return detail::read_as_big_endian<float32_type >(reader);}
-            case 0xCB: {return detail::read_as_big_endian<float64_type >(reader);}
-            case 0xCC: {return detail::read_as_big_endian<std::uint8_t >(reader);}
-            case 0xCD: {return detail::read_as_big_endian<std::uint16_t>(reader);}
-            case 0xCE: {return detail::read_as_big_endian<std::uint32_t>(reader);}
-            case 0xCF: {return detail::read_as_big_endian<std::uint64_t>(reader);}
-            case 0xD0: {return detail::read_as_big_endian<std::int8_t  >(reader);}
-            case 0xD1: {return detail::read_as_big_endian<std::int16_t >(reader);}
-            case 0xD2: {return detail::read_as_big_endian<std::int32_t >(reader);}
-            case 0xD3: {return detail::read_as_big_endian<std::int64_t >(reader);}
-            case 0xD4: {return detail::read_ext(reader,  1);}
-            case 0xD5: {return detail::read_ext(reader,  2);}
-            case 0xD6: {return detail::read_ext(reader,  4);}
-            case 0xD7: {return detail::read_ext(reader,  8);}
-            case 0xD8: {return detail::read_ext(reader, 16);}
-            case 0xD9: {return detail::read_str(reader, detail::read_as_big_endian<std::uint8_t >(reader));}
-            case 0xDA: {return detail::read_str(reader, detail::read_as_big_endian<std::uint16_t>(reader));}
-            case 0xDB: {return detail::read_str(reader, detail::read_as_big_endian<std::uint32_t>(reader));}
-            case 0xDC: {return detail::read_array(reader, detail::read_as_big_endian<std::uint16_t>(reader));}
-            case 0xDD: {return detail::read_array(reader, detail::read_as_big_endian<std::uint32_t>(reader));}
-            case 0xDE: {return detail::read_map(reader, detail::read_as_big_endian<std::uint16_t>(reader));}
-            case 0xDF: {return detail::read_map(reader, detail::read_as_big_endian<std::uint32_t>(reader));}
-            default: return std::nullopt;
+            [[maybe_unused]] std::size_t start = 0;
+            if constexpr(S::enabled) {start = reader.count();}
+
+            auto head = detail::read_head(reader, this->exts_);
+            if( ! head.has_value())
+            {
+                this->stack_.clear();
+                return std::nullopt;
+            }
+            value v = std::move(head.value().v);
+
+            if constexpr(S::enabled)
+            {
+                stats.count_object(v.type(), reader.count() - start);
+                if(v.is_array() || v.is_map())
+                {
+                    const auto n = head.value().size;
+                    stats.count_container(v.type(), v.is_map() ? n / 2 : n,
+                                          this->stack_.size() + 1);
+                }
+            }
+
+            if(v.is_array() || v.is_map())
+            {
+                if(this->max_depth_ <= this->stack_.size())
+                {
+                    this->stack_.clear();
+                    return std::nullopt;
+                }
+                if(head.value().size != 0)
+                {
+                    this->stack_.push_back(frame{std::move(v), value{}, {},
+                                                 head.value().size, proj, nullptr});
+                    // with a projection, only the selected entries are
+                    // allocated, as they are found
+                    if(this->stack_.back().container.is_map() && proj == nullptr)
+                    {
+                        this->stack_.back().pairs.reserve(head.value().size / 2);
+                    }
+                    proj = this->next_projection<P>();
+                    continue;
+                }
+            }
+
+            // `v` is complete. Append it to the enclosing containers, closing
+            // every container that becomes full on the way.
+            while(true)
+            {
+                if(this->stack_.empty())
+                {
+                    return v;
+                }
+
+                auto& top = this->stack_.back();
+                if(top.container.is_array())
+                {
+                    top.container.as_array().push_back(std::move(v));
+                    top.remaining -= 1;
+                }
+                else if(top.remaining % 2 == 0) // key of the next pair
+                {
+                    bool selected = true;
+                    if constexpr(projected)
+                    {
+                        if(top.proj != nullptr)
+                        {
+                            const P* sub = static_cast<const P*>(top.proj)->find(v);
+                            selected  = (sub != nullptr);
+                            top.sub_proj = (sub && ! sub->keeps_all()) ? sub : nullptr;
+                        }
+                    }
+                    if(selected)
+                    {
+                        top.key = std::move(v);
+                        top.remaining -= 1;
+                    }
+                    else
+                    {
+                        if( ! detail::skip_objects(reader, 1))
+                        {
+                            this->stack_.clear();
+                            return std::nullopt;
+                        }
+                        top.remaining -= 2;
+                    }
+                }
+                else
+                {
+                    top.pairs.emplace_back(std::move(top.key), std::move(v));
+                    top.remaining -= 1;
+                }
+
+                if(top.remaining != 0)
+                {
+                    break;
+                }
+                if(top.container.is_map())
+                {
+                    // index all the keys at once. throws if a key is duplicated
+                    top.container = map_type(std::move(top.pairs));
+                }
+                v = std::move(top.container);
+                this->stack_.pop_back();
+            }
+            proj = this->next_projection<P>();
         }
     }
-    else
+
+    // the projection that applies to the next object
+    template<typename P>
+    const P* next_projection() const noexcept
     {
-        return std::nullopt;
+        if constexpr(std::same_as<P, detail::no_projection>)
+        {
+            return nullptr;
+        }
+        else
+        {
+            if(this->stack_.empty()) {return nullptr;}
+
+            const auto& top = this->stack_.back();
+            if(top.container.is_array())  {return static_cast<const P*>(top.proj);}
+            if(top.remaining % 2 == 0)    {return nullptr;} // keys are not projected
+            return static_cast<const P*>(top.sub_proj);
+        }
     }
+
+  private:
+
+    struct frame
+    {
+        value                    container;
+        value                    key;       // pending key while filling a map
+        map_type::container_type pairs;     // entries of a map, indexed at the end
+        std::size_t              remaining; // number of objects until `container` is full
+        const void*              proj;      // projection applied to the elements
+        const void*              sub_proj;  // projection applied to the value of `key`
+    };
+
+  private:
+
+    std::size_t                   max_depth_ = default_max_depth;
+    const ext_registry*           exts_      = nullptr;
+    detail::small_stack<frame, 8> stack_; // shallow values need no allocation
+};
+
+template<Reader R>
+std::optional<value> read(R& reader, decoder& dec)
+{
+    return dec.read(reader);
+}
+
+template<Reader R>
+std::optional<value> read(R& reader)
+{
+    decoder dec;
+    return dec.read(reader);
+}
+
+template<Reader R, CodecStats S>
+std::optional<value> read(R& reader, S& stats)
+{
+    decoder dec;
+    return dec.read(reader, stats);
+}
+
+template<Reader R, CodecStats S>
+std::optional<value> read(R& reader, decoder& dec, S& stats)
+{
+    return dec.read(reader, stats);
+}
+
+// Skips one object without decoding it. Nested objects are skipped by
+// counting, so it needs no memory regardless of the nesting depth.
+template<Reader R>
+bool skip(R& reader)
+{
+    return detail::skip_objects(reader, 1);
 }
 
 } // msgplus
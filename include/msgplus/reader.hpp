@@ -1,13 +1,17 @@
 #ifndef MSGPLUS_READER_HPP
 #define MSGPLUS_READER_HPP
 
+#include <algorithm>
 #include <array>
 #include <concepts>
 #include <filesystem>
 #include <fstream>
+#include <span>
 #include <vector>
 #include <optional>
 
+#include <cstring>
+
 namespace msgplus
 {
 
@@ -64,6 +68,16 @@ class file_reader
         return retval;
     }
 
+    // reads up to `out.size()` bytes and returns the number of bytes read.
+    // it is less than `out.size()` only at the end of the file.
+    std::size_t read_some(std::span<std::byte> out)
+    {
+        if(this->is_eof() || !this->is_ok()) {return 0;}
+
+        file_.read(reinterpret_cast<char*>(out.data()), static_cast<std::streamsize>(out.size()));
+        return static_cast<std::size_t>(file_.gcount());
+    }
+
   private:
 
     std::ifstream file_;
@@ -71,5 +85,113 @@ class file_reader
 
 static_assert(Reader<file_reader>);
 
+// Reads from a contiguous buffer. It does not own the buffer.
+//
+// In addition to the Reader requirements, it provides
+// - `skip_bytes(n)`, which advances the position without copying, and
+// - `read_view(n)`, which returns the next n bytes without copying them,
+// - `read_into(out)`, which copies the next `out.size()` bytes into `out`, and
+// - `read_some(out)`, which reads what is left, up to `out.size()` bytes.
+// The library uses them if a reader has them.
+class memory_reader
+{
+  public:
+
+    explicit memory_reader(std::span<const std::byte> buf) noexcept
+        : buf_(buf), pos_(0), ok_(true)
+    {}
+
+    bool is_ok()  const noexcept {return ok_;}
+    bool is_eof() const noexcept {return buf_.size() <= pos_;}
+
+    std::optional<std::byte> read_byte() noexcept
+    {
+        if( ! this->has(1)) {return std::nullopt;}
+        return buf_[pos_++];
+    }
+
+    template<std::size_t N>
+    std::optional<std::array<std::byte, N>> read_bytes() noexcept
+    {
+        if( ! this->has(N)) {return std::nullopt;}
+
+        std::array<std::byte, N> retval;
+        std::memcpy(retval.data(), buf_.data() + pos_, N);
+        pos_ += N;
+        return retval;
+    }
+
+    std::optional<std::vector<std::byte>> read_bytes(std::size_t N)
+    {
+        if( ! this->has(N)) {return std::nullopt;}
+
+        std::vector<std::byte> retval(buf_.data() + pos_, buf_.data() + pos_ + N);
+        pos_ += N;
+        return retval;
+    }
+
+    std::optional<std::span<const std::byte>> read_view(std::size_t N) noexcept
+    {
+        if( ! this->has(N)) {return std::nullopt;}
+
+        const auto retval = buf_.subspan(pos_, N);
+        pos_ += N;
+        return retval;
+    }
+
+    bool read_into(std::span<std::byte> out) noexcept
+    {
+        if( ! this->has(out.size())) {return false;}
+
+        if( ! out.empty())
+        {
+            std::memcpy(out.data(), buf_.data() + pos_, out.size());
+        }
+        pos_ += out.size();
+        return true;
+    }
+
+    std::size_t read_some(std::span<std::byte> out) noexcept
+    {
+        const auto n = std::min(out.size(), buf_.size() - pos_);
+        if(n != 0)
+        {
+            std::memcpy(out.data(), buf_.data() + pos_, n);
+        }
+        pos_ += n;
+        return n;
+    }
+
+    bool skip_bytes(std::size_t N) noexcept
+    {
+        if( ! this->has(N)) {return false;}
+        pos_ += N;
+        return true;
+    }
+
+    std::size_t position() const noexcept {return pos_;}
+    std::span<const std::byte> buffer() const noexcept {return buf_;}
+
+  private:
+
+    bool has(const std::size_t N) noexcept
+    {
+        if(buf_.size() - pos_ < N) // pos_ <= buf_.size() always holds
+        {
+            ok_ = false;
+            return false;
+        }
+        return true;
+    }
+
+  private:
+
+    std::span<const std::byte> buf_;
+    std::size_t                pos_;
+    bool                       ok_;
+};
+
+static_assert(Reader<memory_reader>);
+
 } // msgplus
 #endif//MSGPLUS_READER_HPP
@@ -0,0 +1,354 @@
+#ifndef MSGPLUS_RING_HPP
+#define MSGPLUS_RING_HPP
+
+#include "reader.hpp"
+#include "writer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <cstring>
+
+namespace msgplus
+{
+
+// A lock-free byte queue between one producer thread and one consumer thread.
+//
+// The producer writes through a `ring_writer` and the consumer reads through
+// a `ring_reader`, so that one thread can `write()` values that another
+// `read()`s. The ends wait for space or data by spinning for a while and then
+// sleeping in `std::atomic::wait`; they never take a lock, and the ring does
+// not allocate after its construction.
+//
+// ```cpp
+// msg::spsc_ring ring(64 * 1024);
+//
+// std::jthread producer([&] {
+//     msg::ring_writer w(ring);
+//     for(const auto& v : values) {msg::write(w, v);}
+//     w.close();
+// });
+//
+// msg::ring_reader r(ring);
+// while(auto v = msg::read(r))
+// {
+//     // ...
+// }
+// if( ! r.is_eof()) { /* broken input */ }
+// ```
+class spsc_ring
+{
+  public:
+
+    // the capacity is rounded up to a power of two
+    explicit spsc_ring(const std::size_t capacity)
+        : capacity_(std::bit_ceil(std::max<std::size_t>(capacity, 2))),
+          buf_(std::make_unique<std::byte[]>(capacity_))
+    {}
+    ~spsc_ring() = default;
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring(spsc_ring&&)      = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+    spsc_ring& operator=(spsc_ring&&)      = delete;
+
+    std::size_t capacity() const noexcept {return capacity_;}
+
+    // the number of bytes that can be read. it may be outdated when it returns.
+    std::size_t size() const noexcept
+    {
+        const auto tail = tail_.load(std::memory_order_acquire);
+        const auto head = head_.load(std::memory_order_acquire);
+        return head - tail;
+    }
+
+    // After `close()`, writes fail, and reads fail once the ring is empty.
+    // Either end may close the ring.
+    void close() noexcept
+    {
+        closed_.store(true, std::memory_order_seq_cst);
+        wake(reader_waiting_);
+        wake(writer_waiting_);
+    }
+    bool is_closed() const noexcept {return closed_.load(std::memory_order_acquire);}
+
+    // true if it is closed and everything has been read. consumer only.
+    bool is_drained() const noexcept
+    {
+        if( ! this->is_closed()) {return false;}
+        // the data written before close() is visible here
+        return tail_.load(std::memory_order_relaxed) == head_.load(std::memory_order_acquire);
+    }
+
+    // Writes up to `n` bytes without waiting, and returns the number of bytes
+    // written. Producer only.
+    std::size_t try_write(const std::byte* src, std::size_t n) noexcept
+    {
+        const auto head = head_.load(std::memory_order_relaxed);
+        if(capacity_ - (head - tail_cache_) < n)
+        {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+        }
+        n = std::min(n, capacity_ - (head - tail_cache_));
+        if(n == 0) {return 0;}
+
+        const auto at    = head & (capacity_ - 1);
+        const auto first = std::min(n, capacity_ - at);
+        std::memcpy(buf_.get() + at, src, first);
+        std::memcpy(buf_.get(), src + first, n - first);
+
+        head_.store(head + n, std::memory_order_seq_cst); // see wake()
+        wake(reader_waiting_);
+        return n;
+    }
+
+    // Reads up to `n` bytes without waiting, and returns the number of bytes
+    // read. `dst` may be nullptr to discard them. Consumer only.
+    std::size_t try_read(std::byte* dst, std::size_t n) noexcept
+    {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        if(head_cache_ - tail < n)
+        {
+            head_cache_ = head_.load(std::memory_order_acquire);
+        }
+        n = std::min(n, head_cache_ - tail);
+        if(n == 0) {return 0;}
+
+        if(dst)
+        {
+            const auto at    = tail & (capacity_ - 1);
+            const auto first = std::min(n, capacity_ - at);
+            std::memcpy(dst, buf_.get() + at, first);
+            std::memcpy(dst + first, buf_.get(), n - first);
+        }
+        tail_.store(tail + n, std::memory_order_seq_cst); // see wake()
+        wake(writer_waiting_);
+        return n;
+    }
+
+    // Sleeps until something may have been written or the ring is closed.
+    // It may return early. Consumer only.
+    void wait_readable() noexcept
+    {
+        reader_waiting_.store(true, std::memory_order_seq_cst);
+        if(head_.load(std::memory_order_seq_cst) == tail_.load(std::memory_order_relaxed) &&
+           ! closed_.load(std::memory_order_seq_cst))
+        {
+            reader_waiting_.wait(true, std::memory_order_relaxed);
+        }
+        reader_waiting_.store(false, std::memory_order_relaxed);
+    }
+
+    // Sleeps until something may have been read or the ring is closed.
+    // It may return early. Producer only.
+    void wait_writable() noexcept
+    {
+        writer_waiting_.store(true, std::memory_order_seq_cst);
+        if(head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_seq_cst) == capacity_ &&
+           ! closed_.load(std::memory_order_seq_cst))
+        {
+            writer_waiting_.wait(true, std::memory_order_relaxed);
+        }
+        writer_waiting_.store(false, std::memory_order_relaxed);
+    }
+
+  private:
+
+    // Called after a position or closed_ is stored. The store, the flag and
+    // the loads in wait_readable() and wait_writable() are all seq_cst, so
+    // either the waiting end sees the store and does not sleep, or this sees
+    // its flag and wakes it.
+    static void wake(std::atomic<bool>& waiting) noexcept
+    {
+        if(waiting.load(std::memory_order_seq_cst))
+        {
+            waiting.store(false, std::memory_order_relaxed);
+            waiting.notify_one();
+        }
+    }
+
+    static constexpr std::size_t cache_line = 64;
+
+    const std::size_t            capacity_;
+    std::unique_ptr<std::byte[]> buf_;
+
+    // the positions only increase; they are masked to index the buffer
+    alignas(cache_line) std::atomic<std::size_t> head_{0}; // written by the producer
+    std::size_t                                  tail_cache_ = 0;
+    alignas(cache_line) std::atomic<std::size_t> tail_{0}; // written by the consumer
+    std::size_t                                  head_cache_ = 0;
+    alignas(cache_line) std::atomic<bool>        closed_{false};
+
+    // set while an end sleeps, so that the other end notifies it only then
+    std::atomic<bool> reader_waiting_{false};
+    std::atomic<bool> writer_waiting_{false};
+};
+
+namespace detail
+{
+// spins for a while, then sleeps in `wait()`
+struct ring_backoff
+{
+    template<typename F>
+    void operator()(F&& wait) noexcept
+    {
+        if(spins < 64)
+        {
+            spins += 1;
+            return;
+        }
+        std::forward<F>(wait)();
+        spins = 0;
+    }
+    std::size_t spins = 0;
+};
+} // detail
+
+// The producer end of an spsc_ring. Writes wait until there is space, and
+// fail if the ring is closed.
+class ring_writer
+{
+  public:
+
+    explicit ring_writer(spsc_ring& ring) noexcept: ring_(ring) {}
+
+    bool is_ok() const noexcept {return ! ring_.is_closed();}
+
+    bool write_byte(std::byte b)
+    {
+        return this->write_bytes(std::addressof(b), 1);
+    }
+    bool write_bytes(const std::byte* ptr, std::size_t len)
+    {
+        detail::ring_backoff backoff;
+        while(len != 0)
+        {
+            if(ring_.is_closed()) {return false;}
+
+            const auto n = ring_.try_write(ptr, len);
+            if(n == 0)
+            {
+                backoff([this] {ring_.wait_writable();});
+                continue;
+            }
+            ptr += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // tells the reader that nothing more will be written
+    void close() noexcept {ring_.close();}
+
+  private:
+
+    spsc_ring& ring_;
+};
+static_assert(Writer<ring_writer>);
+
+// The consumer end of an spsc_ring. Reads wait until the data has been
+// written, and fail if the ring is closed before that.
+//
+// Like memory_reader, it also provides `skip_bytes(n)`, `read_into(out)` and
+// `read_some(out)`.
+class ring_reader
+{
+  public:
+
+    explicit ring_reader(spsc_ring& ring) noexcept: ring_(ring), ok_(true) {}
+
+    bool is_ok()  const noexcept {return ok_;}
+    bool is_eof() const noexcept {return ring_.is_drained();}
+
+    std::optional<std::byte> read_byte()
+    {
+        std::byte b;
+        if( ! this->read_exactly(std::addressof(b), 1)) {return std::nullopt;}
+        return b;
+    }
+
+    template<std::size_t N>
+    std::optional<std::array<std::byte, N>> read_bytes()
+    {
+        std::array<std::byte, N> retval;
+        if( ! this->read_exactly(retval.data(), N)) {return std::nullopt;}
+        return retval;
+    }
+
+    std::optional<std::vector<std::byte>> read_bytes(std::size_t N)
+    {
+        std::vector<std::byte> retval(N);
+        if( ! this->read_exactly(retval.data(), N)) {return std::nullopt;}
+        return retval;
+    }
+
+    bool skip_bytes(std::size_t N)
+    {
+        return this->read_exactly(nullptr, N);
+    }
+
+    // reads exactly `out.size()` bytes into `out`
+    bool read_into(std::span<std::byte> out)
+    {
+        return this->read_exactly(out.data(), out.size());
+    }
+
+    // waits for at least one byte, and reads what is available up to
+    // `out.size()` bytes. 0 if the ring is closed and empty.
+    std::size_t read_some(std::span<std::byte> out)
+    {
+        if(out.empty()) {return 0;}
+
+        detail::ring_backoff backoff;
+        while(true)
+        {
+            if(const auto n = ring_.try_read(out.data(), out.size()); n != 0)
+            {
+                return n;
+            }
+            if(ring_.is_drained()) {return 0;}
+            backoff([this] {ring_.wait_readable();});
+        }
+    }
+
+  private:
+
+    // `dst` may be nullptr to discard the bytes
+    bool read_exactly(std::byte* dst, std::size_t n)
+    {
+        detail::ring_backoff backoff;
+        while(n != 0)
+        {
+            const auto m = ring_.try_read(dst, n);
+            if(m == 0)
+            {
+                if(ring_.is_drained())
+                {
+                    ok_ = false;
+                    return false;
+                }
+                backoff([this] {ring_.wait_readable();});
+                continue;
+            }
+            if(dst) {dst += m;}
+            n -= m;
+        }
+        return true;
+    }
+
+  private:
+
+    spsc_ring& ring_;
+    bool       ok_;
+};
+static_assert(Reader<ring_reader>);
+
+} // msgplus
+#endif // MSGPLUS_RING_HPP
@@ -0,0 +1,696 @@
+#ifndef MSGPLUS_SHARED_VALUE_HPP
+#define MSGPLUS_SHARED_VALUE_HPP
+
+#include "value.hpp"
+#include "hash.hpp"
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <variant>
+#include <vector>
+
+namespace msgplus
+{
+namespace detail
+{
+
+// Walks the elements of a non-empty array or map of `value` or
+// `shared_value`. The elements of a map are its keys and values in turn.
+template<typename V>
+class element_cursor
+{
+  public:
+
+    explicit element_cursor(const V& container) noexcept
+        : array_(container.try_array()), map_(container.try_map())
+    {
+        if(array_) {array_cur_ = array_->begin();}
+        else       {map_cur_   = map_->begin();}
+    }
+
+    bool        is_array() const noexcept {return array_ != nullptr;}
+    std::size_t size()     const noexcept {return array_ ? array_->size() : map_->size();}
+
+    // nullptr after the last element
+    const V* next() noexcept
+    {
+        if(array_)
+        {
+            return array_cur_ == array_->end() ? nullptr : std::addressof(*array_cur_++);
+        }
+        if(map_cur_ == map_->end()) {return nullptr;}
+        if( ! at_value_)
+        {
+            at_value_ = true;
+            return std::addressof(map_cur_->first);
+        }
+        at_value_ = false;
+        return std::addressof((map_cur_++)->second);
+    }
+
+  private:
+
+    const typename V::array_type*                array_;
+    const typename V::map_type*                  map_;
+    typename V::array_type::const_iterator       array_cur_{};
+    typename V::map_type::const_iterator         map_cur_{};
+    bool                                         at_value_ = false;
+};
+
+// Converts a non-empty array or map `root` into `To` through a worklist.
+// `leaf(x)` converts an element without elements. A map is built from all
+// of its pairs at once.
+template<typename To, typename From, typename Leaf>
+To convert_nested(const From& root, Leaf&& leaf)
+{
+    struct frame
+    {
+        explicit frame(const From& container): cursor(container)
+        {
+            if(cursor.is_array()) {elements.reserve(cursor.size());}
+            else                  {pairs   .reserve(cursor.size());}
+        }
+
+        void add(To x)
+        {
+            if(cursor.is_array())
+            {
+                elements.push_back(std::move(x));
+            }
+            else if( ! key.has_value())
+            {
+                key.emplace(std::move(x));
+            }
+            else
+            {
+                pairs.emplace_back(std::move(key.value()), std::move(x));
+                key.reset();
+            }
+        }
+        To finish()
+        {
+            if(cursor.is_array()) {return To(std::move(elements));}
+            return To(typename To::map_type(std::move(pairs)));
+        }
+
+        element_cursor<From>                  cursor;
+        typename To::array_type               elements;
+        typename To::map_type::container_type pairs;
+        std::optional<To>                     key; // of the pair being built
+    };
+
+    std::vector<frame> stack;
+    stack.emplace_back(root);
+    while(true)
+    {
+        const From* next = stack.back().cursor.next();
+        if(next == nullptr) // the top is done
+        {
+            To done = stack.back().finish();
+            stack.pop_back();
+            if(stack.empty())
+            {
+                return done;
+            }
+            stack.back().add(std::move(done));
+        }
+        else if(next->has_elements())
+        {
+            stack.emplace_back(*next);
+        }
+        else
+        {
+            stack.back().add(leaf(*next));
+        }
+    }
+}
+
+} // detail
+
+// An immutable, reference-counted counterpart of `value`.
+//
+// Strings, binaries, extensions, arrays and maps are stored in shared nodes
+// (timestamps are stored inline, like numbers), so copying a shared_value is
+// O(1) and copies can be handed to other threads freely.
+//
+// `mutable_array()` and `mutable_map()` detach (copy) only the node they are
+// called on; its children stay shared. Modifying a nested element through
+// them therefore copies just the path from the root to the element.
+//
+// Like `value`, conversion, comparison, hashing and destruction go through
+// worklists instead of recursion, so a deeply nested tree does not exhaust
+// the call stack.
+class shared_value
+{
+  public:
+
+    using nil_type     = value::nil_type    ;
+    using bool_type    = value::bool_type   ;
+    using int_type     = value::int_type    ;
+    using uint_type    = value::uint_type   ;
+    using float32_type = value::float32_type;
+    using float64_type = value::float64_type;
+    using str_type     = value::str_type    ;
+    using bin_type     = value::bin_type    ;
+    using array_type   = std::vector<shared_value>;
+    using map_type     = ordered_map<shared_value, shared_value>;
+    using ext_type     = value::ext_type    ;
+    using timestamp_type = value::timestamp_type;
+    using typed_ext_type = value::typed_ext_type;
+
+  public:
+
+    shared_value(): storage_(nil_type{}) {}
+    ~shared_value() = default;
+    shared_value(const shared_value&) = default;
+    shared_value(shared_value&&)      = default;
+    shared_value& operator=(const shared_value&) = default;
+    shared_value& operator=(shared_value&&)      = default;
+
+    shared_value(const value& v);
+    shared_value(array_type v);
+    shared_value(map_type   v);
+
+    value to_value() const;
+
+    type_t type() const noexcept;
+
+    // true if this is a non-empty array or map
+    bool has_elements() const noexcept
+    {
+        if(const auto* arr = this->try_array()) {return ! arr->empty();}
+        if(const auto* map = this->try_map())   {return ! map->empty();}
+        return false;
+    }
+
+    bool is_nil    () const noexcept {return this->type() == type_t::nil_t    ;}
+    bool is_bool   () const noexcept {return this->type() == type_t::bool_t   ;}
+    bool is_int    () const noexcept {return this->type() == type_t::int_t    ;}
+    bool is_uint   () const noexcept {return this->type() == type_t::uint_t   ;}
+    bool is_float32() const noexcept {return this->type() == type_t::float32_t;}
+    bool is_float64() const noexcept {return this->type() == type_t::float64_t;}
+    bool is_str    () const noexcept {return this->type() == type_t::str_t    ;}
+    bool is_bin    () const noexcept {return this->type() == type_t::bin_t    ;}
+    bool is_array  () const noexcept {return this->type() == type_t::array_t  ;}
+    bool is_map    () const noexcept {return this->type() == type_t::map_t    ;}
+    bool is_ext    () const noexcept {return this->type() == type_t::ext_t    ;}
+    bool is_timestamp() const noexcept {return this->type() == type_t::timestamp_t;}
+    bool is_typed_ext() const noexcept {return this->type() == type_t::typed_ext_t;}
+
+    nil_type     const& as_nil    () const {return std::get<nil_type    >(storage_);}
+    bool_type    const& as_bool   () const {return std::get<bool_type   >(storage_);}
+    int_type     const& as_int    () const {return std::get<int_type    >(storage_);}
+    uint_type    const& as_uint   () const {return std::get<uint_type   >(storage_);}
+    float32_type const& as_float32() const {return std::get<float32_type>(storage_);}
+    float64_type const& as_float64() const {return std::get<float64_type>(storage_);}
+    str_type     const& as_str    () const {return this->leaf().as_str();}
+    bin_type     const& as_bin    () const {return this->leaf().as_bin();}
+    array_type   const& as_array  () const {return std::get<array_type>(this->get_node().data);}
+    map_type     const& as_map    () const {return std::get<map_type  >(this->get_node().data);}
+    ext_type     const& as_ext    () const {return this->leaf().as_ext();}
+    timestamp_type const& as_timestamp() const {return std::get<timestamp_type>(storage_);}
+    typed_ext_type const& as_typed_ext() const {return this->leaf().as_typed_ext();}
+
+    array_type const* try_array() const noexcept
+    {
+        const auto* n = this->try_node();
+        return n ? std::get_if<array_type>(std::addressof(n->data)) : nullptr;
+    }
+    map_type const* try_map() const noexcept
+    {
+        const auto* n = this->try_node();
+        return n ? std::get_if<map_type>(std::addressof(n->data)) : nullptr;
+    }
+
+    // Detaches this node if it is shared, then gives write access to it.
+    // The reference must not be used after this shared_value is copied.
+    //
+    // A node that has been handed out this way is not memoized by `hash()`
+    // while this shared_value is its only owner, since the reference may
+    // still be used to modify it.
+    array_type& mutable_array() {return std::get<array_type>(this->detach().data);}
+    map_type&   mutable_map()   {return std::get<map_type  >(this->detach().data);}
+
+    // The same hash as `value_hash` gives to the equivalent value. Since
+    // shared nodes are immutable, the hash of each node is computed once and
+    // memoized in it.
+    std::size_t hash() const;
+
+    bool operator==(const shared_value& rhs) const {return compare(*this, rhs, true);}
+    bool operator!=(const shared_value& rhs) const {return !(*this == rhs);}
+    bool operator< (const shared_value& rhs) const {return compare(*this, rhs, false);}
+    bool operator<=(const shared_value& rhs) const {return !(rhs < *this);}
+    bool operator> (const shared_value& rhs) const {return   rhs < *this ;}
+    bool operator>=(const shared_value& rhs) const {return !(*this < rhs);}
+
+    void swap(shared_value& other) noexcept
+    {
+        using std::swap;
+        swap(this->storage_, other.storage_);
+    }
+
+  private:
+
+    struct node
+    {
+        using data_type = std::variant<value, array_type, map_type>;
+
+        explicit node(data_type d): data(std::move(d)) {}
+        node(const node& other): data(other.data) {}
+        ~node() {this->release_nested();}
+
+        void release_nested() noexcept;
+
+        // `value` holds a str, bin, ext or typed_ext. Arrays and maps hold
+        // shared_values.
+        data_type data;
+
+        // memoized hash of `data`. 0 if not computed yet.
+        mutable std::atomic<std::uint64_t> hash{0};
+
+        // true once `data` has been given out by `mutable_array/map()`
+        bool mutated = false;
+    };
+
+    node const* try_node() const noexcept
+    {
+        const auto* n = std::get_if<std::shared_ptr<node>>(std::addressof(storage_));
+        return n ? n->get() : nullptr;
+    }
+    node const& get_node() const
+    {
+        return *std::get<std::shared_ptr<node>>(storage_);
+    }
+    value const& leaf() const
+    {
+        return std::get<value>(this->get_node().data);
+    }
+
+    node& detach()
+    {
+        auto& n = std::get<std::shared_ptr<node>>(storage_);
+        if(n.use_count() == 1)
+        {
+            // synchronize with the other owners that have released the node
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        else
+        {
+            n = std::make_shared<node>(*n);
+        }
+        n->hash.store(0, std::memory_order_relaxed); // it will be modified
+        n->mutated = true;
+        return *n;
+    }
+
+    // the hash of a value without elements
+    std::uint64_t leaf_hash() const;
+    // the memoized hash of a node. 0 if it is not computed yet.
+    std::uint64_t memoized_hash() const noexcept
+    {
+        const auto* n = this->try_node();
+        return n ? n->hash.load(std::memory_order_relaxed) : 0;
+    }
+    void memoize(const std::uint64_t h) const noexcept;
+
+    // how a pair of values compares without looking into their elements
+    enum class shallow_order {less, greater, equal, unequal, nested};
+    static shallow_order compare_shallow(const shared_value& lhs, const shared_value& rhs,
+                                         const bool equality);
+
+    // `lhs == rhs` if `equality`, `lhs < rhs` otherwise
+    static bool compare(const shared_value& lhs, const shared_value& rhs, const bool equality);
+
+  private:
+
+    std::variant<
+        nil_type    ,
+        bool_type   ,
+        int_type    ,
+        uint_type   ,
+        float32_type,
+        float64_type,
+        timestamp_type,
+        std::shared_ptr<node>
+    > storage_;
+};
+
+inline shared_value::shared_value(const value& v)
+{
+    using enum type_t;
+    switch(v.type())
+    {
+        case nil_t     : {storage_ = v.as_nil    (); break;}
+        case bool_t    : {storage_ = v.as_bool   (); break;}
+        case int_t     : {storage_ = v.as_int    (); break;}
+        case uint_t    : {storage_ = v.as_uint   (); break;}
+        case float32_t : {storage_ = v.as_float32(); break;}
+        case float64_t : {storage_ = v.as_float64(); break;}
+        case timestamp_t: {storage_ = v.as_timestamp(); break;}
+        case array_t   :
+        case map_t     :
+        {
+            if( ! v.has_elements())
+            {
+                storage_ = v.is_array() ? std::make_shared<node>(array_type{}) :
+                                          std::make_shared<node>(map_type{});
+                break;
+            }
+            storage_ = detail::convert_nested<shared_value>(v,
+                    [](const value& x) {return shared_value(x);}).storage_;
+            break;
+        }
+        default:
+        {
+            storage_ = std::make_shared<node>(v);
+            break;
+        }
+    }
+}
+
+inline shared_value::shared_value(array_type v)
+    : storage_(std::make_shared<node>(std::move(v)))
+{}
+inline shared_value::shared_value(map_type v)
+    : storage_(std::make_shared<node>(std::move(v)))
+{}
+
+inline type_t shared_value::type() const noexcept
+{
+    if(const auto* n = this->try_node())
+    {
+        switch(n->data.index())
+        {
+            case 0:  {return std::get<value>(n->data).type();}
+            case 1:  {return type_t::array_t;}
+            default: {return type_t::map_t;}
+        }
+    }
+    if(std::holds_alternative<timestamp_type>(storage_))
+    {
+        return type_t::timestamp_t;
+    }
+    return static_cast<type_t>(storage_.index());
+}
+
+inline value shared_value::to_value() const
+{
+    const auto* n = this->try_node();
+    if( ! n)
+    {
+        return std::visit([](const auto& x) -> value {
+                if constexpr(std::is_same_v<std::decay_t<decltype(x)>,
+                                            std::shared_ptr<node>>)
+                {
+                    return value{}; // unreachable
+                }
+                else
+                {
+                    return value(x);
+                }
+            }, storage_);
+    }
+    if(this->has_elements())
+    {
+        return detail::convert_nested<value>(*this,
+                [](const shared_value& x) {return x.to_value();});
+    }
+    if(this->is_array()) {return value(value::array_type{});}
+    if(this->is_map())   {return value(value::map_type{});}
+    return std::get<value>(n->data);
+}
+
+inline shared_value::shallow_order
+shared_value::compare_shallow(const shared_value& lhs, const shared_value& rhs, const bool equality)
+{
+    using enum shallow_order;
+    const auto lt = lhs.type();
+    const auto rt = rhs.type();
+    if(lt != rt)
+    {
+        return equality ? unequal : (lt < rt ? less : greater);
+    }
+    const auto* ln = lhs.try_node();
+    const auto* rn = rhs.try_node();
+    if(ln == nullptr || rn == nullptr)
+    {
+        if(equality) {return lhs.storage_ == rhs.storage_ ? equal : unequal;}
+        if(lhs.storage_ < rhs.storage_) {return less;}
+        return rhs.storage_ < lhs.storage_ ? greater : equal;
+    }
+    if(ln == rn)
+    {
+        return equal;
+    }
+    if(const auto* lv = std::get_if<value>(std::addressof(ln->data)))
+    {
+        const auto& rv = std::get<value>(rn->data);
+        if(equality) {return *lv == rv ? equal : unequal;}
+        if(*lv < rv) {return less;}
+        return rv < *lv ? greater : equal;
+    }
+
+    const auto size = [](const shared_value& c) {
+        return c.is_array() ? c.as_array().size() : c.as_map().size();
+    };
+    const auto ls = size(lhs);
+    const auto rs = size(rhs);
+    if(equality && ls != rs)
+    {
+        return unequal;
+    }
+    if(ls == 0 || rs == 0)
+    {
+        return ls < rs ? less : (rs < ls ? greater : equal);
+    }
+    return nested;
+}
+
+// Compares the elements in order, as `std::equal` and
+// `std::lexicographical_compare` do. Maps compare their keys and values in
+// turn, as a sequence of pairs does.
+inline bool shared_value::compare(const shared_value& lhs, const shared_value& rhs,
+                                  const bool equality)
+{
+    using enum shallow_order;
+    const auto root = compare_shallow(lhs, rhs, equality);
+    if(root != nested)
+    {
+        return root == (equality ? equal : less);
+    }
+
+    struct frame
+    {
+        detail::element_cursor<shared_value> lhs;
+        detail::element_cursor<shared_value> rhs;
+    };
+    std::vector<frame> stack;
+    stack.push_back(frame{detail::element_cursor<shared_value>(lhs),
+                          detail::element_cursor<shared_value>(rhs)});
+    while( ! stack.empty())
+    {
+        const auto* l = stack.back().lhs.next();
+        const auto* r = stack.back().rhs.next();
+        if(l == nullptr || r == nullptr)
+        {
+            if(l != r) // only when ordering; equal sizes end together
+            {
+                return l == nullptr; // a prefix is less
+            }
+            stack.pop_back();
+            continue;
+        }
+        switch(compare_shallow(*l, *r, equality))
+        {
+            case equal:   {break;}
+            case nested:  {stack.push_back(frame{detail::element_cursor<shared_value>(*l),
+                                                 detail::element_cursor<shared_value>(*r)}); break;}
+            case less:    {return true;}
+            case greater: {return false;}
+            case unequal: {return false;}
+        }
+    }
+    return equality;
+}
+
+inline std::uint64_t shared_value::leaf_hash() const
+{
+    const auto* n = this->try_node();
+    if( ! n)
+    {
+        using enum type_t;
+        switch(this->type())
+        {
+            case nil_t     : {return detail::hash_type(nil_t);}
+            case bool_t    : {return detail::hash_combine(detail::hash_type(bool_t), this->as_bool() ? 1 : 0);}
+            case int_t     : {return detail::hash_int(this->as_int());}
+            case uint_t    : {return detail::hash_uint(this->as_uint());}
+            case float32_t : {return detail::hash_float(float32_t, this->as_float32());}
+            case float64_t : {return detail::hash_float(float64_t, this->as_float64());}
+            case timestamp_t: {return detail::hash_timestamp(this->as_timestamp());}
+            default:         {return 0;} // unreachable
+        }
+    }
+    if(this->is_array()) {return detail::hash_container(type_t::array_t, 0);}
+    if(this->is_map())   {return detail::hash_container(type_t::map_t,   0);}
+
+    if(const auto memo = n->hash.load(std::memory_order_relaxed); memo != 0)
+    {
+        return memo;
+    }
+    const std::uint64_t h = detail::hash_leaf(std::get<value>(n->data));
+    this->memoize(h);
+    return h;
+}
+
+inline void shared_value::memoize(const std::uint64_t h) const noexcept
+{
+    // A node that has been given out by mutable_array/map() can still be
+    // modified through that reference as long as it is not shared.
+    // 0 means "not computed yet"; hashes that happen to be 0 are not memoized.
+    const auto& n = std::get<std::shared_ptr<node>>(storage_);
+    if( ! n->mutated || 1 < n.use_count())
+    {
+        n->hash.store(h, std::memory_order_relaxed);
+    }
+}
+
+inline std::size_t shared_value::hash() const
+{
+    if( ! this->has_elements())
+    {
+        return this->leaf_hash();
+    }
+    if(const auto memo = this->memoized_hash(); memo != 0)
+    {
+        return memo;
+    }
+
+    struct frame
+    {
+        const shared_value*                  container;
+        detail::element_cursor<shared_value> cursor;
+        std::uint64_t                        hash;
+    };
+    const auto open = [](const shared_value& c) {
+        const auto t = c.type();
+        const auto size = c.is_array() ? c.as_array().size() : c.as_map().size();
+        return frame{std::addressof(c), detail::element_cursor<shared_value>(c),
+                     detail::hash_container(t, size)};
+    };
+
+    std::vector<frame> stack;
+    stack.push_back(open(*this));
+    while(true)
+    {
+        const shared_value* next = stack.back().cursor.next();
+        if(next == nullptr) // the top is done
+        {
+            const auto h = stack.back().hash;
+            stack.back().container->memoize(h);
+            stack.pop_back();
+            if(stack.empty())
+            {
+                return h;
+            }
+            stack.back().hash = detail::hash_combine(stack.back().hash, h);
+        }
+        else if( ! next->has_elements())
+        {
+            stack.back().hash = detail::hash_combine(stack.back().hash, next->leaf_hash());
+        }
+        else if(const auto memo = next->memoized_hash(); memo != 0)
+        {
+            stack.back().hash = detail::hash_combine(stack.back().hash, memo);
+        }
+        else
+        {
+            stack.push_back(open(*next));
+        }
+    }
+}
+
+// Releases the nested nodes that this node owns alone. Like
+// `value::release_nested()`, shallow trees are released by the ordinary
+// recursive destructor calls, and deeper ones through a worklist.
+inline void shared_value::node::release_nested() noexcept
+{
+    const auto nested = [](const shared_value& e) {return e.has_elements();};
+    const auto* arr = std::get_if<array_type>(std::addressof(data));
+    const auto* map = std::get_if<map_type>  (std::addressof(data));
+    if( ! (arr && std::any_of(arr->begin(), arr->end(), nested)) &&
+        ! (map && std::any_of(map->begin(), map->end(), [&](const auto& kv) {
+                return nested(kv.first) || nested(kv.second);})))
+    {
+        return;
+    }
+
+    if(detail::release_depth < detail::recursive_release_depth)
+    {
+        detail::release_depth += 1;
+        data.emplace<value>(); // the elements release their own children
+        detail::release_depth -= 1;
+        return;
+    }
+
+    try
+    {
+        std::vector<std::shared_ptr<node>> pending;
+        const auto take = [&pending](shared_value& e) {
+            if(e.has_elements())
+            {
+                pending.push_back(std::move(std::get<std::shared_ptr<node>>(e.storage_)));
+            }
+        };
+        const auto collect = [&take](node& n) {
+            if(auto* elems = std::get_if<array_type>(std::addressof(n.data)))
+            {
+                for(auto& e : *elems) {take(e);}
+            }
+            else if(auto* pairs = std::get_if<map_type>(std::addressof(n.data)))
+            {
+                for(auto& [k, e] : *pairs) {take(k); take(e);}
+            }
+        };
+
+        collect(*this);
+        while( ! pending.empty())
+        {
+            auto n = std::move(pending.back());
+            pending.pop_back();
+            if(n.use_count() == 1) // others may still hold the rest
+            {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                collect(*n);
+            }
+        } // `n` has no nested nodes left if it is destroyed here
+    }
+    catch(...)
+    {
+        // out of memory. the rest is released by the recursive calls.
+    }
+    return;
+}
+
+using shared_array_type = shared_value::array_type;
+using shared_map_type   = shared_value::map_type;
+
+inline void swap(shared_value& lhs, shared_value& rhs) noexcept
+{
+    lhs.swap(rhs);
+    return;
+}
+
+} // msgplus
+
+template<>
+struct std::hash<msgplus::shared_value>
+{
+    std::size_t operator()(const msgplus::shared_value& v) const
+    {
+        return v.hash();
+    }
+};
+
+#endif // MSGPLUS_SHARED_VALUE_HPP
@@ -0,0 +1,580 @@
+#ifndef MSGPLUS_SMALL_VECTOR_HPP
+#define MSGPLUS_SMALL_VECTOR_HPP
+
+#include <algorithm>
+#include <compare>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+// A vector of trivially copyable elements that keeps up to `N` elements in
+// itself, without allocating. Longer contents are kept in a `std::vector`,
+// which can be moved in and out without copying the elements.
+//
+// The capacity does not shrink automatically; `shrink_to_fit()` moves short
+// contents back to the inline buffer.
+//
+// It has the members of std::vector that are used to build contents, but it
+// is not one: it converts to std::span, and to std::vector by `to_vector()`.
+template<typename T, std::size_t N, typename Allocator = std::allocator<T>>
+class small_vector
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+    static_assert(0 < N && N < 255);
+
+  public:
+
+    using value_type      = T;
+    using allocator_type  = Allocator;
+    using size_type       = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference       = T&;
+    using const_reference = T const&;
+    using pointer         = T*;
+    using const_pointer   = T const*;
+    using iterator        = T*;
+    using const_iterator  = T const*;
+    using vector_type     = std::vector<T, Allocator>;
+
+    static constexpr size_type inline_capacity = N;
+
+  public:
+
+    small_vector() noexcept: size_(0) {}
+    ~small_vector() {this->reset();}
+
+    small_vector(const small_vector& other): size_(0)
+    {
+        this->assign(other.begin(), other.end());
+    }
+    small_vector(small_vector&& other) noexcept: size_(0)
+    {
+        this->steal(other);
+    }
+    small_vector& operator=(const small_vector& other)
+    {
+        if(this != std::addressof(other))
+        {
+            this->assign(other.begin(), other.end());
+        }
+        return *this;
+    }
+    small_vector& operator=(small_vector&& other) noexcept
+    {
+        if(this != std::addressof(other))
+        {
+            this->reset();
+            this->steal(other);
+        }
+        return *this;
+    }
+
+    explicit small_vector(const size_type n): size_(0)
+    {
+        this->resize(n);
+    }
+    small_vector(const size_type n, const T& x): size_(0)
+    {
+        this->assign(n, x);
+    }
+    template<std::input_iterator InputIter>
+    small_vector(InputIter first, InputIter last): size_(0)
+    {
+        this->assign(first, last);
+    }
+    small_vector(std::initializer_list<T> init): size_(0)
+    {
+        this->assign(init.begin(), init.end());
+    }
+
+    // from a std::vector. a long one is adopted without copying.
+    small_vector(const vector_type& v): size_(0)
+    {
+        this->assign(v.begin(), v.end());
+    }
+    small_vector(vector_type&& v): size_(0)
+    {
+        if(v.size() <= N)
+        {
+            std::copy(v.begin(), v.end(), inline_);
+            size_ = static_cast<std::uint8_t>(v.size());
+        }
+        else
+        {
+            std::construct_at(std::addressof(heap_), std::move(v));
+            size_ = on_heap;
+        }
+    }
+
+    vector_type to_vector() const&
+    {
+        return vector_type(this->begin(), this->end());
+    }
+    vector_type to_vector() &&
+    {
+        if(this->is_inline())
+        {
+            return vector_type(this->begin(), this->end());
+        }
+        vector_type retval(std::move(heap_));
+        this->reset();
+        return retval;
+    }
+
+    operator std::span<const T>() const noexcept {return {this->data(), this->size()};}
+    operator std::span<T>()             noexcept {return {this->data(), this->size()};}
+
+    void assign(const size_type n, const T& x)
+    {
+        if(this->is_inline() && n <= N)
+        {
+            std::fill_n(inline_, n, x);
+            size_ = static_cast<std::uint8_t>(n);
+            return;
+        }
+        this->clear();
+        this->reserve(n);
+        heap_.assign(n, x);
+    }
+    template<std::input_iterator InputIter>
+    void assign(InputIter first, InputIter last)
+    {
+        if constexpr(std::forward_iterator<InputIter>)
+        {
+            const auto n = static_cast<size_type>(std::distance(first, last));
+            if(this->is_inline() && n <= N)
+            {
+                std::copy(first, last, inline_);
+                size_ = static_cast<std::uint8_t>(n);
+                return;
+            }
+            this->clear();
+            this->reserve(n);
+            heap_.assign(first, last);
+        }
+        else
+        {
+            this->clear();
+            for(; first != last; ++first)
+            {
+                this->push_back(*first);
+            }
+        }
+    }
+
+    bool      is_inline() const noexcept {return size_ != on_heap;}
+    bool      empty()     const noexcept {return this->size() == 0;}
+    size_type size()      const noexcept {return this->is_inline() ? size_ : heap_.size();}
+    size_type capacity()  const noexcept {return this->is_inline() ? N : heap_.capacity();}
+
+    void reserve(const size_type n)
+    {
+        if(this->is_inline())
+        {
+            if(n <= N) {return;}
+            this->move_to_heap(n);
+        }
+        else
+        {
+            heap_.reserve(n);
+        }
+    }
+    void shrink_to_fit()
+    {
+        if(this->is_inline()) {return;}
+        if(heap_.size() <= N)
+        {
+            vector_type h(std::move(heap_));
+            this->reset();
+            std::memcpy(inline_, h.data(), h.size() * sizeof(T));
+            size_ = static_cast<std::uint8_t>(h.size());
+        }
+        else
+        {
+            heap_.shrink_to_fit();
+        }
+    }
+
+    // new elements are value-initialized
+    void resize(const size_type n)
+    {
+        if(this->is_inline() && n <= N)
+        {
+            if(size_ < n)
+            {
+                std::fill(inline_ + size_, inline_ + n, T{});
+            }
+            size_ = static_cast<std::uint8_t>(n);
+            return;
+        }
+        this->reserve(n);
+        heap_.resize(n);
+    }
+    void resize(const size_type n, const T& x)
+    {
+        const T copy = x; // `x` may be an element of this
+        if(this->is_inline() && n <= N)
+        {
+            if(size_ < n)
+            {
+                std::fill(inline_ + size_, inline_ + n, copy);
+            }
+            size_ = static_cast<std::uint8_t>(n);
+            return;
+        }
+        this->reserve(n);
+        heap_.resize(n, copy);
+    }
+    void clear() noexcept
+    {
+        if(this->is_inline()) {size_ = 0;}
+        else                  {heap_.clear();}
+    }
+
+    void push_back(const T& x)
+    {
+        if(this->is_inline() && size_ < N)
+        {
+            inline_[size_++] = x;
+            return;
+        }
+        const T copy = x; // `x` may be an element of this
+        if(this->is_inline())
+        {
+            this->move_to_heap(2 * N);
+        }
+        heap_.push_back(copy);
+    }
+    template<typename ... Args>
+    T& emplace_back(Args&& ... args)
+    {
+        this->push_back(T(std::forward<Args>(args)...));
+        return this->back();
+    }
+    void pop_back() noexcept
+    {
+        if(this->is_inline()) {--size_;}
+        else                  {heap_.pop_back();}
+    }
+
+    iterator insert(const_iterator pos, const T& x)
+    {
+        return this->insert(pos, 1, x);
+    }
+    iterator insert(const_iterator pos, const size_type n, const T& x)
+    {
+        const T copy = x; // `x` may be an element of this
+        const auto i = static_cast<size_type>(pos - this->cbegin());
+        if(this->is_inline() && size_ + n <= N)
+        {
+            std::copy_backward(inline_ + i, inline_ + size_, inline_ + size_ + n);
+            std::fill_n(inline_ + i, n, copy);
+            size_ = static_cast<std::uint8_t>(size_ + n);
+            return inline_ + i;
+        }
+        this->spill(n);
+        heap_.insert(heap_.begin() + static_cast<difference_type>(i), n, copy);
+        return heap_.data() + i;
+    }
+    template<std::input_iterator InputIter>
+    iterator insert(const_iterator pos, InputIter first, InputIter last)
+    {
+        if constexpr(std::forward_iterator<InputIter>)
+        {
+            const auto n = static_cast<size_type>(std::distance(first, last));
+            const auto i = static_cast<size_type>(pos - this->cbegin());
+            if(this->is_inline() && size_ + n <= N)
+            {
+                std::copy_backward(inline_ + i, inline_ + size_, inline_ + size_ + n);
+                std::copy(first, last, inline_ + i);
+                size_ = static_cast<std::uint8_t>(size_ + n);
+                return inline_ + i;
+            }
+            this->spill(n);
+            heap_.insert(heap_.begin() + static_cast<difference_type>(i), first, last);
+            return heap_.data() + i;
+        }
+        else // appended, then rotated into place
+        {
+            const auto i   = static_cast<size_type>(pos - this->cbegin());
+            const auto old = this->size();
+            for(; first != last; ++first)
+            {
+                this->push_back(*first);
+            }
+            std::rotate(this->begin() + i, this->begin() + old, this->end());
+            return this->begin() + i;
+        }
+    }
+    iterator insert(const_iterator pos, std::initializer_list<T> init)
+    {
+        return this->insert(pos, init.begin(), init.end());
+    }
+    template<typename ... Args>
+    iterator emplace(const_iterator pos, Args&& ... args)
+    {
+        return this->insert(pos, T(std::forward<Args>(args)...));
+    }
+
+    iterator erase(const_iterator pos)
+    {
+        return this->erase(pos, pos + 1);
+    }
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        const auto i = static_cast<size_type>(first - this->cbegin());
+        const auto j = static_cast<size_type>(last  - this->cbegin());
+        const auto n = this->size();
+        std::copy(this->begin() + j, this->end(), this->begin() + i);
+        this->resize(n - (j - i));
+        return this->begin() + i;
+    }
+
+    T*       data()       noexcept {return this->is_inline() ? inline_ : heap_.data();}
+    T const* data() const noexcept {return this->is_inline() ? inline_ : heap_.data();}
+
+    iterator       begin()        noexcept {return this->data();}
+    iterator       end()          noexcept {return this->data() + this->size();}
+    const_iterator begin()  const noexcept {return this->data();}
+    const_iterator end()    const noexcept {return this->data() + this->size();}
+    const_iterator cbegin() const noexcept {return this->data();}
+    const_iterator cend()   const noexcept {return this->data() + this->size();}
+
+    T&       operator[](const size_type i)       noexcept {return this->data()[i];}
+    T const& operator[](const size_type i) const noexcept {return this->data()[i];}
+
+    T& at(const size_type i)
+    {
+        if(this->size() <= i)
+        {
+            throw std::out_of_range("small_vector::at()");
+        }
+        return this->data()[i];
+    }
+    T const& at(const size_type i) const
+    {
+        if(this->size() <= i)
+        {
+            throw std::out_of_range("small_vector::at()");
+        }
+        return this->data()[i];
+    }
+
+    T&       front()       noexcept {return this->data()[0];}
+    T const& front() const noexcept {return this->data()[0];}
+    T&       back()        noexcept {return this->data()[this->size() - 1];}
+    T const& back()  const noexcept {return this->data()[this->size() - 1];}
+
+    void swap(small_vector& other) noexcept
+    {
+        small_vector tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    friend bool operator==(const small_vector& lhs, const small_vector& rhs) noexcept
+    {
+        return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+    }
+    friend bool operator!=(const small_vector& lhs, const small_vector& rhs) noexcept
+    {
+        return !(lhs == rhs);
+    }
+    friend bool operator< (const small_vector& lhs, const small_vector& rhs) noexcept
+    {
+        return std::lexicographical_compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+    }
+    friend bool operator<=(const small_vector& lhs, const small_vector& rhs) noexcept {return !(rhs < lhs);}
+    friend bool operator> (const small_vector& lhs, const small_vector& rhs) noexcept {return   rhs < lhs ;}
+    friend bool operator>=(const small_vector& lhs, const small_vector& rhs) noexcept {return !(lhs < rhs);}
+
+  private:
+
+    static constexpr std::uint8_t on_heap = 0xFF;
+
+    void move_to_heap(const size_type cap)
+    {
+        vector_type h;
+        h.reserve(cap);
+        h.assign(inline_, inline_ + std::min<size_type>(size_, N)); // size_ <= N here, spelled out for -Warray-bounds
+        std::construct_at(std::addressof(heap_), std::move(h));
+        size_ = on_heap;
+    }
+
+    // moves inline contents to the heap before `n` more elements are added
+    void spill(const size_type n)
+    {
+        if(this->is_inline())
+        {
+            this->move_to_heap(std::max<size_type>(size_ + n, 2 * N));
+        }
+    }
+
+    // takes the contents of `other`. `this` must be empty and inline.
+    void steal(small_vector& other) noexcept
+    {
+        if(other.is_inline())
+        {
+            std::memcpy(inline_, other.inline_, other.size_ * sizeof(T));
+            size_ = other.size_;
+        }
+        else
+        {
+            std::construct_at(std::addressof(heap_), std::move(other.heap_));
+            size_ = on_heap;
+            other.reset();
+        }
+    }
+
+    // back to an empty inline buffer
+    void reset() noexcept
+    {
+        if( ! this->is_inline())
+        {
+            std::destroy_at(std::addressof(heap_));
+        }
+        size_ = 0;
+    }
+
+  private:
+
+    union
+    {
+        T           inline_[N];
+        vector_type heap_;
+    };
+    std::uint8_t size_; // the number of inline elements, or `on_heap`
+};
+
+template<typename T, std::size_t N, typename A>
+void swap(small_vector<T, N, A>& lhs, small_vector<T, N, A>& rhs) noexcept
+{
+    lhs.swap(rhs);
+    return ;
+}
+
+namespace detail
+{
+
+// A stack that keeps its first `N` elements in itself, so that shallow
+// nesting needs no allocation. Unlike small_vector, the elements need not be
+// trivially copyable; the inline ones are constructed when they are pushed.
+// References to them stay valid while the stack grows.
+template<typename T, std::size_t N>
+class small_stack
+{
+  public:
+
+    small_stack() noexcept = default;
+    ~small_stack() {this->clear();}
+
+    small_stack(const small_stack& other): rest_(other.rest_)
+    {
+        try
+        {
+            for(; size_ < std::min(other.size_, N); ++size_)
+            {
+                std::construct_at(this->at(size_), *other.at(size_));
+            }
+        }
+        catch(...)
+        {
+            this->clear();
+            throw;
+        }
+        size_ = other.size_;
+    }
+    small_stack(small_stack&& other) noexcept
+    {
+        this->take(other);
+    }
+    small_stack& operator=(const small_stack& other)
+    {
+        if(this != std::addressof(other))
+        {
+            small_stack tmp(other);
+            this->clear();
+            this->take(tmp);
+        }
+        return *this;
+    }
+    small_stack& operator=(small_stack&& other) noexcept
+    {
+        if(this != std::addressof(other))
+        {
+            this->clear();
+            this->take(other);
+        }
+        return *this;
+    }
+
+    bool        empty() const noexcept {return size_ == 0;}
+    std::size_t size()  const noexcept {return size_;}
+
+    T&       back()       noexcept {return size_ <= N ? *this->at(size_ - 1) : rest_.back();}
+    T const& back() const noexcept {return size_ <= N ? *this->at(size_ - 1) : rest_.back();}
+
+    void push_back(T x)
+    {
+        if(size_ < N) {std::construct_at(this->at(size_), std::move(x));}
+        else          {rest_.push_back(std::move(x));}
+        size_ += 1;
+    }
+    void pop_back() noexcept
+    {
+        if(N < size_) {rest_.pop_back();}
+        else          {std::destroy_at(this->at(size_ - 1));}
+        size_ -= 1;
+    }
+    void clear() noexcept
+    {
+        rest_.clear();
+        for(std::size_t i = std::min(size_, N); 0 < i; --i)
+        {
+            std::destroy_at(this->at(i - 1));
+        }
+        size_ = 0;
+    }
+
+  private:
+
+    static_assert(std::is_nothrow_move_constructible_v<T>);
+
+    // takes the elements of `other`. `this` must be empty.
+    void take(small_stack& other) noexcept
+    {
+        rest_ = std::move(other.rest_);
+        for(; size_ < std::min(other.size_, N); ++size_)
+        {
+            std::construct_at(this->at(size_), std::move(*other.at(size_)));
+        }
+        size_ = other.size_;
+        other.clear();
+    }
+
+    T*       at(const std::size_t i)       noexcept {return std::launder(reinterpret_cast<T*>(inline_)) + i;}
+    T const* at(const std::size_t i) const noexcept {return std::launder(reinterpret_cast<const T*>(inline_)) + i;}
+
+  private:
+
+    alignas(T) std::byte inline_[N * sizeof(T)];
+    std::vector<T>       rest_;
+    std::size_t          size_ = 0;
+};
+
+} // detail
+
+} // msgplus
+#endif // MSGPLUS_SMALL_VECTOR_HPP
@@ -0,0 +1,251 @@
+#ifndef MSGPLUS_SPLIT_FLAT_MAP_HPP
+#define MSGPLUS_SPLIT_FLAT_MAP_HPP
+
+#include "flat_map.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <concepts>
+#include <initializer_list>
+#include <iterator>
+#include <numeric>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+// The order of the keys in a split_flat_map.
+//
+// - `sorted` is a plain sorted array searched by binary search.
+// - `eytzinger` stores the implicit binary search tree breadth-first, so that
+//   the first levels share a few cache lines, the children of a node are next
+//   to each other and can be prefetched, and the search has no unpredictable
+//   branch.
+enum class flat_map_layout : std::uint8_t
+{
+    sorted    = 0,
+    eytzinger = 1,
+};
+
+// A read-mostly map that stores keys and values in separate arrays, so that
+// searching touches only the keys.
+//
+// The set of keys is fixed at construction; values can be modified. If a key
+// appears more than once in the input, the first one is kept, as `flat_map`
+// does with repeated `insert`s.
+//
+// `keys()[i]` corresponds to `values()[i]`. They are in the order of the
+// layout, so with `eytzinger` they are not sorted.
+template<typename Key, typename Value, typename Cmp = std::less<Key>,
+         flat_map_layout Layout = flat_map_layout::sorted,
+         typename KeyAllocator   = std::allocator<Key>,
+         typename ValueAllocator = std::allocator<Value>>
+class split_flat_map
+{
+  public:
+
+    using key_type    = Key;
+    using mapped_type = Value;
+    using key_compare = Cmp;
+    using size_type   = std::size_t;
+
+    using key_container_type   = std::vector<Key,   KeyAllocator>;
+    using value_container_type = std::vector<Value, ValueAllocator>;
+
+    static constexpr flat_map_layout layout = Layout;
+
+  public:
+
+    split_flat_map() = default;
+    ~split_flat_map() = default;
+    split_flat_map(const split_flat_map&) = default;
+    split_flat_map(split_flat_map&&)      = default;
+    split_flat_map& operator=(const split_flat_map&) = default;
+    split_flat_map& operator=(split_flat_map&&)      = default;
+
+    // from a range of key-value pairs, e.g. a flat_map or an ordered_map
+    template<typename InputIter>
+    split_flat_map(InputIter first, InputIter last, key_compare cmp = key_compare{})
+        : cmp_(std::move(cmp))
+    {
+        std::vector<std::pair<Key, Value>> kvs(first, last);
+        this->build(std::move(kvs));
+    }
+    split_flat_map(std::initializer_list<std::pair<Key, Value>> init,
+                   key_compare cmp = key_compare{})
+        : cmp_(std::move(cmp))
+    {
+        std::vector<std::pair<Key, Value>> kvs(init.begin(), init.end());
+        this->build(std::move(kvs));
+    }
+
+    bool      empty() const noexcept {return keys_.empty();}
+    size_type size()  const noexcept {return keys_.size();}
+
+    std::span<const key_type>    keys()   const noexcept {return keys_;}
+    std::span<const mapped_type> values() const noexcept {return values_;}
+    std::span<mapped_type>       values()       noexcept {return values_;}
+
+    // nullptr if there is no such key
+    template<typename K>
+    mapped_type const* find(const K& k) const
+    {
+        const auto i = this->search(detail::lookup_key<key_type, key_compare>(k));
+        return i == this->size() ? nullptr : std::addressof(this->values_[i]);
+    }
+    template<typename K>
+    mapped_type* find(const K& k)
+    {
+        const auto i = this->search(detail::lookup_key<key_type, key_compare>(k));
+        return i == this->size() ? nullptr : std::addressof(this->values_[i]);
+    }
+
+    template<typename K>
+    bool contains(const K& k) const
+    {
+        return this->find(k) != nullptr;
+    }
+    template<typename K>
+    size_type count(const K& k) const
+    {
+        return this->contains(k) ? 1 : 0;
+    }
+
+    template<typename K>
+    mapped_type& at(const K& k)
+    {
+        auto* found = this->find(k);
+        if( ! found)
+        {
+            throw std::out_of_range("split_flat_map::at()");
+        }
+        return *found;
+    }
+    template<typename K>
+    mapped_type const& at(const K& k) const
+    {
+        const auto* found = this->find(k);
+        if( ! found)
+        {
+            throw std::out_of_range("split_flat_map::at()");
+        }
+        return *found;
+    }
+
+    key_compare key_comp() const {return cmp_;}
+
+    void swap(split_flat_map& other)
+    {
+        using std::swap;
+        swap(this->cmp_,    other.cmp_);
+        swap(this->keys_,   other.keys_);
+        swap(this->values_, other.values_);
+    }
+
+  private:
+
+    void build(std::vector<std::pair<Key, Value>> kvs)
+    {
+        std::stable_sort(kvs.begin(), kvs.end(),
+            [this](const auto& lhs, const auto& rhs) {return this->cmp_(lhs.first, rhs.first);});
+        const auto last = std::unique(kvs.begin(), kvs.end(),
+            [this](const auto& lhs, const auto& rhs) {return ! this->cmp_(lhs.first, rhs.first);});
+        kvs.erase(last, kvs.end());
+
+        // the position of the i-th smallest key
+        std::vector<size_type> slots(kvs.size());
+        if constexpr(Layout == flat_map_layout::eytzinger)
+        {
+            size_type rank = 0;
+            eytzinger_slots(slots, rank, 0);
+        }
+        else
+        {
+            std::iota(slots.begin(), slots.end(), size_type(0));
+        }
+
+        std::vector<std::pair<Key, Value>*> placed(kvs.size());
+        for(size_type i=0; i<kvs.size(); ++i)
+        {
+            placed[slots[i]] = std::addressof(kvs[i]);
+        }
+        this->keys_  .clear();
+        this->values_.clear();
+        this->keys_  .reserve(kvs.size());
+        this->values_.reserve(kvs.size());
+        for(auto* kv : placed)
+        {
+            this->keys_  .push_back(std::move(kv->first));
+            this->values_.push_back(std::move(kv->second));
+        }
+    }
+
+    // assigns ranks to the nodes of the tree in in-order. the depth of the
+    // recursion is log2(n).
+    static void eytzinger_slots(std::vector<size_type>& slots, size_type& rank, size_type node)
+    {
+        if(slots.size() <= node) {return;}
+
+        eytzinger_slots(slots, rank, 2 * node + 1);
+        slots[rank++] = node;
+        eytzinger_slots(slots, rank, 2 * node + 2);
+    }
+
+    // returns the position of `k`, or size() if not found
+    template<typename K>
+    size_type search(const K& k) const
+    {
+        const size_type n = this->keys_.size();
+        if constexpr(Layout == flat_map_layout::eytzinger)
+        {
+            // 1-based index of the node; the children of j are 2j and 2j+1
+            size_type j = 1;
+            while(j <= n)
+            {
+#if defined(__GNUC__)
+                __builtin_prefetch(this->keys_.data() + std::min(16 * j, n) - 1);
+#endif
+                j = 2 * j + static_cast<size_type>(this->cmp_(this->keys_[j - 1], k));
+            }
+            // undo the right turns taken after the last left turn, and the
+            // left turn itself. that node is the lower bound.
+            j >>= std::countr_one(j) + 1;
+            if(j == 0 || this->cmp_(k, this->keys_[j - 1]))
+            {
+                return n;
+            }
+            return j - 1;
+        }
+        else
+        {
+            const auto found = std::lower_bound(this->keys_.begin(), this->keys_.end(), k,
+                [this](const key_type& lhs, const auto& rhs) {return this->cmp_(lhs, rhs);});
+            if(found == this->keys_.end() || this->cmp_(k, *found))
+            {
+                return n;
+            }
+            return static_cast<size_type>(found - this->keys_.begin());
+        }
+    }
+
+  private:
+
+    [[no_unique_address]] key_compare cmp_;
+    key_container_type   keys_;
+    value_container_type values_;
+};
+
+template<typename K, typename V, typename C, flat_map_layout L, typename KA, typename VA>
+void swap(split_flat_map<K, V, C, L, KA, VA>& lhs, split_flat_map<K, V, C, L, KA, VA>& rhs)
+{
+    lhs.swap(rhs);
+    return ;
+}
+
+} // msgplus
+#endif// MSGPLUS_SPLIT_FLAT_MAP_HPP
@@ -0,0 +1,193 @@
+#ifndef MSGPLUS_STATS_HPP
+#define MSGPLUS_STATS_HPP
+
+#include "value.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <concepts>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+// Receives what a decoder or an encoder has processed.
+//
+// - `count_object(t, n)`: an object of type `t` that takes `n` bytes. For an
+//   array or a map, `n` is the size of its header only.
+// - `count_container(t, n, depth)`: an array of `n` elements or a map of `n`
+//   pairs. `depth` is 1 for a container at the top level.
+// - `count_call(d)`: a call to read() or write() that took `d`.
+//
+// If `S::enabled` is false, the calls are not made and nothing is measured,
+// so that a disabled policy costs nothing.
+template<typename S>
+concept CodecStats = requires(S& s, type_t t, std::size_t n, std::chrono::nanoseconds d) {
+    {S::enabled} -> std::convertible_to<bool>;
+    s.count_object(t, n);
+    s.count_container(t, n, n);
+    s.count_call(d);
+};
+
+// The default policy. It is not counted.
+struct no_stats
+{
+    static constexpr bool enabled = false;
+
+    void count_object(type_t, std::size_t) noexcept {}
+    void count_container(type_t, std::size_t, std::size_t) noexcept {}
+    void count_call(std::chrono::nanoseconds) noexcept {}
+};
+static_assert(CodecStats<no_stats>);
+
+// Counts the objects and bytes of each type, the sizes of containers, the
+// nesting depth and the time spent. A stats object accumulates over calls
+// until `clear()`.
+//
+// Objects skipped by a projection are not counted.
+//
+// ```cpp
+// msg::codec_stats stats;
+// const auto v = msg::read(reader, stats);
+// stats.objects(msg::type_t::float64_t);
+// ```
+class codec_stats
+{
+  public:
+
+    static constexpr bool enabled = true;
+
+    // one for each type_t, the last of which is typed_ext_t
+    static constexpr std::size_t num_types = static_cast<std::size_t>(type_t::typed_ext_t) + 1;
+
+    // Sizes are bucketed by their bit width: bucket 0 is size 0, bucket 1 is
+    // size 1, bucket 2 is 2-3, bucket 3 is 4-7, and so on.
+    static constexpr std::size_t num_size_buckets = 65;
+
+    using histogram_type = std::array<std::uint64_t, num_size_buckets>;
+
+  public:
+
+    void count_object(const type_t t, const std::size_t n) noexcept
+    {
+        this->objects_[index(t)] += 1;
+        this->bytes_  [index(t)] += n;
+    }
+    void count_container(const type_t t, const std::size_t n, const std::size_t depth) noexcept
+    {
+        auto& hist = (t == type_t::map_t) ? this->map_sizes_ : this->array_sizes_;
+        hist[size_bucket(n)] += 1;
+        this->max_depth_ = std::max(this->max_depth_, depth);
+    }
+    void count_call(const std::chrono::nanoseconds d) noexcept
+    {
+        this->calls_ += 1;
+        this->time_  += d;
+    }
+
+    std::uint64_t objects(const type_t t) const noexcept {return this->objects_[index(t)];}
+    std::uint64_t bytes  (const type_t t) const noexcept {return this->bytes_  [index(t)];}
+
+    std::uint64_t total_objects() const noexcept
+    {
+        std::uint64_t n = 0;
+        for(const auto x : this->objects_) {n += x;}
+        return n;
+    }
+    std::uint64_t total_bytes() const noexcept
+    {
+        std::uint64_t n = 0;
+        for(const auto x : this->bytes_) {n += x;}
+        return n;
+    }
+
+    histogram_type const& array_sizes() const noexcept {return this->array_sizes_;}
+    histogram_type const& map_sizes()   const noexcept {return this->map_sizes_;}
+
+    std::size_t              max_depth() const noexcept {return this->max_depth_;}
+    std::uint64_t            calls()     const noexcept {return this->calls_;}
+    std::chrono::nanoseconds time()      const noexcept {return this->time_;}
+
+    static std::size_t size_bucket(const std::size_t n) noexcept
+    {
+        return static_cast<std::size_t>(std::bit_width(n));
+    }
+    // the smallest size in a bucket
+    static std::size_t bucket_min(const std::size_t bucket) noexcept
+    {
+        return bucket == 0 ? 0 : std::size_t(1) << (bucket - 1);
+    }
+
+    codec_stats& operator+=(const codec_stats& other) noexcept
+    {
+        for(std::size_t i=0; i<num_types; ++i)
+        {
+            this->objects_[i] += other.objects_[i];
+            this->bytes_  [i] += other.bytes_  [i];
+        }
+        for(std::size_t i=0; i<num_size_buckets; ++i)
+        {
+            this->array_sizes_[i] += other.array_sizes_[i];
+            this->map_sizes_  [i] += other.map_sizes_  [i];
+        }
+        this->max_depth_ = std::max(this->max_depth_, other.max_depth_);
+        this->calls_    += other.calls_;
+        this->time_     += other.time_;
+        return *this;
+    }
+
+    void clear() noexcept {*this = codec_stats{};}
+
+  private:
+
+    static std::size_t index(const type_t t) noexcept
+    {
+        return static_cast<std::size_t>(t);
+    }
+
+  private:
+
+    std::array<std::uint64_t, num_types> objects_{};
+    std::array<std::uint64_t, num_types> bytes_{};
+    histogram_type           array_sizes_{};
+    histogram_type           map_sizes_{};
+    std::size_t              max_depth_ = 0;
+    std::uint64_t            calls_     = 0;
+    std::chrono::nanoseconds time_{0};
+};
+static_assert(CodecStats<codec_stats>);
+
+namespace detail
+{
+
+// reports the time from its construction to its destruction, if enabled
+template<CodecStats S>
+struct call_timer
+{
+    explicit call_timer(S&) noexcept {}
+};
+
+template<CodecStats S> requires(S::enabled)
+struct call_timer<S>
+{
+    explicit call_timer(S& s) noexcept
+        : stats(s), start(std::chrono::steady_clock::now())
+    {}
+    ~call_timer()
+    {
+        stats.count_call(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start));
+    }
+    call_timer(const call_timer&) = delete;
+    call_timer& operator=(const call_timer&) = delete;
+
+    S&                                    stats;
+    std::chrono::steady_clock::time_point start;
+};
+
+} // detail
+} // msgplus
+#endif // MSGPLUS_STATS_HPP
@@ -2,11 +2,20 @@
 #define MSGPLUS_VALUE_HPP
 
 #include "ordered_map.hpp"
+#include "ext.hpp"
+#include "small_vector.hpp"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <concepts>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
+#include <cstddef>
 #include <cstdint>
 
 namespace msgplus
@@ -25,8 +34,12 @@ enum class type_t : std::uint8_t
     array_t   =  8,
     map_t     =  9,
     ext_t     = 10,
+    timestamp_t = 11,
+    typed_ext_t = 12,
 };
 
+struct value_less;
+
 class value
 {
   public:
@@ -38,15 +51,20 @@ class value
     using float32_type = float;
     using float64_type = double;
     using str_type     = std::string;
-    using bin_type     = std::vector<std::byte>;
+    // payloads up to 24 bytes (e.g. UUIDs) are stored without allocation
+    using bin_type     = small_vector<std::byte, 24>;
     using array_type   = std::vector<value>;
-    using map_type     = ordered_map<value, value>;
-    using ext_type     = std::pair<std::int8_t, std::vector<std::byte>>;
+    using map_type     = ordered_map<value, value, value_less>;
+    using ext_type     = std::pair<std::int8_t, bin_type>;
+    // the timestamp extension (type -1)
+    using timestamp_type = std::chrono::sys_time<std::chrono::nanoseconds>;
+    // an extension decoded by a registered codec
+    using typed_ext_type = typed_ext;
 
   public:
 
     value(): value_(nil_type{}) {}
-    ~value() = default;
+    ~value() {this->release_nested();}
     value(const value&) = default;
     value(value&&)      = default;
     value& operator=(const value&) = default;
@@ -68,6 +86,8 @@ class value
     value(array_type   v): value_(std::move(v)) {}
     value(map_type     v): value_(std::move(v)) {}
     value(ext_type     v): value_(std::move(v)) {}
+    value(timestamp_type v): value_(std::move(v)) {}
+    value(typed_ext_type v): value_(std::move(v)) {}
 
     value& operator=(nil_type     v) { value_ = std::move(v); return *this;}
     value& operator=(bool_type    v) { value_ = std::move(v); return *this;}
@@ -84,6 +104,8 @@ class value
     value& operator=(array_type   v) { value_ = std::move(v); return *this;}
     value& operator=(map_type     v) { value_ = std::move(v); return *this;}
     value& operator=(ext_type     v) { value_ = std::move(v); return *this;}
+    value& operator=(timestamp_type v) { value_ = std::move(v); return *this;}
+    value& operator=(typed_ext_type v) { value_ = std::move(v); return *this;}
 
     type_t type() const noexcept {return static_cast<type_t>(value_.index());}
 
@@ -98,6 +120,8 @@ class value
     bool is_array  () const noexcept {return value_.index() ==  8;}
     bool is_map    () const noexcept {return value_.index() ==  9;}
     bool is_ext    () const noexcept {return value_.index() == 10;}
+    bool is_timestamp() const noexcept {return value_.index() == 11;}
+    bool is_typed_ext() const noexcept {return value_.index() == 12;}
 
     nil_type    & as_nil    () {return std::get< 0>(value_);}
     bool_type   & as_bool   () {return std::get< 1>(value_);}
@@ -110,6 +134,8 @@ class value
     array_type  & as_array  () {return std::get< 8>(value_);}
     map_type    & as_map    () {return std::get< 9>(value_);}
     ext_type    & as_ext    () {return std::get<10>(value_);}
+    timestamp_type& as_timestamp() {return std::get<11>(value_);}
+    typed_ext_type& as_typed_ext() {return std::get<12>(value_);}
 
     nil_type     const& as_nil    () const {return std::get< 0>(value_);}
     bool_type    const& as_bool   () const {return std::get< 1>(value_);}
@@ -122,6 +148,8 @@ class value
     array_type   const& as_array  () const {return std::get< 8>(value_);}
     map_type     const& as_map    () const {return std::get< 9>(value_);}
     ext_type     const& as_ext    () const {return std::get<10>(value_);}
+    timestamp_type const& as_timestamp() const {return std::get<11>(value_);}
+    typed_ext_type const& as_typed_ext() const {return std::get<12>(value_);}
 
     nil_type    * try_nil    () {return std::get_if< 0>(std::addressof(value_));}
     bool_type   * try_bool   () {return std::get_if< 1>(std::addressof(value_));}
@@ -134,6 +162,8 @@ class value
     array_type  * try_array  () {return std::get_if< 8>(std::addressof(value_));}
     map_type    * try_map    () {return std::get_if< 9>(std::addressof(value_));}
     ext_type    * try_ext    () {return std::get_if<10>(std::addressof(value_));}
+    timestamp_type* try_timestamp() {return std::get_if<11>(std::addressof(value_));}
+    typed_ext_type* try_typed_ext() {return std::get_if<12>(std::addressof(value_));}
 
     nil_type     const* try_nil    () const {return std::get_if< 0>(std::addressof(value_));}
     bool_type    const* try_bool   () const {return std::get_if< 1>(std::addressof(value_));}
@@ -146,6 +176,8 @@ class value
     array_type   const* try_array  () const {return std::get_if< 8>(std::addressof(value_));}
     map_type     const* try_map    () const {return std::get_if< 9>(std::addressof(value_));}
     ext_type     const* try_ext    () const {return std::get_if<10>(std::addressof(value_));}
+    timestamp_type const* try_timestamp() const {return std::get_if<11>(std::addressof(value_));}
+    typed_ext_type const* try_typed_ext() const {return std::get_if<12>(std::addressof(value_));}
 
     bool operator==(const value& rhs) const noexcept {return this->value_ == rhs.value_;}
     bool operator!=(const value& rhs) const noexcept {return this->value_ != rhs.value_;}
@@ -160,6 +192,19 @@ class value
         swap(this->value_, other.value_);
     }
 
+    // true if this is a non-empty array or map
+    bool has_elements() const noexcept
+    {
+        if(const auto* arr = this->try_array()) {return ! arr->empty();}
+        if(const auto* map = this->try_map())   {return ! map->empty();}
+        return false;
+    }
+
+  private:
+
+    void release_nested() noexcept;
+    void release_in_place() noexcept;
+
   private:
 
     std::variant<
@@ -173,7 +218,9 @@ class value
         bin_type    ,
         array_type  ,
         map_type    ,
-        ext_type
+        ext_type    ,
+        timestamp_type,
+        typed_ext_type
     > value_;
 };
 
@@ -188,6 +235,239 @@ using bin_type     = value::bin_type    ;
 using array_type   = value::array_type  ;
 using map_type     = value::map_type    ;
 using ext_type     = value::ext_type    ;
+using timestamp_type = value::timestamp_type;
+using typed_ext_type = value::typed_ext_type;
+
+namespace detail
+{
+
+template<typename K>
+concept value_string_key = std::convertible_to<const K&, std::string_view> &&
+    ( ! std::same_as<K, value>);
+
+template<typename K>
+concept value_int_key = std::signed_integral<K>;
+
+template<typename K>
+concept value_uint_key = std::unsigned_integral<K> && ( ! std::same_as<K, bool>);
+
+// Values nested up to this depth are destroyed by the recursive destructor
+// calls. Deeper ones are torn down through a worklist.
+inline constexpr std::size_t recursive_release_depth = 64;
+
+// the depth of the value being destroyed on this thread
+inline thread_local std::size_t release_depth = 0;
+
+} // detail
+
+// `operator<` that also compares a value with strings and integers as if they
+// were converted into a value. Maps use it, so `m.at("key")` does not
+// construct a temporary value.
+struct value_less
+{
+    using is_transparent = void;
+
+    bool operator()(const value& lhs, const value& rhs) const noexcept
+    {
+        return lhs < rhs;
+    }
+
+    template<detail::value_string_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        if(const auto* s = lhs.try_str())
+        {
+            return std::string_view(*s) < std::string_view(rhs);
+        }
+        return lhs.type() < type_t::str_t;
+    }
+    template<detail::value_string_key K>
+    bool operator()(const K& lhs, const value& rhs) const noexcept
+    {
+        if(const auto* s = rhs.try_str())
+        {
+            return std::string_view(lhs) < std::string_view(*s);
+        }
+        return type_t::str_t < rhs.type();
+    }
+
+    template<detail::value_int_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        if(const auto* i = lhs.try_int())
+        {
+            return *i < static_cast<std::int64_t>(rhs);
+        }
+        return lhs.type() < type_t::int_t;
+    }
+    template<detail::value_int_key K>
+    bool operator()(const K& lhs, const value& rhs) const noexcept
+    {
+        if(const auto* i = rhs.try_int())
+        {
+            return static_cast<std::int64_t>(lhs) < *i;
+        }
+        return type_t::int_t < rhs.type();
+    }
+
+    template<detail::value_uint_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        if(const auto* u = lhs.try_uint())
+        {
+            return *u < static_cast<std::uint64_t>(rhs);
+        }
+        return lhs.type() < type_t::uint_t;
+    }
+    template<detail::value_uint_key K>
+    bool operator()(const K& lhs, const value& rhs) const noexcept
+    {
+        if(const auto* u = rhs.try_uint())
+        {
+            return static_cast<std::uint64_t>(lhs) < *u;
+        }
+        return type_t::uint_t < rhs.type();
+    }
+};
+
+// Destroys a value with nested arrays or maps. Shallow values are destroyed
+// by the ordinary recursive destructor calls, which need no memory. Beyond
+// `recursive_release_depth`, the nested containers are torn down through a
+// worklist instead, so that a deeply nested value does not exhaust the call
+// stack.
+inline void value::release_nested() noexcept
+{
+    const auto has_nested = [](const value& v) {
+        if(const auto* arr = v.try_array())
+        {
+            return std::any_of(arr->begin(), arr->end(),
+                    [](const value& e) {return e.has_elements();});
+        }
+        if(const auto* map = v.try_map())
+        {
+            return std::any_of(map->begin(), map->end(),
+                    [](const auto& kv) {return kv.first.has_elements() ||
+                                               kv.second.has_elements();});
+        }
+        return false;
+    };
+    if( ! has_nested(*this)) {return;}
+
+    if(detail::release_depth < detail::recursive_release_depth)
+    {
+        detail::release_depth += 1;
+        value_.emplace<nil_type>(); // the elements release their own children
+        detail::release_depth -= 1;
+        return;
+    }
+
+    try
+    {
+        std::vector<value> pending;
+        const auto collect = [&pending](value& v) {
+            if(auto* arr = v.try_array())
+            {
+                for(auto& e : *arr)
+                {
+                    if(e.has_elements()) {pending.push_back(std::move(e));}
+                }
+            }
+            else if(auto* map = v.try_map())
+            {
+                for(auto& [k, e] : *map)
+                {
+                    if(k.has_elements()) {pending.push_back(std::move(k));}
+                    if(e.has_elements()) {pending.push_back(std::move(e));}
+                }
+            }
+        };
+
+        collect(*this);
+        while( ! pending.empty())
+        {
+            value v = std::move(pending.back());
+            pending.pop_back();
+            collect(v);
+        } // `v` has no nested elements left when it is destroyed here
+    }
+    catch(...)
+    {
+        // out of memory. what has been moved to `pending` is released by
+        // its destructor, and the rest is released without a worklist.
+        this->release_in_place();
+    }
+    return;
+}
+
+// Releases the nested containers without recursion and without allocation.
+// It goes down to a container whose elements have no elements, clears it,
+// and goes back up. Only the last few containers on the way down are
+// remembered; when they run out, it starts over from the top, so a very deep
+// value takes quadratic time. It is the fallback when a worklist cannot be
+// allocated.
+inline void value::release_in_place() noexcept
+{
+    struct frame
+    {
+        value*              v    = nullptr;
+        std::size_t         next = 0; // the next element of an array
+        map_type::iterator  pair;     // the next pair of a map
+    };
+    const auto make_frame = [](value* v) {
+        frame f;
+        f.v = v;
+        if(auto* map = v->try_map()) {f.pair = map->begin();}
+        return f;
+    };
+    // the next element that has elements, or nullptr
+    const auto next_nested = [](frame& f) -> value* {
+        if(auto* arr = f.v->try_array())
+        {
+            for(; f.next < arr->size(); ++f.next)
+            {
+                if((*arr)[f.next].has_elements()) {return std::addressof((*arr)[f.next]);}
+            }
+        }
+        else if(auto* map = f.v->try_map())
+        {
+            for(; f.pair != map->end(); ++f.pair)
+            {
+                if(f.pair->first .has_elements()) {return std::addressof(f.pair->first);}
+                if(f.pair->second.has_elements()) {return std::addressof(f.pair->second);}
+            }
+        }
+        return nullptr;
+    };
+
+    constexpr std::size_t max_frames = 32;
+    std::array<frame, max_frames> frames;
+
+    bool forgotten = true; // if the frame of `this` has been overwritten
+    while(forgotten)
+    {
+        forgotten = false;
+        std::size_t top   = 0;
+        std::size_t count = 1;
+        frames[top] = make_frame(this);
+        while(count != 0)
+        {
+            if(value* child = next_nested(frames[top]))
+            {
+                top = (top + 1) % max_frames;
+                if(count == max_frames) {forgotten = true;} else {count += 1;}
+                frames[top] = make_frame(child);
+                continue;
+            }
+            if(frames[top].v != this)
+            {
+                frames[top].v->value_.emplace<nil_type>(); // its elements are flat
+            }
+            top    = (top + max_frames - 1) % max_frames;
+            count -= 1;
+        }
+    }
+    return;
+}
 
 inline void swap(value& lhs, value& rhs) noexcept
 {
@@ -3,8 +3,15 @@
 
 #include "value.hpp"
 #include "writer.hpp"
+#include "small_vector.hpp"
+#include "stats.hpp"
 
+#include <array>
 #include <bit>
+#include <chrono>
+#include <limits>
+#include <span>
+#include <vector>
 
 namespace msgplus
 {
@@ -34,10 +41,6 @@ bool write_as_big_endian(W& writer, T x)
 }
 } // detail
 
-// forward decl
-template<Writer W>
-bool write(W& writer, const value& v);
-
 template<Writer W>
 bool write(W& writer, const nil_type&)
 {
@@ -228,135 +231,497 @@ bool write(W& writer, const bin_type& x)
     return writer.write_bytes(x.data(), x.size());
 }
 
+namespace detail
+{
+// writes the tag, the length and the type of an extension
 template<Writer W>
-bool write(W& writer, const array_type& x)
+bool write_ext_header(W& writer, const std::int8_t type, const std::size_t size)
 {
-    if(x.size() <= 15)
+    if(size == 1)
     {
-        const std::uint8_t tag = 0b1001'0000 |
-            static_cast<std::uint8_t>(x.size() & 0b0000'1111);
-        if( ! writer.write_byte(static_cast<std::byte>(tag))) {return false;}
+        if( ! writer.write_byte(static_cast<std::byte>(0xD4))) {return false;}
     }
-    else if(x.size() <= std::numeric_limits<std::uint16_t>::max())
+    else if(size == 2)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xDC))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(x.size()))) {return false;}
+        if( ! writer.write_byte(static_cast<std::byte>(0xD5))) {return false;}
     }
-    else if(x.size() <= std::numeric_limits<std::uint32_t>::max())
+    else if(size == 4)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xDD))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(x.size()))) {return false;}
+        if( ! writer.write_byte(static_cast<std::byte>(0xD6))) {return false;}
+    }
+    else if(size == 8)
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xD7))) {return false;}
+    }
+    else if(size == 16)
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xD8))) {return false;}
+    }
+    else if(size <= std::numeric_limits<std::uint8_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xC7))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint8_t>(size))) {return false;}
+    }
+    else if(size <= std::numeric_limits<std::uint16_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xC8))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(size))) {return false;}
+    }
+    else if(size <= std::numeric_limits<std::uint32_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xC9))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(size))) {return false;}
     }
     else
     {
         return false;
     }
+    return writer.write_byte(static_cast<std::byte>(type));
+}
+} // detail
+
+template<Writer W>
+bool write(W& writer, const ext_type& x)
+{
+    if( ! detail::write_ext_header(writer, x.first, x.second.size())) {return false;}
+    return writer.write_bytes(x.second.data(), x.second.size());
+}
+
+// The payload is encoded before anything is written, so a codec failure
+// leaves the writer untouched.
+template<Writer W>
+bool write(W& writer, const typed_ext_type& x)
+{
+    const auto size = x.encoded_size();
 
-    for(const auto& elem : x)
+    std::array<std::byte, 64> buf;
+    std::vector<std::byte>    heap;
+    std::span<std::byte>      payload(buf.data(), size <= buf.size() ? size : 0);
+    if(buf.size() < size)
     {
-        if( ! write(writer, elem)) {return false;}
+        heap.resize(size);
+        payload = heap;
     }
-    return true;
+    if( ! x.encode(payload)) {return false;}
+
+    if( ! detail::write_ext_header(writer, x.type(), size)) {return false;}
+    return writer.write_bytes(payload.data(), payload.size());
 }
 
+// Writes the timestamp extension in the smallest of its three forms.
 template<Writer W>
-bool write(W& writer, const map_type& x)
+bool write(W& writer, const timestamp_type& x)
 {
-    if(x.size() <= 15)
+    constexpr std::int64_t giga = 1'000'000'000;
+    const auto count = x.time_since_epoch().count();
+
+    // rounded toward negative infinity, so that nsec is in [0, 1e9)
+    std::int64_t sec  = count / giga;
+    std::int64_t nsec = count % giga;
+    if(nsec < 0)
     {
-        const std::uint8_t tag = 0b1000'0000 |
-            static_cast<std::uint8_t>(x.size() & 0b0000'1111);
-        if( ! writer.write_byte(static_cast<std::byte>(tag))) {return false;}
+        sec  -= 1;
+        nsec += giga;
     }
-    else if(x.size() <= std::numeric_limits<std::uint16_t>::max())
+
+    if(0 <= sec && (static_cast<std::uint64_t>(sec) >> 34) == 0)
+    {
+        if(nsec == 0 && sec <= std::numeric_limits<std::uint32_t>::max()) // timestamp 32
+        {
+            if( ! writer.write_byte(static_cast<std::byte>(0xD6))) {return false;}
+            if( ! writer.write_byte(static_cast<std::byte>(0xFF))) {return false;}
+            return detail::write_as_big_endian(writer, static_cast<std::uint32_t>(sec));
+        }
+        else // timestamp 64
+        {
+            const auto data = (static_cast<std::uint64_t>(nsec) << 34) |
+                               static_cast<std::uint64_t>(sec);
+            if( ! writer.write_byte(static_cast<std::byte>(0xD7))) {return false;}
+            if( ! writer.write_byte(static_cast<std::byte>(0xFF))) {return false;}
+            return detail::write_as_big_endian(writer, data);
+        }
+    }
+    else // timestamp 96
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xC7))) {return false;}
+        if( ! writer.write_byte(static_cast<std::byte>(12)))   {return false;}
+        if( ! writer.write_byte(static_cast<std::byte>(0xFF))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(nsec))) {return false;}
+        return detail::write_as_big_endian(writer, sec);
+    }
+}
+
+namespace detail
+{
+template<Writer W>
+bool write_array_header(W& writer, const std::size_t size)
+{
+    if(size <= 15)
+    {
+        const std::uint8_t tag = 0b1001'0000 |
+            static_cast<std::uint8_t>(size & 0b0000'1111);
+        return writer.write_byte(static_cast<std::byte>(tag));
+    }
+    else if(size <= std::numeric_limits<std::uint16_t>::max())
     {
         if( ! writer.write_byte(static_cast<std::byte>(0xDC))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(x.size()))) {return false;}
+        return detail::write_as_big_endian(writer, static_cast<std::uint16_t>(size));
     }
-    else if(x.size() <= std::numeric_limits<std::uint32_t>::max())
+    else if(size <= std::numeric_limits<std::uint32_t>::max())
     {
         if( ! writer.write_byte(static_cast<std::byte>(0xDD))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(x.size()))) {return false;}
+        return detail::write_as_big_endian(writer, static_cast<std::uint32_t>(size));
     }
     else
     {
         return false;
     }
-    for(const auto& [k, v] : x)
+}
+
+template<Writer W>
+bool write_map_header(W& writer, const std::size_t size)
+{
+    if(size <= 15)
+    {
+        const std::uint8_t tag = 0b1000'0000 |
+            static_cast<std::uint8_t>(size & 0b0000'1111);
+        return writer.write_byte(static_cast<std::byte>(tag));
+    }
+    else if(size <= std::numeric_limits<std::uint16_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xDE))) {return false;}
+        return detail::write_as_big_endian(writer, static_cast<std::uint16_t>(size));
+    }
+    else if(size <= std::numeric_limits<std::uint32_t>::max())
     {
-        if( ! write(writer, k)) {return false;}
-        if( ! write(writer, v)) {return false;}
+        if( ! writer.write_byte(static_cast<std::byte>(0xDF))) {return false;}
+        return detail::write_as_big_endian(writer, static_cast<std::uint32_t>(size));
+    }
+    else
+    {
+        return false;
     }
-    return true;
 }
-
+// Forwards to a writer and counts the bytes written, for stats.
 template<Writer W>
-bool write(W& writer, const ext_type& x)
+class counting_writer
 {
-    if(x.second.size() == 1)
+  public:
+
+    explicit counting_writer(W& w) noexcept: writer_(w), count_(0) {}
+
+    std::size_t count() const noexcept {return count_;}
+
+    bool is_ok() const {return writer_.is_ok();}
+
+    bool write_byte(std::byte b)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xD4))) {return false;}
+        const bool ok = writer_.write_byte(b);
+        if(ok) {count_ += 1;}
+        return ok;
     }
-    else if(x.second.size() == 2)
+    bool write_bytes(const std::byte* ptr, const std::size_t len)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xD5))) {return false;}
+        const bool ok = writer_.write_bytes(ptr, len);
+        if(ok) {count_ += len;}
+        return ok;
+    }
+
+  private:
+
+    W&          writer_;
+    std::size_t count_;
+};
+
+} // detail
+
+// Encodes values without recursion. Arrays and maps that are being written
+// are kept on an explicit stack, so the nesting depth is bounded by
+// `max_depth()` instead of the size of the call stack. The stack keeps its
+// capacity between calls; reuse an encoder to avoid reallocating it.
+class encoder
+{
+  public:
+
+    static constexpr std::size_t default_max_depth = 1024;
+
+  public:
+
+    encoder() = default;
+    ~encoder() = default;
+    encoder(const encoder&) = default;
+    encoder(encoder&&)      = default;
+    encoder& operator=(const encoder&) = default;
+    encoder& operator=(encoder&&)      = default;
+
+    explicit encoder(const std::size_t max_depth): max_depth_(max_depth) {}
+
+    std::size_t max_depth() const noexcept {return max_depth_;}
+    void set_max_depth(const std::size_t d) noexcept {max_depth_ = d;}
+
+    template<Writer W>
+    bool write(W& writer, const value& v)
+    {
+        no_stats stats;
+        return this->write_impl(writer, v, stats);
     }
-    else if(x.second.size() == 4)
+    template<Writer W>
+    bool write(W& writer, const array_type& x)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xD6))) {return false;}
+        no_stats stats;
+        return this->write_impl(writer, x, stats);
     }
-    else if(x.second.size() == 8)
+    template<Writer W>
+    bool write(W& writer, const map_type& x)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xD7))) {return false;}
+        no_stats stats;
+        return this->write_impl(writer, x, stats);
     }
-    else if(x.second.size() == 16)
+
+    // counts what is encoded into `stats`
+    template<Writer W, CodecStats S>
+    bool write(W& writer, const value& v, S& stats)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xD8))) {return false;}
+        return this->write_impl(writer, v, stats);
     }
-    else if(x.second.size() <= std::numeric_limits<std::uint8_t>::max())
+    template<Writer W, CodecStats S>
+    bool write(W& writer, const array_type& x, S& stats)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xC7))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint8_t>(x.second.size()))) {return false;}
+        return this->write_impl(writer, x, stats);
     }
-    else if(x.second.size() <= std::numeric_limits<std::uint16_t>::max())
+    template<Writer W, CodecStats S>
+    bool write(W& writer, const map_type& x, S& stats)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xC8))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(x.second.size()))) {return false;}
+        return this->write_impl(writer, x, stats);
     }
-    else if(x.second.size() <= std::numeric_limits<std::uint32_t>::max())
+
+  private:
+
+    template<Writer W, typename T, CodecStats S>
+    bool write_impl(W& writer, const T& x, S& stats)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xC9))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(x.second.size()))) {return false;}
+        if constexpr(S::enabled)
+        {
+            detail::call_timer<S> timer(stats);
+            detail::counting_writer<W> counter(writer);
+            return this->write_root(counter, x, stats);
+        }
+        else
+        {
+            return this->write_root(writer, x, stats);
+        }
     }
-    else
+
+    template<Writer W, CodecStats S>
+    bool write_root(W& writer, const value& v, S& stats)
     {
-        return false;
+        this->stack_.clear();
+        return this->write_one(writer, v, stats) && this->write_children(writer, stats);
     }
-    if( ! writer.write_byte(static_cast<std::byte>(x.first))) {return false;}
-    return writer.write_bytes(x.second.data(), x.second.size());
+    template<Writer W, CodecStats S>
+    bool write_root(W& writer, const array_type& x, S& stats)
+    {
+        this->stack_.clear();
+        return this->open_array(writer, x, stats) && this->write_children(writer, stats);
+    }
+    template<Writer W, CodecStats S>
+    bool write_root(W& writer, const map_type& x, S& stats)
+    {
+        this->stack_.clear();
+        return this->open_map(writer, x, stats) && this->write_children(writer, stats);
+    }
+
+    template<Writer W, CodecStats S>
+    bool open_array(W& writer, const array_type& x, S& stats)
+    {
+        if(this->max_depth_ <= this->stack_.size()) {return false;}
+
+        [[maybe_unused]] std::size_t start = 0;
+        if constexpr(S::enabled) {start = writer.count();}
+
+        if( ! detail::write_array_header(writer, x.size())) {return false;}
+
+        if constexpr(S::enabled)
+        {
+            stats.count_object(type_t::array_t, writer.count() - start);
+            stats.count_container(type_t::array_t, x.size(), this->stack_.size() + 1);
+        }
+        if( ! x.empty())
+        {
+            frame f;
+            f.is_map    = false;
+            f.array_cur = x.begin();
+            f.array_end = x.end();
+            this->stack_.push_back(f);
+        }
+        return true;
+    }
+    template<Writer W, CodecStats S>
+    bool open_map(W& writer, const map_type& x, S& stats)
+    {
+        if(this->max_depth_ <= this->stack_.size()) {return false;}
+
+        [[maybe_unused]] std::size_t start = 0;
+        if constexpr(S::enabled) {start = writer.count();}
+
+        if( ! detail::write_map_header(writer, x.size())) {return false;}
+
+        if constexpr(S::enabled)
+        {
+            stats.count_object(type_t::map_t, writer.count() - start);
+            stats.count_container(type_t::map_t, x.size(), this->stack_.size() + 1);
+        }
+        if( ! x.empty())
+        {
+            frame f;
+            f.is_map  = true;
+            f.map_cur = x.begin();
+            f.map_end = x.end();
+            this->stack_.push_back(f);
+        }
+        return true;
+    }
+
+    // writes a scalar, or the header of a container and pushes it
+    template<Writer W, CodecStats S>
+    bool write_one(W& writer, const value& v, S& stats)
+    {
+        if constexpr(S::enabled)
+        {
+            if( ! v.is_array() && ! v.is_map())
+            {
+                const auto start = writer.count();
+                no_stats none;
+                if( ! this->write_one(writer, v, none)) {return false;}
+                stats.count_object(v.type(), writer.count() - start);
+                return true;
+            }
+        }
+
+        using enum type_t;
+        switch(v.type())
+        {
+            case nil_t     : {return msgplus::write(writer, v.as_nil    ());}
+            case bool_t    : {return msgplus::write(writer, v.as_bool   ());}
+            case int_t     : {return msgplus::write(writer, v.as_int    ());}
+            case uint_t    : {return msgplus::write(writer, v.as_uint   ());}
+            case float32_t : {return msgplus::write(writer, v.as_float32());}
+            case float64_t : {return msgplus::write(writer, v.as_float64());}
+            case str_t     : {return msgplus::write(writer, v.as_str    ());}
+            case bin_t     : {return msgplus::write(writer, v.as_bin    ());}
+            case array_t   : {return this->open_array(writer, v.as_array(), stats);}
+            case map_t     : {return this->open_map  (writer, v.as_map  (), stats);}
+            case ext_t     : {return msgplus::write(writer, v.as_ext    ());}
+            case timestamp_t: {return msgplus::write(writer, v.as_timestamp());}
+            case typed_ext_t: {return msgplus::write(writer, v.as_typed_ext());}
+            default:         {return false;}
+        }
+    }
+
+    // writes the remaining elements of all the open containers
+    template<Writer W, CodecStats S>
+    bool write_children(W& writer, S& stats)
+    {
+        while( ! this->stack_.empty())
+        {
+            auto& top = this->stack_.back();
+            const value* next = nullptr;
+            if( ! top.is_map)
+            {
+                if(top.array_cur == top.array_end)
+                {
+                    this->stack_.pop_back();
+                    continue;
+                }
+                next = std::addressof(*top.array_cur);
+                ++top.array_cur;
+            }
+            else
+            {
+                if(top.map_cur == top.map_end)
+                {
+                    this->stack_.pop_back();
+                    continue;
+                }
+                if( ! top.key_written)
+                {
+                    next = std::addressof(top.map_cur->first);
+                    top.key_written = true;
+                }
+                else
+                {
+                    next = std::addressof(top.map_cur->second);
+                    top.key_written = false;
+                    ++top.map_cur;
+                }
+            }
+            // `top` may be invalidated here
+            if( ! this->write_one(writer, *next, stats))
+            {
+                this->stack_.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+
+    struct frame
+    {
+        bool is_map      = false;
+        bool key_written = false;
+        array_type::const_iterator array_cur;
+        array_type::const_iterator array_end;
+        map_type::const_iterator   map_cur;
+        map_type::const_iterator   map_end;
+    };
+
+  private:
+
+    std::size_t                   max_depth_ = default_max_depth;
+    detail::small_stack<frame, 8> stack_; // shallow values need no allocation
+};
+
+template<Writer W>
+bool write(W& writer, const array_type& x)
+{
+    encoder enc;
+    return enc.write(writer, x);
+}
+
+template<Writer W>
+bool write(W& writer, const map_type& x)
+{
+    encoder enc;
+    return enc.write(writer, x);
+}
+
+template<Writer W>
+bool write(W& writer, const value& v, encoder& enc)
+{
+    return enc.write(writer, v);
 }
 
 template<Writer W>
 bool write(W& writer, const value& v)
 {
-    using enum type_t;
-    switch(v.type())
-    {
-        case nil_t     : {return write(writer, v.as_nil    ());}
-        case bool_t    : {return write(writer, v.as_bool   ());}
-        case int_t     : {return write(writer, v.as_int    ());}
-        case uint_t    : {return write(writer, v.as_uint   ());}
-        case float32_t : {return write(writer, v.as_float32());}
-        case float64_t : {return write(writer, v.as_float64());}
-        case str_t     : {return write(writer, v.as_str    ());}
-        case bin_t     : {return write(writer, v.as_bin    ());}
-        case array_t   : {return write(writer, v.as_array  ());}
-        case map_t     : {return write(writer, v.as_map    ());}
-        case ext_t     : {return write(writer, v.as_ext    ());}
-        default:         {return false;}
-    }
+    encoder enc;
+    return enc.write(writer, v);
+}
+
+template<Writer W, CodecStats S>
+bool write(W& writer, const value& v, S& stats)
+{
+    encoder enc;
+    return enc.write(writer, v, stats);
 }
 
+template<Writer W, CodecStats S>
+bool write(W& writer, const value& v, encoder& enc, S& stats)
+{
+    return enc.write(writer, v, stats);
+}
 
 } // msgplus
 #endif//MSGPLUS_WRITE_HPP
@@ -4,6 +4,9 @@
 #include <concepts>
 #include <filesystem>
 #include <fstream>
+#include <span>
+#include <utility>
+#include <vector>
 
 namespace msgplus
 {
@@ -43,5 +46,45 @@ class file_writer
 
 static_assert(Writer<file_writer>);
 
+// Appends to a buffer that it owns.
+class memory_writer
+{
+  public:
+
+    memory_writer() = default;
+    explicit memory_writer(const std::size_t capacity)
+    {
+        buf_.reserve(capacity);
+    }
+
+    bool is_ok() const noexcept {return true;}
+
+    bool write_byte(std::byte b)
+    {
+        buf_.push_back(b);
+        return true;
+    }
+    bool write_bytes(const std::byte* ptr, const std::size_t len)
+    {
+        if(ptr) {buf_.insert(buf_.end(), ptr, ptr + len);}
+        return true;
+    }
+
+    std::span<const std::byte> buffer() const noexcept {return buf_;}
+    std::size_t size() const noexcept {return buf_.size();}
+
+    // empties the buffer, keeping its capacity
+    void clear() noexcept {buf_.clear();}
+
+    // moves the buffer out and leaves this writer empty
+    std::vector<std::byte> release() noexcept {return std::exchange(buf_, {});}
+
+  private:
+
+    std::vector<std::byte> buf_;
+};
+
+static_assert(Writer<memory_writer>);
+
 } // msgplus
 #endif//MSGPLUS_WRITER_HPP
@@ -4,6 +4,9 @@
 #include <concepts>
 #include <filesystem>
 #include <fstream>
+#include <span>
+#include <utility>
+#include <vector>
 
 namespace msgplus
 {
@@ -43,18 +46,62 @@ class file_writer
 
 static_assert(Writer<file_writer>);
 
+// Appends to a buffer that it owns.
+class memory_writer
+{
+  public:
+
+    memory_writer() = default;
+    explicit memory_writer(const std::size_t capacity)
+    {
+        buf_.reserve(capacity);
+    }
+
+    bool is_ok() const noexcept {return true;}
+
+    bool write_byte(std::byte b)
+    {
+        buf_.push_back(b);
+        return true;
+    }
+    bool write_bytes(const std::byte* ptr, const std::size_t len)
+    {
+        if(ptr) {buf_.insert(buf_.end(), ptr, ptr + len);}
+        return true;
+    }
+
+    std::span<const std::byte> buffer() const noexcept {return buf_;}
+    std::size_t size() const noexcept {return buf_.size();}
+
+    // empties the buffer, keeping its capacity
+    void clear() noexcept {buf_.clear();}
+
+    // moves the buffer out and leaves this writer empty
+    std::vector<std::byte> release() noexcept {return std::exchange(buf_, {});}
+
+  private:
+
+    std::vector<std::byte> buf_;
+};
+
+static_assert(Writer<memory_writer>);
+
 } // msgplus
 #endif//MSGPLUS_WRITER_HPP
 #ifndef MSGPLUS_READER_HPP
 #define MSGPLUS_READER_HPP
 
+#include <algorithm>
 #include <array>
 #include <concepts>
 #include <filesystem>
 #include <fstream>
+#include <span>
 #include <vector>
 #include <optional>
 
+#include <cstring>
+
 namespace msgplus
 {
 
@@ -111,6 +158,16 @@ class file_reader
         return retval;
     }
 
+    // reads up to `out.size()` bytes and returns the number of bytes read.
+    // it is less than `out.size()` only at the end of the file.
+    std::size_t read_some(std::span<std::byte> out)
+    {
+        if(this->is_eof() || !this->is_ok()) {return 0;}
+
+        file_.read(reinterpret_cast<char*>(out.data()), static_cast<std::streamsize>(out.size()));
+        return static_cast<std::size_t>(file_.gcount());
+    }
+
   private:
 
     std::ifstream file_;
@@ -118,19 +175,160 @@ class file_reader
 
 static_assert(Reader<file_reader>);
 
+// Reads from a contiguous buffer. It does not own the buffer.
+//
+// In addition to the Reader requirements, it provides
+// - `skip_bytes(n)`, which advances the position without copying, and
+// - `read_view(n)`, which returns the next n bytes without copying them,
+// - `read_into(out)`, which copies the next `out.size()` bytes into `out`, and
+// - `read_some(out)`, which reads what is left, up to `out.size()` bytes.
+// The library uses them if a reader has them.
+class memory_reader
+{
+  public:
+
+    explicit memory_reader(std::span<const std::byte> buf) noexcept
+        : buf_(buf), pos_(0), ok_(true)
+    {}
+
+    bool is_ok()  const noexcept {return ok_;}
+    bool is_eof() const noexcept {return buf_.size() <= pos_;}
+
+    std::optional<std::byte> read_byte() noexcept
+    {
+        if( ! this->has(1)) {return std::nullopt;}
+        return buf_[pos_++];
+    }
+
+    template<std::size_t N>
+    std::optional<std::array<std::byte, N>> read_bytes() noexcept
+    {
+        if( ! this->has(N)) {return std::nullopt;}
+
+        std::array<std::byte, N> retval;
+        std::memcpy(retval.data(), buf_.data() + pos_, N);
+        pos_ += N;
+        return retval;
+    }
+
+    std::optional<std::vector<std::byte>> read_bytes(std::size_t N)
+    {
+        if( ! this->has(N)) {return std::nullopt;}
+
+        std::vector<std::byte> retval(buf_.data() + pos_, buf_.data() + pos_ + N);
+        pos_ += N;
+        return retval;
+    }
+
+    std::optional<std::span<const std::byte>> read_view(std::size_t N) noexcept
+    {
+        if( ! this->has(N)) {return std::nullopt;}
+
+        const auto retval = buf_.subspan(pos_, N);
+        pos_ += N;
+        return retval;
+    }
+
+    bool read_into(std::span<std::byte> out) noexcept
+    {
+        if( ! this->has(out.size())) {return false;}
+
+        if( ! out.empty())
+        {
+            std::memcpy(out.data(), buf_.data() + pos_, out.size());
+        }
+        pos_ += out.size();
+        return true;
+    }
+
+    std::size_t read_some(std::span<std::byte> out) noexcept
+    {
+        const auto n = std::min(out.size(), buf_.size() - pos_);
+        if(n != 0)
+        {
+            std::memcpy(out.data(), buf_.data() + pos_, n);
+        }
+        pos_ += n;
+        return n;
+    }
+
+    bool skip_bytes(std::size_t N) noexcept
+    {
+        if( ! this->has(N)) {return false;}
+        pos_ += N;
+        return true;
+    }
+
+    std::size_t position() const noexcept {return pos_;}
+    std::span<const std::byte> buffer() const noexcept {return buf_;}
+
+  private:
+
+    bool has(const std::size_t N) noexcept
+    {
+        if(buf_.size() - pos_ < N) // pos_ <= buf_.size() always holds
+        {
+            ok_ = false;
+            return false;
+        }
+        return true;
+    }
+
+  private:
+
+    std::span<const std::byte> buf_;
+    std::size_t                pos_;
+    bool                       ok_;
+};
+
+static_assert(Reader<memory_reader>);
+
 } // msgplus
 #endif//MSGPLUS_READER_HPP
 #ifndef MSGPLUS_FLAT_MAP_HPP
 #define MSGPLUS_FLAT_MAP_HPP
 
 #include <algorithm>
+#include <array>
+#include <concepts>
+#include <iterator>
+#include <optional>
 #include <stdexcept>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#include <cassert>
+
 namespace msgplus
 {
 
+namespace detail
+{
+
+// With a transparent comparator, `k` is used as is. Otherwise it is
+// converted into a Key (that is a no-op if it already is one).
+template<typename Key, typename Cmp, typename K>
+decltype(auto) lookup_key(const K& k)
+{
+    if constexpr(std::same_as<K, Key> || requires {typename Cmp::is_transparent;})
+    {
+        return (k);
+    }
+    else
+    {
+        return Key(k);
+    }
+}
+
+} // detail
+
+// indicates that the input is already sorted and has no duplicate keys
+struct sorted_unique_t { explicit sorted_unique_t() = default; };
+inline constexpr sorted_unique_t sorted_unique{};
+
+// If the input has duplicate keys, the first one is kept, as repeated
+// `insert`s do. `insert_or_assign` keeps the last one instead.
 template<typename Key, typename Value, typename Cmp = std::less<Key>,
          typename Allocator = std::allocator<std::pair<Key, Value>>>
 class flat_map
@@ -180,8 +378,9 @@ class flat_map
              allocator_type alloc = allocator_type{})
         : cmp_(std::move(cmp)), container_(std::move(init), std::move(alloc))
     {
-        std::sort(this->container_.begin(), this->container_.end(),
-                  value_compare{cmp_});
+        std::stable_sort(this->container_.begin(), this->container_.end(),
+                         value_compare{cmp_});
+        this->deduplicate(false);
     }
     template<typename InputIter>
     flat_map(InputIter begin, InputIter end,
@@ -189,8 +388,26 @@ class flat_map
              allocator_type alloc = allocator_type{})
         : cmp_(std::move(cmp)), container_(begin, end, std::move(alloc))
     {
-        std::sort(this->container_.begin(), this->container_.end(),
-                  value_compare{cmp_});
+        std::stable_sort(this->container_.begin(), this->container_.end(),
+                         value_compare{cmp_});
+        this->deduplicate(false);
+    }
+
+    // The input must be sorted by `cmp` and have no duplicate keys. It is
+    // taken as is, without sorting.
+    flat_map(sorted_unique_t, container_type sorted,
+             key_compare cmp = key_compare{})
+        : cmp_(std::move(cmp)), container_(std::move(sorted))
+    {
+        assert(this->is_sorted_unique());
+    }
+    template<typename InputIter>
+    flat_map(sorted_unique_t, InputIter begin, InputIter end,
+             key_compare cmp = key_compare{},
+             allocator_type alloc = allocator_type{})
+        : cmp_(std::move(cmp)), container_(begin, end, std::move(alloc))
+    {
+        assert(this->is_sorted_unique());
     }
 
     bool      empty()    const noexcept {return this->container_.empty()   ;}
@@ -199,6 +416,9 @@ class flat_map
 
     void clear() {return this->container_.clear();}
 
+    size_type capacity() const noexcept {return this->container_.capacity();}
+    void reserve(const size_type n) {this->container_.reserve(n);}
+
     iterator       begin()        noexcept {return this->container_.begin();}
     iterator       end()          noexcept {return this->container_.end();}
     const_iterator begin()  const noexcept {return this->container_.begin();}
@@ -207,13 +427,13 @@ class flat_map
     const_iterator cend()   const noexcept {return this->container_.cend();}
 
     template<typename K>
-    bool contains(const K& k)
+    bool contains(const K& k) const
     {
-        return std::binary_search(this->container_.begin(), this->container_.end(), k);
+        return this->find(k) != this->end();
     }
 
     template<typename K>
-    size_type count(const K& k)
+    size_type count(const K& k) const
     {
         if(this->contains(k)) {return 1;} else {return 0;}
     }
@@ -221,7 +441,7 @@ class flat_map
     mapped_type& operator[](key_type k)
     {
         const auto found = this->lower_bound(k);
-        if(found < this->end() && found->first == k)
+        if(this->is_equivalent(found, k))
         {
             return found->second;
         }
@@ -234,81 +454,83 @@ class flat_map
     template<typename K>
     mapped_type& at(const K& k)
     {
-        const auto found = this->lower_bound(k);
-        if(found < this->end() && found->first == k)
-        {
-            return found->second;
-        }
-        else
+        const auto found = this->find(k);
+        if(found == this->end())
         {
             throw std::out_of_range("flat_map::at()");
         }
+        return found->second;
     }
     template<typename K>
     mapped_type const& at(const K& k) const
     {
-        const auto found = this->lower_bound(k);
-        if(found < this->end() && found->first == k)
-        {
-            return found->second;
-        }
-        else
+        const auto found = this->find(k);
+        if(found == this->end())
         {
             throw std::out_of_range("flat_map::at()");
         }
+        return found->second;
     }
 
     template<typename K>
     iterator find(const K& k)
     {
-        const auto found = this->lower_bound(k);
-        if(found < this->end() && found->first == k)
-        {
-            return found;
-        }
-        else
-        {
-            return this->end();
-        }
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        const auto found = this->lower_bound(key);
+        return this->is_equivalent(found, key) ? found : this->end();
     }
     template<typename K>
     const_iterator find(const K& k) const
     {
-        const auto found = this->lower_bound(k);
-        if(found < this->end() && found->first == k)
-        {
-            return found;
-        }
-        else
-        {
-            return this->end();
-        }
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        const auto found = this->lower_bound(key);
+        return this->is_equivalent(found, key) ? found : this->end();
     }
 
     template<typename K>
     iterator lower_bound(const K& k)
     {
-        return std::lower_bound(this->begin(), this->end(), k,
-            [](const value_type& v, const key_type& k) {return v.first < k;});
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        return std::lower_bound(this->begin(), this->end(), key,
+            [this](const value_type& v, const auto& x) {return this->cmp_(v.first, x);});
     }
     template<typename K>
     const_iterator lower_bound(const K& k) const
     {
-        return std::lower_bound(this->begin(), this->end(), k,
-            [](const value_type& v, const key_type& k) {return v.first < k;});
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        return std::lower_bound(this->begin(), this->end(), key,
+            [this](const value_type& v, const auto& x) {return this->cmp_(v.first, x);});
     }
 
     template<typename K>
     iterator upper_bound(const K& k)
     {
-        return std::upper_bound(this->begin(), this->end(), k,
-            [](const value_type& v, const key_type& k) {return v.first < k;});
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        return std::upper_bound(this->begin(), this->end(), key,
+            [this](const auto& x, const value_type& v) {return this->cmp_(x, v.first);});
     }
     template<typename K>
     const_iterator upper_bound(const K& k) const
     {
-        return std::upper_bound(this->begin(), this->end(), k,
-            [](const value_type& v, const key_type& k) {return v.first < k;});
+        const auto& key = detail::lookup_key<key_type, key_compare>(k);
+        return std::upper_bound(this->begin(), this->end(), key,
+            [this](const auto& x, const value_type& v) {return this->cmp_(x, v.first);});
+    }
+
+    // Looks up a batch of keys sorted by the comparator, writing the iterator
+    // to each key (or end()) to `out` in the same order. The keys are searched
+    // in groups whose binary searches run interleaved, so that their cache
+    // misses overlap instead of queuing behind each other, and each group
+    // starts from where the previous one ended.
+    template<std::forward_iterator KeyIter, typename OutputIter>
+    OutputIter find_sorted(KeyIter first, KeyIter last, OutputIter out)
+    {
+        return this->find_sorted_impl(this->begin(), this->end(), first, last, out);
+    }
+    template<std::forward_iterator KeyIter, typename OutputIter>
+    OutputIter find_sorted(KeyIter first, KeyIter last, OutputIter out) const
+    {
+        return this->find_sorted_impl(this->begin(), this->end(), first, last, out);
     }
 
     template<typename ... Args>
@@ -320,32 +542,96 @@ class flat_map
     std::pair<iterator, bool> insert(value_type v)
     {
         const auto found = this->lower_bound(v.first);
-        if(found < this->end() && found->first == v.first)
+        if(this->is_equivalent(found, v.first))
         {
             return std::make_pair(found, false);
         }
         else
         {
-            const auto idx = std::distance(container_.begin(), found);
-            container_.insert(std::move(v));
-            return std::make_pair(std::next(this->container_.begin(), idx), true);
+            return std::make_pair(container_.insert(found, std::move(v)), true);
+        }
+    }
+
+    // Inserts many elements at once: appends them, sorts only the new ones,
+    // merges the two sorted runs and removes duplicates, in O(m log m + n)
+    // instead of O(n) per element. Keys that already exist are not changed.
+    template<typename InputIter>
+    void insert(InputIter first, InputIter last)
+    {
+        this->bulk_insert(first, last, false);
+    }
+    void insert(std::initializer_list<value_type> init)
+    {
+        this->bulk_insert(init.begin(), init.end(), false);
+    }
+
+    // Same as `insert`, but the new element replaces the existing one, and
+    // the last one wins among the new elements.
+    template<typename InputIter>
+    void insert_or_assign(InputIter first, InputIter last)
+    {
+        this->bulk_insert(first, last, true);
+    }
+
+    // Moves the elements of `other` whose keys are not in this map, in
+    // O(n + m). The others remain in `other`, like std::map::merge.
+    void merge(flat_map& other)
+    {
+        container_type merged(this->container_.get_allocator());
+        container_type rest(other.container_.get_allocator());
+        merged.reserve(this->size() + other.size());
+
+        auto lhs = this->container_.begin();
+        auto rhs = other.container_.begin();
+        while(lhs != this->container_.end() && rhs != other.container_.end())
+        {
+            if(this->cmp_(lhs->first, rhs->first))
+            {
+                merged.push_back(std::move(*lhs++));
+            }
+            else if(this->cmp_(rhs->first, lhs->first))
+            {
+                merged.push_back(std::move(*rhs++));
+            }
+            else
+            {
+                merged.push_back(std::move(*lhs++));
+                rest.push_back(std::move(*rhs++));
+            }
         }
+        std::move(lhs, this->container_.end(),  std::back_inserter(merged));
+        std::move(rhs, other.container_.end(), std::back_inserter(merged));
+
+        this->container_ = std::move(merged);
+        other.container_ = std::move(rest);
+        return;
+    }
+    void merge(flat_map&& other)
+    {
+        this->merge(other);
     }
 
-    void erase(const_iterator i)
+    iterator erase(iterator i)
+    {
+        return this->container_.erase(i);
+    }
+    iterator erase(const_iterator i)
     {
-        this->container_.erase(i);
+        return this->container_.erase(i);
     }
-    void erase(key_type k)
+    template<typename K>
+    size_type erase(const K& k)
     {
         const auto found = this->find(k);
-        if(found != this->end())
+        if(found == this->end())
         {
-            this->container_.erase(found);
+            return 0;
         }
+        this->container_.erase(found);
+        return 1;
     }
 
-    key_compare   key_comp()   const {return key_compare{};}
+    key_compare   key_comp()   const {return cmp_;}
     value_compare value_comp() const {return value_compare{this->key_comp()};}
 
     bool operator==(const flat_map& rhs) const noexcept {return this->container_ == rhs.container_;}
@@ -363,6 +649,131 @@ class flat_map
         return;
     }
 
+  private:
+
+    template<typename InputIter>
+    void bulk_insert(InputIter first, InputIter last, const bool keep_last)
+    {
+        const auto old_size = static_cast<difference_type>(this->container_.size());
+        this->container_.insert(this->container_.end(), first, last);
+
+        const auto mid = std::next(this->container_.begin(), old_size);
+        std::stable_sort(mid, this->container_.end(), value_compare{cmp_});
+        std::inplace_merge(this->container_.begin(), mid, this->container_.end(),
+                           value_compare{cmp_}); // stable: old ones come first
+        this->deduplicate(keep_last);
+    }
+
+    // removes the duplicates of a sorted container in one pass. With
+    // `keep_last`, the last of equivalent elements remains.
+    void deduplicate(const bool keep_last)
+    {
+        if(this->container_.empty()) {return;}
+
+        auto out = this->container_.begin();
+        for(auto in = std::next(out); in != this->container_.end(); ++in)
+        {
+            if(this->cmp_(out->first, in->first))
+            {
+                ++out;
+                if(out != in) {*out = std::move(*in);}
+            }
+            else if(keep_last)
+            {
+                *out = std::move(*in);
+            }
+        }
+        this->container_.erase(std::next(out), this->container_.end());
+    }
+
+    template<typename Iterator, typename KeyIter, typename OutputIter>
+    OutputIter find_sorted_impl(Iterator lo, const Iterator end,
+                                KeyIter first, KeyIter last, OutputIter out) const
+    {
+        constexpr std::size_t group_size = 16;
+
+        assert(std::is_sorted(first, last, [this](const auto& lhs, const auto& rhs) {
+                return this->cmp_(detail::lookup_key<key_type, key_compare>(lhs),
+                                  detail::lookup_key<key_type, key_compare>(rhs));
+            }));
+
+        // If the comparator is not transparent, the keys of a group are
+        // converted into Key once, not on each comparison.
+        constexpr bool converts = ! std::is_reference_v<
+            decltype(detail::lookup_key<key_type, key_compare>(*first))>;
+        struct no_keys {};
+        using converted_keys = std::conditional_t<converts,
+              std::array<std::optional<key_type>, group_size>, no_keys>;
+
+        std::array<KeyIter,  group_size> keys;
+        std::array<Iterator, group_size> base;
+        [[maybe_unused]] converted_keys  converted;
+
+        const auto key = [&](const std::size_t i) -> decltype(auto) {
+            if constexpr(converts) {return (*converted[i]);}
+            else {return detail::lookup_key<key_type, key_compare>(*keys[i]);}
+        };
+        const auto less = [&](const value_type& v, const std::size_t i) {
+            return this->cmp_(v.first, key(i));
+        };
+
+        while(first != last)
+        {
+            std::size_t n_keys = 0;
+            for(; n_keys < group_size && first != last; ++n_keys, ++first)
+            {
+                keys[n_keys] = first;
+                base[n_keys] = lo;
+                if constexpr(converts) {converted[n_keys].emplace(*first);}
+            }
+
+            // branch-free lower_bound of all the keys in lockstep, so that the
+            // cache misses of different keys overlap
+            auto len = std::distance(lo, end);
+            while(1 < len)
+            {
+                const auto half = len / 2;
+                for(std::size_t i=0; i<n_keys; ++i)
+                {
+#if defined(__GNUC__)
+                    __builtin_prefetch(std::addressof(*std::next(base[i], half / 2)));
+                    __builtin_prefetch(std::addressof(*std::next(base[i], half + half / 2)));
+#endif
+                    base[i] = less(*std::next(base[i], half), i) ?
+                              std::next(base[i], half) : base[i];
+                }
+                len -= half;
+            }
+            for(std::size_t i=0; i<n_keys; ++i)
+            {
+                if(len == 1 && less(*base[i], i))
+                {
+                    ++base[i];
+                }
+                *out = this->is_equivalent(base[i], key(i)) ? base[i] : end;
+                ++out;
+            }
+            // the keys are sorted, so the next ones are not before this
+            lo = base[n_keys - 1];
+        }
+        return out;
+    }
+
+    bool is_sorted_unique() const
+    {
+        return std::adjacent_find(this->container_.begin(), this->container_.end(),
+            [this](const value_type& lhs, const value_type& rhs) {
+                return ! this->cmp_(lhs.first, rhs.first);
+            }) == this->container_.end();
+    }
+
+    // `found` is the lower_bound of `k`
+    template<typename Iterator, typename K>
+    bool is_equivalent(const Iterator found, const K& k) const
+    {
+        return found != this->container_.end() && ! this->cmp_(k, found->first);
+    }
+
   private:
 
     [[no_unique_address]] key_compare cmp_;
@@ -378,1026 +789,7559 @@ void swap(flat_map<K, V, C, A>& lhs, flat_map<K, V, C, A>& rhs)
 
 } // msgplus
 #endif// MSGPLUS_FLAT_MAP_HPP
-#ifndef MSGPLUS_ORDERED_MAP_HPP
-#define MSGPLUS_ORDERED_MAP_HPP
+#ifndef MSGPLUS_SPLIT_FLAT_MAP_HPP
+#define MSGPLUS_SPLIT_FLAT_MAP_HPP
 
 
 #include <algorithm>
+#include <bit>
+#include <concepts>
+#include <initializer_list>
+#include <iterator>
+#include <numeric>
+#include <span>
 #include <stdexcept>
 #include <utility>
 #include <vector>
 
-#include <cassert>
+#include <cstdint>
 
 namespace msgplus
 {
 
-template<typename Key, typename Val, typename Cmp = std::less<Key>,
-         typename Allocator = std::allocator<std::pair<Key, Val>>>
-class ordered_map
+// The order of the keys in a split_flat_map.
+//
+// - `sorted` is a plain sorted array searched by binary search.
+// - `eytzinger` stores the implicit binary search tree breadth-first, so that
+//   the first levels share a few cache lines, the children of a node are next
+//   to each other and can be prefetched, and the search has no unpredictable
+//   branch.
+enum class flat_map_layout : std::uint8_t
+{
+    sorted    = 0,
+    eytzinger = 1,
+};
+
+// A read-mostly map that stores keys and values in separate arrays, so that
+// searching touches only the keys.
+//
+// The set of keys is fixed at construction; values can be modified. If a key
+// appears more than once in the input, the first one is kept, as `flat_map`
+// does with repeated `insert`s.
+//
+// `keys()[i]` corresponds to `values()[i]`. They are in the order of the
+// layout, so with `eytzinger` they are not sorted.
+template<typename Key, typename Value, typename Cmp = std::less<Key>,
+         flat_map_layout Layout = flat_map_layout::sorted,
+         typename KeyAllocator   = std::allocator<Key>,
+         typename ValueAllocator = std::allocator<Value>>
+class split_flat_map
 {
   public:
 
     using key_type    = Key;
-    using mapped_type = Val;
-    using value_type  = std::pair<Key, Val>;
+    using mapped_type = Value;
     using key_compare = Cmp;
+    using size_type   = std::size_t;
 
-    using allocator_type = typename std::allocator_traits<Allocator>::template
-        rebind_alloc<value_type>;
-
-    using container_type  = std::vector<value_type, Allocator>;
-    using reference       = typename container_type::reference;
-    using pointer         = typename container_type::pointer;
-    using const_reference = typename container_type::const_reference;
-    using const_pointer   = typename container_type::const_pointer;
-    using iterator        = typename container_type::iterator;
-    using const_iterator  = typename container_type::const_iterator;
-    using size_type       = typename container_type::size_type;
-    using difference_type = typename container_type::difference_type;
+    using key_container_type   = std::vector<Key,   KeyAllocator>;
+    using value_container_type = std::vector<Value, ValueAllocator>;
 
-    using key_index_map = flat_map<key_type, size_type, key_compare, typename
-        std::allocator_traits<allocator_type>::template rebind_alloc<std::pair<key_type, size_type>>
-          >;
+    static constexpr flat_map_layout layout = Layout;
 
   public:
 
-    ordered_map() = default;
-    ~ordered_map() = default;
-    ordered_map(const ordered_map&) = default;
-    ordered_map(ordered_map&&)      = default;
-    ordered_map& operator=(const ordered_map&) = default;
-    ordered_map& operator=(ordered_map&&)      = default;
+    split_flat_map() = default;
+    ~split_flat_map() = default;
+    split_flat_map(const split_flat_map&) = default;
+    split_flat_map(split_flat_map&&)      = default;
+    split_flat_map& operator=(const split_flat_map&) = default;
+    split_flat_map& operator=(split_flat_map&&)      = default;
 
-    template<typename InputIterator>
-    ordered_map(InputIterator first, InputIterator last)
-        :  container_(first, last)
+    // from a range of key-value pairs, e.g. a flat_map or an ordered_map
+    template<typename InputIter>
+    split_flat_map(InputIter first, InputIter last, key_compare cmp = key_compare{})
+        : cmp_(std::move(cmp))
     {
-        this->construct_index();
+        std::vector<std::pair<Key, Value>> kvs(first, last);
+        this->build(std::move(kvs));
     }
-
-    ordered_map(std::initializer_list<value_type> v)
-        : container_(std::move(v))
+    split_flat_map(std::initializer_list<std::pair<Key, Value>> init,
+                   key_compare cmp = key_compare{})
+        : cmp_(std::move(cmp))
     {
-        this->construct_index();
+        std::vector<std::pair<Key, Value>> kvs(init.begin(), init.end());
+        this->build(std::move(kvs));
     }
-    ordered_map& operator=(std::initializer_list<value_type> v)
-    {
-        this->container_ = std::move(v);
-        this->construct_index();
-        return *this;
+
+    bool      empty() const noexcept {return keys_.empty();}
+    size_type size()  const noexcept {return keys_.size();}
+
+    std::span<const key_type>    keys()   const noexcept {return keys_;}
+    std::span<const mapped_type> values() const noexcept {return values_;}
+    std::span<mapped_type>       values()       noexcept {return values_;}
+
+    // nullptr if there is no such key
+    template<typename K>
+    mapped_type const* find(const K& k) const
+    {
+        const auto i = this->search(detail::lookup_key<key_type, key_compare>(k));
+        return i == this->size() ? nullptr : std::addressof(this->values_[i]);
+    }
+    template<typename K>
+    mapped_type* find(const K& k)
+    {
+        const auto i = this->search(detail::lookup_key<key_type, key_compare>(k));
+        return i == this->size() ? nullptr : std::addressof(this->values_[i]);
     }
 
-    iterator       begin()        noexcept {return container_.begin();}
-    iterator       end()          noexcept {return container_.end();}
-    const_iterator begin()  const noexcept {return container_.begin();}
-    const_iterator end()    const noexcept {return container_.end();}
-    const_iterator cbegin() const noexcept {return container_.cbegin();}
-    const_iterator cend()   const noexcept {return container_.cend();}
+    template<typename K>
+    bool contains(const K& k) const
+    {
+        return this->find(k) != nullptr;
+    }
+    template<typename K>
+    size_type count(const K& k) const
+    {
+        return this->contains(k) ? 1 : 0;
+    }
 
-    bool        empty()    const noexcept {return container_.empty();}
-    std::size_t size()     const noexcept {return container_.size();}
-    std::size_t max_size() const noexcept {return container_.max_size();}
+    template<typename K>
+    mapped_type& at(const K& k)
+    {
+        auto* found = this->find(k);
+        if( ! found)
+        {
+            throw std::out_of_range("split_flat_map::at()");
+        }
+        return *found;
+    }
+    template<typename K>
+    mapped_type const& at(const K& k) const
+    {
+        const auto* found = this->find(k);
+        if( ! found)
+        {
+            throw std::out_of_range("split_flat_map::at()");
+        }
+        return *found;
+    }
 
-    void clear() {container_.clear();}
+    key_compare key_comp() const {return cmp_;}
 
-    void push_back(value_type v)
+    void swap(split_flat_map& other)
+    {
+        using std::swap;
+        swap(this->cmp_,    other.cmp_);
+        swap(this->keys_,   other.keys_);
+        swap(this->values_, other.values_);
+    }
+
+  private:
+
+    void build(std::vector<std::pair<Key, Value>> kvs)
     {
-        if(this->contains(v.first))
+        std::stable_sort(kvs.begin(), kvs.end(),
+            [this](const auto& lhs, const auto& rhs) {return this->cmp_(lhs.first, rhs.first);});
+        const auto last = std::unique(kvs.begin(), kvs.end(),
+            [this](const auto& lhs, const auto& rhs) {return ! this->cmp_(lhs.first, rhs.first);});
+        kvs.erase(last, kvs.end());
+
+        // the position of the i-th smallest key
+        std::vector<size_type> slots(kvs.size());
+        if constexpr(Layout == flat_map_layout::eytzinger)
         {
-            throw std::out_of_range("ordered_map: value already exists");
+            size_type rank = 0;
+            eytzinger_slots(slots, rank, 0);
+        }
+        else
+        {
+            std::iota(slots.begin(), slots.end(), size_type(0));
+        }
+
+        std::vector<std::pair<Key, Value>*> placed(kvs.size());
+        for(size_type i=0; i<kvs.size(); ++i)
+        {
+            placed[slots[i]] = std::addressof(kvs[i]);
+        }
+        this->keys_  .clear();
+        this->values_.clear();
+        this->keys_  .reserve(kvs.size());
+        this->values_.reserve(kvs.size());
+        for(auto* kv : placed)
+        {
+            this->keys_  .push_back(std::move(kv->first));
+            this->values_.push_back(std::move(kv->second));
         }
-        this->key_index_[v.first] = this->container_.size();
-        container_.push_back(std::move(v));
     }
-    void emplace_back(key_type k, mapped_type v)
+
+    // assigns ranks to the nodes of the tree in in-order. the depth of the
+    // recursion is log2(n).
+    static void eytzinger_slots(std::vector<size_type>& slots, size_type& rank, size_type node)
+    {
+        if(slots.size() <= node) {return;}
+
+        eytzinger_slots(slots, rank, 2 * node + 1);
+        slots[rank++] = node;
+        eytzinger_slots(slots, rank, 2 * node + 2);
+    }
+
+    // returns the position of `k`, or size() if not found
+    template<typename K>
+    size_type search(const K& k) const
     {
-        if(this->contains(k))
+        const size_type n = this->keys_.size();
+        if constexpr(Layout == flat_map_layout::eytzinger)
         {
-            throw std::out_of_range("ordered_map: value already exists");
+            // 1-based index of the node; the children of j are 2j and 2j+1
+            size_type j = 1;
+            while(j <= n)
+            {
+#if defined(__GNUC__)
+                __builtin_prefetch(this->keys_.data() + std::min(16 * j, n) - 1);
+#endif
+                j = 2 * j + static_cast<size_type>(this->cmp_(this->keys_[j - 1], k));
+            }
+            // undo the right turns taken after the last left turn, and the
+            // left turn itself. that node is the lower bound.
+            j >>= std::countr_one(j) + 1;
+            if(j == 0 || this->cmp_(k, this->keys_[j - 1]))
+            {
+                return n;
+            }
+            return j - 1;
+        }
+        else
+        {
+            const auto found = std::lower_bound(this->keys_.begin(), this->keys_.end(), k,
+                [this](const key_type& lhs, const auto& rhs) {return this->cmp_(lhs, rhs);});
+            if(found == this->keys_.end() || this->cmp_(k, *found))
+            {
+                return n;
+            }
+            return static_cast<size_type>(found - this->keys_.begin());
         }
-        this->key_index_[k] = this->container_.size();
-        container_.emplace_back(std::move(k), std::move(v));
     }
-    void pop_back()
+
+  private:
+
+    [[no_unique_address]] key_compare cmp_;
+    key_container_type   keys_;
+    value_container_type values_;
+};
+
+template<typename K, typename V, typename C, flat_map_layout L, typename KA, typename VA>
+void swap(split_flat_map<K, V, C, L, KA, VA>& lhs, split_flat_map<K, V, C, L, KA, VA>& rhs)
+{
+    lhs.swap(rhs);
+    return ;
+}
+
+} // msgplus
+#endif// MSGPLUS_SPLIT_FLAT_MAP_HPP
+#ifndef MSGPLUS_ORDERED_MAP_HPP
+#define MSGPLUS_ORDERED_MAP_HPP
+
+#include <algorithm>
+#include <compare>
+#include <concepts>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <cassert>
+#include <cstdint>
+
+namespace msgplus
+{
+
+template<typename Key, typename Val, typename Cmp, typename Allocator,
+         std::size_t LinearSearchThreshold, typename Index>
+class ordered_map;
+
+namespace detail
+{
+
+// Positions of the elements of an ordered_map, sorted by their keys.
+template<typename Key, typename Cmp, typename Allocator>
+class sorted_position_index
+{
+  public:
+
+    using size_type = std::size_t;
+
+    struct lookup
     {
-        if(this->empty()) {return;}
+        bool      exists;
+        size_type position; // of the element, if it exists
+        size_type hint;     // passed to `insert` to add the key
+    };
+
+    // if keys can be searched by types other than Key
+    static constexpr bool is_transparent = requires {typename Cmp::is_transparent;};
+
+  public:
 
-        this->key_index_.erase(container_.back().first);
-        container_.pop_back();
+    template<typename K1, typename K2>
+    static bool equal(const K1& lhs, const K2& rhs)
+    {
+        const Cmp cmp{};
+        return ! cmp(lhs, rhs) && ! cmp(rhs, lhs);
     }
 
-    void insert(const_iterator pos, value_type kv)
+    template<typename Container, typename K>
+    lookup find(const Container& c, const K& k) const
     {
-        if(this->contains(kv.first))
+        const Cmp cmp{};
+        const auto slot = std::lower_bound(this->positions_.begin(), this->positions_.end(), k,
+            [&c, &cmp](const size_type i, const K& key) {
+                return cmp(c[i].first, key);
+            });
+        const auto hint = static_cast<size_type>(slot - this->positions_.begin());
+        if(slot != this->positions_.end() && ! cmp(k, c[*slot].first))
         {
-            throw std::out_of_range("ordered_map: value already exists");
+            return lookup{true, *slot, hint};
         }
+        return lookup{false, c.size(), hint};
+    }
 
-        const auto index = std::distance(this->container_.cbegin(), pos);
-        for(auto iter=pos; iter != this->cend(); ++iter)
+    // `c` has no tombstones. throws std::out_of_range if there are duplicate keys
+    template<typename Container>
+    void build(const Container& c)
+    {
+        const Cmp cmp{};
+        this->positions_.resize(c.size());
+        for(size_type i=0; i<c.size(); ++i)
+        {
+            this->positions_[i] = i;
+        }
+        std::sort(this->positions_.begin(), this->positions_.end(),
+            [&c, &cmp](const size_type lhs, const size_type rhs) {
+                return cmp(c[lhs].first, c[rhs].first);
+            });
+
+        const auto dup = std::adjacent_find(this->positions_.begin(), this->positions_.end(),
+            [&c, &cmp](const size_type lhs, const size_type rhs) {
+                return ! cmp(c[lhs].first, c[rhs].first);
+            });
+        if(dup != this->positions_.end())
         {
-            assert(index <= this->key_index_.at(iter->first));
-            this->key_index_.at(iter->first) += 1;
+            this->positions_.clear();
+            throw std::out_of_range("ordered_map: value already exists");
         }
-        this->key_index_[kv.first] = index;
+    }
 
-        container_.insert(pos, std::move(kv));
-        return;
+    // `c[pos]` has just been inserted. `hint` is from `find` before that.
+    template<typename Container>
+    void insert(const Container&, const size_type hint, const size_type pos)
+    {
+        this->positions_.insert(this->positions_.begin() +
+                static_cast<std::ptrdiff_t>(hint), pos);
     }
-    void emplace(const_iterator pos, key_type k, mapped_type v)
+
+    // `c[pos]` is about to be erased. `hint` is from `find` of its key.
+    template<typename Container>
+    void erase(const Container&, const size_type hint, [[maybe_unused]] const size_type pos)
     {
-        this->insert(pos, std::make_pair(std::move(k), std::move(v)));
-        return;
+        assert(this->positions_[hint] == pos);
+        this->positions_.erase(this->positions_.begin() + static_cast<std::ptrdiff_t>(hint));
     }
 
-    std::size_t count(const key_type& key) const
+    // the elements that were at [first, last) have been moved by `delta`
+    template<typename Container>
+    void shift(const Container&, const size_type first, const size_type last,
+               const std::ptrdiff_t delta)
     {
-        return this->contains(key) ? 1 : 0;
+        for(auto& i : this->positions_)
+        {
+            if(first <= i && i < last) {i = static_cast<size_type>(static_cast<std::ptrdiff_t>(i) + delta);}
+        }
     }
-    bool contains(const key_type& key) const
+
+    // removes the positions of the elements that have been erased
+    template<typename Marks>
+    void erase_marked(const Marks& erased)
     {
-        return this->find(key) != this->end();
+        std::erase_if(this->positions_, [&erased](const size_type i) {return erased[i];});
     }
-    iterator find(const key_type& key) noexcept
+
+    // the element at `i` has been moved to `moved_to[i]`
+    template<typename Positions>
+    void renumber(const Positions& moved_to)
     {
-        const auto index = this->key_index_.find(key);
-        if(index == this->key_index_.end())
+        for(auto& i : this->positions_)
         {
-            return this->end();
+            i = moved_to[i];
         }
-        assert(index->second < this->size());
+    }
+
+    void reserve(const size_type n) {positions_.reserve(n);}
+    void clear() noexcept {positions_.clear();}
+    void swap(sorted_position_index& other) noexcept {positions_.swap(other.positions_);}
+
+  private:
+
+    std::vector<size_type, typename std::allocator_traits<Allocator>::template
+        rebind_alloc<size_type>> positions_;
+};
+
+// Positions of the elements of an ordered_map in an open-addressing hash
+// table with Robin Hood probing.
+template<typename Key, typename Hash, typename KeyEqual, typename Allocator>
+class hashed_position_index
+{
+  public:
+
+    using size_type = std::size_t;
+
+    struct lookup
+    {
+        bool      exists;
+        size_type position; // of the element, if it exists
+        size_type hint;     // the hash of the key
+    };
+
+    // if keys can be searched by types other than Key
+    static constexpr bool is_transparent =
+        requires {typename Hash::is_transparent; typename KeyEqual::is_transparent;};
 
-        const auto found = std::next(this->begin(), index->second);
-        assert(found->first == key);
+  public:
 
-        return found;
+    template<typename K1, typename K2>
+    static bool equal(const K1& lhs, const K2& rhs)
+    {
+        return KeyEqual{}(lhs, rhs);
     }
-    const_iterator find(const key_type& key) const noexcept
+
+    template<typename Container, typename K>
+    lookup find(const Container& c, const K& k) const
     {
-        const auto index = this->key_index_.find(key);
-        if(index == this->key_index_.end())
+        const size_type h = spread(Hash{}(k));
+        if(this->slots_.empty())
         {
-            return this->end();
+            return lookup{false, c.size(), h};
+        }
+        const size_type mask = this->slots_.size() - 1;
+        size_type i    = h & mask;
+        size_type dist = 1;
+        while(true)
+        {
+            const auto& s = this->slots_[i];
+            if(s.distance < dist) // empty, or a key that would have been after `k`
+            {
+                return lookup{false, c.size(), h};
+            }
+            if(s.hash == h && KeyEqual{}(c[s.position].first, k))
+            {
+                return lookup{true, s.position, h};
+            }
+            i = (i + 1) & mask;
+            dist += 1;
         }
-        assert(index->second < this->size());
+    }
 
-        const auto found = std::next(this->begin(), index->second);
-        assert(found->first == key);
+    // `c` has no tombstones. throws std::out_of_range if there are duplicate keys
+    template<typename Container>
+    void build(const Container& c)
+    {
+        this->clear();
+        this->reserve(c.size());
+        for(size_type i=0; i<c.size(); ++i)
+        {
+            const auto found = this->find(c, c[i].first);
+            if(found.exists)
+            {
+                this->clear();
+                throw std::out_of_range("ordered_map: value already exists");
+            }
+            this->place(slot{i, found.hint, 1});
+        }
+    }
 
-        return found;
+    // `c[pos]` has just been inserted. `hint` is from `find` before that.
+    template<typename Container>
+    void insert(const Container&, const size_type hint, const size_type pos)
+    {
+        this->reserve(this->count_ + 1);
+        this->place(slot{pos, hint, 1});
     }
 
-    mapped_type&       at(const key_type& k)
+    // `c[pos]` is about to be erased. `hint` is from `find` of its key.
+    template<typename Container>
+    void erase(const Container&, const size_type hint, const size_type pos)
     {
-        const auto iter = this->find(k);
-        if(iter == this->end())
+        const size_type mask = this->slots_.size() - 1;
+        size_type i = hint & mask;
+        while(this->slots_[i].position != pos || this->slots_[i].distance == 0)
         {
-            throw std::out_of_range("ordered_map: no such element");
+            i = (i + 1) & mask;
         }
-        return iter->second;
+        this->remove_at(i);
     }
-    mapped_type const& at(const key_type& k) const
+
+    // The elements that were at [first, last) have been moved by `delta`.
+    // A few elements are looked up by their keys; many are renumbered in a
+    // pass over the table.
+    template<typename Container>
+    void shift(const Container& c, const size_type first, const size_type last,
+               const std::ptrdiff_t delta)
     {
-        const auto iter = this->find(k);
-        if(iter == this->end())
+        if((last - first) * 4 < this->slots_.size())
         {
-            throw std::out_of_range("ordered_map: no such element");
+            const size_type mask = this->slots_.size() - 1;
+            for(size_type k=0; k<last-first; ++k)
+            {
+                // in the order that does not make two of them share a position
+                const size_type from = (0 < delta) ? last - 1 - k : first + k;
+                const size_type to   = static_cast<size_type>(static_cast<std::ptrdiff_t>(from) + delta);
+                const size_type h    = spread(Hash{}(c[to].first));
+                size_type i = h & mask;
+                while(this->slots_[i].distance == 0 || this->slots_[i].position != from ||
+                      this->slots_[i].hash != h)
+                {
+                    i = (i + 1) & mask;
+                }
+                this->slots_[i].position = to;
+            }
+            return;
+        }
+        for(auto& s : this->slots_)
+        {
+            if(s.distance != 0 && first <= s.position && s.position < last)
+            {
+                s.position = static_cast<size_type>(static_cast<std::ptrdiff_t>(s.position) + delta);
+            }
         }
-        return iter->second;
     }
 
-    mapped_type& operator[](const key_type& k)
+    // removes the positions of the elements that have been erased
+    template<typename Marks>
+    void erase_marked(const Marks& erased)
     {
-        const auto iter = this->find(k);
-        if(iter == this->end())
+        for(size_type i=0; i<this->slots_.size(); )
         {
-            this->container_.emplace_back(k, mapped_type{});
-            return this->container_.back().second;
+            const auto& s = this->slots_[i];
+            if(s.distance != 0 && erased[s.position])
+            {
+                this->remove_at(i); // the next one may have moved to `i`
+                continue;
+            }
+            i += 1;
         }
-        else
+    }
+
+    // the element at `i` has been moved to `moved_to[i]`
+    template<typename Positions>
+    void renumber(const Positions& moved_to)
+    {
+        for(auto& s : this->slots_)
         {
-            return iter->second;
+            if(s.distance != 0) {s.position = moved_to[s.position];}
         }
     }
 
-    mapped_type const& operator[](const key_type& k) const
+    // makes room for `n` keys, keeping the load factor at most 7/8
+    void reserve(const size_type n)
     {
-        const auto iter = this->find(k);
-        if(iter == this->end())
+        if(n * 8 <= this->slots_.size() * 7)
         {
-            throw std::out_of_range("ordered_map: no such element");
+            return;
         }
-        else
+        size_type capacity = 16;
+        while(capacity * 7 < n * 8)
         {
-            return iter->second;
+            capacity *= 2;
+        }
+        slots_type old(capacity);
+        old.swap(this->slots_);
+        this->count_ = 0;
+        for(const auto& s : old)
+        {
+            if(s.distance != 0)
+            {
+                this->place(slot{s.position, s.hash, 1});
+            }
         }
     }
+    void clear() noexcept
+    {
+        slots_.clear();
+        count_ = 0;
+    }
+    void swap(hashed_position_index& other) noexcept
+    {
+        using std::swap;
+        swap(slots_, other.slots_);
+        swap(count_, other.count_);
+    }
+
+  private:
 
-    void swap(ordered_map& other)
+    // Only the low bits of a hash select the home slot, and some hashes, such
+    // as std::hash of integers, leave them poorly distributed.
+    static size_type spread(const size_type h) noexcept
     {
-        container_.swap(other.container_);
+        const std::uint64_t x = static_cast<std::uint64_t>(h) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_type>(x ^ (x >> 32));
     }
 
-    bool operator==(const ordered_map& rhs) const noexcept {return this->container_ == rhs.container_;}
-    bool operator!=(const ordered_map& rhs) const noexcept {return this->container_ != rhs.container_;}
-    bool operator< (const ordered_map& rhs) const noexcept {return this->container_ <  rhs.container_;}
-    bool operator<=(const ordered_map& rhs) const noexcept {return this->container_ <= rhs.container_;}
-    bool operator> (const ordered_map& rhs) const noexcept {return this->container_ >  rhs.container_;}
-    bool operator>=(const ordered_map& rhs) const noexcept {return this->container_ >= rhs.container_;}
+    struct slot
+    {
+        size_type position = 0;
+        size_type hash     = 0;
+        size_type distance = 0; // 1 + distance from the home slot. 0 if empty
+    };
+    using slots_type = std::vector<slot,
+        typename std::allocator_traits<Allocator>::template rebind_alloc<slot>>;
 
-  private:
+    // backward shift deletion: no tombstones are left behind
+    void remove_at(size_type i)
+    {
+        const size_type mask = this->slots_.size() - 1;
+        while(true)
+        {
+            const size_type next = (i + 1) & mask;
+            if(this->slots_[next].distance <= 1)
+            {
+                this->slots_[i] = slot{};
+                break;
+            }
+            this->slots_[i] = this->slots_[next];
+            this->slots_[i].distance -= 1;
+            i = next;
+        }
+        this->count_ -= 1;
+    }
 
-    void construct_index()
+    void place(slot s)
     {
-        this->key_index_.clear();
-        for(size_type i=0; i<this->container_.size(); ++i)
+        const size_type mask = this->slots_.size() - 1;
+        size_type i = s.hash & mask;
+        while(this->slots_[i].distance != 0)
         {
-            this->key_index_[this->container_[i].first] = i;
+            if(this->slots_[i].distance < s.distance) // take from the rich
+            {
+                std::swap(this->slots_[i], s);
+            }
+            i = (i + 1) & mask;
+            s.distance += 1;
         }
+        this->slots_[i] = s;
+        this->count_ += 1;
     }
 
   private:
 
-    key_index_map  key_index_;
-    container_type container_;
+    slots_type slots_;
+    size_type  count_ = 0;
 };
 
-template<typename K, typename V, typename A>
-void swap(ordered_map<K,V,A>& lhs, ordered_map<K,V,A>& rhs)
-{
-    lhs.swap(rhs);
-    return;
-}
+// Marks the slots of an ordered_map where elements have been erased.
+template<typename Allocator>
+using ordered_map_marks = std::vector<bool,
+      typename std::allocator_traits<Allocator>::template rebind_alloc<bool>>;
 
-} // msgplus
-#endif // MSGPLUS_ORDERED_MAP_HPP
-#ifndef MSGPLUS_VALUE_HPP
-#define MSGPLUS_VALUE_HPP
+// Iterates over the elements of an ordered_map in order, skipping the
+// tombstones. `marks_` is null if the map had none when it was made.
+// Iterators compare by the positions of their elements.
+template<typename T, typename Marks, bool IsConst>
+class ordered_map_iterator
+{
+  public:
 
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type        = T;
+    using difference_type   = std::ptrdiff_t;
+    using pointer           = std::conditional_t<IsConst, const T*, T*>;
+    using reference         = std::conditional_t<IsConst, const T&, T&>;
 
-#include <concepts>
-#include <variant>
-#include <vector>
+  public:
 
-#include <cstdint>
+    ordered_map_iterator() = default;
+    ordered_map_iterator(pointer ptr, pointer base, const Marks* marks) noexcept
+        : ptr_(ptr), base_(base), marks_(marks)
+    {}
 
-namespace msgplus
-{
+    // iterator -> const_iterator
+    template<bool C> requires(IsConst && ! C)
+    ordered_map_iterator(const ordered_map_iterator<T, Marks, C>& other) noexcept
+        : ptr_(other.ptr_), base_(other.base_), marks_(other.marks_)
+    {}
 
-enum class type_t : std::uint8_t
-{
-    nil_t     =  0,
-    bool_t    =  1,
-    int_t     =  2,
-    uint_t    =  3,
-    float32_t =  4,
-    float64_t =  5,
-    str_t     =  6,
-    bin_t     =  7,
-    array_t   =  8,
-    map_t     =  9,
-    ext_t     = 10,
-};
+    reference operator*()  const noexcept {return *ptr_;}
+    pointer   operator->() const noexcept {return ptr_;}
 
-class value
-{
-  public:
+    ordered_map_iterator& operator++() noexcept
+    {
+        ++ptr_;
+        if(marks_)
+        {
+            const auto last = base_ + marks_->size();
+            while(ptr_ != last && (*marks_)[static_cast<std::size_t>(ptr_ - base_)]) {++ptr_;}
+        }
+        return *this;
+    }
+    ordered_map_iterator operator++(int) noexcept
+    {
+        auto tmp = *this;
+        ++(*this);
+        return tmp;
+    }
+    ordered_map_iterator& operator--() noexcept
+    {
+        --ptr_;
+        if(marks_)
+        {
+            while((*marks_)[static_cast<std::size_t>(ptr_ - base_)]) {--ptr_;}
+        }
+        return *this;
+    }
+    ordered_map_iterator operator--(int) noexcept
+    {
+        auto tmp = *this;
+        --(*this);
+        return tmp;
+    }
+
+    friend bool operator==(const ordered_map_iterator& lhs, const ordered_map_iterator& rhs) noexcept
+    {
+        return lhs.ptr_ == rhs.ptr_;
+    }
+    friend std::strong_ordering operator<=>(const ordered_map_iterator& lhs,
+                                            const ordered_map_iterator& rhs) noexcept
+    {
+        return std::compare_three_way{}(lhs.ptr_, rhs.ptr_);
+    }
+
+  private:
+
+    template<typename, typename, bool>
+    friend class ordered_map_iterator;
+    template<typename, typename, typename, typename, std::size_t, typename>
+    friend class msgplus::ordered_map;
+
+    pointer      ptr_   = nullptr;
+    pointer      base_  = nullptr; // the first slot
+    const Marks* marks_ = nullptr;
+};
+
+// K can be used to search a map of Key without being converted into Key
+template<typename K, typename Key, typename Index>
+concept transparent_key = Index::is_transparent && ( ! std::same_as<K, Key>);
+
+} // detail
+
+// Index policies of ordered_map.
+//
+// `sorted_index` binary-searches positions sorted by `Cmp`. `hashed_index`
+// looks positions up in a hash table, which is faster for large maps; `Cmp`
+// is then unused. Both keep the elements in insertion order.
+struct sorted_index
+{
+    template<typename Key, typename Cmp, typename Allocator>
+    using type = detail::sorted_position_index<Key, Cmp, Allocator>;
+};
+
+template<typename Hash = void, typename KeyEqual = void>
+struct hashed_index
+{
+    template<typename Key, typename Cmp, typename Allocator>
+    using type = detail::hashed_position_index<Key,
+        std::conditional_t<std::is_void_v<Hash>,     std::hash<Key>,     Hash>,
+        std::conditional_t<std::is_void_v<KeyEqual>, std::equal_to<Key>, KeyEqual>,
+        Allocator>;
+};
+
+// A map that keeps the insertion order of its elements.
+//
+// Maps smaller than `LinearSearchThreshold` are searched linearly and have no
+// index. When a map grows to the threshold, an index of the kind `Index` is
+// built and used for the rest of its lifetime, unless it shrinks again.
+//
+// Erasing an element leaves a tombstone in its place, so that the others do
+// not move. The tombstones are skipped by the iterators, reused by `insert`,
+// and removed at once when they outnumber the elements. Inserting and
+// erasing invalidate the iterators.
+template<typename Key, typename Val, typename Cmp = std::less<Key>,
+         typename Allocator = std::allocator<std::pair<Key, Val>>,
+         std::size_t LinearSearchThreshold = 16,
+         typename Index = sorted_index>
+class ordered_map
+{
+  public:
+
+    using key_type    = Key;
+    using mapped_type = Val;
+    using value_type  = std::pair<Key, Val>;
+    using key_compare = Cmp;
+
+    using allocator_type = typename std::allocator_traits<Allocator>::template
+        rebind_alloc<value_type>;
+
+    using container_type  = std::vector<value_type, Allocator>;
+    using reference       = typename container_type::reference;
+    using pointer         = typename container_type::pointer;
+    using const_reference = typename container_type::const_reference;
+    using const_pointer   = typename container_type::const_pointer;
+    using iterator        = detail::ordered_map_iterator<value_type,
+                                detail::ordered_map_marks<Allocator>, false>;
+    using const_iterator  = detail::ordered_map_iterator<value_type,
+                                detail::ordered_map_marks<Allocator>, true>;
+    using size_type       = typename container_type::size_type;
+    using difference_type = typename container_type::difference_type;
+
+    static constexpr std::size_t linear_search_threshold = LinearSearchThreshold;
+
+    // positions in `container_`, searchable by the keys at those positions
+    using key_index_type = typename Index::template type<Key, Cmp, allocator_type>;
+
+  public:
+
+    ordered_map() = default;
+    ~ordered_map() = default;
+    ordered_map(ordered_map&&)      = default;
+    ordered_map& operator=(ordered_map&&) = default;
+
+    ordered_map(const ordered_map& other)
+        : container_(other.container_),
+          extras_(other.extras_ ? std::make_unique<extras>(*other.extras_) : nullptr)
+    {}
+    ordered_map& operator=(const ordered_map& other)
+    {
+        if(this != std::addressof(other))
+        {
+            ordered_map tmp(other);
+            this->swap(tmp);
+        }
+        return *this;
+    }
+
+    template<typename InputIterator>
+    ordered_map(InputIterator first, InputIterator last)
+        :  container_(first, last)
+    {
+        this->construct_index();
+    }
+
+    ordered_map(std::initializer_list<value_type> v)
+        : container_(std::move(v))
+    {
+        this->construct_index();
+    }
+    ordered_map& operator=(std::initializer_list<value_type> v)
+    {
+        ordered_map tmp(std::move(v));
+        this->swap(tmp);
+        return *this;
+    }
+
+    // Takes the elements at once and sorts the index once, in O(n log n).
+    // Throws std::out_of_range if a key appears more than once.
+    explicit ordered_map(container_type v)
+        : container_(std::move(v))
+    {
+        this->construct_index();
+    }
+
+    iterator       begin()        noexcept {return this->iterator_at(this->first());}
+    iterator       end()          noexcept {return this->iterator_at(container_.size());}
+    const_iterator begin()  const noexcept {return this->iterator_at(this->first());}
+    const_iterator end()    const noexcept {return this->iterator_at(container_.size());}
+    const_iterator cbegin() const noexcept {return this->begin();}
+    const_iterator cend()   const noexcept {return this->end();}
+
+    bool        empty()    const noexcept {return this->size() == 0;}
+    std::size_t size()     const noexcept
+    {
+        return container_.size() - (extras_ ? extras_->count : 0);
+    }
+    std::size_t max_size() const noexcept {return container_.max_size();}
+    std::size_t capacity() const noexcept {return container_.capacity();}
+
+    void reserve(const size_type n)
+    {
+        container_.reserve(n);
+        if(linear_search_threshold <= n)
+        {
+            this->extra().index.reserve(n);
+        }
+    }
+
+    void clear() noexcept
+    {
+        container_.clear();
+        extras_.reset();
+    }
+
+    void push_back(value_type v)
+    {
+        const auto found = this->locate(v.first);
+        if(found.exists)
+        {
+            throw std::out_of_range("ordered_map: value already exists");
+        }
+        this->append(std::move(v));
+        this->index_inserted(found.hint, this->container_.size() - 1);
+    }
+    void emplace_back(key_type k, mapped_type v)
+    {
+        const auto found = this->locate(k);
+        if(found.exists)
+        {
+            throw std::out_of_range("ordered_map: value already exists");
+        }
+        this->append(value_type(std::move(k), std::move(v)));
+        this->index_inserted(found.hint, this->container_.size() - 1);
+    }
+    void pop_back()
+    {
+        if(this->empty()) {return;}
+
+        const auto found = this->locate(container_.back().first);
+        assert(found.exists);
+        this->erase_at(found);
+    }
+
+    // Moves the elements between `pos` and the nearest tombstone, if any, to
+    // make room. Without tombstones, the following elements are moved.
+    void insert(const_iterator pos, value_type kv)
+    {
+        const auto found = this->locate(kv.first);
+        if(found.exists)
+        {
+            throw std::out_of_range("ordered_map: value already exists");
+        }
+        const auto index = this->place(this->slot_index(pos), std::move(kv));
+        this->index_inserted(found.hint, index);
+        return;
+    }
+    void emplace(const_iterator pos, key_type k, mapped_type v)
+    {
+        this->insert(pos, std::make_pair(std::move(k), std::move(v)));
+        return;
+    }
+
+    // Erasing an element leaves a tombstone, so it takes amortized O(1)
+    // time besides the update of the index.
+    iterator erase(iterator pos)
+    {
+        return this->erase(const_iterator(pos));
+    }
+    iterator erase(const_iterator pos)
+    {
+        const auto found = this->locate(pos->first);
+        assert(found.exists);
+        return this->erase_at(found);
+    }
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        const auto from = this->slot_index(first);
+        const auto to   = this->slot_index(last);
+        if(from == to)
+        {
+            return this->iterator_at(from);
+        }
+        this->mark_tombstones();
+        const bool indexed = this->is_indexed();
+        for(size_type i=from; i<to; ++i)
+        {
+            if( ! this->extras_->erased[i]) {this->bury(i);}
+        }
+        return this->iterator_at(this->index_erased(indexed, to));
+    }
+    size_type erase(const key_type& k)
+    {
+        const auto found = this->locate(k);
+        if( ! found.exists)
+        {
+            return 0;
+        }
+        this->erase_at(found);
+        return 1;
+    }
+
+    // removes all the elements that satisfy `pred`, and updates the index
+    // in a single pass
+    template<typename Pred>
+    friend size_type erase_if(ordered_map& m, Pred pred)
+    {
+        if(m.empty()) {return 0;}
+
+        m.mark_tombstones();
+        const bool indexed = m.is_indexed();
+        size_type n = 0;
+        try
+        {
+            for(size_type i=m.first(); i<m.container_.size(); ++i)
+            {
+                if( ! m.extras_->erased[i] && pred(m.container_[i]))
+                {
+                    m.bury(i);
+                    n += 1;
+                }
+            }
+        }
+        catch(...)
+        {
+            m.index_erased(indexed, 0);
+            throw;
+        }
+        if(n != 0) {m.index_erased(indexed, 0);}
+        else       {m.tidy(0);} // drops the marks
+        return n;
+    }
+
+    std::size_t count(const key_type& key) const
+    {
+        return this->contains(key) ? 1 : 0;
+    }
+    bool contains(const key_type& key) const
+    {
+        return this->find(key) != this->end();
+    }
+    iterator find(const key_type& key)
+    {
+        const auto found = this->locate(key);
+        if( ! found.exists)
+        {
+            return this->end();
+        }
+        return this->iterator_at(found.position);
+    }
+    const_iterator find(const key_type& key) const
+    {
+        const auto found = this->locate(key);
+        if( ! found.exists)
+        {
+            return this->end();
+        }
+        return this->iterator_at(found.position);
+    }
+
+    mapped_type&       at(const key_type& k)
+    {
+        const auto iter = this->find(k);
+        if(iter == this->end())
+        {
+            throw std::out_of_range("ordered_map: no such element");
+        }
+        return iter->second;
+    }
+    mapped_type const& at(const key_type& k) const
+    {
+        const auto iter = this->find(k);
+        if(iter == this->end())
+        {
+            throw std::out_of_range("ordered_map: no such element");
+        }
+        return iter->second;
+    }
+
+    // Heterogeneous lookup. Available if the comparator (or the hash and the
+    // equality of hashed_index) is transparent, like value_less.
+    template<detail::transparent_key<Key, key_index_type> K>
+    std::size_t count(const K& key) const
+    {
+        return this->contains(key) ? 1 : 0;
+    }
+    template<detail::transparent_key<Key, key_index_type> K>
+    bool contains(const K& key) const
+    {
+        return this->locate(key).exists;
+    }
+    template<detail::transparent_key<Key, key_index_type> K>
+    iterator find(const K& key)
+    {
+        const auto found = this->locate(key);
+        if( ! found.exists)
+        {
+            return this->end();
+        }
+        return this->iterator_at(found.position);
+    }
+    template<detail::transparent_key<Key, key_index_type> K>
+    const_iterator find(const K& key) const
+    {
+        const auto found = this->locate(key);
+        if( ! found.exists)
+        {
+            return this->end();
+        }
+        return this->iterator_at(found.position);
+    }
+    template<detail::transparent_key<Key, key_index_type> K>
+    mapped_type& at(const K& k)
+    {
+        const auto found = this->locate(k);
+        if( ! found.exists)
+        {
+            throw std::out_of_range("ordered_map: no such element");
+        }
+        return this->container_[found.position].second;
+    }
+    template<detail::transparent_key<Key, key_index_type> K>
+    mapped_type const& at(const K& k) const
+    {
+        const auto found = this->locate(k);
+        if( ! found.exists)
+        {
+            throw std::out_of_range("ordered_map: no such element");
+        }
+        return this->container_[found.position].second;
+    }
+
+    mapped_type& operator[](const key_type& k)
+    {
+        const auto found = this->locate(k);
+        if( ! found.exists)
+        {
+            this->append(value_type(k, mapped_type{}));
+            this->index_inserted(found.hint, this->container_.size() - 1);
+            return this->container_.back().second;
+        }
+        else
+        {
+            return this->container_[found.position].second;
+        }
+    }
+
+    mapped_type const& operator[](const key_type& k) const
+    {
+        const auto iter = this->find(k);
+        if(iter == this->end())
+        {
+            throw std::out_of_range("ordered_map: no such element");
+        }
+        else
+        {
+            return iter->second;
+        }
+    }
+
+    void swap(ordered_map& other) noexcept
+    {
+        container_.swap(other.container_);
+        extras_.swap(other.extras_);
+    }
+
+    bool operator==(const ordered_map& rhs) const noexcept
+    {
+        return this->size() == rhs.size() && std::equal(this->begin(), this->end(), rhs.begin());
+    }
+    bool operator< (const ordered_map& rhs) const noexcept
+    {
+        return std::lexicographical_compare(this->begin(), this->end(), rhs.begin(), rhs.end());
+    }
+    bool operator!=(const ordered_map& rhs) const noexcept {return !(*this == rhs);}
+    bool operator<=(const ordered_map& rhs) const noexcept {return !(rhs < *this);}
+    bool operator> (const ordered_map& rhs) const noexcept {return   rhs < *this ;}
+    bool operator>=(const ordered_map& rhs) const noexcept {return !(*this < rhs);}
+
+  private:
+
+    using lookup = typename key_index_type::lookup;
+
+    // The index and the places where elements have been erased. They are
+    // allocated together, only when the map is indexed or has tombstones, so
+    // that a small map without erasures is no larger than its vector and a
+    // null pointer, and iterating over it checks nothing.
+    struct extras
+    {
+        key_index_type index;
+        detail::ordered_map_marks<Allocator> erased; // one for each slot, or none
+        size_type count = 0; // of the tombstones
+        size_type first = 0; // the position of the first element
+    };
+
+    extras& extra()
+    {
+        if( ! this->extras_)
+        {
+            this->extras_ = std::make_unique<extras>();
+        }
+        return *this->extras_;
+    }
+
+    bool is_indexed() const noexcept
+    {
+        return linear_search_threshold <= this->size();
+    }
+    bool has_tombstones() const noexcept
+    {
+        return this->extras_ && ! this->extras_->erased.empty();
+    }
+    bool is_erased(const size_type i) const noexcept
+    {
+        return this->has_tombstones() && this->extras_->erased[i];
+    }
+    size_type first() const noexcept
+    {
+        return this->extras_ ? this->extras_->first : 0;
+    }
+    // the marks live on the heap, so that the iterators survive a swap like
+    // those of a vector
+    iterator iterator_at(const size_type i) noexcept
+    {
+        return iterator(this->container_.data() + i, this->container_.data(),
+                        this->has_tombstones() ? std::addressof(this->extras_->erased) : nullptr);
+    }
+    const_iterator iterator_at(const size_type i) const noexcept
+    {
+        return const_iterator(this->container_.data() + i, this->container_.data(),
+                              this->has_tombstones() ? std::addressof(this->extras_->erased) : nullptr);
+    }
+    size_type slot_index(const const_iterator pos) const noexcept
+    {
+        return static_cast<size_type>(pos.ptr_ - this->container_.data());
+    }
+
+    // throws std::out_of_range if there are duplicate keys
+    void construct_index()
+    {
+        if( ! this->is_indexed())
+        {
+            if(this->extras_) {this->extras_->index.clear();}
+            for(size_type i=this->first(); i<this->container_.size(); ++i)
+            {
+                if(this->is_erased(i)) {continue;}
+                for(size_type j=this->first(); j<i; ++j)
+                {
+                    if( ! this->is_erased(j) &&
+                        key_index_type::equal(this->container_[i].first,
+                                              this->container_[j].first))
+                    {
+                        throw std::out_of_range("ordered_map: value already exists");
+                    }
+                }
+            }
+            return;
+        }
+        if(this->has_tombstones())
+        {
+            this->compact(0);
+        }
+        this->extra().index.build(this->container_);
+    }
+
+    template<typename K>
+    lookup locate(const K& k) const
+    {
+        if( ! this->is_indexed())
+        {
+            for(size_type i=this->first(); i<this->container_.size(); ++i)
+            {
+                if( ! this->is_erased(i) && key_index_type::equal(this->container_[i].first, k))
+                {
+                    return lookup{true, i, 0};
+                }
+            }
+            return lookup{false, this->container_.size(), 0};
+        }
+        return this->extras_->index.find(this->container_, k);
+    }
+
+    // appends an element after the last slot
+    void append(value_type&& kv)
+    {
+        if( ! this->has_tombstones())
+        {
+            this->container_.push_back(std::move(kv));
+            return;
+        }
+        this->extras_->erased.push_back(false); // before the element, which cannot be undone
+        try
+        {
+            this->container_.push_back(std::move(kv));
+        }
+        catch(...)
+        {
+            this->extras_->erased.pop_back();
+            throw;
+        }
+    }
+
+    // allocates the tombstones before anything is erased
+    void mark_tombstones()
+    {
+        if( ! this->has_tombstones())
+        {
+            this->extra().erased.resize(this->container_.size(), false);
+        }
+    }
+
+    // forgets the marks after the last tombstone has gone. the index is kept
+    // if the map is still large enough to have one.
+    void drop_tombstones() noexcept
+    {
+        this->extras_->count = 0;
+        this->extras_->first = 0;
+        if( ! this->is_indexed())
+        {
+            this->extras_.reset();
+            return;
+        }
+        detail::ordered_map_marks<Allocator>().swap(this->extras_->erased);
+    }
+
+    // destroys the element at `i` and leaves a tombstone. the index is not
+    // updated.
+    void bury(const size_type i)
+    {
+        {
+            value_type erased(std::move(this->container_[i]));
+        }
+        this->extras_->erased[i] = true;
+        this->extras_->count += 1;
+    }
+
+    iterator erase_at(const lookup& found)
+    {
+        const bool last = (found.position + 1 == this->container_.size());
+        if( ! last)
+        {
+            this->mark_tombstones();
+        }
+        const bool indexed = this->is_indexed();
+        if(indexed)
+        {
+            this->extras_->index.erase(this->container_, found.hint, found.position);
+        }
+        if(last && ! this->has_tombstones()) // like pop_back, no tombstone is needed
+        {
+            this->container_.pop_back();
+            if(indexed && ! this->is_indexed())
+            {
+                this->extras_.reset();
+            }
+            return this->end();
+        }
+        this->bury(found.position);
+        if(indexed && ! this->is_indexed())
+        {
+            this->extras_->index.clear();
+        }
+
+        size_type next = found.position + 1;
+        while(next < this->container_.size() && this->extras_->erased[next])
+        {
+            next += 1;
+        }
+        return this->iterator_at(this->tidy(next));
+    }
+
+    // updates the index after elements are buried at once. returns the
+    // position of the slot `next` after that.
+    size_type index_erased(const bool was_indexed, const size_type next)
+    {
+        if(was_indexed)
+        {
+            if(this->is_indexed())
+            {
+                this->extras_->index.erase_marked(this->extras_->erased);
+            }
+            else
+            {
+                this->extras_->index.clear();
+            }
+        }
+        return this->tidy(next);
+    }
+
+    // Drops the tombstones at both ends, and compacts the slots if most of
+    // them are tombstones. Returns the position of the slot `next` after that.
+    size_type tidy(size_type next)
+    {
+        if(this->empty())
+        {
+            this->clear();
+            return 0;
+        }
+        auto& t = *this->extras_;
+        while(t.erased.back())
+        {
+            this->container_.pop_back();
+            t.erased.pop_back();
+            t.count -= 1;
+        }
+        while(t.erased[t.first])
+        {
+            t.first += 1;
+        }
+        next = std::min(next, this->container_.size());
+
+        if(t.count == 0)
+        {
+            this->drop_tombstones();
+        }
+        else if(this->size() < t.count)
+        {
+            return this->compact(next);
+        }
+        return next;
+    }
+
+    // Removes all the tombstones, keeping the order. Returns the position of
+    // the slot `keep` after that.
+    size_type compact(const size_type keep)
+    {
+        std::vector<size_type> moved_to;
+        if(this->is_indexed())
+        {
+            moved_to.resize(this->container_.size());
+        }
+        size_type n    = 0;
+        size_type kept = 0;
+        for(size_type i=0; i<this->container_.size(); ++i)
+        {
+            if(i == keep) {kept = n;}
+            if(this->extras_->erased[i]) {continue;}
+
+            if( ! moved_to.empty()) {moved_to[i] = n;}
+            if(i != n) {this->container_[n] = std::move(this->container_[i]);}
+            n += 1;
+        }
+        if(this->container_.size() <= keep) {kept = n;}
+
+        this->container_.erase(this->container_.begin() + static_cast<difference_type>(n),
+                               this->container_.end());
+        this->drop_tombstones();
+        if( ! moved_to.empty())
+        {
+            this->extras_->index.renumber(moved_to);
+        }
+        return kept;
+    }
+
+    // Puts `kv` in front of the slot `at`. It reuses the nearest tombstone,
+    // moving the elements in between by one, and the index is updated for
+    // the moved ones. Returns the position of `kv`.
+    size_type place(const size_type at, value_type&& kv)
+    {
+        const bool indexed = this->is_indexed();
+        if(at == this->container_.size())
+        {
+            this->append(std::move(kv));
+            return at;
+        }
+        if( ! this->has_tombstones())
+        {
+            this->container_.insert(this->container_.begin() + static_cast<difference_type>(at),
+                                    std::move(kv));
+            if(indexed)
+            {
+                this->extras_->index.shift(this->container_, at, this->container_.size() - 1, 1);
+            }
+            return at;
+        }
+
+        auto& t = *this->extras_;
+        size_type hole = at;
+        if(0 < at && t.erased[at - 1])
+        {
+            hole = at - 1;
+        }
+        else // find the nearest tombstone on either side
+        {
+            for(size_type d=1; ; ++d)
+            {
+                if(at + d < this->container_.size() && t.erased[at + d])
+                {
+                    const auto gap = at + d;
+                    std::move_backward(this->container_.begin() + static_cast<difference_type>(at),
+                                       this->container_.begin() + static_cast<difference_type>(gap),
+                                       this->container_.begin() + static_cast<difference_type>(gap + 1));
+                    if(indexed)
+                    {
+                        this->extras_->index.shift(this->container_, at, gap, 1);
+                    }
+                    t.erased[gap] = false;
+                    hole = at;
+                    break;
+                }
+                if(d + 1 <= at && t.erased[at - 1 - d])
+                {
+                    const auto gap = at - 1 - d;
+                    std::move(this->container_.begin() + static_cast<difference_type>(gap + 1),
+                              this->container_.begin() + static_cast<difference_type>(at),
+                              this->container_.begin() + static_cast<difference_type>(gap));
+                    if(indexed)
+                    {
+                        this->extras_->index.shift(this->container_, gap + 1, at, -1);
+                    }
+                    t.erased[gap] = false;
+                    hole = at - 1;
+                    t.first = std::min(t.first, gap);
+                    break;
+                }
+            }
+        }
+        this->container_[hole] = std::move(kv);
+        t.erased[hole] = false;
+        t.count -= 1;
+        t.first  = std::min(t.first, hole);
+        return hole;
+    }
+
+    // updates the index after an element is inserted at `index`. `hint` is
+    // the one `locate` returned before the insertion.
+    void index_inserted(const size_type hint, const size_type index)
+    {
+        if(this->has_tombstones() && this->extras_->count == 0)
+        {
+            this->drop_tombstones(); // the last tombstone has been reused
+        }
+        if( ! this->is_indexed())
+        {
+            return;
+        }
+        if(this->size() == linear_search_threshold)
+        {
+            this->construct_index(); // reached the threshold just now
+            return;
+        }
+        this->extras_->index.insert(this->container_, hint, index);
+    }
+
+  private:
+
+    container_type container_;
+    std::unique_ptr<extras> extras_; // null if there is neither an index nor a tombstone
+};
+
+template<typename K, typename V, typename C, typename A, std::size_t N, typename I>
+void swap(ordered_map<K,V,C,A,N,I>& lhs, ordered_map<K,V,C,A,N,I>& rhs) noexcept
+{
+    lhs.swap(rhs);
+    return;
+}
+
+} // msgplus
+#endif // MSGPLUS_ORDERED_MAP_HPP
+#ifndef MSGPLUS_SMALL_VECTOR_HPP
+#define MSGPLUS_SMALL_VECTOR_HPP
+
+#include <algorithm>
+#include <compare>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+// A vector of trivially copyable elements that keeps up to `N` elements in
+// itself, without allocating. Longer contents are kept in a `std::vector`,
+// which can be moved in and out without copying the elements.
+//
+// The capacity does not shrink automatically; `shrink_to_fit()` moves short
+// contents back to the inline buffer.
+//
+// It has the members of std::vector that are used to build contents, but it
+// is not one: it converts to std::span, and to std::vector by `to_vector()`.
+template<typename T, std::size_t N, typename Allocator = std::allocator<T>>
+class small_vector
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+    static_assert(0 < N && N < 255);
+
+  public:
+
+    using value_type      = T;
+    using allocator_type  = Allocator;
+    using size_type       = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference       = T&;
+    using const_reference = T const&;
+    using pointer         = T*;
+    using const_pointer   = T const*;
+    using iterator        = T*;
+    using const_iterator  = T const*;
+    using vector_type     = std::vector<T, Allocator>;
+
+    static constexpr size_type inline_capacity = N;
+
+  public:
+
+    small_vector() noexcept: size_(0) {}
+    ~small_vector() {this->reset();}
+
+    small_vector(const small_vector& other): size_(0)
+    {
+        this->assign(other.begin(), other.end());
+    }
+    small_vector(small_vector&& other) noexcept: size_(0)
+    {
+        this->steal(other);
+    }
+    small_vector& operator=(const small_vector& other)
+    {
+        if(this != std::addressof(other))
+        {
+            this->assign(other.begin(), other.end());
+        }
+        return *this;
+    }
+    small_vector& operator=(small_vector&& other) noexcept
+    {
+        if(this != std::addressof(other))
+        {
+            this->reset();
+            this->steal(other);
+        }
+        return *this;
+    }
+
+    explicit small_vector(const size_type n): size_(0)
+    {
+        this->resize(n);
+    }
+    small_vector(const size_type n, const T& x): size_(0)
+    {
+        this->assign(n, x);
+    }
+    template<std::input_iterator InputIter>
+    small_vector(InputIter first, InputIter last): size_(0)
+    {
+        this->assign(first, last);
+    }
+    small_vector(std::initializer_list<T> init): size_(0)
+    {
+        this->assign(init.begin(), init.end());
+    }
+
+    // from a std::vector. a long one is adopted without copying.
+    small_vector(const vector_type& v): size_(0)
+    {
+        this->assign(v.begin(), v.end());
+    }
+    small_vector(vector_type&& v): size_(0)
+    {
+        if(v.size() <= N)
+        {
+            std::copy(v.begin(), v.end(), inline_);
+            size_ = static_cast<std::uint8_t>(v.size());
+        }
+        else
+        {
+            std::construct_at(std::addressof(heap_), std::move(v));
+            size_ = on_heap;
+        }
+    }
+
+    vector_type to_vector() const&
+    {
+        return vector_type(this->begin(), this->end());
+    }
+    vector_type to_vector() &&
+    {
+        if(this->is_inline())
+        {
+            return vector_type(this->begin(), this->end());
+        }
+        vector_type retval(std::move(heap_));
+        this->reset();
+        return retval;
+    }
+
+    operator std::span<const T>() const noexcept {return {this->data(), this->size()};}
+    operator std::span<T>()             noexcept {return {this->data(), this->size()};}
+
+    void assign(const size_type n, const T& x)
+    {
+        if(this->is_inline() && n <= N)
+        {
+            std::fill_n(inline_, n, x);
+            size_ = static_cast<std::uint8_t>(n);
+            return;
+        }
+        this->clear();
+        this->reserve(n);
+        heap_.assign(n, x);
+    }
+    template<std::input_iterator InputIter>
+    void assign(InputIter first, InputIter last)
+    {
+        if constexpr(std::forward_iterator<InputIter>)
+        {
+            const auto n = static_cast<size_type>(std::distance(first, last));
+            if(this->is_inline() && n <= N)
+            {
+                std::copy(first, last, inline_);
+                size_ = static_cast<std::uint8_t>(n);
+                return;
+            }
+            this->clear();
+            this->reserve(n);
+            heap_.assign(first, last);
+        }
+        else
+        {
+            this->clear();
+            for(; first != last; ++first)
+            {
+                this->push_back(*first);
+            }
+        }
+    }
+
+    bool      is_inline() const noexcept {return size_ != on_heap;}
+    bool      empty()     const noexcept {return this->size() == 0;}
+    size_type size()      const noexcept {return this->is_inline() ? size_ : heap_.size();}
+    size_type capacity()  const noexcept {return this->is_inline() ? N : heap_.capacity();}
+
+    void reserve(const size_type n)
+    {
+        if(this->is_inline())
+        {
+            if(n <= N) {return;}
+            this->move_to_heap(n);
+        }
+        else
+        {
+            heap_.reserve(n);
+        }
+    }
+    void shrink_to_fit()
+    {
+        if(this->is_inline()) {return;}
+        if(heap_.size() <= N)
+        {
+            vector_type h(std::move(heap_));
+            this->reset();
+            std::memcpy(inline_, h.data(), h.size() * sizeof(T));
+            size_ = static_cast<std::uint8_t>(h.size());
+        }
+        else
+        {
+            heap_.shrink_to_fit();
+        }
+    }
+
+    // new elements are value-initialized
+    void resize(const size_type n)
+    {
+        if(this->is_inline() && n <= N)
+        {
+            if(size_ < n)
+            {
+                std::fill(inline_ + size_, inline_ + n, T{});
+            }
+            size_ = static_cast<std::uint8_t>(n);
+            return;
+        }
+        this->reserve(n);
+        heap_.resize(n);
+    }
+    void resize(const size_type n, const T& x)
+    {
+        const T copy = x; // `x` may be an element of this
+        if(this->is_inline() && n <= N)
+        {
+            if(size_ < n)
+            {
+                std::fill(inline_ + size_, inline_ + n, copy);
+            }
+            size_ = static_cast<std::uint8_t>(n);
+            return;
+        }
+        this->reserve(n);
+        heap_.resize(n, copy);
+    }
+    void clear() noexcept
+    {
+        if(this->is_inline()) {size_ = 0;}
+        else                  {heap_.clear();}
+    }
+
+    void push_back(const T& x)
+    {
+        if(this->is_inline() && size_ < N)
+        {
+            inline_[size_++] = x;
+            return;
+        }
+        const T copy = x; // `x` may be an element of this
+        if(this->is_inline())
+        {
+            this->move_to_heap(2 * N);
+        }
+        heap_.push_back(copy);
+    }
+    template<typename ... Args>
+    T& emplace_back(Args&& ... args)
+    {
+        this->push_back(T(std::forward<Args>(args)...));
+        return this->back();
+    }
+    void pop_back() noexcept
+    {
+        if(this->is_inline()) {--size_;}
+        else                  {heap_.pop_back();}
+    }
+
+    iterator insert(const_iterator pos, const T& x)
+    {
+        return this->insert(pos, 1, x);
+    }
+    iterator insert(const_iterator pos, const size_type n, const T& x)
+    {
+        const T copy = x; // `x` may be an element of this
+        const auto i = static_cast<size_type>(pos - this->cbegin());
+        if(this->is_inline() && size_ + n <= N)
+        {
+            std::copy_backward(inline_ + i, inline_ + size_, inline_ + size_ + n);
+            std::fill_n(inline_ + i, n, copy);
+            size_ = static_cast<std::uint8_t>(size_ + n);
+            return inline_ + i;
+        }
+        this->spill(n);
+        heap_.insert(heap_.begin() + static_cast<difference_type>(i), n, copy);
+        return heap_.data() + i;
+    }
+    template<std::input_iterator InputIter>
+    iterator insert(const_iterator pos, InputIter first, InputIter last)
+    {
+        if constexpr(std::forward_iterator<InputIter>)
+        {
+            const auto n = static_cast<size_type>(std::distance(first, last));
+            const auto i = static_cast<size_type>(pos - this->cbegin());
+            if(this->is_inline() && size_ + n <= N)
+            {
+                std::copy_backward(inline_ + i, inline_ + size_, inline_ + size_ + n);
+                std::copy(first, last, inline_ + i);
+                size_ = static_cast<std::uint8_t>(size_ + n);
+                return inline_ + i;
+            }
+            this->spill(n);
+            heap_.insert(heap_.begin() + static_cast<difference_type>(i), first, last);
+            return heap_.data() + i;
+        }
+        else // appended, then rotated into place
+        {
+            const auto i   = static_cast<size_type>(pos - this->cbegin());
+            const auto old = this->size();
+            for(; first != last; ++first)
+            {
+                this->push_back(*first);
+            }
+            std::rotate(this->begin() + i, this->begin() + old, this->end());
+            return this->begin() + i;
+        }
+    }
+    iterator insert(const_iterator pos, std::initializer_list<T> init)
+    {
+        return this->insert(pos, init.begin(), init.end());
+    }
+    template<typename ... Args>
+    iterator emplace(const_iterator pos, Args&& ... args)
+    {
+        return this->insert(pos, T(std::forward<Args>(args)...));
+    }
+
+    iterator erase(const_iterator pos)
+    {
+        return this->erase(pos, pos + 1);
+    }
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        const auto i = static_cast<size_type>(first - this->cbegin());
+        const auto j = static_cast<size_type>(last  - this->cbegin());
+        const auto n = this->size();
+        std::copy(this->begin() + j, this->end(), this->begin() + i);
+        this->resize(n - (j - i));
+        return this->begin() + i;
+    }
+
+    T*       data()       noexcept {return this->is_inline() ? inline_ : heap_.data();}
+    T const* data() const noexcept {return this->is_inline() ? inline_ : heap_.data();}
+
+    iterator       begin()        noexcept {return this->data();}
+    iterator       end()          noexcept {return this->data() + this->size();}
+    const_iterator begin()  const noexcept {return this->data();}
+    const_iterator end()    const noexcept {return this->data() + this->size();}
+    const_iterator cbegin() const noexcept {return this->data();}
+    const_iterator cend()   const noexcept {return this->data() + this->size();}
+
+    T&       operator[](const size_type i)       noexcept {return this->data()[i];}
+    T const& operator[](const size_type i) const noexcept {return this->data()[i];}
+
+    T& at(const size_type i)
+    {
+        if(this->size() <= i)
+        {
+            throw std::out_of_range("small_vector::at()");
+        }
+        return this->data()[i];
+    }
+    T const& at(const size_type i) const
+    {
+        if(this->size() <= i)
+        {
+            throw std::out_of_range("small_vector::at()");
+        }
+        return this->data()[i];
+    }
+
+    T&       front()       noexcept {return this->data()[0];}
+    T const& front() const noexcept {return this->data()[0];}
+    T&       back()        noexcept {return this->data()[this->size() - 1];}
+    T const& back()  const noexcept {return this->data()[this->size() - 1];}
+
+    void swap(small_vector& other) noexcept
+    {
+        small_vector tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    friend bool operator==(const small_vector& lhs, const small_vector& rhs) noexcept
+    {
+        return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+    }
+    friend bool operator!=(const small_vector& lhs, const small_vector& rhs) noexcept
+    {
+        return !(lhs == rhs);
+    }
+    friend bool operator< (const small_vector& lhs, const small_vector& rhs) noexcept
+    {
+        return std::lexicographical_compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+    }
+    friend bool operator<=(const small_vector& lhs, const small_vector& rhs) noexcept {return !(rhs < lhs);}
+    friend bool operator> (const small_vector& lhs, const small_vector& rhs) noexcept {return   rhs < lhs ;}
+    friend bool operator>=(const small_vector& lhs, const small_vector& rhs) noexcept {return !(lhs < rhs);}
+
+  private:
+
+    static constexpr std::uint8_t on_heap = 0xFF;
+
+    void move_to_heap(const size_type cap)
+    {
+        vector_type h;
+        h.reserve(cap);
+        h.assign(inline_, inline_ + std::min<size_type>(size_, N)); // size_ <= N here, spelled out for -Warray-bounds
+        std::construct_at(std::addressof(heap_), std::move(h));
+        size_ = on_heap;
+    }
+
+    // moves inline contents to the heap before `n` more elements are added
+    void spill(const size_type n)
+    {
+        if(this->is_inline())
+        {
+            this->move_to_heap(std::max<size_type>(size_ + n, 2 * N));
+        }
+    }
+
+    // takes the contents of `other`. `this` must be empty and inline.
+    void steal(small_vector& other) noexcept
+    {
+        if(other.is_inline())
+        {
+            std::memcpy(inline_, other.inline_, other.size_ * sizeof(T));
+            size_ = other.size_;
+        }
+        else
+        {
+            std::construct_at(std::addressof(heap_), std::move(other.heap_));
+            size_ = on_heap;
+            other.reset();
+        }
+    }
+
+    // back to an empty inline buffer
+    void reset() noexcept
+    {
+        if( ! this->is_inline())
+        {
+            std::destroy_at(std::addressof(heap_));
+        }
+        size_ = 0;
+    }
+
+  private:
+
+    union
+    {
+        T           inline_[N];
+        vector_type heap_;
+    };
+    std::uint8_t size_; // the number of inline elements, or `on_heap`
+};
+
+template<typename T, std::size_t N, typename A>
+void swap(small_vector<T, N, A>& lhs, small_vector<T, N, A>& rhs) noexcept
+{
+    lhs.swap(rhs);
+    return ;
+}
+
+namespace detail
+{
+
+// A stack that keeps its first `N` elements in itself, so that shallow
+// nesting needs no allocation. Unlike small_vector, the elements need not be
+// trivially copyable; the inline ones are constructed when they are pushed.
+// References to them stay valid while the stack grows.
+template<typename T, std::size_t N>
+class small_stack
+{
+  public:
+
+    small_stack() noexcept = default;
+    ~small_stack() {this->clear();}
+
+    small_stack(const small_stack& other): rest_(other.rest_)
+    {
+        try
+        {
+            for(; size_ < std::min(other.size_, N); ++size_)
+            {
+                std::construct_at(this->at(size_), *other.at(size_));
+            }
+        }
+        catch(...)
+        {
+            this->clear();
+            throw;
+        }
+        size_ = other.size_;
+    }
+    small_stack(small_stack&& other) noexcept
+    {
+        this->take(other);
+    }
+    small_stack& operator=(const small_stack& other)
+    {
+        if(this != std::addressof(other))
+        {
+            small_stack tmp(other);
+            this->clear();
+            this->take(tmp);
+        }
+        return *this;
+    }
+    small_stack& operator=(small_stack&& other) noexcept
+    {
+        if(this != std::addressof(other))
+        {
+            this->clear();
+            this->take(other);
+        }
+        return *this;
+    }
+
+    bool        empty() const noexcept {return size_ == 0;}
+    std::size_t size()  const noexcept {return size_;}
+
+    T&       back()       noexcept {return size_ <= N ? *this->at(size_ - 1) : rest_.back();}
+    T const& back() const noexcept {return size_ <= N ? *this->at(size_ - 1) : rest_.back();}
+
+    void push_back(T x)
+    {
+        if(size_ < N) {std::construct_at(this->at(size_), std::move(x));}
+        else          {rest_.push_back(std::move(x));}
+        size_ += 1;
+    }
+    void pop_back() noexcept
+    {
+        if(N < size_) {rest_.pop_back();}
+        else          {std::destroy_at(this->at(size_ - 1));}
+        size_ -= 1;
+    }
+    void clear() noexcept
+    {
+        rest_.clear();
+        for(std::size_t i = std::min(size_, N); 0 < i; --i)
+        {
+            std::destroy_at(this->at(i - 1));
+        }
+        size_ = 0;
+    }
+
+  private:
+
+    static_assert(std::is_nothrow_move_constructible_v<T>);
+
+    // takes the elements of `other`. `this` must be empty.
+    void take(small_stack& other) noexcept
+    {
+        rest_ = std::move(other.rest_);
+        for(; size_ < std::min(other.size_, N); ++size_)
+        {
+            std::construct_at(this->at(size_), std::move(*other.at(size_)));
+        }
+        size_ = other.size_;
+        other.clear();
+    }
+
+    T*       at(const std::size_t i)       noexcept {return std::launder(reinterpret_cast<T*>(inline_)) + i;}
+    T const* at(const std::size_t i) const noexcept {return std::launder(reinterpret_cast<const T*>(inline_)) + i;}
+
+  private:
+
+    alignas(T) std::byte inline_[N * sizeof(T)];
+    std::vector<T>       rest_;
+    std::size_t          size_ = 0;
+};
+
+} // detail
+
+} // msgplus
+#endif // MSGPLUS_SMALL_VECTOR_HPP
+#ifndef MSGPLUS_EXT_HPP
+#define MSGPLUS_EXT_HPP
+
+#include <algorithm>
+#include <array>
+#include <compare>
+#include <concepts>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+// Converts the payload of an extension to an object of `value_type` and back.
+//
+// ```cpp
+// struct point_codec
+// {
+//     using value_type = point;
+//     std::optional<point> decode(std::span<const std::byte> payload) const;
+//     std::size_t encoded_size(const point& p) const;
+//     bool encode(const point& p, std::span<std::byte> out) const; // out.size() == encoded_size(p)
+//
+//     // optional. compares two objects without encoding them. It must agree
+//     // with the comparison of their encoded payloads.
+//     std::strong_ordering compare(const point& a, const point& b) const;
+// };
+// ```
+template<typename C>
+concept ExtCodec = std::copy_constructible<C> &&
+    requires(const C& c, const typename C::value_type& x,
+             std::span<const std::byte> in, std::span<std::byte> out) {
+    {c.decode(in)}          -> std::same_as<std::optional<typename C::value_type>>;
+    {c.encoded_size(x)}     -> std::convertible_to<std::size_t>;
+    {c.encode(x, out)}      -> std::convertible_to<bool>;
+};
+
+namespace detail
+{
+
+// a distinct address for each type, to identify the object without RTTI
+template<typename T>
+struct type_tag
+{
+    static constexpr char id = 0;
+};
+
+struct typed_ext_model_base
+{
+    virtual ~typed_ext_model_base() = default;
+
+    virtual const void* tag()       const noexcept = 0;
+    virtual const void* codec_tag() const noexcept = 0;
+    virtual const void* object()    const noexcept = 0;
+    virtual std::size_t encoded_size() const = 0;
+    virtual bool        encode(std::span<std::byte> out) const = 0;
+
+    // unordered if the codec cannot compare the objects
+    virtual std::partial_ordering compare(const typed_ext_model_base& rhs) const = 0;
+};
+
+template<ExtCodec C>
+struct typed_ext_model final : typed_ext_model_base
+{
+    typed_ext_model(C c, typename C::value_type x)
+        : codec(std::move(c)), obj(std::move(x))
+    {}
+
+    const void* tag()       const noexcept override {return std::addressof(type_tag<typename C::value_type>::id);}
+    const void* codec_tag() const noexcept override {return std::addressof(type_tag<C>::id);}
+    const void* object()    const noexcept override {return std::addressof(obj);}
+    std::size_t encoded_size() const override {return codec.encoded_size(obj);}
+    bool encode(std::span<std::byte> out) const override {return codec.encode(obj, out);}
+
+    std::partial_ordering compare(const typed_ext_model_base& rhs) const override
+    {
+        if constexpr(requires {{codec.compare(obj, obj)} -> std::convertible_to<std::strong_ordering>;})
+        {
+            if(rhs.codec_tag() == this->codec_tag())
+            {
+                return codec.compare(obj, static_cast<const typed_ext_model&>(rhs).obj);
+            }
+        }
+        return std::partial_ordering::unordered;
+    }
+
+    [[no_unique_address]] C codec;
+    typename C::value_type  obj;
+};
+
+// The encoded payload of a typed_ext. It is encoded into a buffer on the
+// stack if it fits, so that comparing and hashing small objects does not
+// allocate. Empty and not `ok()` if the codec fails to encode the object,
+// including by throwing, or if a large payload cannot be allocated.
+class typed_ext_payload
+{
+  public:
+
+    static constexpr std::size_t inline_size = 128;
+
+    explicit typed_ext_payload(const typed_ext_model_base& m) noexcept
+    {
+        try
+        {
+            const std::size_t n = m.encoded_size();
+            std::span<std::byte> out;
+            if(n <= inline_size)
+            {
+                out = std::span<std::byte>(this->buf_).first(n);
+            }
+            else
+            {
+                this->heap_.resize(n);
+                out = this->heap_;
+            }
+            if(m.encode(out))
+            {
+                this->bytes_ = out;
+                this->ok_    = true;
+            }
+        }
+        catch(...)
+        {
+            // the same as a failure to encode
+        }
+    }
+    ~typed_ext_payload() = default;
+    typed_ext_payload(const typed_ext_payload&) = delete;
+    typed_ext_payload(typed_ext_payload&&)      = delete;
+    typed_ext_payload& operator=(const typed_ext_payload&) = delete;
+    typed_ext_payload& operator=(typed_ext_payload&&)      = delete;
+
+    std::span<const std::byte> bytes() const noexcept {return bytes_;}
+    bool                       ok()    const noexcept {return ok_;}
+
+  private:
+
+    std::array<std::byte, inline_size> buf_;
+    std::vector<std::byte>             heap_;
+    std::span<const std::byte>         bytes_;
+    bool                               ok_ = false;
+};
+
+} // detail
+
+// An extension object decoded by a codec registered in an `ext_registry`.
+//
+// The object is immutable and shared between copies, like the nodes of
+// `shared_value`. It keeps its codec, so it is written back in the same
+// format. Two typed_exts are compared by their type and encoded payload, or
+// by the codec if it provides `compare`. Payloads of up to
+// `detail::typed_ext_payload::inline_size` bytes are compared and hashed
+// without allocation.
+//
+// The comparisons do not throw, since `value`'s do not. If the codec throws
+// or fails to encode an object, the object sorts before the ones that
+// encode, and is equal only to its own copies.
+class typed_ext
+{
+  public:
+
+    template<ExtCodec C>
+    typed_ext(const std::int8_t type, typename C::value_type obj, C codec)
+        : type_(type),
+          obj_(std::make_shared<const detail::typed_ext_model<C>>(std::move(codec), std::move(obj)))
+    {}
+    ~typed_ext() = default;
+    typed_ext(const typed_ext&) = default;
+    typed_ext(typed_ext&&)      = default;
+    typed_ext& operator=(const typed_ext&) = default;
+    typed_ext& operator=(typed_ext&&)      = default;
+
+    std::int8_t type() const noexcept {return type_;}
+
+    // nullptr if the object is not a T
+    template<typename T>
+    T const* get() const noexcept
+    {
+        if(this->obj_->tag() != std::addressof(detail::type_tag<T>::id))
+        {
+            return nullptr;
+        }
+        return static_cast<T const*>(this->obj_->object());
+    }
+
+    std::size_t encoded_size() const {return obj_->encoded_size();}
+
+    // `out.size()` must be `encoded_size()`
+    bool encode(std::span<std::byte> out) const {return obj_->encode(out);}
+
+    // the encoded payload. empty if the codec fails to encode the object.
+    std::vector<std::byte> payload() const
+    {
+        std::vector<std::byte> retval(this->encoded_size());
+        if( ! this->encode(retval))
+        {
+            retval.clear();
+        }
+        return retval;
+    }
+
+    // calls `f` with the encoded payload, which is not allocated if it is
+    // small. it is empty if the object cannot be encoded.
+    template<typename F>
+    decltype(auto) visit_payload(F&& f) const
+    {
+        const detail::typed_ext_payload p(*this->obj_);
+        return std::forward<F>(f)(p.bytes());
+    }
+
+    bool operator==(const typed_ext& rhs) const noexcept {return this->order(rhs) == 0;}
+    bool operator!=(const typed_ext& rhs) const noexcept {return !(*this == rhs);}
+    bool operator< (const typed_ext& rhs) const noexcept {return this->order(rhs) <  0;}
+    bool operator<=(const typed_ext& rhs) const noexcept {return !(rhs < *this);}
+    bool operator> (const typed_ext& rhs) const noexcept {return   rhs < *this ;}
+    bool operator>=(const typed_ext& rhs) const noexcept {return !(*this < rhs);}
+
+  private:
+
+    std::strong_ordering order(const typed_ext& rhs) const noexcept
+    {
+        if(this->type_ != rhs.type_) {return this->type_ <=> rhs.type_;}
+        if(this->obj_  == rhs.obj_)  {return std::strong_ordering::equal;}
+        try
+        {
+            const auto c = this->obj_->compare(*rhs.obj_);
+            if(c != std::partial_ordering::unordered)
+            {
+                return c < 0 ? std::strong_ordering::less :
+                       c > 0 ? std::strong_ordering::greater : std::strong_ordering::equal;
+            }
+        }
+        catch(...)
+        {
+            // compare the payloads instead
+        }
+
+        const detail::typed_ext_payload lhs_payload(*this->obj_);
+        const detail::typed_ext_payload rhs_payload(*rhs.obj_);
+        if(lhs_payload.ok() && rhs_payload.ok())
+        {
+            const auto l = lhs_payload.bytes();
+            const auto r = rhs_payload.bytes();
+            return std::lexicographical_compare_three_way(l.begin(), l.end(), r.begin(), r.end());
+        }
+        if(lhs_payload.ok() != rhs_payload.ok())
+        {
+            return lhs_payload.ok() ? std::strong_ordering::greater : std::strong_ordering::less;
+        }
+        // neither can be encoded. distinct objects are ordered by address.
+        return std::compare_three_way{}(this->obj_.get(), rhs.obj_.get());
+    }
+
+    std::int8_t                                        type_;
+    std::shared_ptr<const detail::typed_ext_model_base> obj_;
+};
+
+// A set of codecs, one for each extension type id.
+//
+// A decoder that is given a registry decodes the extensions of the registered
+// types into `typed_ext`s, directly from the reader when it provides
+// `read_view()`, and without a payload vector otherwise. Other extensions
+// remain `ext_type`. If a codec fails to decode a payload, the payload is kept
+// as an `ext_type` too.
+//
+// A registered codec takes precedence over the built-in timestamp (-1).
+class ext_registry
+{
+  public:
+
+    using decode_function = std::function<
+        std::optional<typed_ext>(std::int8_t, std::span<const std::byte>)>;
+
+  public:
+
+    ext_registry() = default;
+    ~ext_registry() = default;
+    ext_registry(const ext_registry&) = default;
+    ext_registry(ext_registry&&)      = default;
+    ext_registry& operator=(const ext_registry&) = default;
+    ext_registry& operator=(ext_registry&&)      = default;
+
+    // replaces the codec of `type` if there already is one
+    template<ExtCodec C>
+    ext_registry& add(const std::int8_t type, C codec)
+    {
+        this->codecs_[slot(type)] = [codec = std::move(codec)](
+            const std::int8_t t, std::span<const std::byte> payload) -> std::optional<typed_ext>
+        {
+            auto obj = codec.decode(payload);
+            if( ! obj.has_value())
+            {
+                return std::nullopt;
+            }
+            return typed_ext(t, std::move(obj.value()), codec);
+        };
+        return *this;
+    }
+
+    void remove(const std::int8_t type)
+    {
+        this->codecs_[slot(type)] = nullptr;
+    }
+
+    bool contains(const std::int8_t type) const noexcept
+    {
+        return static_cast<bool>(this->codecs_[slot(type)]);
+    }
+
+    // nullptr if `type` has no codec
+    decode_function const* find(const std::int8_t type) const noexcept
+    {
+        const auto& f = this->codecs_[slot(type)];
+        return f ? std::addressof(f) : nullptr;
+    }
+
+  private:
+
+    static std::size_t slot(const std::int8_t type) noexcept
+    {
+        return static_cast<std::uint8_t>(type);
+    }
+
+  private:
+
+    std::array<decode_function, 256> codecs_;
+};
+
+} // msgplus
+#endif // MSGPLUS_EXT_HPP
+#ifndef MSGPLUS_VALUE_HPP
+#define MSGPLUS_VALUE_HPP
+
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <concepts>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace msgplus
+{
+
+enum class type_t : std::uint8_t
+{
+    nil_t     =  0,
+    bool_t    =  1,
+    int_t     =  2,
+    uint_t    =  3,
+    float32_t =  4,
+    float64_t =  5,
+    str_t     =  6,
+    bin_t     =  7,
+    array_t   =  8,
+    map_t     =  9,
+    ext_t     = 10,
+    timestamp_t = 11,
+    typed_ext_t = 12,
+};
+
+struct value_less;
+
+class value
+{
+  public:
+
+    using nil_type     = std::monostate;
+    using bool_type    = bool;
+    using int_type     = std::int64_t;
+    using uint_type    = std::uint64_t;
+    using float32_type = float;
+    using float64_type = double;
+    using str_type     = std::string;
+    // payloads up to 24 bytes (e.g. UUIDs) are stored without allocation
+    using bin_type     = small_vector<std::byte, 24>;
+    using array_type   = std::vector<value>;
+    using map_type     = ordered_map<value, value, value_less>;
+    using ext_type     = std::pair<std::int8_t, bin_type>;
+    // the timestamp extension (type -1)
+    using timestamp_type = std::chrono::sys_time<std::chrono::nanoseconds>;
+    // an extension decoded by a registered codec
+    using typed_ext_type = typed_ext;
+
+  public:
+
+    value(): value_(nil_type{}) {}
+    ~value() {this->release_nested();}
+    value(const value&) = default;
+    value(value&&)      = default;
+    value& operator=(const value&) = default;
+    value& operator=(value&&)      = default;
+
+    value(nil_type     v): value_(std::move(v)) {}
+    value(bool_type    v): value_(std::move(v)) {}
+    template<std::signed_integral T>
+    value(T v): value_(int_type(std::move(v))) {}
+    template<std::unsigned_integral T>
+    value(T v): value_(uint_type(std::move(v))) {}
+    value(float32_type v): value_(std::move(v)) {}
+    value(float64_type v): value_(std::move(v)) {}
+    value(str_type     v): value_(std::move(v)) {}
+    template<std::size_t N>
+    value(const char (&v)[N]): value_(str_type(v)) {}
+    value(const char* v): value_(str_type(v)) {}
+    value(bin_type     v): value_(std::move(v)) {}
+    value(array_type   v): value_(std::move(v)) {}
+    value(map_type     v): value_(std::move(v)) {}
+    value(ext_type     v): value_(std::move(v)) {}
+    value(timestamp_type v): value_(std::move(v)) {}
+    value(typed_ext_type v): value_(std::move(v)) {}
+
+    value& operator=(nil_type     v) { value_ = std::move(v); return *this;}
+    value& operator=(bool_type    v) { value_ = std::move(v); return *this;}
+    template<std::signed_integral T>
+    value& operator=(T v) { value_ = int_type(std::move(v)); return *this;}
+    template<std::unsigned_integral T>
+    value& operator=(T v) { value_ = uint_type(std::move(v)); return *this;}
+    value& operator=(float32_type v) { value_ = std::move(v); return *this;}
+    value& operator=(float64_type v) { value_ = std::move(v); return *this;}
+    template<std::size_t N>
+    value& operator=(const char (&v)[N]){ value_ = str_type(v); return *this;}
+    value& operator=(const char* v)     { value_ = str_type(v); return *this;}
+    value& operator=(bin_type     v) { value_ = std::move(v); return *this;}
+    value& operator=(array_type   v) { value_ = std::move(v); return *this;}
+    value& operator=(map_type     v) { value_ = std::move(v); return *this;}
+    value& operator=(ext_type     v) { value_ = std::move(v); return *this;}
+    value& operator=(timestamp_type v) { value_ = std::move(v); return *this;}
+    value& operator=(typed_ext_type v) { value_ = std::move(v); return *this;}
+
+    type_t type() const noexcept {return static_cast<type_t>(value_.index());}
+
+    bool is_nil    () const noexcept {return value_.index() ==  0;}
+    bool is_bool   () const noexcept {return value_.index() ==  1;}
+    bool is_int    () const noexcept {return value_.index() ==  2;}
+    bool is_uint   () const noexcept {return value_.index() ==  3;}
+    bool is_float32() const noexcept {return value_.index() ==  4;}
+    bool is_float64() const noexcept {return value_.index() ==  5;}
+    bool is_str    () const noexcept {return value_.index() ==  6;}
+    bool is_bin    () const noexcept {return value_.index() ==  7;}
+    bool is_array  () const noexcept {return value_.index() ==  8;}
+    bool is_map    () const noexcept {return value_.index() ==  9;}
+    bool is_ext    () const noexcept {return value_.index() == 10;}
+    bool is_timestamp() const noexcept {return value_.index() == 11;}
+    bool is_typed_ext() const noexcept {return value_.index() == 12;}
+
+    nil_type    & as_nil    () {return std::get< 0>(value_);}
+    bool_type   & as_bool   () {return std::get< 1>(value_);}
+    int_type    & as_int    () {return std::get< 2>(value_);}
+    uint_type   & as_uint   () {return std::get< 3>(value_);}
+    float32_type& as_float32() {return std::get< 4>(value_);}
+    float64_type& as_float64() {return std::get< 5>(value_);}
+    str_type    & as_str    () {return std::get< 6>(value_);}
+    bin_type    & as_bin    () {return std::get< 7>(value_);}
+    array_type  & as_array  () {return std::get< 8>(value_);}
+    map_type    & as_map    () {return std::get< 9>(value_);}
+    ext_type    & as_ext    () {return std::get<10>(value_);}
+    timestamp_type& as_timestamp() {return std::get<11>(value_);}
+    typed_ext_type& as_typed_ext() {return std::get<12>(value_);}
+
+    nil_type     const& as_nil    () const {return std::get< 0>(value_);}
+    bool_type    const& as_bool   () const {return std::get< 1>(value_);}
+    int_type     const& as_int    () const {return std::get< 2>(value_);}
+    uint_type    const& as_uint   () const {return std::get< 3>(value_);}
+    float32_type const& as_float32() const {return std::get< 4>(value_);}
+    float64_type const& as_float64() const {return std::get< 5>(value_);}
+    str_type     const& as_str    () const {return std::get< 6>(value_);}
+    bin_type     const& as_bin    () const {return std::get< 7>(value_);}
+    array_type   const& as_array  () const {return std::get< 8>(value_);}
+    map_type     const& as_map    () const {return std::get< 9>(value_);}
+    ext_type     const& as_ext    () const {return std::get<10>(value_);}
+    timestamp_type const& as_timestamp() const {return std::get<11>(value_);}
+    typed_ext_type const& as_typed_ext() const {return std::get<12>(value_);}
+
+    nil_type    * try_nil    () {return std::get_if< 0>(std::addressof(value_));}
+    bool_type   * try_bool   () {return std::get_if< 1>(std::addressof(value_));}
+    int_type    * try_int    () {return std::get_if< 2>(std::addressof(value_));}
+    uint_type   * try_uint   () {return std::get_if< 3>(std::addressof(value_));}
+    float32_type* try_float32() {return std::get_if< 4>(std::addressof(value_));}
+    float64_type* try_float64() {return std::get_if< 5>(std::addressof(value_));}
+    str_type    * try_str    () {return std::get_if< 6>(std::addressof(value_));}
+    bin_type    * try_bin    () {return std::get_if< 7>(std::addressof(value_));}
+    array_type  * try_array  () {return std::get_if< 8>(std::addressof(value_));}
+    map_type    * try_map    () {return std::get_if< 9>(std::addressof(value_));}
+    ext_type    * try_ext    () {return std::get_if<10>(std::addressof(value_));}
+    timestamp_type* try_timestamp() {return std::get_if<11>(std::addressof(value_));}
+    typed_ext_type* try_typed_ext() {return std::get_if<12>(std::addressof(value_));}
+
+    nil_type     const* try_nil    () const {return std::get_if< 0>(std::addressof(value_));}
+    bool_type    const* try_bool   () const {return std::get_if< 1>(std::addressof(value_));}
+    int_type     const* try_int    () const {return std::get_if< 2>(std::addressof(value_));}
+    uint_type    const* try_uint   () const {return std::get_if< 3>(std::addressof(value_));}
+    float32_type const* try_float32() const {return std::get_if< 4>(std::addressof(value_));}
+    float64_type const* try_float64() const {return std::get_if< 5>(std::addressof(value_));}
+    str_type     const* try_str    () const {return std::get_if< 6>(std::addressof(value_));}
+    bin_type     const* try_bin    () const {return std::get_if< 7>(std::addressof(value_));}
+    array_type   const* try_array  () const {return std::get_if< 8>(std::addressof(value_));}
+    map_type     const* try_map    () const {return std::get_if< 9>(std::addressof(value_));}
+    ext_type     const* try_ext    () const {return std::get_if<10>(std::addressof(value_));}
+    timestamp_type const* try_timestamp() const {return std::get_if<11>(std::addressof(value_));}
+    typed_ext_type const* try_typed_ext() const {return std::get_if<12>(std::addressof(value_));}
+
+    bool operator==(const value& rhs) const noexcept {return this->value_ == rhs.value_;}
+    bool operator!=(const value& rhs) const noexcept {return this->value_ != rhs.value_;}
+    bool operator< (const value& rhs) const noexcept {return this->value_ <  rhs.value_;}
+    bool operator<=(const value& rhs) const noexcept {return this->value_ <= rhs.value_;}
+    bool operator> (const value& rhs) const noexcept {return this->value_ >  rhs.value_;}
+    bool operator>=(const value& rhs) const noexcept {return this->value_ >= rhs.value_;}
+
+    void swap(value& other) noexcept
+    {
+        using std::swap;
+        swap(this->value_, other.value_);
+    }
+
+    // true if this is a non-empty array or map
+    bool has_elements() const noexcept
+    {
+        if(const auto* arr = this->try_array()) {return ! arr->empty();}
+        if(const auto* map = this->try_map())   {return ! map->empty();}
+        return false;
+    }
+
+  private:
+
+    void release_nested() noexcept;
+    void release_in_place() noexcept;
+
+  private:
+
+    std::variant<
+        nil_type    ,
+        bool_type   ,
+        int_type    ,
+        uint_type   ,
+        float32_type,
+        float64_type,
+        str_type    ,
+        bin_type    ,
+        array_type  ,
+        map_type    ,
+        ext_type    ,
+        timestamp_type,
+        typed_ext_type
+    > value_;
+};
+
+using nil_type     = value::nil_type    ;
+using bool_type    = value::bool_type   ;
+using int_type     = value::int_type    ;
+using uint_type    = value::uint_type   ;
+using float32_type = value::float32_type;
+using float64_type = value::float64_type;
+using str_type     = value::str_type    ;
+using bin_type     = value::bin_type    ;
+using array_type   = value::array_type  ;
+using map_type     = value::map_type    ;
+using ext_type     = value::ext_type    ;
+using timestamp_type = value::timestamp_type;
+using typed_ext_type = value::typed_ext_type;
+
+namespace detail
+{
+
+template<typename K>
+concept value_string_key = std::convertible_to<const K&, std::string_view> &&
+    ( ! std::same_as<K, value>);
+
+template<typename K>
+concept value_int_key = std::signed_integral<K>;
+
+template<typename K>
+concept value_uint_key = std::unsigned_integral<K> && ( ! std::same_as<K, bool>);
+
+// Values nested up to this depth are destroyed by the recursive destructor
+// calls. Deeper ones are torn down through a worklist.
+inline constexpr std::size_t recursive_release_depth = 64;
+
+// the depth of the value being destroyed on this thread
+inline thread_local std::size_t release_depth = 0;
+
+} // detail
+
+// `operator<` that also compares a value with strings and integers as if they
+// were converted into a value. Maps use it, so `m.at("key")` does not
+// construct a temporary value.
+struct value_less
+{
+    using is_transparent = void;
+
+    bool operator()(const value& lhs, const value& rhs) const noexcept
+    {
+        return lhs < rhs;
+    }
+
+    template<detail::value_string_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        if(const auto* s = lhs.try_str())
+        {
+            return std::string_view(*s) < std::string_view(rhs);
+        }
+        return lhs.type() < type_t::str_t;
+    }
+    template<detail::value_string_key K>
+    bool operator()(const K& lhs, const value& rhs) const noexcept
+    {
+        if(const auto* s = rhs.try_str())
+        {
+            return std::string_view(lhs) < std::string_view(*s);
+        }
+        return type_t::str_t < rhs.type();
+    }
+
+    template<detail::value_int_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        if(const auto* i = lhs.try_int())
+        {
+            return *i < static_cast<std::int64_t>(rhs);
+        }
+        return lhs.type() < type_t::int_t;
+    }
+    template<detail::value_int_key K>
+    bool operator()(const K& lhs, const value& rhs) const noexcept
+    {
+        if(const auto* i = rhs.try_int())
+        {
+            return static_cast<std::int64_t>(lhs) < *i;
+        }
+        return type_t::int_t < rhs.type();
+    }
+
+    template<detail::value_uint_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        if(const auto* u = lhs.try_uint())
+        {
+            return *u < static_cast<std::uint64_t>(rhs);
+        }
+        return lhs.type() < type_t::uint_t;
+    }
+    template<detail::value_uint_key K>
+    bool operator()(const K& lhs, const value& rhs) const noexcept
+    {
+        if(const auto* u = rhs.try_uint())
+        {
+            return static_cast<std::uint64_t>(lhs) < *u;
+        }
+        return type_t::uint_t < rhs.type();
+    }
+};
+
+// Destroys a value with nested arrays or maps. Shallow values are destroyed
+// by the ordinary recursive destructor calls, which need no memory. Beyond
+// `recursive_release_depth`, the nested containers are torn down through a
+// worklist instead, so that a deeply nested value does not exhaust the call
+// stack.
+inline void value::release_nested() noexcept
+{
+    const auto has_nested = [](const value& v) {
+        if(const auto* arr = v.try_array())
+        {
+            return std::any_of(arr->begin(), arr->end(),
+                    [](const value& e) {return e.has_elements();});
+        }
+        if(const auto* map = v.try_map())
+        {
+            return std::any_of(map->begin(), map->end(),
+                    [](const auto& kv) {return kv.first.has_elements() ||
+                                               kv.second.has_elements();});
+        }
+        return false;
+    };
+    if( ! has_nested(*this)) {return;}
+
+    if(detail::release_depth < detail::recursive_release_depth)
+    {
+        detail::release_depth += 1;
+        value_.emplace<nil_type>(); // the elements release their own children
+        detail::release_depth -= 1;
+        return;
+    }
+
+    try
+    {
+        std::vector<value> pending;
+        const auto collect = [&pending](value& v) {
+            if(auto* arr = v.try_array())
+            {
+                for(auto& e : *arr)
+                {
+                    if(e.has_elements()) {pending.push_back(std::move(e));}
+                }
+            }
+            else if(auto* map = v.try_map())
+            {
+                for(auto& [k, e] : *map)
+                {
+                    if(k.has_elements()) {pending.push_back(std::move(k));}
+                    if(e.has_elements()) {pending.push_back(std::move(e));}
+                }
+            }
+        };
+
+        collect(*this);
+        while( ! pending.empty())
+        {
+            value v = std::move(pending.back());
+            pending.pop_back();
+            collect(v);
+        } // `v` has no nested elements left when it is destroyed here
+    }
+    catch(...)
+    {
+        // out of memory. what has been moved to `pending` is released by
+        // its destructor, and the rest is released without a worklist.
+        this->release_in_place();
+    }
+    return;
+}
+
+// Releases the nested containers without recursion and without allocation.
+// It goes down to a container whose elements have no elements, clears it,
+// and goes back up. Only the last few containers on the way down are
+// remembered; when they run out, it starts over from the top, so a very deep
+// value takes quadratic time. It is the fallback when a worklist cannot be
+// allocated.
+inline void value::release_in_place() noexcept
+{
+    struct frame
+    {
+        value*              v    = nullptr;
+        std::size_t         next = 0; // the next element of an array
+        map_type::iterator  pair;     // the next pair of a map
+    };
+    const auto make_frame = [](value* v) {
+        frame f;
+        f.v = v;
+        if(auto* map = v->try_map()) {f.pair = map->begin();}
+        return f;
+    };
+    // the next element that has elements, or nullptr
+    const auto next_nested = [](frame& f) -> value* {
+        if(auto* arr = f.v->try_array())
+        {
+            for(; f.next < arr->size(); ++f.next)
+            {
+                if((*arr)[f.next].has_elements()) {return std::addressof((*arr)[f.next]);}
+            }
+        }
+        else if(auto* map = f.v->try_map())
+        {
+            for(; f.pair != map->end(); ++f.pair)
+            {
+                if(f.pair->first .has_elements()) {return std::addressof(f.pair->first);}
+                if(f.pair->second.has_elements()) {return std::addressof(f.pair->second);}
+            }
+        }
+        return nullptr;
+    };
+
+    constexpr std::size_t max_frames = 32;
+    std::array<frame, max_frames> frames;
+
+    bool forgotten = true; // if the frame of `this` has been overwritten
+    while(forgotten)
+    {
+        forgotten = false;
+        std::size_t top   = 0;
+        std::size_t count = 1;
+        frames[top] = make_frame(this);
+        while(count != 0)
+        {
+            if(value* child = next_nested(frames[top]))
+            {
+                top = (top + 1) % max_frames;
+                if(count == max_frames) {forgotten = true;} else {count += 1;}
+                frames[top] = make_frame(child);
+                continue;
+            }
+            if(frames[top].v != this)
+            {
+                frames[top].v->value_.emplace<nil_type>(); // its elements are flat
+            }
+            top    = (top + max_frames - 1) % max_frames;
+            count -= 1;
+        }
+    }
+    return;
+}
+
+inline void swap(value& lhs, value& rhs) noexcept
+{
+    lhs.swap(rhs);
+    return;
+}
+
+} // msgplus
+#endif // MSGPLUS_VALUE_HPP
+#ifndef MSGPLUS_STATS_HPP
+#define MSGPLUS_STATS_HPP
+
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <concepts>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+// Receives what a decoder or an encoder has processed.
+//
+// - `count_object(t, n)`: an object of type `t` that takes `n` bytes. For an
+//   array or a map, `n` is the size of its header only.
+// - `count_container(t, n, depth)`: an array of `n` elements or a map of `n`
+//   pairs. `depth` is 1 for a container at the top level.
+// - `count_call(d)`: a call to read() or write() that took `d`.
+//
+// If `S::enabled` is false, the calls are not made and nothing is measured,
+// so that a disabled policy costs nothing.
+template<typename S>
+concept CodecStats = requires(S& s, type_t t, std::size_t n, std::chrono::nanoseconds d) {
+    {S::enabled} -> std::convertible_to<bool>;
+    s.count_object(t, n);
+    s.count_container(t, n, n);
+    s.count_call(d);
+};
+
+// The default policy. It is not counted.
+struct no_stats
+{
+    static constexpr bool enabled = false;
+
+    void count_object(type_t, std::size_t) noexcept {}
+    void count_container(type_t, std::size_t, std::size_t) noexcept {}
+    void count_call(std::chrono::nanoseconds) noexcept {}
+};
+static_assert(CodecStats<no_stats>);
+
+// Counts the objects and bytes of each type, the sizes of containers, the
+// nesting depth and the time spent. A stats object accumulates over calls
+// until `clear()`.
+//
+// Objects skipped by a projection are not counted.
+//
+// ```cpp
+// msg::codec_stats stats;
+// const auto v = msg::read(reader, stats);
+// stats.objects(msg::type_t::float64_t);
+// ```
+class codec_stats
+{
+  public:
+
+    static constexpr bool enabled = true;
+
+    // one for each type_t, the last of which is typed_ext_t
+    static constexpr std::size_t num_types = static_cast<std::size_t>(type_t::typed_ext_t) + 1;
+
+    // Sizes are bucketed by their bit width: bucket 0 is size 0, bucket 1 is
+    // size 1, bucket 2 is 2-3, bucket 3 is 4-7, and so on.
+    static constexpr std::size_t num_size_buckets = 65;
+
+    using histogram_type = std::array<std::uint64_t, num_size_buckets>;
+
+  public:
+
+    void count_object(const type_t t, const std::size_t n) noexcept
+    {
+        this->objects_[index(t)] += 1;
+        this->bytes_  [index(t)] += n;
+    }
+    void count_container(const type_t t, const std::size_t n, const std::size_t depth) noexcept
+    {
+        auto& hist = (t == type_t::map_t) ? this->map_sizes_ : this->array_sizes_;
+        hist[size_bucket(n)] += 1;
+        this->max_depth_ = std::max(this->max_depth_, depth);
+    }
+    void count_call(const std::chrono::nanoseconds d) noexcept
+    {
+        this->calls_ += 1;
+        this->time_  += d;
+    }
+
+    std::uint64_t objects(const type_t t) const noexcept {return this->objects_[index(t)];}
+    std::uint64_t bytes  (const type_t t) const noexcept {return this->bytes_  [index(t)];}
+
+    std::uint64_t total_objects() const noexcept
+    {
+        std::uint64_t n = 0;
+        for(const auto x : this->objects_) {n += x;}
+        return n;
+    }
+    std::uint64_t total_bytes() const noexcept
+    {
+        std::uint64_t n = 0;
+        for(const auto x : this->bytes_) {n += x;}
+        return n;
+    }
+
+    histogram_type const& array_sizes() const noexcept {return this->array_sizes_;}
+    histogram_type const& map_sizes()   const noexcept {return this->map_sizes_;}
+
+    std::size_t              max_depth() const noexcept {return this->max_depth_;}
+    std::uint64_t            calls()     const noexcept {return this->calls_;}
+    std::chrono::nanoseconds time()      const noexcept {return this->time_;}
+
+    static std::size_t size_bucket(const std::size_t n) noexcept
+    {
+        return static_cast<std::size_t>(std::bit_width(n));
+    }
+    // the smallest size in a bucket
+    static std::size_t bucket_min(const std::size_t bucket) noexcept
+    {
+        return bucket == 0 ? 0 : std::size_t(1) << (bucket - 1);
+    }
+
+    codec_stats& operator+=(const codec_stats& other) noexcept
+    {
+        for(std::size_t i=0; i<num_types; ++i)
+        {
+            this->objects_[i] += other.objects_[i];
+            this->bytes_  [i] += other.bytes_  [i];
+        }
+        for(std::size_t i=0; i<num_size_buckets; ++i)
+        {
+            this->array_sizes_[i] += other.array_sizes_[i];
+            this->map_sizes_  [i] += other.map_sizes_  [i];
+        }
+        this->max_depth_ = std::max(this->max_depth_, other.max_depth_);
+        this->calls_    += other.calls_;
+        this->time_     += other.time_;
+        return *this;
+    }
+
+    void clear() noexcept {*this = codec_stats{};}
+
+  private:
+
+    static std::size_t index(const type_t t) noexcept
+    {
+        return static_cast<std::size_t>(t);
+    }
+
+  private:
+
+    std::array<std::uint64_t, num_types> objects_{};
+    std::array<std::uint64_t, num_types> bytes_{};
+    histogram_type           array_sizes_{};
+    histogram_type           map_sizes_{};
+    std::size_t              max_depth_ = 0;
+    std::uint64_t            calls_     = 0;
+    std::chrono::nanoseconds time_{0};
+};
+static_assert(CodecStats<codec_stats>);
+
+namespace detail
+{
+
+// reports the time from its construction to its destruction, if enabled
+template<CodecStats S>
+struct call_timer
+{
+    explicit call_timer(S&) noexcept {}
+};
+
+template<CodecStats S> requires(S::enabled)
+struct call_timer<S>
+{
+    explicit call_timer(S& s) noexcept
+        : stats(s), start(std::chrono::steady_clock::now())
+    {}
+    ~call_timer()
+    {
+        stats.count_call(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start));
+    }
+    call_timer(const call_timer&) = delete;
+    call_timer& operator=(const call_timer&) = delete;
+
+    S&                                    stats;
+    std::chrono::steady_clock::time_point start;
+};
+
+} // detail
+} // msgplus
+#endif // MSGPLUS_STATS_HPP
+#ifndef MSGPLUS_HASH_HPP
+#define MSGPLUS_HASH_HPP
+
+
+#include <bit>
+#include <concepts>
+#include <functional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+namespace detail
+{
+
+// the finalizer of splitmix64
+constexpr std::uint64_t hash_mix(std::uint64_t x) noexcept
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+// order-dependent, so that [a, b] and [b, a] are hashed differently
+constexpr std::uint64_t hash_combine(std::uint64_t seed, std::uint64_t h) noexcept
+{
+    return hash_mix(seed * 0x9E3779B97F4A7C15ull + h);
+}
+
+constexpr std::uint64_t hash_type(const type_t t) noexcept
+{
+    return hash_mix(static_cast<std::uint64_t>(t) + 1);
+}
+
+inline std::uint64_t hash_bytes(const type_t t, std::string_view bytes) noexcept
+{
+    return hash_combine(hash_type(t), std::hash<std::string_view>{}(bytes));
+}
+inline std::uint64_t hash_bytes(const type_t t, std::span<const std::byte> bytes) noexcept
+{
+    return hash_bytes(t, std::string_view(
+            reinterpret_cast<const char*>(bytes.data()), bytes.size()));
+}
+
+inline std::uint64_t hash_int(const std::int64_t x) noexcept
+{
+    return hash_combine(hash_type(type_t::int_t), static_cast<std::uint64_t>(x));
+}
+inline std::uint64_t hash_uint(const std::uint64_t x) noexcept
+{
+    return hash_combine(hash_type(type_t::uint_t), x);
+}
+
+inline std::uint64_t hash_timestamp(const timestamp_type& x) noexcept
+{
+    return hash_combine(hash_type(type_t::timestamp_t),
+                        static_cast<std::uint64_t>(x.time_since_epoch().count()));
+}
+
+template<std::floating_point T>
+std::uint64_t hash_float(const type_t t, T x) noexcept
+{
+    if(x == T(0)) {x = T(0);} // -0.0 == +0.0
+    if constexpr(sizeof(T) == sizeof(std::uint32_t))
+    {
+        return hash_combine(hash_type(t), std::bit_cast<std::uint32_t>(x));
+    }
+    else
+    {
+        return hash_combine(hash_type(t), std::bit_cast<std::uint64_t>(x));
+    }
+}
+
+// arrays and maps start from this and fold the hashes of their elements in
+inline std::uint64_t hash_container(const type_t t, const std::size_t size) noexcept
+{
+    return hash_combine(hash_type(t), size);
+}
+
+// hash of anything but a non-empty array or map
+inline std::uint64_t hash_leaf(const value& v) noexcept
+{
+    using enum type_t;
+    switch(v.type())
+    {
+        case nil_t     : {return hash_type(nil_t);}
+        case bool_t    : {return hash_combine(hash_type(bool_t), v.as_bool() ? 1 : 0);}
+        case int_t     : {return hash_int(v.as_int());}
+        case uint_t    : {return hash_uint(v.as_uint());}
+        case float32_t : {return hash_float(float32_t, v.as_float32());}
+        case float64_t : {return hash_float(float64_t, v.as_float64());}
+        case str_t     : {return hash_bytes(str_t, v.as_str());}
+        case bin_t     : {return hash_bytes(bin_t, v.as_bin());}
+        case array_t   : {return hash_container(array_t, v.as_array().size());}
+        case map_t     : {return hash_container(map_t,   v.as_map().size());}
+        case ext_t     :
+        {
+            return hash_combine(hash_bytes(ext_t, v.as_ext().second),
+                                static_cast<std::uint8_t>(v.as_ext().first));
+        }
+        case timestamp_t: {return hash_timestamp(v.as_timestamp());}
+        case typed_ext_t:
+        {
+            const auto h = v.as_typed_ext().visit_payload([](std::span<const std::byte> p) {
+                    return hash_bytes(typed_ext_t, p);
+                });
+            return hash_combine(h, static_cast<std::uint8_t>(v.as_typed_ext().type()));
+        }
+        default:         {return 0;}
+    }
+}
+
+} // detail
+
+// Hash of a value, consistent with `value::operator==`. Nested arrays and maps
+// are traversed without recursion.
+//
+// It is transparent: strings and integers are hashed as if they were
+// converted into a value, so hashed containers can be searched by them
+// without constructing a temporary value.
+struct value_hash
+{
+    using is_transparent = void;
+
+    std::size_t operator()(const value& v) const
+    {
+        if( ! v.has_elements())
+        {
+            return detail::hash_leaf(v);
+        }
+
+        struct frame
+        {
+            const value*               container;
+            std::uint64_t              hash;
+            array_type::const_iterator array_cur;
+            map_type::const_iterator   map_cur;
+            bool                       key_hashed;
+        };
+        const auto open = [](const value& c) {
+            frame f{std::addressof(c), detail::hash_leaf(c), {}, {}, false};
+            if(c.is_array()) {f.array_cur = c.as_array().begin();}
+            else             {f.map_cur   = c.as_map().begin();}
+            return f;
+        };
+
+        std::vector<frame> stack;
+        stack.push_back(open(v));
+        while(true)
+        {
+            auto& top = stack.back();
+            const value* next = nullptr;
+            if(top.container->is_array())
+            {
+                if(top.array_cur != top.container->as_array().end())
+                {
+                    next = std::addressof(*top.array_cur++);
+                }
+            }
+            else if(top.map_cur != top.container->as_map().end())
+            {
+                if( ! top.key_hashed)
+                {
+                    next = std::addressof(top.map_cur->first);
+                    top.key_hashed = true;
+                }
+                else
+                {
+                    next = std::addressof(top.map_cur->second);
+                    top.key_hashed = false;
+                    ++top.map_cur;
+                }
+            }
+
+            if(next == nullptr) // `top` is done
+            {
+                const auto h = top.hash;
+                stack.pop_back();
+                if(stack.empty())
+                {
+                    return h;
+                }
+                stack.back().hash = detail::hash_combine(stack.back().hash, h);
+            }
+            else if(next->has_elements())
+            {
+                stack.push_back(open(*next)); // `top` is invalidated
+            }
+            else
+            {
+                top.hash = detail::hash_combine(top.hash, detail::hash_leaf(*next));
+            }
+        }
+    }
+
+    template<detail::value_string_key K>
+    std::size_t operator()(const K& k) const noexcept
+    {
+        return detail::hash_bytes(type_t::str_t, std::string_view(k));
+    }
+    template<detail::value_int_key K>
+    std::size_t operator()(const K& k) const noexcept
+    {
+        return detail::hash_int(static_cast<std::int64_t>(k));
+    }
+    template<detail::value_uint_key K>
+    std::size_t operator()(const K& k) const noexcept
+    {
+        return detail::hash_uint(static_cast<std::uint64_t>(k));
+    }
+};
+
+// `operator==` that also compares a value with strings and integers
+struct value_equal
+{
+    using is_transparent = void;
+
+    bool operator()(const value& lhs, const value& rhs) const noexcept
+    {
+        return lhs == rhs;
+    }
+
+    template<detail::value_string_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        return lhs.is_str() && lhs.as_str() == std::string_view(rhs);
+    }
+    template<detail::value_int_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        return lhs.is_int() && lhs.as_int() == static_cast<std::int64_t>(rhs);
+    }
+    template<detail::value_uint_key K>
+    bool operator()(const value& lhs, const K& rhs) const noexcept
+    {
+        return lhs.is_uint() && lhs.as_uint() == static_cast<std::uint64_t>(rhs);
+    }
+    template<typename K>
+        requires detail::value_string_key<K> || detail::value_int_key<K> ||
+                 detail::value_uint_key<K>
+    bool operator()(const K& lhs, const value& rhs) const noexcept
+    {
+        return (*this)(rhs, lhs);
+    }
+};
+
+template<typename T>
+using unordered_value_map = std::unordered_map<value, T, value_hash, value_equal>;
+
+using unordered_value_set = std::unordered_set<value, value_hash, value_equal>;
+
+// an ordered_map from values, indexed by a hash table instead of sorted keys
+template<typename T>
+using hashed_value_map = ordered_map<value, T, value_less,
+    std::allocator<std::pair<value, T>>, 16, hashed_index<value_hash, value_equal>>;
+
+} // msgplus
+
+template<>
+struct std::hash<msgplus::value>
+{
+    std::size_t operator()(const msgplus::value& v) const
+    {
+        return msgplus::value_hash{}(v);
+    }
+};
+
+#endif // MSGPLUS_HASH_HPP
+#ifndef MSGPLUS_SHARED_VALUE_HPP
+#define MSGPLUS_SHARED_VALUE_HPP
+
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <variant>
+#include <vector>
+
+namespace msgplus
+{
+namespace detail
+{
+
+// Walks the elements of a non-empty array or map of `value` or
+// `shared_value`. The elements of a map are its keys and values in turn.
+template<typename V>
+class element_cursor
+{
+  public:
+
+    explicit element_cursor(const V& container) noexcept
+        : array_(container.try_array()), map_(container.try_map())
+    {
+        if(array_) {array_cur_ = array_->begin();}
+        else       {map_cur_   = map_->begin();}
+    }
+
+    bool        is_array() const noexcept {return array_ != nullptr;}
+    std::size_t size()     const noexcept {return array_ ? array_->size() : map_->size();}
+
+    // nullptr after the last element
+    const V* next() noexcept
+    {
+        if(array_)
+        {
+            return array_cur_ == array_->end() ? nullptr : std::addressof(*array_cur_++);
+        }
+        if(map_cur_ == map_->end()) {return nullptr;}
+        if( ! at_value_)
+        {
+            at_value_ = true;
+            return std::addressof(map_cur_->first);
+        }
+        at_value_ = false;
+        return std::addressof((map_cur_++)->second);
+    }
+
+  private:
+
+    const typename V::array_type*                array_;
+    const typename V::map_type*                  map_;
+    typename V::array_type::const_iterator       array_cur_{};
+    typename V::map_type::const_iterator         map_cur_{};
+    bool                                         at_value_ = false;
+};
+
+// Converts a non-empty array or map `root` into `To` through a worklist.
+// `leaf(x)` converts an element without elements. A map is built from all
+// of its pairs at once.
+template<typename To, typename From, typename Leaf>
+To convert_nested(const From& root, Leaf&& leaf)
+{
+    struct frame
+    {
+        explicit frame(const From& container): cursor(container)
+        {
+            if(cursor.is_array()) {elements.reserve(cursor.size());}
+            else                  {pairs   .reserve(cursor.size());}
+        }
+
+        void add(To x)
+        {
+            if(cursor.is_array())
+            {
+                elements.push_back(std::move(x));
+            }
+            else if( ! key.has_value())
+            {
+                key.emplace(std::move(x));
+            }
+            else
+            {
+                pairs.emplace_back(std::move(key.value()), std::move(x));
+                key.reset();
+            }
+        }
+        To finish()
+        {
+            if(cursor.is_array()) {return To(std::move(elements));}
+            return To(typename To::map_type(std::move(pairs)));
+        }
+
+        element_cursor<From>                  cursor;
+        typename To::array_type               elements;
+        typename To::map_type::container_type pairs;
+        std::optional<To>                     key; // of the pair being built
+    };
+
+    std::vector<frame> stack;
+    stack.emplace_back(root);
+    while(true)
+    {
+        const From* next = stack.back().cursor.next();
+        if(next == nullptr) // the top is done
+        {
+            To done = stack.back().finish();
+            stack.pop_back();
+            if(stack.empty())
+            {
+                return done;
+            }
+            stack.back().add(std::move(done));
+        }
+        else if(next->has_elements())
+        {
+            stack.emplace_back(*next);
+        }
+        else
+        {
+            stack.back().add(leaf(*next));
+        }
+    }
+}
+
+} // detail
+
+// An immutable, reference-counted counterpart of `value`.
+//
+// Strings, binaries, extensions, arrays and maps are stored in shared nodes
+// (timestamps are stored inline, like numbers), so copying a shared_value is
+// O(1) and copies can be handed to other threads freely.
+//
+// `mutable_array()` and `mutable_map()` detach (copy) only the node they are
+// called on; its children stay shared. Modifying a nested element through
+// them therefore copies just the path from the root to the element.
+//
+// Like `value`, conversion, comparison, hashing and destruction go through
+// worklists instead of recursion, so a deeply nested tree does not exhaust
+// the call stack.
+class shared_value
+{
+  public:
+
+    using nil_type     = value::nil_type    ;
+    using bool_type    = value::bool_type   ;
+    using int_type     = value::int_type    ;
+    using uint_type    = value::uint_type   ;
+    using float32_type = value::float32_type;
+    using float64_type = value::float64_type;
+    using str_type     = value::str_type    ;
+    using bin_type     = value::bin_type    ;
+    using array_type   = std::vector<shared_value>;
+    using map_type     = ordered_map<shared_value, shared_value>;
+    using ext_type     = value::ext_type    ;
+    using timestamp_type = value::timestamp_type;
+    using typed_ext_type = value::typed_ext_type;
+
+  public:
+
+    shared_value(): storage_(nil_type{}) {}
+    ~shared_value() = default;
+    shared_value(const shared_value&) = default;
+    shared_value(shared_value&&)      = default;
+    shared_value& operator=(const shared_value&) = default;
+    shared_value& operator=(shared_value&&)      = default;
+
+    shared_value(const value& v);
+    shared_value(array_type v);
+    shared_value(map_type   v);
+
+    value to_value() const;
+
+    type_t type() const noexcept;
+
+    // true if this is a non-empty array or map
+    bool has_elements() const noexcept
+    {
+        if(const auto* arr = this->try_array()) {return ! arr->empty();}
+        if(const auto* map = this->try_map())   {return ! map->empty();}
+        return false;
+    }
+
+    bool is_nil    () const noexcept {return this->type() == type_t::nil_t    ;}
+    bool is_bool   () const noexcept {return this->type() == type_t::bool_t   ;}
+    bool is_int    () const noexcept {return this->type() == type_t::int_t    ;}
+    bool is_uint   () const noexcept {return this->type() == type_t::uint_t   ;}
+    bool is_float32() const noexcept {return this->type() == type_t::float32_t;}
+    bool is_float64() const noexcept {return this->type() == type_t::float64_t;}
+    bool is_str    () const noexcept {return this->type() == type_t::str_t    ;}
+    bool is_bin    () const noexcept {return this->type() == type_t::bin_t    ;}
+    bool is_array  () const noexcept {return this->type() == type_t::array_t  ;}
+    bool is_map    () const noexcept {return this->type() == type_t::map_t    ;}
+    bool is_ext    () const noexcept {return this->type() == type_t::ext_t    ;}
+    bool is_timestamp() const noexcept {return this->type() == type_t::timestamp_t;}
+    bool is_typed_ext() const noexcept {return this->type() == type_t::typed_ext_t;}
+
+    nil_type     const& as_nil    () const {return std::get<nil_type    >(storage_);}
+    bool_type    const& as_bool   () const {return std::get<bool_type   >(storage_);}
+    int_type     const& as_int    () const {return std::get<int_type    >(storage_);}
+    uint_type    const& as_uint   () const {return std::get<uint_type   >(storage_);}
+    float32_type const& as_float32() const {return std::get<float32_type>(storage_);}
+    float64_type const& as_float64() const {return std::get<float64_type>(storage_);}
+    str_type     const& as_str    () const {return this->leaf().as_str();}
+    bin_type     const& as_bin    () const {return this->leaf().as_bin();}
+    array_type   const& as_array  () const {return std::get<array_type>(this->get_node().data);}
+    map_type     const& as_map    () const {return std::get<map_type  >(this->get_node().data);}
+    ext_type     const& as_ext    () const {return this->leaf().as_ext();}
+    timestamp_type const& as_timestamp() const {return std::get<timestamp_type>(storage_);}
+    typed_ext_type const& as_typed_ext() const {return this->leaf().as_typed_ext();}
+
+    array_type const* try_array() const noexcept
+    {
+        const auto* n = this->try_node();
+        return n ? std::get_if<array_type>(std::addressof(n->data)) : nullptr;
+    }
+    map_type const* try_map() const noexcept
+    {
+        const auto* n = this->try_node();
+        return n ? std::get_if<map_type>(std::addressof(n->data)) : nullptr;
+    }
+
+    // Detaches this node if it is shared, then gives write access to it.
+    // The reference must not be used after this shared_value is copied.
+    //
+    // A node that has been handed out this way is not memoized by `hash()`
+    // while this shared_value is its only owner, since the reference may
+    // still be used to modify it.
+    array_type& mutable_array() {return std::get<array_type>(this->detach().data);}
+    map_type&   mutable_map()   {return std::get<map_type  >(this->detach().data);}
+
+    // The same hash as `value_hash` gives to the equivalent value. Since
+    // shared nodes are immutable, the hash of each node is computed once and
+    // memoized in it.
+    std::size_t hash() const;
+
+    bool operator==(const shared_value& rhs) const {return compare(*this, rhs, true);}
+    bool operator!=(const shared_value& rhs) const {return !(*this == rhs);}
+    bool operator< (const shared_value& rhs) const {return compare(*this, rhs, false);}
+    bool operator<=(const shared_value& rhs) const {return !(rhs < *this);}
+    bool operator> (const shared_value& rhs) const {return   rhs < *this ;}
+    bool operator>=(const shared_value& rhs) const {return !(*this < rhs);}
+
+    void swap(shared_value& other) noexcept
+    {
+        using std::swap;
+        swap(this->storage_, other.storage_);
+    }
+
+  private:
+
+    struct node
+    {
+        using data_type = std::variant<value, array_type, map_type>;
+
+        explicit node(data_type d): data(std::move(d)) {}
+        node(const node& other): data(other.data) {}
+        ~node() {this->release_nested();}
+
+        void release_nested() noexcept;
+
+        // `value` holds a str, bin, ext or typed_ext. Arrays and maps hold
+        // shared_values.
+        data_type data;
+
+        // memoized hash of `data`. 0 if not computed yet.
+        mutable std::atomic<std::uint64_t> hash{0};
+
+        // true once `data` has been given out by `mutable_array/map()`
+        bool mutated = false;
+    };
+
+    node const* try_node() const noexcept
+    {
+        const auto* n = std::get_if<std::shared_ptr<node>>(std::addressof(storage_));
+        return n ? n->get() : nullptr;
+    }
+    node const& get_node() const
+    {
+        return *std::get<std::shared_ptr<node>>(storage_);
+    }
+    value const& leaf() const
+    {
+        return std::get<value>(this->get_node().data);
+    }
+
+    node& detach()
+    {
+        auto& n = std::get<std::shared_ptr<node>>(storage_);
+        if(n.use_count() == 1)
+        {
+            // synchronize with the other owners that have released the node
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        else
+        {
+            n = std::make_shared<node>(*n);
+        }
+        n->hash.store(0, std::memory_order_relaxed); // it will be modified
+        n->mutated = true;
+        return *n;
+    }
+
+    // the hash of a value without elements
+    std::uint64_t leaf_hash() const;
+    // the memoized hash of a node. 0 if it is not computed yet.
+    std::uint64_t memoized_hash() const noexcept
+    {
+        const auto* n = this->try_node();
+        return n ? n->hash.load(std::memory_order_relaxed) : 0;
+    }
+    void memoize(const std::uint64_t h) const noexcept;
+
+    // how a pair of values compares without looking into their elements
+    enum class shallow_order {less, greater, equal, unequal, nested};
+    static shallow_order compare_shallow(const shared_value& lhs, const shared_value& rhs,
+                                         const bool equality);
+
+    // `lhs == rhs` if `equality`, `lhs < rhs` otherwise
+    static bool compare(const shared_value& lhs, const shared_value& rhs, const bool equality);
+
+  private:
+
+    std::variant<
+        nil_type    ,
+        bool_type   ,
+        int_type    ,
+        uint_type   ,
+        float32_type,
+        float64_type,
+        timestamp_type,
+        std::shared_ptr<node>
+    > storage_;
+};
+
+inline shared_value::shared_value(const value& v)
+{
+    using enum type_t;
+    switch(v.type())
+    {
+        case nil_t     : {storage_ = v.as_nil    (); break;}
+        case bool_t    : {storage_ = v.as_bool   (); break;}
+        case int_t     : {storage_ = v.as_int    (); break;}
+        case uint_t    : {storage_ = v.as_uint   (); break;}
+        case float32_t : {storage_ = v.as_float32(); break;}
+        case float64_t : {storage_ = v.as_float64(); break;}
+        case timestamp_t: {storage_ = v.as_timestamp(); break;}
+        case array_t   :
+        case map_t     :
+        {
+            if( ! v.has_elements())
+            {
+                storage_ = v.is_array() ? std::make_shared<node>(array_type{}) :
+                                          std::make_shared<node>(map_type{});
+                break;
+            }
+            storage_ = detail::convert_nested<shared_value>(v,
+                    [](const value& x) {return shared_value(x);}).storage_;
+            break;
+        }
+        default:
+        {
+            storage_ = std::make_shared<node>(v);
+            break;
+        }
+    }
+}
+
+inline shared_value::shared_value(array_type v)
+    : storage_(std::make_shared<node>(std::move(v)))
+{}
+inline shared_value::shared_value(map_type v)
+    : storage_(std::make_shared<node>(std::move(v)))
+{}
+
+inline type_t shared_value::type() const noexcept
+{
+    if(const auto* n = this->try_node())
+    {
+        switch(n->data.index())
+        {
+            case 0:  {return std::get<value>(n->data).type();}
+            case 1:  {return type_t::array_t;}
+            default: {return type_t::map_t;}
+        }
+    }
+    if(std::holds_alternative<timestamp_type>(storage_))
+    {
+        return type_t::timestamp_t;
+    }
+    return static_cast<type_t>(storage_.index());
+}
+
+inline value shared_value::to_value() const
+{
+    const auto* n = this->try_node();
+    if( ! n)
+    {
+        return std::visit([](const auto& x) -> value {
+                if constexpr(std::is_same_v<std::decay_t<decltype(x)>,
+                                            std::shared_ptr<node>>)
+                {
+                    return value{}; // unreachable
+                }
+                else
+                {
+                    return value(x);
+                }
+            }, storage_);
+    }
+    if(this->has_elements())
+    {
+        return detail::convert_nested<value>(*this,
+                [](const shared_value& x) {return x.to_value();});
+    }
+    if(this->is_array()) {return value(value::array_type{});}
+    if(this->is_map())   {return value(value::map_type{});}
+    return std::get<value>(n->data);
+}
+
+inline shared_value::shallow_order
+shared_value::compare_shallow(const shared_value& lhs, const shared_value& rhs, const bool equality)
+{
+    using enum shallow_order;
+    const auto lt = lhs.type();
+    const auto rt = rhs.type();
+    if(lt != rt)
+    {
+        return equality ? unequal : (lt < rt ? less : greater);
+    }
+    const auto* ln = lhs.try_node();
+    const auto* rn = rhs.try_node();
+    if(ln == nullptr || rn == nullptr)
+    {
+        if(equality) {return lhs.storage_ == rhs.storage_ ? equal : unequal;}
+        if(lhs.storage_ < rhs.storage_) {return less;}
+        return rhs.storage_ < lhs.storage_ ? greater : equal;
+    }
+    if(ln == rn)
+    {
+        return equal;
+    }
+    if(const auto* lv = std::get_if<value>(std::addressof(ln->data)))
+    {
+        const auto& rv = std::get<value>(rn->data);
+        if(equality) {return *lv == rv ? equal : unequal;}
+        if(*lv < rv) {return less;}
+        return rv < *lv ? greater : equal;
+    }
+
+    const auto size = [](const shared_value& c) {
+        return c.is_array() ? c.as_array().size() : c.as_map().size();
+    };
+    const auto ls = size(lhs);
+    const auto rs = size(rhs);
+    if(equality && ls != rs)
+    {
+        return unequal;
+    }
+    if(ls == 0 || rs == 0)
+    {
+        return ls < rs ? less : (rs < ls ? greater : equal);
+    }
+    return nested;
+}
+
+// Compares the elements in order, as `std::equal` and
+// `std::lexicographical_compare` do. Maps compare their keys and values in
+// turn, as a sequence of pairs does.
+inline bool shared_value::compare(const shared_value& lhs, const shared_value& rhs,
+                                  const bool equality)
+{
+    using enum shallow_order;
+    const auto root = compare_shallow(lhs, rhs, equality);
+    if(root != nested)
+    {
+        return root == (equality ? equal : less);
+    }
+
+    struct frame
+    {
+        detail::element_cursor<shared_value> lhs;
+        detail::element_cursor<shared_value> rhs;
+    };
+    std::vector<frame> stack;
+    stack.push_back(frame{detail::element_cursor<shared_value>(lhs),
+                          detail::element_cursor<shared_value>(rhs)});
+    while( ! stack.empty())
+    {
+        const auto* l = stack.back().lhs.next();
+        const auto* r = stack.back().rhs.next();
+        if(l == nullptr || r == nullptr)
+        {
+            if(l != r) // only when ordering; equal sizes end together
+            {
+                return l == nullptr; // a prefix is less
+            }
+            stack.pop_back();
+            continue;
+        }
+        switch(compare_shallow(*l, *r, equality))
+        {
+            case equal:   {break;}
+            case nested:  {stack.push_back(frame{detail::element_cursor<shared_value>(*l),
+                                                 detail::element_cursor<shared_value>(*r)}); break;}
+            case less:    {return true;}
+            case greater: {return false;}
+            case unequal: {return false;}
+        }
+    }
+    return equality;
+}
+
+inline std::uint64_t shared_value::leaf_hash() const
+{
+    const auto* n = this->try_node();
+    if( ! n)
+    {
+        using enum type_t;
+        switch(this->type())
+        {
+            case nil_t     : {return detail::hash_type(nil_t);}
+            case bool_t    : {return detail::hash_combine(detail::hash_type(bool_t), this->as_bool() ? 1 : 0);}
+            case int_t     : {return detail::hash_int(this->as_int());}
+            case uint_t    : {return detail::hash_uint(this->as_uint());}
+            case float32_t : {return detail::hash_float(float32_t, this->as_float32());}
+            case float64_t : {return detail::hash_float(float64_t, this->as_float64());}
+            case timestamp_t: {return detail::hash_timestamp(this->as_timestamp());}
+            default:         {return 0;} // unreachable
+        }
+    }
+    if(this->is_array()) {return detail::hash_container(type_t::array_t, 0);}
+    if(this->is_map())   {return detail::hash_container(type_t::map_t,   0);}
+
+    if(const auto memo = n->hash.load(std::memory_order_relaxed); memo != 0)
+    {
+        return memo;
+    }
+    const std::uint64_t h = detail::hash_leaf(std::get<value>(n->data));
+    this->memoize(h);
+    return h;
+}
+
+inline void shared_value::memoize(const std::uint64_t h) const noexcept
+{
+    // A node that has been given out by mutable_array/map() can still be
+    // modified through that reference as long as it is not shared.
+    // 0 means "not computed yet"; hashes that happen to be 0 are not memoized.
+    const auto& n = std::get<std::shared_ptr<node>>(storage_);
+    if( ! n->mutated || 1 < n.use_count())
+    {
+        n->hash.store(h, std::memory_order_relaxed);
+    }
+}
+
+inline std::size_t shared_value::hash() const
+{
+    if( ! this->has_elements())
+    {
+        return this->leaf_hash();
+    }
+    if(const auto memo = this->memoized_hash(); memo != 0)
+    {
+        return memo;
+    }
+
+    struct frame
+    {
+        const shared_value*                  container;
+        detail::element_cursor<shared_value> cursor;
+        std::uint64_t                        hash;
+    };
+    const auto open = [](const shared_value& c) {
+        const auto t = c.type();
+        const auto size = c.is_array() ? c.as_array().size() : c.as_map().size();
+        return frame{std::addressof(c), detail::element_cursor<shared_value>(c),
+                     detail::hash_container(t, size)};
+    };
+
+    std::vector<frame> stack;
+    stack.push_back(open(*this));
+    while(true)
+    {
+        const shared_value* next = stack.back().cursor.next();
+        if(next == nullptr) // the top is done
+        {
+            const auto h = stack.back().hash;
+            stack.back().container->memoize(h);
+            stack.pop_back();
+            if(stack.empty())
+            {
+                return h;
+            }
+            stack.back().hash = detail::hash_combine(stack.back().hash, h);
+        }
+        else if( ! next->has_elements())
+        {
+            stack.back().hash = detail::hash_combine(stack.back().hash, next->leaf_hash());
+        }
+        else if(const auto memo = next->memoized_hash(); memo != 0)
+        {
+            stack.back().hash = detail::hash_combine(stack.back().hash, memo);
+        }
+        else
+        {
+            stack.push_back(open(*next));
+        }
+    }
+}
+
+// Releases the nested nodes that this node owns alone. Like
+// `value::release_nested()`, shallow trees are released by the ordinary
+// recursive destructor calls, and deeper ones through a worklist.
+inline void shared_value::node::release_nested() noexcept
+{
+    const auto nested = [](const shared_value& e) {return e.has_elements();};
+    const auto* arr = std::get_if<array_type>(std::addressof(data));
+    const auto* map = std::get_if<map_type>  (std::addressof(data));
+    if( ! (arr && std::any_of(arr->begin(), arr->end(), nested)) &&
+        ! (map && std::any_of(map->begin(), map->end(), [&](const auto& kv) {
+                return nested(kv.first) || nested(kv.second);})))
+    {
+        return;
+    }
+
+    if(detail::release_depth < detail::recursive_release_depth)
+    {
+        detail::release_depth += 1;
+        data.emplace<value>(); // the elements release their own children
+        detail::release_depth -= 1;
+        return;
+    }
+
+    try
+    {
+        std::vector<std::shared_ptr<node>> pending;
+        const auto take = [&pending](shared_value& e) {
+            if(e.has_elements())
+            {
+                pending.push_back(std::move(std::get<std::shared_ptr<node>>(e.storage_)));
+            }
+        };
+        const auto collect = [&take](node& n) {
+            if(auto* elems = std::get_if<array_type>(std::addressof(n.data)))
+            {
+                for(auto& e : *elems) {take(e);}
+            }
+            else if(auto* pairs = std::get_if<map_type>(std::addressof(n.data)))
+            {
+                for(auto& [k, e] : *pairs) {take(k); take(e);}
+            }
+        };
+
+        collect(*this);
+        while( ! pending.empty())
+        {
+            auto n = std::move(pending.back());
+            pending.pop_back();
+            if(n.use_count() == 1) // others may still hold the rest
+            {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                collect(*n);
+            }
+        } // `n` has no nested nodes left if it is destroyed here
+    }
+    catch(...)
+    {
+        // out of memory. the rest is released by the recursive calls.
+    }
+    return;
+}
+
+using shared_array_type = shared_value::array_type;
+using shared_map_type   = shared_value::map_type;
+
+inline void swap(shared_value& lhs, shared_value& rhs) noexcept
+{
+    lhs.swap(rhs);
+    return;
+}
+
+} // msgplus
+
+template<>
+struct std::hash<msgplus::shared_value>
+{
+    std::size_t operator()(const msgplus::shared_value& v) const
+    {
+        return v.hash();
+    }
+};
+
+#endif // MSGPLUS_SHARED_VALUE_HPP
+#ifndef MSGPLUS_WRITE_HPP
+#define MSGPLUS_WRITE_HPP
+
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <limits>
+#include <span>
+#include <vector>
+
+namespace msgplus
+{
+
+namespace detail
+{
+template<Writer W, typename T>
+bool write_as_big_endian(W& writer, T x)
+{
+    constexpr auto N = sizeof(T);
+    const auto as_bytes = reinterpret_cast<const std::byte*>(std::addressof(x));
+    if constexpr(std::endian::native == std::endian::little)
+    {
+        for(std::size_t i=1; i<=N; ++i)
+        {
+            if( ! writer.write_byte(as_bytes[N-i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    else // native == big endian
+    {
+        return writer.write_bytes(as_bytes, N);
+    }
+}
+} // detail
+
+template<Writer W>
+bool write(W& writer, const nil_type&)
+{
+    return writer.write_byte(static_cast<std::byte>(0xC0));
+}
+template<Writer W>
+bool write(W& writer, const bool_type& x)
+{
+    if(x)
+    {
+        return writer.write_byte(static_cast<std::byte>(0xC3));
+    }
+    else
+    {
+        return writer.write_byte(static_cast<std::byte>(0xC2));
+    }
+}
+template<Writer W>
+bool write(W& writer, const int_type& x)
+{
+    if(0 <= x)
+    {
+        if(x < 128)
+        {
+            return writer.write_byte(static_cast<std::byte>(x & 0xFF));
+        }
+        else if(x <= std::numeric_limits<std::uint8_t>::max())
+        {
+            if( ! writer.write_byte(static_cast<std::byte>(0xCC))) {return false;}
+            return detail::write_as_big_endian(writer,
+                    static_cast<std::uint8_t>(x));
+        }
+        else if(x <= std::numeric_limits<std::uint16_t>::max())
+        {
+            if( ! writer.write_byte(static_cast<std::byte>(0xCD))) {return false;}
+            return detail::write_as_big_endian(writer,
+                    static_cast<std::uint16_t>(x));
+        }
+        else if(x <= std::numeric_limits<std::uint32_t>::max())
+        {
+            if( ! writer.write_byte(static_cast<std::byte>(0xCE))) {return false;}
+            return detail::write_as_big_endian(writer,
+                    static_cast<std::uint32_t>(x));
+        }
+        else
+        {
+            if( ! writer.write_byte(static_cast<std::byte>(0xCF))) {return false;}
+            return detail::write_as_big_endian(writer,
+                    static_cast<std::uint64_t>(x));
+        }
+    }
+    else
+    {
+        if(-32 <= x)
+        {
+            return detail::write_as_big_endian(writer,
+                    static_cast<std::int8_t>(x));
+        }
+        else if(std::numeric_limits<std::int8_t>::min() <= x)
+        {
+            if( ! writer.write_byte(static_cast<std::byte>(0xD0))) {return false;}
+            return detail::write_as_big_endian(writer,
+                    static_cast<std::int8_t>(x));
+        }
+        else if(std::numeric_limits<std::int16_t>::min() <= x)
+        {
+            if( ! writer.write_byte(static_cast<std::byte>(0xD1))) {return false;}
+            return detail::write_as_big_endian(writer,
+                    static_cast<std::int16_t>(x));
+        }
+        else if(std::numeric_limits<std::int32_t>::min() <= x)
+        {
+            if( ! writer.write_byte(static_cast<std::byte>(0xD2))) {return false;}
+            return detail::write_as_big_endian(writer,
+                    static_cast<std::int32_t>(x));
+        }
+        else if(std::numeric_limits<std::int64_t>::min() <= x)
+        {
+            if( ! writer.write_byte(static_cast<std::byte>(0xD3))) {return false;}
+            return detail::write_as_big_endian(writer, x);
+        }
+    }
+    return false;
+}
+template<Writer W>
+bool write(W& writer, const uint_type& x)
+{
+    if(x < 128)
+    {
+        return writer.write_byte(static_cast<std::byte>(x & 0xFF));
+    }
+    else if(x <= std::numeric_limits<std::uint8_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xCC))) {return false;}
+        return detail::write_as_big_endian(writer,
+                static_cast<std::uint8_t>(x));
+    }
+    else if(x <= std::numeric_limits<std::uint16_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xCD))) {return false;}
+        return detail::write_as_big_endian(writer,
+                static_cast<std::uint16_t>(x));
+    }
+    else if(x <= std::numeric_limits<std::uint32_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xCE))) {return false;}
+        return detail::write_as_big_endian(writer,
+                static_cast<std::uint32_t>(x));
+    }
+    else
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xCF))) {return false;}
+        return detail::write_as_big_endian(writer,
+                static_cast<std::uint64_t>(x));
+    }
+}
+template<Writer W>
+bool write(W& writer, const float32_type& x)
+{
+    if( ! writer.write_byte(static_cast<std::byte>(0xCA)))
+    {
+        return false;
+    }
+    return detail::write_as_big_endian(writer, x);
+}
+template<Writer W>
+bool write(W& writer, const float64_type& x)
+{
+    if( ! writer.write_byte(static_cast<std::byte>(0xCB)))
+    {
+        return false;
+    }
+    return detail::write_as_big_endian(writer, x);
+}
+template<Writer W>
+bool write(W& writer, const str_type& x)
+{
+    if(x.size() <= 31)
+    {
+        const std::uint8_t tag = 0b1010'0000 |
+            static_cast<std::uint8_t>(x.size() & 0b0001'1111);
+        if( ! writer.write_byte(static_cast<std::byte>(tag))) {return false;}
+    }
+    else if(x.size() <= std::numeric_limits<std::uint8_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xD9))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint8_t>(x.size()))) {return false;}
+    }
+    else if(x.size() <= std::numeric_limits<std::uint16_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xDA))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(x.size()))) {return false;}
+    }
+    else if(x.size() <= std::numeric_limits<std::uint32_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xDB))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(x.size()))) {return false;}
+    }
+    else
+    {
+        return false;
+    }
+
+    return writer.write_bytes(reinterpret_cast<const std::byte*>(x.data()), x.size());
+}
+template<Writer W>
+bool write(W& writer, const bin_type& x)
+{
+    if(x.size() <= std::numeric_limits<std::uint8_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xC4))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint8_t>(x.size()))) {return false;}
+    }
+    else if(x.size() <= std::numeric_limits<std::uint16_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xC5))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(x.size()))) {return false;}
+    }
+    else if(x.size() <= std::numeric_limits<std::uint32_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xC6))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(x.size()))) {return false;}
+    }
+    else
+    {
+        return false;
+    }
+    return writer.write_bytes(x.data(), x.size());
+}
+
+namespace detail
+{
+// writes the tag, the length and the type of an extension
+template<Writer W>
+bool write_ext_header(W& writer, const std::int8_t type, const std::size_t size)
+{
+    if(size == 1)
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xD4))) {return false;}
+    }
+    else if(size == 2)
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xD5))) {return false;}
+    }
+    else if(size == 4)
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xD6))) {return false;}
+    }
+    else if(size == 8)
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xD7))) {return false;}
+    }
+    else if(size == 16)
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xD8))) {return false;}
+    }
+    else if(size <= std::numeric_limits<std::uint8_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xC7))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint8_t>(size))) {return false;}
+    }
+    else if(size <= std::numeric_limits<std::uint16_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xC8))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(size))) {return false;}
+    }
+    else if(size <= std::numeric_limits<std::uint32_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xC9))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(size))) {return false;}
+    }
+    else
+    {
+        return false;
+    }
+    return writer.write_byte(static_cast<std::byte>(type));
+}
+} // detail
+
+template<Writer W>
+bool write(W& writer, const ext_type& x)
+{
+    if( ! detail::write_ext_header(writer, x.first, x.second.size())) {return false;}
+    return writer.write_bytes(x.second.data(), x.second.size());
+}
+
+// The payload is encoded before anything is written, so a codec failure
+// leaves the writer untouched.
+template<Writer W>
+bool write(W& writer, const typed_ext_type& x)
+{
+    const auto size = x.encoded_size();
+
+    std::array<std::byte, 64> buf;
+    std::vector<std::byte>    heap;
+    std::span<std::byte>      payload(buf.data(), size <= buf.size() ? size : 0);
+    if(buf.size() < size)
+    {
+        heap.resize(size);
+        payload = heap;
+    }
+    if( ! x.encode(payload)) {return false;}
+
+    if( ! detail::write_ext_header(writer, x.type(), size)) {return false;}
+    return writer.write_bytes(payload.data(), payload.size());
+}
+
+// Writes the timestamp extension in the smallest of its three forms.
+template<Writer W>
+bool write(W& writer, const timestamp_type& x)
+{
+    constexpr std::int64_t giga = 1'000'000'000;
+    const auto count = x.time_since_epoch().count();
+
+    // rounded toward negative infinity, so that nsec is in [0, 1e9)
+    std::int64_t sec  = count / giga;
+    std::int64_t nsec = count % giga;
+    if(nsec < 0)
+    {
+        sec  -= 1;
+        nsec += giga;
+    }
+
+    if(0 <= sec && (static_cast<std::uint64_t>(sec) >> 34) == 0)
+    {
+        if(nsec == 0 && sec <= std::numeric_limits<std::uint32_t>::max()) // timestamp 32
+        {
+            if( ! writer.write_byte(static_cast<std::byte>(0xD6))) {return false;}
+            if( ! writer.write_byte(static_cast<std::byte>(0xFF))) {return false;}
+            return detail::write_as_big_endian(writer, static_cast<std::uint32_t>(sec));
+        }
+        else // timestamp 64
+        {
+            const auto data = (static_cast<std::uint64_t>(nsec) << 34) |
+                               static_cast<std::uint64_t>(sec);
+            if( ! writer.write_byte(static_cast<std::byte>(0xD7))) {return false;}
+            if( ! writer.write_byte(static_cast<std::byte>(0xFF))) {return false;}
+            return detail::write_as_big_endian(writer, data);
+        }
+    }
+    else // timestamp 96
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xC7))) {return false;}
+        if( ! writer.write_byte(static_cast<std::byte>(12)))   {return false;}
+        if( ! writer.write_byte(static_cast<std::byte>(0xFF))) {return false;}
+        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(nsec))) {return false;}
+        return detail::write_as_big_endian(writer, sec);
+    }
+}
+
+namespace detail
+{
+template<Writer W>
+bool write_array_header(W& writer, const std::size_t size)
+{
+    if(size <= 15)
+    {
+        const std::uint8_t tag = 0b1001'0000 |
+            static_cast<std::uint8_t>(size & 0b0000'1111);
+        return writer.write_byte(static_cast<std::byte>(tag));
+    }
+    else if(size <= std::numeric_limits<std::uint16_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xDC))) {return false;}
+        return detail::write_as_big_endian(writer, static_cast<std::uint16_t>(size));
+    }
+    else if(size <= std::numeric_limits<std::uint32_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xDD))) {return false;}
+        return detail::write_as_big_endian(writer, static_cast<std::uint32_t>(size));
+    }
+    else
+    {
+        return false;
+    }
+}
+
+template<Writer W>
+bool write_map_header(W& writer, const std::size_t size)
+{
+    if(size <= 15)
+    {
+        const std::uint8_t tag = 0b1000'0000 |
+            static_cast<std::uint8_t>(size & 0b0000'1111);
+        return writer.write_byte(static_cast<std::byte>(tag));
+    }
+    else if(size <= std::numeric_limits<std::uint16_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xDE))) {return false;}
+        return detail::write_as_big_endian(writer, static_cast<std::uint16_t>(size));
+    }
+    else if(size <= std::numeric_limits<std::uint32_t>::max())
+    {
+        if( ! writer.write_byte(static_cast<std::byte>(0xDF))) {return false;}
+        return detail::write_as_big_endian(writer, static_cast<std::uint32_t>(size));
+    }
+    else
+    {
+        return false;
+    }
+}
+// Forwards to a writer and counts the bytes written, for stats.
+template<Writer W>
+class counting_writer
+{
+  public:
+
+    explicit counting_writer(W& w) noexcept: writer_(w), count_(0) {}
+
+    std::size_t count() const noexcept {return count_;}
+
+    bool is_ok() const {return writer_.is_ok();}
+
+    bool write_byte(std::byte b)
+    {
+        const bool ok = writer_.write_byte(b);
+        if(ok) {count_ += 1;}
+        return ok;
+    }
+    bool write_bytes(const std::byte* ptr, const std::size_t len)
+    {
+        const bool ok = writer_.write_bytes(ptr, len);
+        if(ok) {count_ += len;}
+        return ok;
+    }
+
+  private:
+
+    W&          writer_;
+    std::size_t count_;
+};
+
+} // detail
+
+// Encodes values without recursion. Arrays and maps that are being written
+// are kept on an explicit stack, so the nesting depth is bounded by
+// `max_depth()` instead of the size of the call stack. The stack keeps its
+// capacity between calls; reuse an encoder to avoid reallocating it.
+class encoder
+{
+  public:
+
+    static constexpr std::size_t default_max_depth = 1024;
+
+  public:
+
+    encoder() = default;
+    ~encoder() = default;
+    encoder(const encoder&) = default;
+    encoder(encoder&&)      = default;
+    encoder& operator=(const encoder&) = default;
+    encoder& operator=(encoder&&)      = default;
+
+    explicit encoder(const std::size_t max_depth): max_depth_(max_depth) {}
+
+    std::size_t max_depth() const noexcept {return max_depth_;}
+    void set_max_depth(const std::size_t d) noexcept {max_depth_ = d;}
+
+    template<Writer W>
+    bool write(W& writer, const value& v)
+    {
+        no_stats stats;
+        return this->write_impl(writer, v, stats);
+    }
+    template<Writer W>
+    bool write(W& writer, const array_type& x)
+    {
+        no_stats stats;
+        return this->write_impl(writer, x, stats);
+    }
+    template<Writer W>
+    bool write(W& writer, const map_type& x)
+    {
+        no_stats stats;
+        return this->write_impl(writer, x, stats);
+    }
+
+    // counts what is encoded into `stats`
+    template<Writer W, CodecStats S>
+    bool write(W& writer, const value& v, S& stats)
+    {
+        return this->write_impl(writer, v, stats);
+    }
+    template<Writer W, CodecStats S>
+    bool write(W& writer, const array_type& x, S& stats)
+    {
+        return this->write_impl(writer, x, stats);
+    }
+    template<Writer W, CodecStats S>
+    bool write(W& writer, const map_type& x, S& stats)
+    {
+        return this->write_impl(writer, x, stats);
+    }
+
+  private:
+
+    template<Writer W, typename T, CodecStats S>
+    bool write_impl(W& writer, const T& x, S& stats)
+    {
+        if constexpr(S::enabled)
+        {
+            detail::call_timer<S> timer(stats);
+            detail::counting_writer<W> counter(writer);
+            return this->write_root(counter, x, stats);
+        }
+        else
+        {
+            return this->write_root(writer, x, stats);
+        }
+    }
+
+    template<Writer W, CodecStats S>
+    bool write_root(W& writer, const value& v, S& stats)
+    {
+        this->stack_.clear();
+        return this->write_one(writer, v, stats) && this->write_children(writer, stats);
+    }
+    template<Writer W, CodecStats S>
+    bool write_root(W& writer, const array_type& x, S& stats)
+    {
+        this->stack_.clear();
+        return this->open_array(writer, x, stats) && this->write_children(writer, stats);
+    }
+    template<Writer W, CodecStats S>
+    bool write_root(W& writer, const map_type& x, S& stats)
+    {
+        this->stack_.clear();
+        return this->open_map(writer, x, stats) && this->write_children(writer, stats);
+    }
+
+    template<Writer W, CodecStats S>
+    bool open_array(W& writer, const array_type& x, S& stats)
+    {
+        if(this->max_depth_ <= this->stack_.size()) {return false;}
+
+        [[maybe_unused]] std::size_t start = 0;
+        if constexpr(S::enabled) {start = writer.count();}
+
+        if( ! detail::write_array_header(writer, x.size())) {return false;}
+
+        if constexpr(S::enabled)
+        {
+            stats.count_object(type_t::array_t, writer.count() - start);
+            stats.count_container(type_t::array_t, x.size(), this->stack_.size() + 1);
+        }
+        if( ! x.empty())
+        {
+            frame f;
+            f.is_map    = false;
+            f.array_cur = x.begin();
+            f.array_end = x.end();
+            this->stack_.push_back(f);
+        }
+        return true;
+    }
+    template<Writer W, CodecStats S>
+    bool open_map(W& writer, const map_type& x, S& stats)
+    {
+        if(this->max_depth_ <= this->stack_.size()) {return false;}
+
+        [[maybe_unused]] std::size_t start = 0;
+        if constexpr(S::enabled) {start = writer.count();}
+
+        if( ! detail::write_map_header(writer, x.size())) {return false;}
+
+        if constexpr(S::enabled)
+        {
+            stats.count_object(type_t::map_t, writer.count() - start);
+            stats.count_container(type_t::map_t, x.size(), this->stack_.size() + 1);
+        }
+        if( ! x.empty())
+        {
+            frame f;
+            f.is_map  = true;
+            f.map_cur = x.begin();
+            f.map_end = x.end();
+            this->stack_.push_back(f);
+        }
+        return true;
+    }
+
+    // writes a scalar, or the header of a container and pushes it
+    template<Writer W, CodecStats S>
+    bool write_one(W& writer, const value& v, S& stats)
+    {
+        if constexpr(S::enabled)
+        {
+            if( ! v.is_array() && ! v.is_map())
+            {
+                const auto start = writer.count();
+                no_stats none;
+                if( ! this->write_one(writer, v, none)) {return false;}
+                stats.count_object(v.type(), writer.count() - start);
+                return true;
+            }
+        }
+
+        using enum type_t;
+        switch(v.type())
+        {
+            case nil_t     : {return msgplus::write(writer, v.as_nil    ());}
+            case bool_t    : {return msgplus::write(writer, v.as_bool   ());}
+            case int_t     : {return msgplus::write(writer, v.as_int    ());}
+            case uint_t    : {return msgplus::write(writer, v.as_uint   ());}
+            case float32_t : {return msgplus::write(writer, v.as_float32());}
+            case float64_t : {return msgplus::write(writer, v.as_float64());}
+            case str_t     : {return msgplus::write(writer, v.as_str    ());}
+            case bin_t     : {return msgplus::write(writer, v.as_bin    ());}
+            case array_t   : {return this->open_array(writer, v.as_array(), stats);}
+            case map_t     : {return this->open_map  (writer, v.as_map  (), stats);}
+            case ext_t     : {return msgplus::write(writer, v.as_ext    ());}
+            case timestamp_t: {return msgplus::write(writer, v.as_timestamp());}
+            case typed_ext_t: {return msgplus::write(writer, v.as_typed_ext());}
+            default:         {return false;}
+        }
+    }
+
+    // writes the remaining elements of all the open containers
+    template<Writer W, CodecStats S>
+    bool write_children(W& writer, S& stats)
+    {
+        while( ! this->stack_.empty())
+        {
+            auto& top = this->stack_.back();
+            const value* next = nullptr;
+            if( ! top.is_map)
+            {
+                if(top.array_cur == top.array_end)
+                {
+                    this->stack_.pop_back();
+                    continue;
+                }
+                next = std::addressof(*top.array_cur);
+                ++top.array_cur;
+            }
+            else
+            {
+                if(top.map_cur == top.map_end)
+                {
+                    this->stack_.pop_back();
+                    continue;
+                }
+                if( ! top.key_written)
+                {
+                    next = std::addressof(top.map_cur->first);
+                    top.key_written = true;
+                }
+                else
+                {
+                    next = std::addressof(top.map_cur->second);
+                    top.key_written = false;
+                    ++top.map_cur;
+                }
+            }
+            // `top` may be invalidated here
+            if( ! this->write_one(writer, *next, stats))
+            {
+                this->stack_.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+
+    struct frame
+    {
+        bool is_map      = false;
+        bool key_written = false;
+        array_type::const_iterator array_cur;
+        array_type::const_iterator array_end;
+        map_type::const_iterator   map_cur;
+        map_type::const_iterator   map_end;
+    };
+
+  private:
+
+    std::size_t                   max_depth_ = default_max_depth;
+    detail::small_stack<frame, 8> stack_; // shallow values need no allocation
+};
+
+template<Writer W>
+bool write(W& writer, const array_type& x)
+{
+    encoder enc;
+    return enc.write(writer, x);
+}
+
+template<Writer W>
+bool write(W& writer, const map_type& x)
+{
+    encoder enc;
+    return enc.write(writer, x);
+}
+
+template<Writer W>
+bool write(W& writer, const value& v, encoder& enc)
+{
+    return enc.write(writer, v);
+}
+
+template<Writer W>
+bool write(W& writer, const value& v)
+{
+    encoder enc;
+    return enc.write(writer, v);
+}
+
+template<Writer W, CodecStats S>
+bool write(W& writer, const value& v, S& stats)
+{
+    encoder enc;
+    return enc.write(writer, v, stats);
+}
+
+template<Writer W, CodecStats S>
+bool write(W& writer, const value& v, encoder& enc, S& stats)
+{
+    return enc.write(writer, v, stats);
+}
+
+} // msgplus
+#endif//MSGPLUS_WRITE_HPP
+#ifndef MSGPLUS_READ_HPP
+#define MSGPLUS_READ_HPP
+
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <limits>
+#include <cstring>
+
+namespace msgplus
+{
+
+namespace detail
+{
+template<typename T, Reader R>
+std::optional<T> read_as_big_endian(R& reader)
+{
+    constexpr auto N = sizeof(T);
+    T x;
+    const auto as_bytes = reinterpret_cast<std::byte*>(std::addressof(x));
+    if constexpr(std::endian::native == std::endian::little)
+    {
+        for(std::size_t i=1; i<=N; ++i)
+        {
+            if(const auto b = reader.read_byte())
+            {
+                as_bytes[N-i] = b.value();
+            }
+            else
+            {
+                return std::nullopt;
+            }
+        }
+        return x;
+    }
+    else // native == big endian
+    {
+        if(const auto bs = reader.template read_bytes<N>())
+        {
+            std::memcpy(as_bytes, bs.value().data(), N);
+            return x;
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+}
+} // detail
+
+namespace detail
+{
+
+// Reads a bin or ext payload. A short one is copied into the inline buffer
+// of bin_type without going through a std::vector.
+template<Reader R>
+std::optional<bin_type> read_payload(R& reader, const std::size_t len)
+{
+    if constexpr(requires {reader.read_view(len);})
+    {
+        const auto bytes = reader.read_view(len);
+        if( ! bytes.has_value()) {return std::nullopt;}
+        return bin_type(bytes.value().begin(), bytes.value().end());
+    }
+    else
+    {
+        if(len <= bin_type::inline_capacity)
+        {
+            bin_type retval(len);
+            for(auto& b : retval)
+            {
+                const auto x = reader.read_byte();
+                if( ! x.has_value()) {return std::nullopt;}
+                b = x.value();
+            }
+            return retval;
+        }
+        auto bytes = reader.read_bytes(len);
+        if( ! bytes.has_value()) {return std::nullopt;}
+        return bin_type(std::move(bytes.value())); // adopts the buffer
+    }
+}
+
+template<Reader R>
+std::optional<value> read_bin(R& reader, std::optional<std::size_t> len)
+{
+    if( ! len.has_value()) {return std::nullopt;}
+
+    auto v = read_payload(reader, len.value());
+    if( ! v.has_value()) {return std::nullopt;}
+
+    return value(std::move(v.value()));
+}
+
+template<typename T, std::size_t N>
+T load_big_endian(const std::array<std::byte, N>& bytes, const std::size_t offset) noexcept
+{
+    T x = 0;
+    for(std::size_t i=0; i<sizeof(T); ++i)
+    {
+        x = static_cast<T>((x << 8) | static_cast<T>(bytes[offset + i]));
+    }
+    return x;
+}
+
+// Converts the payload of a timestamp extension. Returns nullopt if it is
+// malformed or the time cannot be represented in `timestamp_type`.
+template<std::size_t N>
+std::optional<timestamp_type> decode_timestamp(const std::array<std::byte, N>& payload) noexcept
+{
+    std::int64_t  sec  = 0;
+    std::uint32_t nsec = 0;
+    if constexpr(N == 4) // timestamp 32
+    {
+        sec = load_big_endian<std::uint32_t>(payload, 0);
+    }
+    else if constexpr(N == 8) // timestamp 64
+    {
+        const auto data = load_big_endian<std::uint64_t>(payload, 0);
+        nsec = static_cast<std::uint32_t>(data >> 34);
+        sec  = static_cast<std::int64_t>(data & 0x3'FFFF'FFFFull);
+    }
+    else // timestamp 96
+    {
+        static_assert(N == 12);
+        nsec = load_big_endian<std::uint32_t>(payload, 0);
+        sec  = static_cast<std::int64_t>(load_big_endian<std::uint64_t>(payload, 4));
+    }
+
+    constexpr std::int64_t giga = 1'000'000'000;
+    if(giga <= nsec) {return std::nullopt;}
+
+    // count = hi * 1e9 + lo, where lo has the same sign as hi, so that the
+    // range check is symmetric
+    const std::int64_t hi = sec < 0 ? sec + 1 : sec;
+    const std::int64_t lo = sec < 0 ? std::int64_t(nsec) - giga : std::int64_t(nsec);
+
+    constexpr auto max_count = std::numeric_limits<std::int64_t>::max();
+    constexpr auto min_count = std::numeric_limits<std::int64_t>::min();
+    if(hi < min_count / giga || max_count / giga < hi ||
+       (hi == max_count / giga && max_count % giga < lo) ||
+       (hi == min_count / giga && lo < min_count % giga))
+    {
+        return std::nullopt;
+    }
+    return timestamp_type(std::chrono::nanoseconds(hi * giga + lo));
+}
+
+// Reads the payload of a timestamp extension into a stack buffer. If it is
+// not a valid timestamp, it is returned as an ordinary ext.
+template<std::size_t N, Reader R>
+std::optional<value> read_timestamp(R& reader, const std::int8_t type)
+{
+    const auto payload = reader.template read_bytes<N>();
+    if( ! payload.has_value()) {return std::nullopt;}
+
+    if(const auto ts = decode_timestamp(payload.value()))
+    {
+        return value(ts.value());
+    }
+    return value(std::make_pair(type, bin_type(payload.value().begin(), payload.value().end())));
+}
+
+// Reads the payload of an extension that has a codec. It is passed to the
+// codec as a view of the reader's buffer if possible, or through a stack
+// buffer if it is small.
+template<Reader R>
+std::optional<value> read_typed_ext(R& reader, const std::size_t len, const std::int8_t type,
+                                    const ext_registry::decode_function& decode)
+{
+    const auto convert = [&](std::span<const std::byte> payload) {
+        if(auto obj = decode(type, payload))
+        {
+            return value(std::move(obj.value()));
+        }
+        return value(std::make_pair(type, bin_type(payload.begin(), payload.end())));
+    };
+
+    if constexpr(requires {reader.read_view(len);})
+    {
+        const auto payload = reader.read_view(len);
+        if( ! payload.has_value()) {return std::nullopt;}
+        return std::optional<value>(convert(payload.value()));
+    }
+    else
+    {
+        std::array<std::byte, 64> buf;
+        if(len <= buf.size())
+        {
+            for(std::size_t i=0; i<len; ++i)
+            {
+                const auto b = reader.read_byte();
+                if( ! b.has_value()) {return std::nullopt;}
+                buf[i] = b.value();
+            }
+            return std::optional<value>(convert(std::span<const std::byte>(buf.data(), len)));
+        }
+        const auto payload = reader.read_bytes(len);
+        if( ! payload.has_value()) {return std::nullopt;}
+        return std::optional<value>(convert(payload.value()));
+    }
+}
+
+template<Reader R>
+std::optional<value> read_ext(R& reader, std::optional<std::size_t> len,
+                              const ext_registry* exts = nullptr)
+{
+    if( ! len.has_value()) {return std::nullopt;}
+
+    auto type = detail::read_as_big_endian<std::int8_t>(reader);
+    if( ! type.has_value()) {return std::nullopt;}
+
+    if(exts != nullptr)
+    {
+        if(const auto* decode = exts->find(type.value()))
+        {
+            return read_typed_ext(reader, len.value(), type.value(), *decode);
+        }
+    }
+
+    if(type.value() == -1) // timestamp
+    {
+        switch(len.value())
+        {
+            case  4: {return read_timestamp< 4>(reader, type.value());}
+            case  8: {return read_timestamp< 8>(reader, type.value());}
+            case 12: {return read_timestamp<12>(reader, type.value());}
+            default: {break;}
+        }
+    }
+
+    auto v = read_payload(reader, len.value());
+    if( ! v.has_value()) {return std::nullopt;}
+
+    return value(std::make_pair(type.value(), std::move(v.value())));
+}
+
+template<Reader R>
+std::optional<value> read_str(R& reader, std::optional<std::size_t> len)
+{
+    if( ! len.has_value()) {return std::nullopt;}
+
+    // A view is checked against the input before the string is allocated,
+    // so it is preferred to `read_into()`.
+    if constexpr(requires {reader.read_view(len.value());})
+    {
+        const auto bytes = reader.read_view(len.value());
+        if( ! bytes.has_value()) {return std::nullopt;}
+        return value(std::string(reinterpret_cast<const char*>(bytes.value().data()),
+                                 bytes.value().size()));
+    }
+    else if constexpr(requires(std::span<std::byte> out) {{reader.read_into(out)} -> std::convertible_to<bool>;})
+    {
+        std::string s(len.value(), '\0');
+        if( ! reader.read_into(std::as_writable_bytes(std::span<char>(s)))) {return std::nullopt;}
+        return value(std::move(s));
+    }
+    else
+    {
+        auto v = reader.read_bytes(len.value());
+        if( ! v.has_value()) {return std::nullopt;}
+
+        std::string s(len.value(), '\0');
+        std::transform(v.value().begin(), v.value().end(), s.begin(),
+            [](const std::byte b) -> char { return std::bit_cast<char>(b); });
+
+        return value(std::move(s));
+    }
+}
+
+
+// Header of a msgpack object. Scalars are read entirely into `v`.
+// For arrays and maps, `v` holds an empty container and `size` is the number
+// of objects that follow it (a map of n pairs is followed by 2n objects).
+struct object_head
+{
+    value       v;
+    std::size_t size;
+};
+
+inline std::optional<object_head> read_array_head(std::optional<std::size_t> len)
+{
+    if( ! len.has_value()) {return std::nullopt;}
+
+    array_type vs;
+    vs.reserve(len.value());
+    return object_head{value(std::move(vs)), len.value()};
+}
+
+inline std::optional<object_head> read_map_head(std::optional<std::size_t> len)
+{
+    if( ! len.has_value()) {return std::nullopt;}
+
+    return object_head{value(map_type{}), len.value() * 2};
+}
+
+inline std::optional<object_head> read_scalar(std::optional<value> v)
+{
+    if( ! v.has_value()) {return std::nullopt;}
+
+    return object_head{std::move(v.value()), 0};
+}
+
+// `exts` is the codecs for extensions. nullptr if there is none.
+template<Reader R>
+std::optional<object_head> read_head(R& reader, const std::uint8_t tag,
+                                     const ext_registry* exts = nullptr)
+{
+    if(tag <= 0x7F) // positive fixint
+    {
+        return object_head{value(tag), 0};
+    }
+    else if(0xE0 <= tag) // negative fixint
+    {
+        const auto fixint = std::bit_cast<std::int8_t>(tag);
+        return object_head{value(fixint), 0};
+    }
+    else if((tag & 0b1110'0000) == 0b1010'0000) // fixstr
+    {
+        const auto len = tag & 0b0001'1111;
+        return read_scalar(read_str(reader, len));
+    }
+    else if((tag & 0b1111'0000) == 0b1001'0000) // fixarray
+    {
+        const auto len = tag & 0b0000'1111;
+        return read_array_head(len);
+    }
+    else if((tag & 0b1111'0000) == 0b1000'0000) // fixmap
+    {
+        const auto len = tag & 0b0000'1111;
+        return read_map_head(len);
+    }
+
+    switch(tag)
+    {
+        case 0xC0: {return object_head{value(nil_type{}), 0};}
+        //   0xC1: {never used}
+        case 0xC2: {return object_head{value(false), 0};}
+        case 0xC3: {return object_head{value(true), 0};}
+        case 0xC4: {return read_scalar(read_bin(reader, read_as_big_endian<std::uint8_t >(reader)));}
+        case 0xC5: {return read_scalar(read_bin(reader, read_as_big_endian<std::uint16_t>(reader)));}
+        case 0xC6: {return read_scalar(read_bin(reader, read_as_big_endian<std::uint32_t>(reader)));}
+        case 0xC7: {return read_scalar(read_ext(reader, read_as_big_endian<std::uint8_t >(reader), exts));}
+        case 0xC8: {return read_scalar(read_ext(reader, read_as_big_endian<std::uint16_t>(reader), exts));}
+        case 0xC9: {return read_scalar(read_ext(reader, read_as_big_endian<std::uint32_t>(reader), exts));}
+        case 0xCA: {return read_scalar(read_as_big_endian<float32_type >(reader));}
+        case 0xCB: {return read_scalar(read_as_big_endian<float64_type >(reader));}
+        case 0xCC: {return read_scalar(read_as_big_endian<std::uint8_t >(reader));}
+        case 0xCD: {return read_scalar(read_as_big_endian<std::uint16_t>(reader));}
+        case 0xCE: {return read_scalar(read_as_big_endian<std::uint32_t>(reader));}
+        case 0xCF: {return read_scalar(read_as_big_endian<std::uint64_t>(reader));}
+        case 0xD0: {return read_scalar(read_as_big_endian<std::int8_t  >(reader));}
+        case 0xD1: {return read_scalar(read_as_big_endian<std::int16_t >(reader));}
+        case 0xD2: {return read_scalar(read_as_big_endian<std::int32_t >(reader));}
+        case 0xD3: {return read_scalar(read_as_big_endian<std::int64_t >(reader));}
+        case 0xD4: {return read_scalar(read_ext(reader,  1, exts));}
+        case 0xD5: {return read_scalar(read_ext(reader,  2, exts));}
+        case 0xD6: {return read_scalar(read_ext(reader,  4, exts));}
+        case 0xD7: {return read_scalar(read_ext(reader,  8, exts));}
+        case 0xD8: {return read_scalar(read_ext(reader, 16, exts));}
+        case 0xD9: {return read_scalar(read_str(reader, read_as_big_endian<std::uint8_t >(reader)));}
+        case 0xDA: {return read_scalar(read_str(reader, read_as_big_endian<std::uint16_t>(reader)));}
+        case 0xDB: {return read_scalar(read_str(reader, read_as_big_endian<std::uint32_t>(reader)));}
+        case 0xDC: {return read_array_head(read_as_big_endian<std::uint16_t>(reader));}
+        case 0xDD: {return read_array_head(read_as_big_endian<std::uint32_t>(reader));}
+        case 0xDE: {return read_map_head(read_as_big_endian<std::uint16_t>(reader));}
+        case 0xDF: {return read_map_head(read_as_big_endian<std::uint32_t>(reader));}
+        default: return std::nullopt;
+    }
+}
+
+template<Reader R>
+std::optional<object_head> read_head(R& reader, const ext_registry* exts = nullptr)
+{
+    const auto b = reader.read_byte();
+    if( ! b.has_value()) {return std::nullopt;}
+
+    return read_head(reader, static_cast<std::uint8_t>(b.value()), exts);
+}
+
+template<Reader R>
+bool skip_bytes(R& reader, std::size_t n)
+{
+    if constexpr(requires {{reader.skip_bytes(n)} -> std::convertible_to<bool>;})
+    {
+        return reader.skip_bytes(n);
+    }
+    else
+    {
+        for(; 64 <= n; n -= 64)
+        {
+            if( ! reader.template read_bytes<64>().has_value()) {return false;}
+        }
+        for(; 0 < n; n -= 1)
+        {
+            if( ! reader.read_byte().has_value()) {return false;}
+        }
+        return true;
+    }
+}
+
+template<Reader R>
+bool skip_len(R& reader, std::optional<std::size_t> len)
+{
+    return len.has_value() && skip_bytes(reader, len.value());
+}
+
+inline bool add_len(std::size_t& count, std::optional<std::size_t> len, const std::size_t factor)
+{
+    if( ! len.has_value()) {return false;}
+    count += len.value() * factor;
+    return true;
+}
+
+// Skips the rest of an object whose tag has already been read. The number of
+// objects contained in it (the elements of an array or the keys and values of
+// a map) are added to `count`.
+template<Reader R>
+bool skip_after_tag(R& reader, const std::uint8_t tag, std::size_t& count)
+{
+    if(tag <= 0x7F || 0xE0 <= tag) // fixint
+    {
+        return true;
+    }
+    else if((tag & 0b1110'0000) == 0b1010'0000) // fixstr
+    {
+        return skip_bytes(reader, tag & 0b0001'1111);
+    }
+    else if((tag & 0b1111'0000) == 0b1001'0000) // fixarray
+    {
+        count += tag & 0b0000'1111;
+        return true;
+    }
+    else if((tag & 0b1111'0000) == 0b1000'0000) // fixmap
+    {
+        count += (tag & 0b0000'1111) * 2;
+        return true;
+    }
+
+    switch(tag)
+    {
+        case 0xC0: {return true;}
+        //   0xC1: {never used}
+        case 0xC2: {return true;}
+        case 0xC3: {return true;}
+        case 0xC4: {return skip_len(reader, read_as_big_endian<std::uint8_t >(reader));}
+        case 0xC5: {return skip_len(reader, read_as_big_endian<std::uint16_t>(reader));}
+        case 0xC6: {return skip_len(reader, read_as_big_endian<std::uint32_t>(reader));}
+        case 0xC7: {return skip_len(reader, read_as_big_endian<std::uint8_t >(reader)) && skip_bytes(reader, 1);}
+        case 0xC8: {return skip_len(reader, read_as_big_endian<std::uint16_t>(reader)) && skip_bytes(reader, 1);}
+        case 0xC9: {return skip_len(reader, read_as_big_endian<std::uint32_t>(reader)) && skip_bytes(reader, 1);}
+        case 0xCA: {return skip_bytes(reader, 4);}
+        case 0xCB: {return skip_bytes(reader, 8);}
+        case 0xCC: {return skip_bytes(reader, 1);}
+        case 0xCD: {return skip_bytes(reader, 2);}
+        case 0xCE: {return skip_bytes(reader, 4);}
+        case 0xCF: {return skip_bytes(reader, 8);}
+        case 0xD0: {return skip_bytes(reader, 1);}
+        case 0xD1: {return skip_bytes(reader, 2);}
+        case 0xD2: {return skip_bytes(reader, 4);}
+        case 0xD3: {return skip_bytes(reader, 8);}
+        case 0xD4: {return skip_bytes(reader, 1 +  1);}
+        case 0xD5: {return skip_bytes(reader, 1 +  2);}
+        case 0xD6: {return skip_bytes(reader, 1 +  4);}
+        case 0xD7: {return skip_bytes(reader, 1 +  8);}
+        case 0xD8: {return skip_bytes(reader, 1 + 16);}
+        case 0xD9: {return skip_len(reader, read_as_big_endian<std::uint8_t >(reader));}
+        case 0xDA: {return skip_len(reader, read_as_big_endian<std::uint16_t>(reader));}
+        case 0xDB: {return skip_len(reader, read_as_big_endian<std::uint32_t>(reader));}
+        case 0xDC: {return add_len(count, read_as_big_endian<std::uint16_t>(reader), 1);}
+        case 0xDD: {return add_len(count, read_as_big_endian<std::uint32_t>(reader), 1);}
+        case 0xDE: {return add_len(count, read_as_big_endian<std::uint16_t>(reader), 2);}
+        case 0xDF: {return add_len(count, read_as_big_endian<std::uint32_t>(reader), 2);}
+        default: return false;
+    }
+}
+
+// Skips `count` objects, including everything nested in them.
+template<Reader R>
+bool skip_objects(R& reader, std::size_t count)
+{
+    while(count != 0)
+    {
+        const auto b = reader.read_byte();
+        if( ! b.has_value()) {return false;}
+
+        count -= 1;
+        if( ! skip_after_tag(reader, static_cast<std::uint8_t>(b.value()), count))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Forwards to a reader and counts the bytes read, for stats.
+template<Reader R>
+class counting_reader
+{
+  public:
+
+    explicit counting_reader(R& r) noexcept: reader_(r), count_(0) {}
+
+    std::size_t count() const noexcept {return count_;}
+
+    bool is_ok()  const {return reader_.is_ok();}
+    bool is_eof() const {return reader_.is_eof();}
+
+    std::optional<std::byte> read_byte()
+    {
+        auto b = reader_.read_byte();
+        if(b.has_value()) {count_ += 1;}
+        return b;
+    }
+    template<std::size_t N>
+    std::optional<std::array<std::byte, N>> read_bytes()
+    {
+        auto bs = reader_.template read_bytes<N>();
+        if(bs.has_value()) {count_ += N;}
+        return bs;
+    }
+    std::optional<std::vector<std::byte>> read_bytes(std::size_t n)
+    {
+        auto bs = reader_.read_bytes(n);
+        if(bs.has_value()) {count_ += n;}
+        return bs;
+    }
+    std::optional<std::span<const std::byte>> read_view(std::size_t n)
+        requires requires(R& r) {r.read_view(n);}
+    {
+        auto bs = reader_.read_view(n);
+        if(bs.has_value()) {count_ += n;}
+        return bs;
+    }
+    bool read_into(std::span<std::byte> out)
+        requires requires(R& r) {{r.read_into(out)} -> std::convertible_to<bool>;}
+    {
+        const bool ok = reader_.read_into(out);
+        if(ok) {count_ += out.size();}
+        return ok;
+    }
+    bool skip_bytes(std::size_t n)
+        requires requires(R& r) {{r.skip_bytes(n)} -> std::convertible_to<bool>;}
+    {
+        const bool ok = reader_.skip_bytes(n);
+        if(ok) {count_ += n;}
+        return ok;
+    }
+
+  private:
+
+    R&          reader_;
+    std::size_t count_;
+};
+
+} // detail
+
+// A projection selects the parts of a map to be decoded. Map entries that are
+// not selected are skipped without being decoded.
+//
+// - `p.find(key)` returns the projection that applies to the value of `key`,
+//   or nullptr if the entry is not selected.
+// - `p.keeps_all()` returns true if `p` selects everything under it.
+//
+// A projection applies to each element of an array, and it does not apply to
+// scalars.
+template<typename P>
+concept Projection = requires(const P& p, const value& key) {
+    {p.find(key)}    -> std::convertible_to<const P*>;
+    {p.keeps_all()}  -> std::convertible_to<bool>;
+};
+
+namespace detail
+{
+struct no_projection
+{
+    no_projection const* find(const value&) const noexcept {return nullptr;}
+    bool keeps_all() const noexcept {return true;}
+};
+static_assert(Projection<no_projection>);
+} // detail
+
+// Decodes values without recursion. Containers that are being filled are kept
+// on an explicit stack, so the nesting depth of the input is bounded by
+// `max_depth()` instead of the size of the call stack. The stack keeps its
+// capacity between calls; reuse a decoder to avoid reallocating it.
+class decoder
+{
+  public:
+
+    static constexpr std::size_t default_max_depth = 1024;
+
+  public:
+
+    decoder() = default;
+    ~decoder() = default;
+    decoder(const decoder&) = default;
+    decoder(decoder&&)      = default;
+    decoder& operator=(const decoder&) = default;
+    decoder& operator=(decoder&&)      = default;
+
+    explicit decoder(const std::size_t max_depth): max_depth_(max_depth) {}
+
+    std::size_t max_depth() const noexcept {return max_depth_;}
+    void set_max_depth(const std::size_t d) noexcept {max_depth_ = d;}
+
+    // Codecs for extension types. The registry is not owned and must outlive
+    // the reads. nullptr (the default) decodes every extension as `ext_type`.
+    ext_registry const* ext_codecs() const noexcept {return exts_;}
+    void set_ext_codecs(const ext_registry* exts) noexcept {exts_ = exts;}
+
+    template<Reader R>
+    std::optional<value> read(R& reader)
+    {
+        no_stats stats;
+        return this->read_impl<detail::no_projection>(reader, nullptr, stats);
+    }
+
+    template<Reader R, Projection P>
+    std::optional<value> read(R& reader, const P& proj)
+    {
+        no_stats stats;
+        return this->read_impl<P>(reader,
+                proj.keeps_all() ? nullptr : std::addressof(proj), stats);
+    }
+
+    // counts what is decoded into `stats`
+    template<Reader R, CodecStats S>
+    std::optional<value> read(R& reader, S& stats)
+    {
+        return this->read_impl<detail::no_projection>(reader, nullptr, stats);
+    }
+
+    template<Reader R, Projection P, CodecStats S>
+    std::optional<value> read(R& reader, const P& proj, S& stats)
+    {
+        return this->read_impl<P>(reader,
+                proj.keeps_all() ? nullptr : std::addressof(proj), stats);
+    }
+
+  private:
+
+    template<typename P, Reader R, CodecStats S>
+    std::optional<value> read_impl(R& reader, const P* proj, S& stats)
+    {
+        if constexpr(S::enabled)
+        {
+            detail::call_timer<S> timer(stats);
+            detail::counting_reader<R> counter(reader);
+            return this->read_loop(counter, proj, stats);
+        }
+        else
+        {
+            return this->read_loop(reader, proj, stats);
+        }
+    }
+
+    // `proj == nullptr` means that everything is decoded
+    template<typename P, Reader R, CodecStats S>
+    std::optional<value> read_loop(R& reader, const P* proj, S& stats)
+    {
+        constexpr bool projected = ! std::same_as<P, detail::no_projection>;
+
+        this->stack_.clear();
+
+        while(true)
+        {
+            [[maybe_unused]] std::size_t start = 0;
+            if constexpr(S::enabled) {start = reader.count();}
+
+            auto head = detail::read_head(reader, this->exts_);
+            if( ! head.has_value())
+            {
+                this->stack_.clear();
+                return std::nullopt;
+            }
+            value v = std::move(head.value().v);
+
+            if constexpr(S::enabled)
+            {
+                stats.count_object(v.type(), reader.count() - start);
+                if(v.is_array() || v.is_map())
+                {
+                    const auto n = head.value().size;
+                    stats.count_container(v.type(), v.is_map() ? n / 2 : n,
+                                          this->stack_.size() + 1);
+                }
+            }
 
-    using nil_type     = std::monostate;
-    using bool_type    = bool;
-    using int_type     = std::int64_t;
-    using uint_type    = std::uint64_t;
-    using float32_type = float;
-    using float64_type = double;
-    using str_type     = std::string;
-    using bin_type     = std::vector<std::byte>;
-    using array_type   = std::vector<value>;
-    using map_type     = ordered_map<value, value>;
-    using ext_type     = std::pair<std::int8_t, std::vector<std::byte>>;
+            if(v.is_array() || v.is_map())
+            {
+                if(this->max_depth_ <= this->stack_.size())
+                {
+                    this->stack_.clear();
+                    return std::nullopt;
+                }
+                if(head.value().size != 0)
+                {
+                    this->stack_.push_back(frame{std::move(v), value{}, {},
+                                                 head.value().size, proj, nullptr});
+                    // with a projection, only the selected entries are
+                    // allocated, as they are found
+                    if(this->stack_.back().container.is_map() && proj == nullptr)
+                    {
+                        this->stack_.back().pairs.reserve(head.value().size / 2);
+                    }
+                    proj = this->next_projection<P>();
+                    continue;
+                }
+            }
+
+            // `v` is complete. Append it to the enclosing containers, closing
+            // every container that becomes full on the way.
+            while(true)
+            {
+                if(this->stack_.empty())
+                {
+                    return v;
+                }
+
+                auto& top = this->stack_.back();
+                if(top.container.is_array())
+                {
+                    top.container.as_array().push_back(std::move(v));
+                    top.remaining -= 1;
+                }
+                else if(top.remaining % 2 == 0) // key of the next pair
+                {
+                    bool selected = true;
+                    if constexpr(projected)
+                    {
+                        if(top.proj != nullptr)
+                        {
+                            const P* sub = static_cast<const P*>(top.proj)->find(v);
+                            selected  = (sub != nullptr);
+                            top.sub_proj = (sub && ! sub->keeps_all()) ? sub : nullptr;
+                        }
+                    }
+                    if(selected)
+                    {
+                        top.key = std::move(v);
+                        top.remaining -= 1;
+                    }
+                    else
+                    {
+                        if( ! detail::skip_objects(reader, 1))
+                        {
+                            this->stack_.clear();
+                            return std::nullopt;
+                        }
+                        top.remaining -= 2;
+                    }
+                }
+                else
+                {
+                    top.pairs.emplace_back(std::move(top.key), std::move(v));
+                    top.remaining -= 1;
+                }
+
+                if(top.remaining != 0)
+                {
+                    break;
+                }
+                if(top.container.is_map())
+                {
+                    // index all the keys at once. throws if a key is duplicated
+                    top.container = map_type(std::move(top.pairs));
+                }
+                v = std::move(top.container);
+                this->stack_.pop_back();
+            }
+            proj = this->next_projection<P>();
+        }
+    }
+
+    // the projection that applies to the next object
+    template<typename P>
+    const P* next_projection() const noexcept
+    {
+        if constexpr(std::same_as<P, detail::no_projection>)
+        {
+            return nullptr;
+        }
+        else
+        {
+            if(this->stack_.empty()) {return nullptr;}
+
+            const auto& top = this->stack_.back();
+            if(top.container.is_array())  {return static_cast<const P*>(top.proj);}
+            if(top.remaining % 2 == 0)    {return nullptr;} // keys are not projected
+            return static_cast<const P*>(top.sub_proj);
+        }
+    }
+
+  private:
+
+    struct frame
+    {
+        value                    container;
+        value                    key;       // pending key while filling a map
+        map_type::container_type pairs;     // entries of a map, indexed at the end
+        std::size_t              remaining; // number of objects until `container` is full
+        const void*              proj;      // projection applied to the elements
+        const void*              sub_proj;  // projection applied to the value of `key`
+    };
+
+  private:
+
+    std::size_t                   max_depth_ = default_max_depth;
+    const ext_registry*           exts_      = nullptr;
+    detail::small_stack<frame, 8> stack_; // shallow values need no allocation
+};
+
+template<Reader R>
+std::optional<value> read(R& reader, decoder& dec)
+{
+    return dec.read(reader);
+}
+
+template<Reader R>
+std::optional<value> read(R& reader)
+{
+    decoder dec;
+    return dec.read(reader);
+}
+
+template<Reader R, CodecStats S>
+std::optional<value> read(R& reader, S& stats)
+{
+    decoder dec;
+    return dec.read(reader, stats);
+}
+
+template<Reader R, CodecStats S>
+std::optional<value> read(R& reader, decoder& dec, S& stats)
+{
+    return dec.read(reader, stats);
+}
+
+// Skips one object without decoding it. Nested objects are skipped by
+// counting, so it needs no memory regardless of the nesting depth.
+template<Reader R>
+bool skip(R& reader)
+{
+    return detail::skip_objects(reader, 1);
+}
+
+} // msgplus
+#endif//MSGPLUS_READ_HPP
+#ifndef MSGPLUS_PATCH_HPP
+#define MSGPLUS_PATCH_HPP
+
+
+#include <algorithm>
+#include <iterator>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+namespace msgplus
+{
 
+// A list of edits that turns one value into another.
+//
+// The location of an edit is a list of keys from the root: a map is indexed
+// by a key of the map, and an array by a uint. An empty location means the
+// root itself.
+//
+// - `set`    replaces the element at the location, or appends a new entry if
+//            the location is a key that the map does not have.
+// - `remove` erases the element at the location.
+// - `insert` inserts an element into an array before the index.
+//
+// A patch can be converted to a value and back, so it can be sent as msgpack.
+// The format is an array of `[op, [keys...]]` for remove and
+// `[op, [keys...], value]` for set and insert, where op is 0, 1, 2 for set,
+// remove and insert.
+class patch
+{
   public:
 
-    value(): value_(nil_type{}) {}
-    ~value() = default;
-    value(const value&) = default;
-    value(value&&)      = default;
-    value& operator=(const value&) = default;
-    value& operator=(value&&)      = default;
+    enum class op_t : std::uint8_t
+    {
+        set    = 0,
+        remove = 1,
+        insert = 2,
+    };
 
-    value(nil_type     v): value_(std::move(v)) {}
-    value(bool_type    v): value_(std::move(v)) {}
-    template<std::signed_integral T>
-    value(T v): value_(int_type(std::move(v))) {}
-    template<std::unsigned_integral T>
-    value(T v): value_(uint_type(std::move(v))) {}
-    value(float32_type v): value_(std::move(v)) {}
-    value(float64_type v): value_(std::move(v)) {}
-    value(str_type     v): value_(std::move(v)) {}
-    template<std::size_t N>
-    value(const char (&v)[N]): value_(str_type(v)) {}
-    value(const char* v): value_(str_type(v)) {}
-    value(bin_type     v): value_(std::move(v)) {}
-    value(array_type   v): value_(std::move(v)) {}
-    value(map_type     v): value_(std::move(v)) {}
-    value(ext_type     v): value_(std::move(v)) {}
+    struct operation
+    {
+        op_t               op;
+        std::vector<value> location;
+        value              element; // nil for remove
+    };
 
-    value& operator=(nil_type     v) { value_ = std::move(v); return *this;}
-    value& operator=(bool_type    v) { value_ = std::move(v); return *this;}
-    template<std::signed_integral T>
-    value& operator=(T v) { value_ = int_type(std::move(v)); return *this;}
-    template<std::unsigned_integral T>
-    value& operator=(T v) { value_ = uint_type(std::move(v)); return *this;}
-    value& operator=(float32_type v) { value_ = std::move(v); return *this;}
-    value& operator=(float64_type v) { value_ = std::move(v); return *this;}
-    template<std::size_t N>
-    value& operator=(const char (&v)[N]){ value_ = str_type(v); return *this;}
-    value& operator=(const char* v)     { value_ = str_type(v); return *this;}
-    value& operator=(bin_type     v) { value_ = std::move(v); return *this;}
-    value& operator=(array_type   v) { value_ = std::move(v); return *this;}
-    value& operator=(map_type     v) { value_ = std::move(v); return *this;}
-    value& operator=(ext_type     v) { value_ = std::move(v); return *this;}
+    using container_type = std::vector<operation>;
+    using iterator       = typename container_type::iterator;
+    using const_iterator = typename container_type::const_iterator;
 
-    type_t type() const noexcept {return static_cast<type_t>(value_.index());}
+  public:
 
-    bool is_nil    () const noexcept {return value_.index() ==  0;}
-    bool is_bool   () const noexcept {return value_.index() ==  1;}
-    bool is_int    () const noexcept {return value_.index() ==  2;}
-    bool is_uint   () const noexcept {return value_.index() ==  3;}
-    bool is_float32() const noexcept {return value_.index() ==  4;}
-    bool is_float64() const noexcept {return value_.index() ==  5;}
-    bool is_str    () const noexcept {return value_.index() ==  6;}
-    bool is_bin    () const noexcept {return value_.index() ==  7;}
-    bool is_array  () const noexcept {return value_.index() ==  8;}
-    bool is_map    () const noexcept {return value_.index() ==  9;}
-    bool is_ext    () const noexcept {return value_.index() == 10;}
+    patch() = default;
+    ~patch() = default;
+    patch(const patch&) = default;
+    patch(patch&&)      = default;
+    patch& operator=(const patch&) = default;
+    patch& operator=(patch&&)      = default;
 
-    nil_type    & as_nil    () {return std::get< 0>(value_);}
-    bool_type   & as_bool   () {return std::get< 1>(value_);}
-    int_type    & as_int    () {return std::get< 2>(value_);}
-    uint_type   & as_uint   () {return std::get< 3>(value_);}
-    float32_type& as_float32() {return std::get< 4>(value_);}
-    float64_type& as_float64() {return std::get< 5>(value_);}
-    str_type    & as_str    () {return std::get< 6>(value_);}
-    bin_type    & as_bin    () {return std::get< 7>(value_);}
-    array_type  & as_array  () {return std::get< 8>(value_);}
-    map_type    & as_map    () {return std::get< 9>(value_);}
-    ext_type    & as_ext    () {return std::get<10>(value_);}
+    void set(std::vector<value> location, value element)
+    {
+        this->ops_.push_back(operation{op_t::set, std::move(location), std::move(element)});
+    }
+    void remove(std::vector<value> location)
+    {
+        this->ops_.push_back(operation{op_t::remove, std::move(location), value{}});
+    }
+    void insert(std::vector<value> location, value element)
+    {
+        this->ops_.push_back(operation{op_t::insert, std::move(location), std::move(element)});
+    }
 
-    nil_type     const& as_nil    () const {return std::get< 0>(value_);}
-    bool_type    const& as_bool   () const {return std::get< 1>(value_);}
-    int_type     const& as_int    () const {return std::get< 2>(value_);}
-    uint_type    const& as_uint   () const {return std::get< 3>(value_);}
-    float32_type const& as_float32() const {return std::get< 4>(value_);}
-    float64_type const& as_float64() const {return std::get< 5>(value_);}
-    str_type     const& as_str    () const {return std::get< 6>(value_);}
-    bin_type     const& as_bin    () const {return std::get< 7>(value_);}
-    array_type   const& as_array  () const {return std::get< 8>(value_);}
-    map_type     const& as_map    () const {return std::get< 9>(value_);}
-    ext_type     const& as_ext    () const {return std::get<10>(value_);}
+    iterator       begin()        noexcept {return ops_.begin();}
+    iterator       end()          noexcept {return ops_.end();}
+    const_iterator begin()  const noexcept {return ops_.begin();}
+    const_iterator end()    const noexcept {return ops_.end();}
+    const_iterator cbegin() const noexcept {return ops_.cbegin();}
+    const_iterator cend()   const noexcept {return ops_.cend();}
 
-    nil_type    * try_nil    () {return std::get_if< 0>(std::addressof(value_));}
-    bool_type   * try_bool   () {return std::get_if< 1>(std::addressof(value_));}
-    int_type    * try_int    () {return std::get_if< 2>(std::addressof(value_));}
-    uint_type   * try_uint   () {return std::get_if< 3>(std::addressof(value_));}
-    float32_type* try_float32() {return std::get_if< 4>(std::addressof(value_));}
-    float64_type* try_float64() {return std::get_if< 5>(std::addressof(value_));}
-    str_type    * try_str    () {return std::get_if< 6>(std::addressof(value_));}
-    bin_type    * try_bin    () {return std::get_if< 7>(std::addressof(value_));}
-    array_type  * try_array  () {return std::get_if< 8>(std::addressof(value_));}
-    map_type    * try_map    () {return std::get_if< 9>(std::addressof(value_));}
-    ext_type    * try_ext    () {return std::get_if<10>(std::addressof(value_));}
+    bool        empty() const noexcept {return ops_.empty();}
+    std::size_t size()  const noexcept {return ops_.size();}
 
-    nil_type     const* try_nil    () const {return std::get_if< 0>(std::addressof(value_));}
-    bool_type    const* try_bool   () const {return std::get_if< 1>(std::addressof(value_));}
-    int_type     const* try_int    () const {return std::get_if< 2>(std::addressof(value_));}
-    uint_type    const* try_uint   () const {return std::get_if< 3>(std::addressof(value_));}
-    float32_type const* try_float32() const {return std::get_if< 4>(std::addressof(value_));}
-    float64_type const* try_float64() const {return std::get_if< 5>(std::addressof(value_));}
-    str_type     const* try_str    () const {return std::get_if< 6>(std::addressof(value_));}
-    bin_type     const* try_bin    () const {return std::get_if< 7>(std::addressof(value_));}
-    array_type   const* try_array  () const {return std::get_if< 8>(std::addressof(value_));}
-    map_type     const* try_map    () const {return std::get_if< 9>(std::addressof(value_));}
-    ext_type     const* try_ext    () const {return std::get_if<10>(std::addressof(value_));}
+    value to_value() const
+    {
+        array_type retval;
+        retval.reserve(this->ops_.size());
+        for(const auto& o : this->ops_)
+        {
+            array_type entry;
+            entry.reserve(3);
+            entry.push_back(value(static_cast<std::uint8_t>(o.op)));
+            entry.push_back(value(o.location));
+            if(o.op != op_t::remove)
+            {
+                entry.push_back(o.element);
+            }
+            retval.push_back(value(std::move(entry)));
+        }
+        return value(std::move(retval));
+    }
 
-    bool operator==(const value& rhs) const noexcept {return this->value_ == rhs.value_;}
-    bool operator!=(const value& rhs) const noexcept {return this->value_ != rhs.value_;}
-    bool operator< (const value& rhs) const noexcept {return this->value_ <  rhs.value_;}
-    bool operator<=(const value& rhs) const noexcept {return this->value_ <= rhs.value_;}
-    bool operator> (const value& rhs) const noexcept {return this->value_ >  rhs.value_;}
-    bool operator>=(const value& rhs) const noexcept {return this->value_ >= rhs.value_;}
+    // returns nullopt if `v` is not in the format of `to_value()`
+    static std::optional<patch> from_value(value v)
+    {
+        if( ! v.is_array())
+        {
+            return std::nullopt;
+        }
+        patch retval;
+        retval.ops_.reserve(v.as_array().size());
+        for(auto& entry : v.as_array())
+        {
+            if( ! entry.is_array() || entry.as_array().size() < 2)
+            {
+                return std::nullopt;
+            }
+            auto& e = entry.as_array();
+            const auto* op = e[0].try_uint();
+            if( ! op || 2 < *op || ! e[1].is_array())
+            {
+                return std::nullopt;
+            }
+            const auto kind = static_cast<op_t>(*op);
+            if(e.size() != (kind == op_t::remove ? 2 : 3))
+            {
+                return std::nullopt;
+            }
+            retval.ops_.push_back(operation{kind, std::move(e[1].as_array()),
+                    kind == op_t::remove ? value{} : std::move(e[2])});
+        }
+        return retval;
+    }
+
+  private:
+
+    container_type ops_;
+};
+
+namespace detail
+{
+
+// the keys of `b` are those of `a` that are not removed, in the same order,
+// followed by the new keys
+inline bool keeps_key_order(const map_type& a, const map_type& b)
+{
+    auto last      = a.begin();
+    bool appending = false;
+    for(const auto& [key, elem] : b)
+    {
+        const auto found = a.find(key);
+        if(found == a.end())
+        {
+            appending = true;
+            continue;
+        }
+        if(appending || found < last)
+        {
+            return false;
+        }
+        last = found;
+    }
+    return true;
+}
+
+inline std::vector<value> extend(const std::vector<value>& location, value key)
+{
+    std::vector<value> retval;
+    retval.reserve(location.size() + 1);
+    retval.insert(retval.end(), location.begin(), location.end());
+    retval.push_back(std::move(key));
+    return retval;
+}
+
+// the parent of the element at `location`; nullptr if it does not exist
+inline value* find_parent(value& root, const std::vector<value>& location)
+{
+    value* current = std::addressof(root);
+    for(std::size_t i=0; i+1 < location.size(); ++i)
+    {
+        const auto& key = location[i];
+        if(auto* map = current->try_map())
+        {
+            const auto found = map->find(key);
+            if(found == map->end()) {return nullptr;}
+            current = std::addressof(found->second);
+        }
+        else if(auto* arr = current->try_array())
+        {
+            const auto* idx = key.try_uint();
+            if( ! idx || arr->size() <= *idx) {return nullptr;}
+            current = std::addressof((*arr)[*idx]);
+        }
+        else
+        {
+            return nullptr;
+        }
+    }
+    return current;
+}
+
+} // detail
+
+// Computes a patch that turns `a` into `b`. Arrays are compared element-wise
+// after their common prefix and suffix are removed, so that an insertion or a
+// removal in the middle becomes a single operation. Nested values are visited
+// without recursion.
+inline patch diff(const value& a, const value& b)
+{
+    struct task
+    {
+        const value*       a;
+        const value*       b;
+        std::vector<value> location;
+    };
+
+    patch retval;
+    std::vector<task> stack;
+    stack.push_back(task{std::addressof(a), std::addressof(b), {}});
+    while( ! stack.empty())
+    {
+        auto t = std::move(stack.back());
+        stack.pop_back();
+
+        const auto* aarr = t.a->try_array();
+        const auto* barr = t.b->try_array();
+        const auto* amap = t.a->try_map();
+        const auto* bmap = t.b->try_map();
+
+        if(aarr && barr)
+        {
+            const auto& x = *aarr;
+            const auto& y = *barr;
+            std::size_t head = 0;
+            while(head < x.size() && head < y.size() && x[head] == y[head])
+            {
+                ++head;
+            }
+            std::size_t tail = 0;
+            while(tail < x.size() - head && tail < y.size() - head &&
+                  x[x.size() - tail - 1] == y[y.size() - tail - 1])
+            {
+                ++tail;
+            }
+            const std::size_t xlen   = x.size() - head - tail;
+            const std::size_t ylen   = y.size() - head - tail;
+            const std::size_t common = std::min(xlen, ylen);
+
+            // removed from the back so that the indices stay valid
+            for(std::size_t i=xlen; common < i; --i)
+            {
+                retval.remove(detail::extend(t.location, value(head + i - 1)));
+            }
+            for(std::size_t i=common; i < ylen; ++i)
+            {
+                retval.insert(detail::extend(t.location, value(head + i)), y[head + i]);
+            }
+            for(std::size_t i=common; 0 < i; --i)
+            {
+                const auto idx = head + i - 1;
+                stack.push_back(task{std::addressof(x[idx]), std::addressof(y[idx]),
+                        detail::extend(t.location, value(idx))});
+            }
+        }
+        else if(amap && bmap)
+        {
+            if( ! detail::keeps_key_order(*amap, *bmap))
+            {
+                retval.set(std::move(t.location), *t.b);
+                continue;
+            }
+            for(const auto& [key, elem] : *amap)
+            {
+                if( ! bmap->contains(key))
+                {
+                    retval.remove(detail::extend(t.location, key));
+                }
+            }
+            for(const auto& [key, elem] : *bmap)
+            {
+                const auto found = amap->find(key);
+                if(found == amap->end())
+                {
+                    retval.set(detail::extend(t.location, key), elem);
+                }
+                else
+                {
+                    stack.push_back(task{std::addressof(found->second),
+                            std::addressof(elem), detail::extend(t.location, key)});
+                }
+            }
+        }
+        else if(*t.a != *t.b)
+        {
+            retval.set(std::move(t.location), *t.b);
+        }
+    }
+    return retval;
+}
 
-    void swap(value& other) noexcept
+// Applies `p` to `v`. Returns false if an operation refers to an element that
+// does not exist; the operations before it are left applied.
+inline bool apply(const patch& p, value& v)
+{
+    for(const auto& o : p)
     {
-        using std::swap;
-        swap(this->value_, other.value_);
-    }
+        if(o.location.empty())
+        {
+            if(o.op != patch::op_t::set) {return false;}
+            v = o.element;
+            continue;
+        }
 
-  private:
+        auto* parent = detail::find_parent(v, o.location);
+        if( ! parent) {return false;}
+        const auto& key = o.location.back();
 
-    std::variant<
-        nil_type    ,
-        bool_type   ,
-        int_type    ,
-        uint_type   ,
-        float32_type,
-        float64_type,
-        str_type    ,
-        bin_type    ,
-        array_type  ,
-        map_type    ,
-        ext_type
-    > value_;
-};
+        if(auto* map = parent->try_map())
+        {
+            const auto found = map->find(key);
+            switch(o.op)
+            {
+                case patch::op_t::set:
+                {
+                    if(found == map->end())
+                    {
+                        map->emplace_back(key, o.element);
+                    }
+                    else
+                    {
+                        found->second = o.element;
+                    }
+                    break;
+                }
+                case patch::op_t::remove:
+                {
+                    if(found == map->end()) {return false;}
+                    map->erase(found);
+                    break;
+                }
+                default:
+                {
+                    return false; // maps have no positions to insert at
+                }
+            }
+        }
+        else if(auto* arr = parent->try_array())
+        {
+            const auto* idx = key.try_uint();
+            if( ! idx) {return false;}
+            const auto i = *idx;
+            switch(o.op)
+            {
+                case patch::op_t::set:
+                {
+                    if(arr->size() <= i) {return false;}
+                    (*arr)[i] = o.element;
+                    break;
+                }
+                case patch::op_t::remove:
+                {
+                    if(arr->size() <= i) {return false;}
+                    arr->erase(arr->begin() + static_cast<std::ptrdiff_t>(i));
+                    break;
+                }
+                case patch::op_t::insert:
+                {
+                    if(arr->size() < i) {return false;}
+                    arr->insert(arr->begin() + static_cast<std::ptrdiff_t>(i), o.element);
+                    break;
+                }
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-using nil_type     = value::nil_type    ;
-using bool_type    = value::bool_type   ;
-using int_type     = value::int_type    ;
-using uint_type    = value::uint_type   ;
-using float32_type = value::float32_type;
-using float64_type = value::float64_type;
-using str_type     = value::str_type    ;
-using bin_type     = value::bin_type    ;
-using array_type   = value::array_type  ;
-using map_type     = value::map_type    ;
-using ext_type     = value::ext_type    ;
+template<Writer W>
+bool write(W& writer, const patch& p)
+{
+    return msgplus::write(writer, p.to_value());
+}
 
-inline void swap(value& lhs, value& rhs) noexcept
+template<Reader R>
+std::optional<patch> read_patch(R& reader)
 {
-    lhs.swap(rhs);
-    return;
+    auto v = msgplus::read(reader);
+    if( ! v.has_value())
+    {
+        return std::nullopt;
+    }
+    return patch::from_value(std::move(v.value()));
 }
 
 } // msgplus
-#endif // MSGPLUS_VALUE_HPP
-#ifndef MSGPLUS_WRITE_HPP
-#define MSGPLUS_WRITE_HPP
+#endif // MSGPLUS_PATCH_HPP
+#ifndef MSGPLUS_PATH_HPP
+#define MSGPLUS_PATH_HPP
 
 
-#include <bit>
+#include <limits>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+#include <cstring>
 
 namespace msgplus
 {
 
-namespace detail
+// A location in a value, written like a JSON Pointer (RFC 6901), e.g.
+// `path("/orders/3/price")`. `~1` and `~0` in a segment stand for `/` and `~`.
+//
+// A path is parsed once and then can be evaluated repeatedly, either on a
+// value or on encoded msgpack, where the objects that are not on the path are
+// skipped instead of decoded.
+//
+// A segment matches a map key that is a string equal to it. If the segment is
+// a non-negative integer, it also matches an integer key of the same value
+// and selects an element of an array.
+class path
 {
-template<Writer W, typename T>
-bool write_as_big_endian(W& writer, T x)
-{
-    constexpr auto N = sizeof(T);
-    const auto as_bytes = reinterpret_cast<const std::byte*>(std::addressof(x));
-    if constexpr(std::endian::native == std::endian::little)
+  public:
+
+    struct segment
     {
-        for(std::size_t i=1; i<=N; ++i)
+        std::string                  name;
+        value                        key;   // `name` as a str, to look up maps
+        std::optional<std::uint64_t> index; // `name` as a non-negative integer
+
+        bool matches(const value& k) const noexcept
         {
-            if( ! writer.write_byte(as_bytes[N-i]))
+            if(const auto* s = k.try_str())
+            {
+                return *s == this->name;
+            }
+            if( ! this->index.has_value())
             {
                 return false;
             }
+            if(const auto* u = k.try_uint())
+            {
+                return *u == this->index.value();
+            }
+            if(const auto* i = k.try_int())
+            {
+                return 0 <= *i && static_cast<std::uint64_t>(*i) == this->index.value();
+            }
+            return false;
         }
-        return true;
-    }
-    else // native == big endian
+    };
+
+  public:
+
+    path() = default;
+    ~path() = default;
+    path(const path&) = default;
+    path(path&&)      = default;
+    path& operator=(const path&) = default;
+    path& operator=(path&&)      = default;
+
+    // throws std::invalid_argument if `pointer` is not a valid JSON Pointer
+    explicit path(std::string_view pointer)
     {
-        return writer.write_bytes(as_bytes, N);
+        if(pointer.empty()) {return;} // the root
+
+        if(pointer.front() != '/')
+        {
+            throw std::invalid_argument("msgplus::path: path must start with '/'");
+        }
+        pointer.remove_prefix(1);
+
+        while(true)
+        {
+            const auto end = pointer.find('/');
+            this->segments_.push_back(make_segment(pointer.substr(0, end)));
+            if(end == std::string_view::npos)
+            {
+                break;
+            }
+            pointer.remove_prefix(end + 1);
+        }
     }
-}
-} // detail
 
-// forward decl
-template<Writer W>
-bool write(W& writer, const value& v);
+    bool        empty() const noexcept {return segments_.empty();}
+    std::size_t size()  const noexcept {return segments_.size();}
 
-template<Writer W>
-bool write(W& writer, const nil_type&)
-{
-    return writer.write_byte(static_cast<std::byte>(0xC0));
-}
-template<Writer W>
-bool write(W& writer, const bool_type& x)
-{
-    if(x)
+    std::vector<segment> const& segments() const noexcept {return segments_;}
+
+    // returns nullptr if `v` has nothing at this path
+    value const* find(const value& v) const
     {
-        return writer.write_byte(static_cast<std::byte>(0xC3));
+        const value* current = std::addressof(v);
+        for(const auto& seg : this->segments_)
+        {
+            current = find_child(*current, seg);
+            if( ! current) {return nullptr;}
+        }
+        return current;
     }
-    else
+    value* find(value& v) const
     {
-        return writer.write_byte(static_cast<std::byte>(0xC2));
+        return const_cast<value*>(this->find(std::as_const(v)));
     }
-}
-template<Writer W>
-bool write(W& writer, const int_type& x)
-{
-    if(0 <= x)
+
+    // Finds the element in an encoded object, and returns the bytes that
+    // encode the element.
+    std::optional<std::span<const std::byte>>
+    find_encoded(std::span<const std::byte> encoded) const
     {
-        if(x < 128)
-        {
-            return writer.write_byte(static_cast<std::byte>(x & 0xFF));
-        }
-        else if(x <= std::numeric_limits<std::uint8_t>::max())
+        memory_reader reader(encoded);
+        std::size_t rest = 0;
+        if( ! this->seek(reader, rest)) {return std::nullopt;}
+
+        const auto first = reader.position();
+        if( ! msgplus::skip(reader)) {return std::nullopt;}
+
+        return encoded.subspan(first, reader.position() - first);
+    }
+
+    // Reads one object from `reader` and returns its element at this path.
+    // Only the element is decoded; the rest of the object is skipped. The
+    // whole object is consumed even if it has no such element.
+    template<Reader R>
+    std::optional<value> read(R& reader) const
+    {
+        std::size_t rest = 0;
+        if( ! this->seek(reader, rest))
         {
-            if( ! writer.write_byte(static_cast<std::byte>(0xCC))) {return false;}
-            return detail::write_as_big_endian(writer,
-                    static_cast<std::uint8_t>(x));
+            detail::skip_objects(reader, rest);
+            return std::nullopt;
         }
-        else if(x <= std::numeric_limits<std::uint16_t>::max())
+
+        auto v = msgplus::read(reader);
+        if( ! v.has_value() || ! detail::skip_objects(reader, rest))
         {
-            if( ! writer.write_byte(static_cast<std::byte>(0xCD))) {return false;}
-            return detail::write_as_big_endian(writer,
-                    static_cast<std::uint16_t>(x));
+            return std::nullopt;
         }
-        else if(x <= std::numeric_limits<std::uint32_t>::max())
+        return v;
+    }
+
+  private:
+
+    static segment make_segment(std::string_view token)
+    {
+        segment seg;
+        for(std::size_t i=0; i<token.size(); ++i)
         {
-            if( ! writer.write_byte(static_cast<std::byte>(0xCE))) {return false;}
-            return detail::write_as_big_endian(writer,
-                    static_cast<std::uint32_t>(x));
+            if(token[i] != '~')
+            {
+                seg.name += token[i];
+                continue;
+            }
+            if(i+1 < token.size() && token[i+1] == '0')
+            {
+                seg.name += '~';
+            }
+            else if(i+1 < token.size() && token[i+1] == '1')
+            {
+                seg.name += '/';
+            }
+            else
+            {
+                throw std::invalid_argument("msgplus::path: invalid escape sequence");
+            }
+            i += 1;
         }
-        else
+        seg.key = value(seg.name);
+
+        if( ! seg.name.empty() && seg.name.size() <= 20 &&
+            seg.name.find_first_not_of("0123456789") == std::string::npos)
         {
-            if( ! writer.write_byte(static_cast<std::byte>(0xCF))) {return false;}
-            return detail::write_as_big_endian(writer,
-                    static_cast<std::uint64_t>(x));
+            std::uint64_t idx = 0;
+            bool overflow = false;
+            for(const char c : seg.name)
+            {
+                const std::uint64_t digit = static_cast<std::uint64_t>(c - '0');
+                if((std::numeric_limits<std::uint64_t>::max() - digit) / 10 < idx)
+                {
+                    overflow = true;
+                    break;
+                }
+                idx = idx * 10 + digit;
+            }
+            if( ! overflow) {seg.index = idx;}
         }
+        return seg;
     }
-    else
+
+    static value const* find_child(const value& v, const segment& seg)
     {
-        if(-32 <= x)
+        if(const auto* map = v.try_map())
         {
-            return detail::write_as_big_endian(writer,
-                    static_cast<std::int8_t>(x));
+            if(const auto found = map->find(seg.key); found != map->end())
+            {
+                return std::addressof(found->second);
+            }
+            if(seg.index.has_value())
+            {
+                if(const auto found = map->find(value(seg.index.value()));
+                        found != map->end())
+                {
+                    return std::addressof(found->second);
+                }
+                if(seg.index.value() <= static_cast<std::uint64_t>(
+                            std::numeric_limits<std::int64_t>::max()))
+                {
+                    const auto i = static_cast<std::int64_t>(seg.index.value());
+                    if(const auto found = map->find(value(i)); found != map->end())
+                    {
+                        return std::addressof(found->second);
+                    }
+                }
+            }
+            return nullptr;
         }
-        else if(std::numeric_limits<std::int8_t>::min() <= x)
+        if(const auto* arr = v.try_array())
         {
-            if( ! writer.write_byte(static_cast<std::byte>(0xD0))) {return false;}
-            return detail::write_as_big_endian(writer,
-                    static_cast<std::int8_t>(x));
+            if(seg.index.has_value() && seg.index.value() < arr->size())
+            {
+                return std::addressof((*arr)[seg.index.value()]);
+            }
+            return nullptr;
         }
-        else if(std::numeric_limits<std::int16_t>::min() <= x)
+        return nullptr;
+    }
+
+    // Reads a map key and checks if it matches `seg`. String keys are compared
+    // without being decoded into a value.
+    template<Reader R>
+    static std::optional<bool> read_key(R& reader, const segment& seg)
+    {
+        const auto b = reader.read_byte();
+        if( ! b.has_value()) {return std::nullopt;}
+        const auto tag = static_cast<std::uint8_t>(b.value());
+
+        std::optional<std::size_t> len;
+        bool is_str = true;
+        if     ((tag & 0b1110'0000) == 0b1010'0000) {len = tag & 0b0001'1111;}
+        else if(tag == 0xD9) {len = detail::read_as_big_endian<std::uint8_t >(reader);}
+        else if(tag == 0xDA) {len = detail::read_as_big_endian<std::uint16_t>(reader);}
+        else if(tag == 0xDB) {len = detail::read_as_big_endian<std::uint32_t>(reader);}
+        else                 {is_str = false;}
+
+        if(is_str)
         {
-            if( ! writer.write_byte(static_cast<std::byte>(0xD1))) {return false;}
-            return detail::write_as_big_endian(writer,
-                    static_cast<std::int16_t>(x));
+            if( ! len.has_value()) {return std::nullopt;}
+            if(len.value() != seg.name.size())
+            {
+                if( ! detail::skip_bytes(reader, len.value())) {return std::nullopt;}
+                return false;
+            }
+            if constexpr(requires {reader.read_view(len.value());})
+            {
+                const auto bytes = reader.read_view(len.value());
+                if( ! bytes.has_value()) {return std::nullopt;}
+                return std::memcmp(bytes.value().data(), seg.name.data(), seg.name.size()) == 0;
+            }
+            else
+            {
+                const auto bytes = reader.read_bytes(len.value());
+                if( ! bytes.has_value()) {return std::nullopt;}
+                return std::memcmp(bytes.value().data(), seg.name.data(), seg.name.size()) == 0;
+            }
         }
-        else if(std::numeric_limits<std::int32_t>::min() <= x)
+
+        auto head = detail::read_head(reader, tag);
+        if( ! head.has_value()) {return std::nullopt;}
+        if(head.value().size != 0) // a map or an array as a key
         {
-            if( ! writer.write_byte(static_cast<std::byte>(0xD2))) {return false;}
-            return detail::write_as_big_endian(writer,
-                    static_cast<std::int32_t>(x));
+            if( ! detail::skip_objects(reader, head.value().size)) {return std::nullopt;}
+            return false;
         }
-        else if(std::numeric_limits<std::int64_t>::min() <= x)
+        return seg.matches(head.value().v);
+    }
+
+    // Advances `reader` to the beginning of the element at this path. `rest`
+    // is increased by the number of objects that follow the element in the
+    // enclosing containers. If there is no such element, it returns false
+    // after skipping the innermost container.
+    template<Reader R>
+    bool seek(R& reader, std::size_t& rest) const
+    {
+        for(const auto& seg : this->segments_)
         {
-            if( ! writer.write_byte(static_cast<std::byte>(0xD3))) {return false;}
-            return detail::write_as_big_endian(writer, x);
+            const auto b = reader.read_byte();
+            if( ! b.has_value()) {return false;}
+            const auto tag = static_cast<std::uint8_t>(b.value());
+
+            const bool is_map = ((tag & 0b1111'0000) == 0b1000'0000) ||
+                                tag == 0xDE || tag == 0xDF;
+            const bool is_arr = ((tag & 0b1111'0000) == 0b1001'0000) ||
+                                tag == 0xDC || tag == 0xDD;
+
+            std::size_t count = 0;
+            if( ! detail::skip_after_tag(reader, tag, count)) {return false;}
+
+            if(is_map)
+            {
+                bool found = false;
+                while(count != 0)
+                {
+                    const auto matched = read_key(reader, seg);
+                    if( ! matched.has_value()) {return false;}
+                    count -= 2;
+                    if(matched.value())
+                    {
+                        found = true;
+                        break;
+                    }
+                    if( ! detail::skip_objects(reader, 1)) {return false;}
+                }
+                if( ! found)
+                {
+                    return false;
+                }
+                rest += count;
+            }
+            else if(is_arr && seg.index.has_value() && seg.index.value() < count)
+            {
+                const auto idx = static_cast<std::size_t>(seg.index.value());
+                if( ! detail::skip_objects(reader, idx)) {return false;}
+                rest += count - idx - 1;
+            }
+            else
+            {
+                detail::skip_objects(reader, count);
+                return false;
+            }
         }
+        return true;
     }
-    return false;
-}
-template<Writer W>
-bool write(W& writer, const uint_type& x)
+
+  private:
+
+    std::vector<segment> segments_;
+};
+
+} // msgplus
+#endif // MSGPLUS_PATH_HPP
+#ifndef MSGPLUS_PROJECTION_HPP
+#define MSGPLUS_PROJECTION_HPP
+
+
+#include <algorithm>
+#include <initializer_list>
+#include <string_view>
+#include <vector>
+
+namespace msgplus
+{
+
+// A set of paths to be decoded, stored as a tree of segments.
+//
+// `read(reader, proj)` decodes only the map entries on the paths and skips
+// the others without allocating anything for them. Everything under the end
+// of a path is decoded. A projection applies to every element of an array, so
+// `/orders/price` keeps `price` of each element of `orders`; unlike `path`, a
+// segment never selects an array element by its index.
+//
+// ```cpp
+// const msgplus::projection proj{"/id", "/orders/price"};
+// const auto v = msgplus::read(reader, proj);
+// ```
+class projection
 {
-    if(x < 128)
+  public:
+
+    // selects nothing
+    projection() = default;
+    ~projection() = default;
+    projection(const projection&) = default;
+    projection(projection&&)      = default;
+    projection& operator=(const projection&) = default;
+    projection& operator=(projection&&)      = default;
+
+    projection(std::initializer_list<std::string_view> paths)
     {
-        return writer.write_byte(static_cast<std::byte>(x & 0xFF));
+        for(const auto& p : paths)
+        {
+            this->add(path(p));
+        }
     }
-    else if(x <= std::numeric_limits<std::uint8_t>::max())
+    explicit projection(const std::vector<path>& paths)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xCC))) {return false;}
-        return detail::write_as_big_endian(writer,
-                static_cast<std::uint8_t>(x));
+        for(const auto& p : paths)
+        {
+            this->add(p);
+        }
     }
-    else if(x <= std::numeric_limits<std::uint16_t>::max())
+
+    projection& add(const path& p)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xCD))) {return false;}
-        return detail::write_as_big_endian(writer,
-                static_cast<std::uint16_t>(x));
+        projection* node = this;
+        for(const auto& seg : p.segments())
+        {
+            if(node->keeps_all_) {return *this;}
+            node = std::addressof(node->make_child(seg));
+        }
+        node->keeps_all_ = true;
+        node->children_.clear();
+        return *this;
     }
-    else if(x <= std::numeric_limits<std::uint32_t>::max())
+
+    bool keeps_all() const noexcept {return keeps_all_;}
+
+    // the projection applied to the value of `key`; nullptr if not selected
+    projection const* find(const value& key) const;
+
+  private:
+
+    projection& make_child(const path::segment& seg);
+
+  private:
+
+    struct child;
+
+    bool               keeps_all_ = false;
+    std::vector<child> children_; // sorted by seg.name
+};
+
+struct projection::child
+{
+    path::segment seg;
+    projection    sub;
+};
+
+inline projection const* projection::find(const value& key) const
+{
+    if(const auto* s = key.try_str())
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xCE))) {return false;}
-        return detail::write_as_big_endian(writer,
-                static_cast<std::uint32_t>(x));
+        const auto found = std::lower_bound(
+            this->children_.begin(), this->children_.end(), std::string_view(*s),
+            [](const child& c, std::string_view k) {return c.seg.name < k;});
+
+        if(found != this->children_.end() && found->seg.name == *s)
+        {
+            return std::addressof(found->sub);
+        }
+        return nullptr;
     }
-    else
+    for(const auto& c : this->children_) // integer keys
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xCF))) {return false;}
-        return detail::write_as_big_endian(writer,
-                static_cast<std::uint64_t>(x));
+        if(c.seg.matches(key))
+        {
+            return std::addressof(c.sub);
+        }
     }
+    return nullptr;
 }
-template<Writer W>
-bool write(W& writer, const float32_type& x)
+
+inline projection& projection::make_child(const path::segment& seg)
 {
-    if( ! writer.write_byte(static_cast<std::byte>(0xCA)))
+    const auto found = std::lower_bound(
+        this->children_.begin(), this->children_.end(), std::string_view(seg.name),
+        [](const child& c, std::string_view k) {return c.seg.name < k;});
+
+    if(found != this->children_.end() && found->seg.name == seg.name)
     {
-        return false;
+        return found->sub;
     }
-    return detail::write_as_big_endian(writer, x);
+    return this->children_.insert(found, child{seg, projection{}})->sub;
 }
-template<Writer W>
-bool write(W& writer, const float64_type& x)
+
+static_assert(Projection<projection>);
+
+template<Reader R, Projection P>
+std::optional<value> read(R& reader, const P& proj)
 {
-    if( ! writer.write_byte(static_cast<std::byte>(0xCB)))
-    {
-        return false;
-    }
-    return detail::write_as_big_endian(writer, x);
+    decoder dec;
+    return dec.read(reader, proj);
 }
-template<Writer W>
-bool write(W& writer, const str_type& x)
+
+template<Reader R, Projection P>
+std::optional<value> read(R& reader, decoder& dec, const P& proj)
 {
-    if(x.size() <= 31)
+    return dec.read(reader, proj);
+}
+
+template<Reader R, Projection P, CodecStats S>
+std::optional<value> read(R& reader, const P& proj, S& stats)
+{
+    decoder dec;
+    return dec.read(reader, proj, stats);
+}
+
+} // msgplus
+#endif // MSGPLUS_PROJECTION_HPP
+#ifndef MSGPLUS_PIPELINE_HPP
+#define MSGPLUS_PIPELINE_HPP
+
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+namespace msgplus
+{
+
+struct pipeline_options
+{
+    // the number of decoding threads. 0 means one less than the number of
+    // hardware threads, and at least 1.
+    std::size_t threads = 0;
+
+    // the number of bytes read from the source at once. Documents found in a
+    // block are decoded together.
+    std::size_t block_size = 1024 * 1024;
+
+    // the maximum number of blocks that have been read but not yet consumed,
+    // including the ones being decoded. The reading stops while it is reached.
+    // 0 means twice the number of threads.
+    std::size_t max_blocks = 0;
+
+    // a document larger than this is an error, so that a corrupted length
+    // does not make the reading thread buffer the whole input.
+    std::size_t max_document_size = std::numeric_limits<std::size_t>::max();
+
+    std::size_t         max_depth = decoder::default_max_depth;
+    const ext_registry* exts      = nullptr; // not owned
+};
+
+namespace detail
+{
+
+// Reads up to `out.size()` bytes. Fewer bytes are read only at the end of
+// the input, or if the reader fails.
+template<Reader R>
+std::size_t read_some(R& reader, std::span<std::byte> out)
+{
+    if constexpr(requires {{reader.read_some(out)} -> std::convertible_to<std::size_t>;})
     {
-        const std::uint8_t tag = 0b1010'0000 |
-            static_cast<std::uint8_t>(x.size() & 0b0001'1111);
-        if( ! writer.write_byte(static_cast<std::byte>(tag))) {return false;}
+        std::size_t n = 0;
+        while(n < out.size())
+        {
+            const std::size_t m = reader.read_some(out.subspan(n));
+            if(m == 0) {break;}
+            n += m;
+        }
+        return n;
     }
-    else if(x.size() <= std::numeric_limits<std::uint8_t>::max())
+    else
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xD9))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint8_t>(x.size()))) {return false;}
+        std::size_t n = 0;
+        for(; n < out.size(); ++n)
+        {
+            const auto b = reader.read_byte();
+            if( ! b.has_value()) {break;}
+            out[n] = b.value();
+        }
+        return n;
     }
-    else if(x.size() <= std::numeric_limits<std::uint16_t>::max())
+}
+
+} // detail
+
+// Decodes a stream of concatenated msgpack documents on multiple threads.
+//
+// A reading thread reads blocks from the reader, finds the boundaries of the
+// complete documents in each block by skipping over them, and hands the
+// blocks to the decoding threads. `next()` returns the documents in the
+// order of the input. At most `max_blocks` blocks are buffered; when the
+// consumer is slower than the decoders, the reading waits for it.
+//
+// The reader is used only by the reading thread and must outlive the
+// pipeline. The destructor stops the threads, after the reading thread
+// returns from the read in progress, if any.
+//
+// ```cpp
+// msg::file_reader reader("records.msg");
+// msg::pipelined_decoder<msg::file_reader> pipeline(reader);
+// while(auto v = pipeline.next())
+// {
+//     // ...
+// }
+// if( ! pipeline.is_ok()) { /* broken input */ }
+// ```
+template<Reader R>
+class pipelined_decoder
+{
+  public:
+
+    explicit pipelined_decoder(R& reader, const pipeline_options& opts = pipeline_options{})
+        : reader_(reader), opts_(opts)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xDA))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(x.size()))) {return false;}
+        if(opts_.threads == 0)
+        {
+            const std::size_t hw = std::thread::hardware_concurrency();
+            opts_.threads = std::max<std::size_t>(1, hw - std::min<std::size_t>(hw, 1));
+        }
+        if(opts_.max_blocks == 0)
+        {
+            opts_.max_blocks = 2 * opts_.threads;
+        }
+        opts_.block_size = std::max<std::size_t>(1, opts_.block_size);
+
+        slots_.resize(opts_.max_blocks);
+
+        workers_.reserve(opts_.threads);
+        try
+        {
+            for(std::size_t i=0; i<opts_.threads; ++i)
+            {
+                workers_.emplace_back([this] {this->run_worker();});
+            }
+            io_thread_ = std::thread([this] {this->run_io();});
+        }
+        catch(...) // a thread could not be started
+        {
+            this->stop();
+            throw;
+        }
     }
-    else if(x.size() <= std::numeric_limits<std::uint32_t>::max())
+    ~pipelined_decoder()
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xDB))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(x.size()))) {return false;}
+        this->stop();
     }
-    else
+
+    pipelined_decoder(const pipelined_decoder&) = delete;
+    pipelined_decoder(pipelined_decoder&&)      = delete;
+    pipelined_decoder& operator=(const pipelined_decoder&) = delete;
+    pipelined_decoder& operator=(pipelined_decoder&&)      = delete;
+
+    // The next document. nullopt at the end of the input, or if the input
+    // cannot be decoded. An exception thrown while decoding a document is
+    // rethrown here, in its place. Once it has returned nullopt, it always
+    // does.
+    std::optional<value> next()
     {
-        return false;
+        while(true)
+        {
+            if(pos_ < current_.values.size())
+            {
+                return std::move(current_.values[pos_++]);
+            }
+            if(finished_)
+            {
+                return std::nullopt;
+            }
+            if(current_.exception)
+            {
+                finished_ = true;
+                ok_       = false;
+                std::rethrow_exception(current_.exception);
+            }
+            if( ! current_.ok)
+            {
+                finished_ = true;
+                ok_       = false;
+                return std::nullopt;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                auto& slot = slots_[next_out_ % slots_.size()];
+                out_cv_.wait(lock, [&] {
+                        return slot.has_value() || (io_done_ && next_out_ == next_seq_);
+                    });
+                if( ! slot.has_value())
+                {
+                    finished_ = true;
+                    return std::nullopt;
+                }
+                current_ = std::move(slot.value());
+                slot.reset();
+                next_out_ += 1;
+                in_flight_ -= 1;
+            }
+            io_cv_.notify_one();
+            pos_ = 0;
+        }
     }
 
-    return writer.write_bytes(reinterpret_cast<const std::byte*>(x.data()), x.size());
-}
-template<Writer W>
-bool write(W& writer, const bin_type& x)
-{
-    if(x.size() <= std::numeric_limits<std::uint8_t>::max())
+    // false if the input was broken or could not be read
+    bool is_ok() const noexcept {return ok_;}
+
+    pipeline_options const& options() const noexcept {return opts_;}
+
+  private:
+
+    // stops and joins the threads that have been started
+    void stop() noexcept
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xC4))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint8_t>(x.size()))) {return false;}
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stopped_ = true;
+        }
+        io_cv_  .notify_all();
+        work_cv_.notify_all();
+        if(io_thread_.joinable()) {io_thread_.join();}
+        for(auto& w : workers_) {w.join();}
     }
-    else if(x.size() <= std::numeric_limits<std::uint16_t>::max())
+
+    struct batch
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xC5))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(x.size()))) {return false;}
-    }
-    else if(x.size() <= std::numeric_limits<std::uint32_t>::max())
+        std::uint64_t                                    seq = 0;
+        std::vector<std::byte>                           data;
+        std::vector<std::pair<std::size_t, std::size_t>> docs; // offset and size
+        bool                                             ok  = true; // false if the input breaks after `docs`
+        std::exception_ptr                               exception;
+    };
+    struct result
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xC6))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(x.size()))) {return false;}
-    }
-    else
+        std::vector<value> values;
+        bool               ok = true;
+        std::exception_ptr exception;
+    };
+
+    // Scans `buf` from `pos` for complete documents. Returns the position of
+    // the first byte that is not part of a complete document, and sets `ok`
+    // to false if the document there is invalid, not just incomplete.
+    std::size_t scan(const std::vector<std::byte>& buf, std::size_t pos,
+                     batch& b, bool& ok) const
     {
-        return false;
+        ok = true;
+        while(pos < buf.size())
+        {
+            memory_reader r(std::span<const std::byte>(buf).subspan(pos));
+            if( ! skip(r))
+            {
+                ok = ! r.is_ok() && (buf.size() - pos) <= opts_.max_document_size;
+                break;
+            }
+            if(opts_.max_document_size < r.position())
+            {
+                ok = false;
+                break;
+            }
+            b.docs.emplace_back(pos, r.position());
+            pos += r.position();
+        }
+        return pos;
     }
-    return writer.write_bytes(x.data(), x.size());
-}
 
-template<Writer W>
-bool write(W& writer, const array_type& x)
-{
-    if(x.size() <= 15)
+    void run_io()
     {
-        const std::uint8_t tag = 0b1001'0000 |
-            static_cast<std::uint8_t>(x.size() & 0b0000'1111);
-        if( ! writer.write_byte(static_cast<std::byte>(tag))) {return false;}
+        std::vector<std::byte> buf; // starts with the incomplete document of the last block
+        while(true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                io_cv_.wait(lock, [&] {return stopped_ || in_flight_ < opts_.max_blocks;});
+                if(stopped_) {return;}
+            }
+
+            batch b;
+            bool  last = false;
+            try
+            {
+                // read at least as much as is pending, so that a document
+                // larger than a block is rescanned only a few times
+                const std::size_t pending = buf.size();
+                const std::size_t want    = std::max(opts_.block_size, pending);
+                buf.resize(pending + want);
+                const std::size_t n = detail::read_some(reader_,
+                        std::span<std::byte>(buf.data() + pending, want));
+                buf.resize(pending + n);
+
+                bool valid = true;
+                const std::size_t end = this->scan(buf, 0, b, valid);
+
+                const bool eof = (n < want);
+                if( ! valid || (eof && (end != buf.size() || ! reader_.is_eof())))
+                {
+                    b.ok = false; // broken, truncated or unreadable
+                }
+                last = eof || ! b.ok;
+
+                std::vector<std::byte> rest(buf.begin() + static_cast<std::ptrdiff_t>(end), buf.end());
+                buf.resize(end);
+                b.data = std::move(buf);
+                buf    = std::move(rest);
+            }
+            catch(...)
+            {
+                b.docs.clear();
+                b.ok        = false;
+                b.exception = std::current_exception();
+                last        = true;
+            }
+
+            if(b.docs.empty() && b.ok && ! last)
+            {
+                continue; // no complete document yet
+            }
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                b.seq = next_seq_++;
+                in_flight_ += 1;
+                work_.push_back(std::move(b));
+                if(last) {io_done_ = true;}
+            }
+            work_cv_.notify_one();
+            if(last)
+            {
+                work_cv_.notify_all();
+                out_cv_.notify_all();
+                return;
+            }
+        }
     }
-    else if(x.size() <= std::numeric_limits<std::uint16_t>::max())
+
+    void run_worker()
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xDC))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(x.size()))) {return false;}
+        decoder dec(opts_.max_depth);
+        dec.set_ext_codecs(opts_.exts);
+        while(true)
+        {
+            batch b;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                work_cv_.wait(lock, [&] {return stopped_ || io_done_ || ! work_.empty();});
+                if(stopped_ || work_.empty()) {return;}
+                b = std::move(work_.front());
+                work_.pop_front();
+            }
+
+            result res;
+            res.ok        = b.ok;
+            res.exception = b.exception;
+            try
+            {
+                res.values.reserve(b.docs.size());
+                for(const auto& [offset, size] : b.docs)
+                {
+                    memory_reader r(std::span<const std::byte>(b.data).subspan(offset, size));
+                    auto v = dec.read(r);
+                    if( ! v.has_value())
+                    {
+                        res.ok = false;
+                        break;
+                    }
+                    res.values.push_back(std::move(v.value()));
+                }
+            }
+            catch(...)
+            {
+                res.exception = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                slots_[b.seq % slots_.size()] = std::move(res);
+            }
+            out_cv_.notify_all();
+        }
     }
-    else if(x.size() <= std::numeric_limits<std::uint32_t>::max())
+
+  private:
+
+    R&               reader_;
+    pipeline_options opts_;
+
+    std::mutex              mtx_;
+    std::condition_variable io_cv_;   // a block can be read
+    std::condition_variable work_cv_; // a block can be decoded
+    std::condition_variable out_cv_;  // a block has been decoded
+
+    // guarded by mtx_
+    std::deque<batch>                  work_;
+    std::vector<std::optional<result>> slots_;         // decoded blocks, at `seq % max_blocks`
+    std::uint64_t                      next_seq_  = 0; // of the next block read
+    std::uint64_t                      next_out_  = 0; // of the next block consumed
+    std::size_t                        in_flight_ = 0; // blocks read but not consumed
+    bool                               io_done_   = false;
+    bool                               stopped_   = false;
+
+    // used by the consumer only
+    result      current_;
+    std::size_t pos_      = 0;
+    bool        finished_ = false;
+    bool        ok_       = true;
+
+    std::vector<std::thread> workers_;
+    std::thread              io_thread_;
+};
+
+} // msgplus
+#endif // MSGPLUS_PIPELINE_HPP
+#ifndef MSGPLUS_RING_HPP
+#define MSGPLUS_RING_HPP
+
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <cstring>
+
+namespace msgplus
+{
+
+// A lock-free byte queue between one producer thread and one consumer thread.
+//
+// The producer writes through a `ring_writer` and the consumer reads through
+// a `ring_reader`, so that one thread can `write()` values that another
+// `read()`s. The ends wait for space or data by spinning for a while and then
+// sleeping in `std::atomic::wait`; they never take a lock, and the ring does
+// not allocate after its construction.
+//
+// ```cpp
+// msg::spsc_ring ring(64 * 1024);
+//
+// std::jthread producer([&] {
+//     msg::ring_writer w(ring);
+//     for(const auto& v : values) {msg::write(w, v);}
+//     w.close();
+// });
+//
+// msg::ring_reader r(ring);
+// while(auto v = msg::read(r))
+// {
+//     // ...
+// }
+// if( ! r.is_eof()) { /* broken input */ }
+// ```
+class spsc_ring
+{
+  public:
+
+    // the capacity is rounded up to a power of two
+    explicit spsc_ring(const std::size_t capacity)
+        : capacity_(std::bit_ceil(std::max<std::size_t>(capacity, 2))),
+          buf_(std::make_unique<std::byte[]>(capacity_))
+    {}
+    ~spsc_ring() = default;
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring(spsc_ring&&)      = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+    spsc_ring& operator=(spsc_ring&&)      = delete;
+
+    std::size_t capacity() const noexcept {return capacity_;}
+
+    // the number of bytes that can be read. it may be outdated when it returns.
+    std::size_t size() const noexcept
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xDD))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(x.size()))) {return false;}
+        const auto tail = tail_.load(std::memory_order_acquire);
+        const auto head = head_.load(std::memory_order_acquire);
+        return head - tail;
     }
-    else
+
+    // After `close()`, writes fail, and reads fail once the ring is empty.
+    // Either end may close the ring.
+    void close() noexcept
     {
-        return false;
+        closed_.store(true, std::memory_order_seq_cst);
+        wake(reader_waiting_);
+        wake(writer_waiting_);
     }
+    bool is_closed() const noexcept {return closed_.load(std::memory_order_acquire);}
 
-    for(const auto& elem : x)
+    // true if it is closed and everything has been read. consumer only.
+    bool is_drained() const noexcept
     {
-        if( ! write(writer, elem)) {return false;}
+        if( ! this->is_closed()) {return false;}
+        // the data written before close() is visible here
+        return tail_.load(std::memory_order_relaxed) == head_.load(std::memory_order_acquire);
     }
-    return true;
-}
 
-template<Writer W>
-bool write(W& writer, const map_type& x)
-{
-    if(x.size() <= 15)
+    // Writes up to `n` bytes without waiting, and returns the number of bytes
+    // written. Producer only.
+    std::size_t try_write(const std::byte* src, std::size_t n) noexcept
     {
-        const std::uint8_t tag = 0b1000'0000 |
-            static_cast<std::uint8_t>(x.size() & 0b0000'1111);
-        if( ! writer.write_byte(static_cast<std::byte>(tag))) {return false;}
+        const auto head = head_.load(std::memory_order_relaxed);
+        if(capacity_ - (head - tail_cache_) < n)
+        {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+        }
+        n = std::min(n, capacity_ - (head - tail_cache_));
+        if(n == 0) {return 0;}
+
+        const auto at    = head & (capacity_ - 1);
+        const auto first = std::min(n, capacity_ - at);
+        std::memcpy(buf_.get() + at, src, first);
+        std::memcpy(buf_.get(), src + first, n - first);
+
+        head_.store(head + n, std::memory_order_seq_cst); // see wake()
+        wake(reader_waiting_);
+        return n;
     }
-    else if(x.size() <= std::numeric_limits<std::uint16_t>::max())
+
+    // Reads up to `n` bytes without waiting, and returns the number of bytes
+    // read. `dst` may be nullptr to discard them. Consumer only.
+    std::size_t try_read(std::byte* dst, std::size_t n) noexcept
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xDC))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(x.size()))) {return false;}
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        if(head_cache_ - tail < n)
+        {
+            head_cache_ = head_.load(std::memory_order_acquire);
+        }
+        n = std::min(n, head_cache_ - tail);
+        if(n == 0) {return 0;}
+
+        if(dst)
+        {
+            const auto at    = tail & (capacity_ - 1);
+            const auto first = std::min(n, capacity_ - at);
+            std::memcpy(dst, buf_.get() + at, first);
+            std::memcpy(dst + first, buf_.get(), n - first);
+        }
+        tail_.store(tail + n, std::memory_order_seq_cst); // see wake()
+        wake(writer_waiting_);
+        return n;
     }
-    else if(x.size() <= std::numeric_limits<std::uint32_t>::max())
+
+    // Sleeps until something may have been written or the ring is closed.
+    // It may return early. Consumer only.
+    void wait_readable() noexcept
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xDD))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(x.size()))) {return false;}
+        reader_waiting_.store(true, std::memory_order_seq_cst);
+        if(head_.load(std::memory_order_seq_cst) == tail_.load(std::memory_order_relaxed) &&
+           ! closed_.load(std::memory_order_seq_cst))
+        {
+            reader_waiting_.wait(true, std::memory_order_relaxed);
+        }
+        reader_waiting_.store(false, std::memory_order_relaxed);
     }
-    else
+
+    // Sleeps until something may have been read or the ring is closed.
+    // It may return early. Producer only.
+    void wait_writable() noexcept
     {
-        return false;
+        writer_waiting_.store(true, std::memory_order_seq_cst);
+        if(head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_seq_cst) == capacity_ &&
+           ! closed_.load(std::memory_order_seq_cst))
+        {
+            writer_waiting_.wait(true, std::memory_order_relaxed);
+        }
+        writer_waiting_.store(false, std::memory_order_relaxed);
     }
-    for(const auto& [k, v] : x)
+
+  private:
+
+    // Called after a position or closed_ is stored. The store, the flag and
+    // the loads in wait_readable() and wait_writable() are all seq_cst, so
+    // either the waiting end sees the store and does not sleep, or this sees
+    // its flag and wakes it.
+    static void wake(std::atomic<bool>& waiting) noexcept
     {
-        if( ! write(writer, k)) {return false;}
-        if( ! write(writer, v)) {return false;}
+        if(waiting.load(std::memory_order_seq_cst))
+        {
+            waiting.store(false, std::memory_order_relaxed);
+            waiting.notify_one();
+        }
     }
-    return true;
-}
 
-template<Writer W>
-bool write(W& writer, const ext_type& x)
+    static constexpr std::size_t cache_line = 64;
+
+    const std::size_t            capacity_;
+    std::unique_ptr<std::byte[]> buf_;
+
+    // the positions only increase; they are masked to index the buffer
+    alignas(cache_line) std::atomic<std::size_t> head_{0}; // written by the producer
+    std::size_t                                  tail_cache_ = 0;
+    alignas(cache_line) std::atomic<std::size_t> tail_{0}; // written by the consumer
+    std::size_t                                  head_cache_ = 0;
+    alignas(cache_line) std::atomic<bool>        closed_{false};
+
+    // set while an end sleeps, so that the other end notifies it only then
+    std::atomic<bool> reader_waiting_{false};
+    std::atomic<bool> writer_waiting_{false};
+};
+
+namespace detail
 {
-    if(x.second.size() == 1)
+// spins for a while, then sleeps in `wait()`
+struct ring_backoff
+{
+    template<typename F>
+    void operator()(F&& wait) noexcept
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xD4))) {return false;}
+        if(spins < 64)
+        {
+            spins += 1;
+            return;
+        }
+        std::forward<F>(wait)();
+        spins = 0;
     }
-    else if(x.second.size() == 2)
+    std::size_t spins = 0;
+};
+} // detail
+
+// The producer end of an spsc_ring. Writes wait until there is space, and
+// fail if the ring is closed.
+class ring_writer
+{
+  public:
+
+    explicit ring_writer(spsc_ring& ring) noexcept: ring_(ring) {}
+
+    bool is_ok() const noexcept {return ! ring_.is_closed();}
+
+    bool write_byte(std::byte b)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xD5))) {return false;}
+        return this->write_bytes(std::addressof(b), 1);
     }
-    else if(x.second.size() == 4)
+    bool write_bytes(const std::byte* ptr, std::size_t len)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xD6))) {return false;}
+        detail::ring_backoff backoff;
+        while(len != 0)
+        {
+            if(ring_.is_closed()) {return false;}
+
+            const auto n = ring_.try_write(ptr, len);
+            if(n == 0)
+            {
+                backoff([this] {ring_.wait_writable();});
+                continue;
+            }
+            ptr += n;
+            len -= n;
+        }
+        return true;
     }
-    else if(x.second.size() == 8)
+
+    // tells the reader that nothing more will be written
+    void close() noexcept {ring_.close();}
+
+  private:
+
+    spsc_ring& ring_;
+};
+static_assert(Writer<ring_writer>);
+
+// The consumer end of an spsc_ring. Reads wait until the data has been
+// written, and fail if the ring is closed before that.
+//
+// Like memory_reader, it also provides `skip_bytes(n)`, `read_into(out)` and
+// `read_some(out)`.
+class ring_reader
+{
+  public:
+
+    explicit ring_reader(spsc_ring& ring) noexcept: ring_(ring), ok_(true) {}
+
+    bool is_ok()  const noexcept {return ok_;}
+    bool is_eof() const noexcept {return ring_.is_drained();}
+
+    std::optional<std::byte> read_byte()
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xD7))) {return false;}
+        std::byte b;
+        if( ! this->read_exactly(std::addressof(b), 1)) {return std::nullopt;}
+        return b;
     }
-    else if(x.second.size() == 16)
+
+    template<std::size_t N>
+    std::optional<std::array<std::byte, N>> read_bytes()
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xD8))) {return false;}
+        std::array<std::byte, N> retval;
+        if( ! this->read_exactly(retval.data(), N)) {return std::nullopt;}
+        return retval;
     }
-    else if(x.second.size() <= std::numeric_limits<std::uint8_t>::max())
+
+    std::optional<std::vector<std::byte>> read_bytes(std::size_t N)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xC7))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint8_t>(x.second.size()))) {return false;}
+        std::vector<std::byte> retval(N);
+        if( ! this->read_exactly(retval.data(), N)) {return std::nullopt;}
+        return retval;
     }
-    else if(x.second.size() <= std::numeric_limits<std::uint16_t>::max())
+
+    bool skip_bytes(std::size_t N)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xC8))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint16_t>(x.second.size()))) {return false;}
+        return this->read_exactly(nullptr, N);
     }
-    else if(x.second.size() <= std::numeric_limits<std::uint32_t>::max())
+
+    // reads exactly `out.size()` bytes into `out`
+    bool read_into(std::span<std::byte> out)
     {
-        if( ! writer.write_byte(static_cast<std::byte>(0xC9))) {return false;}
-        if( ! detail::write_as_big_endian(writer, static_cast<std::uint32_t>(x.second.size()))) {return false;}
+        return this->read_exactly(out.data(), out.size());
     }
-    else
+
+    // waits for at least one byte, and reads what is available up to
+    // `out.size()` bytes. 0 if the ring is closed and empty.
+    std::size_t read_some(std::span<std::byte> out)
     {
-        return false;
+        if(out.empty()) {return 0;}
+
+        detail::ring_backoff backoff;
+        while(true)
+        {
+            if(const auto n = ring_.try_read(out.data(), out.size()); n != 0)
+            {
+                return n;
+            }
+            if(ring_.is_drained()) {return 0;}
+            backoff([this] {ring_.wait_readable();});
+        }
     }
-    if( ! writer.write_byte(static_cast<std::byte>(x.first))) {return false;}
-    return writer.write_bytes(x.second.data(), x.second.size());
-}
 
-template<Writer W>
-bool write(W& writer, const value& v)
-{
-    using enum type_t;
-    switch(v.type())
+  private:
+
+    // `dst` may be nullptr to discard the bytes
+    bool read_exactly(std::byte* dst, std::size_t n)
     {
-        case nil_t     : {return write(writer, v.as_nil    ());}
-        case bool_t    : {return write(writer, v.as_bool   ());}
-        case int_t     : {return write(writer, v.as_int    ());}
-        case uint_t    : {return write(writer, v.as_uint   ());}
-        case float32_t : {return write(writer, v.as_float32());}
-        case float64_t : {return write(writer, v.as_float64());}
-        case str_t     : {return write(writer, v.as_str    ());}
-        case bin_t     : {return write(writer, v.as_bin    ());}
-        case array_t   : {return write(writer, v.as_array  ());}
-        case map_t     : {return write(writer, v.as_map    ());}
-        case ext_t     : {return write(writer, v.as_ext    ());}
-        default:         {return false;}
+        detail::ring_backoff backoff;
+        while(n != 0)
+        {
+            const auto m = ring_.try_read(dst, n);
+            if(m == 0)
+            {
+                if(ring_.is_drained())
+                {
+                    ok_ = false;
+                    return false;
+                }
+                backoff([this] {ring_.wait_readable();});
+                continue;
+            }
+            if(dst) {dst += m;}
+            n -= m;
+        }
+        return true;
     }
-}
 
+  private:
+
+    spsc_ring& ring_;
+    bool       ok_;
+};
+static_assert(Reader<ring_reader>);
 
 } // msgplus
-#endif//MSGPLUS_WRITE_HPP
-#ifndef MSGPLUS_READ_HPP
-#define MSGPLUS_READ_HPP
+#endif // MSGPLUS_RING_HPP
+#ifndef MSGPLUS_ALLOCATION_STATS_HPP
+#define MSGPLUS_ALLOCATION_STATS_HPP
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
 
-#include <bit>
-#include <cstring>
+// Opt-in counting of heap allocations.
+//
+// The counting is done by replacements of the global operator new and delete.
+// To install them, define `MSGPLUS_IMPLEMENT_ALLOCATION_HOOKS` in exactly one
+// translation unit of the program before including this header:
+//
+// ```cpp
+// #define MSGPLUS_IMPLEMENT_ALLOCATION_HOOKS
+// #include <msgplus.hpp>
+//
+// const auto stats = msgplus::count_allocations([&] { v = msgplus::read(reader); });
+// ```
+//
+// Only the allocations made by the current thread inside an allocation_scope
+// are counted. Outside of a scope, the hooks cost a thread-local flag check.
+// Every allocation carries a small header that remembers its size, so the
+// hooks are for measurement builds, not for production.
 
 namespace msgplus
 {
 
-namespace detail
-{
-template<typename T, Reader R>
-std::optional<T> read_as_big_endian(R& reader)
+struct allocation_stats
 {
-    constexpr auto N = sizeof(T);
-    T x;
-    const auto as_bytes = reinterpret_cast<std::byte*>(std::addressof(x));
-    if constexpr(std::endian::native == std::endian::little)
-    {
-        for(std::size_t i=1; i<=N; ++i)
-        {
-            if(const auto b = reader.read_byte())
-            {
-                as_bytes[N-i] = b.value();
-            }
-            else
-            {
-                return std::nullopt;
-            }
-        }
-        return x;
-    }
-    else // native == big endian
-    {
-        if(const auto bs = reader.template read_bytes<N>())
-        {
-            std::memcpy(as_bytes, bs.value().data(), N);
-            return x;
-        }
-        else
-        {
-            return std::nullopt;
-        }
-    }
-}
-} // detail
-
-// forward decl
-template<Reader R>
-std::optional<value> read(R& reader);
+    std::size_t allocations     = 0;
+    std::size_t deallocations   = 0;
+    std::size_t bytes_allocated = 0;
+    std::size_t bytes_freed     = 0;
+    // the largest net amount of memory held at any point since the start,
+    // not counting what was allocated before it
+    std::size_t peak_live_bytes = 0;
+};
 
 namespace detail
 {
 
-template<Reader R>
-std::optional<value> read_bin(R& reader, std::optional<std::size_t> len)
+struct allocation_counter
 {
-    if( ! len.has_value()) {return std::nullopt;}
+    bool             active = false;
+    allocation_stats stats;
+    std::int64_t     live   = 0; // may be negative if memory from before is freed
+};
 
-    auto v = reader.read_bytes(len.value());
-    if( ! v.has_value()) {return std::nullopt;}
+inline thread_local allocation_counter current_allocations;
 
-    return value(std::move(v.value()));
-}
+// set by the translation unit that implements the hooks
+inline bool allocation_hooks_installed = false;
 
-template<Reader R>
-std::optional<value> read_ext(R& reader, std::optional<std::size_t> len)
+inline void record_allocation(const std::size_t n) noexcept
 {
-    if( ! len.has_value()) {return std::nullopt;}
-
-    auto type = detail::read_as_big_endian<std::int8_t>(reader);
-    if( ! type.has_value()) {return std::nullopt;}
+    auto& c = current_allocations;
+    if( ! c.active) {return;}
 
-    auto v = reader.read_bytes(len.value());
-    if( ! v.has_value()) {return std::nullopt;}
-
-    return value(std::make_pair(type.value(), std::move(v.value())));
+    c.stats.allocations     += 1;
+    c.stats.bytes_allocated += n;
+    c.live                  += static_cast<std::int64_t>(n);
+    if(0 < c.live)
+    {
+        c.stats.peak_live_bytes = std::max(c.stats.peak_live_bytes,
+                                           static_cast<std::size_t>(c.live));
+    }
+    return;
 }
 
-template<Reader R>
-std::optional<value> read_str(R& reader, std::optional<std::size_t> len)
+inline void record_deallocation(const std::size_t n) noexcept
 {
-    if( ! len.has_value()) {return std::nullopt;}
+    auto& c = current_allocations;
+    if( ! c.active) {return;}
 
-    auto v = reader.read_bytes(len.value());
-    if( ! v.has_value()) {return std::nullopt;}
+    c.stats.deallocations += 1;
+    c.stats.bytes_freed   += n;
+    c.live                -= static_cast<std::int64_t>(n);
+    return;
+}
 
-    std::string s(len.value(), '\0');
-    std::transform(v.value().begin(), v.value().end(), s.begin(),
-        [](const std::byte b) -> char { return std::bit_cast<char>(b); });
+} // detail
 
-    return value(std::move(s));
+// true if the hooks are linked into the program. If not, scopes count nothing.
+inline bool allocation_counting_available() noexcept
+{
+    return detail::allocation_hooks_installed;
 }
 
-template<Reader R>
-std::optional<value> read_array(R& reader, std::optional<std::size_t> len)
+// Counts the allocations of this thread while it is alive. Scopes can be
+// nested; what an inner scope counts is also counted by the outer one.
+class allocation_scope
 {
-    if( ! len.has_value()) {return std::nullopt;}
+  public:
 
-    std::vector<value> vs;
-    vs.reserve(len.value());
-    for(std::size_t i=0; i<len.value(); ++i)
+    allocation_scope() noexcept
+        : outer_(std::exchange(detail::current_allocations, detail::allocation_counter{}))
     {
-        auto elem = read(reader);
-        if( ! elem.has_value()) {return std::nullopt;}
-        vs.push_back(std::move(elem.value()));
+        detail::current_allocations.active = true;
     }
-    return value(vs);
-}
-
-template<Reader R>
-std::optional<value> read_map(R& reader, std::optional<std::size_t> len)
-{
-    if( ! len.has_value()) {return std::nullopt;}
-
-    ordered_map<value, value> vs;
-    for(std::size_t i=0; i<len.value(); ++i)
+    ~allocation_scope() noexcept
     {
-        auto key = read(reader);
-        if( ! key.has_value()) {return std::nullopt;}
+        const auto inner = detail::current_allocations;
+        detail::current_allocations = outer_;
 
-        auto elem = read(reader);
-        if( ! elem.has_value()) {return std::nullopt;}
+        auto& c = detail::current_allocations;
+        if( ! c.active) {return;}
 
-        vs.emplace_back(std::move(key.value()), std::move(elem.value()));
+        const auto peak = c.live + static_cast<std::int64_t>(inner.stats.peak_live_bytes);
+        if(0 < peak)
+        {
+            c.stats.peak_live_bytes = std::max(c.stats.peak_live_bytes,
+                                               static_cast<std::size_t>(peak));
+        }
+        c.stats.allocations     += inner.stats.allocations;
+        c.stats.deallocations   += inner.stats.deallocations;
+        c.stats.bytes_allocated += inner.stats.bytes_allocated;
+        c.stats.bytes_freed     += inner.stats.bytes_freed;
+        c.live                  += inner.live;
     }
-    return value(vs);
+
+    allocation_scope(const allocation_scope&) = delete;
+    allocation_scope(allocation_scope&&)      = delete;
+    allocation_scope& operator=(const allocation_scope&) = delete;
+    allocation_scope& operator=(allocation_scope&&)      = delete;
+
+    // what has been counted so far
+    allocation_stats stats() const noexcept {return detail::current_allocations.stats;}
+
+  private:
+
+    detail::allocation_counter outer_;
+};
+
+// runs `f` and returns the allocations it made on this thread
+template<typename F>
+allocation_stats count_allocations(F&& f)
+{
+    allocation_scope scope;
+    std::forward<F>(f)();
+    return scope.stats();
 }
 
-} // detail
+} // msgplus
+#endif // MSGPLUS_ALLOCATION_STATS_HPP
 
-template<Reader R>
-std::optional<value> read(R& reader)
+#if defined(MSGPLUS_IMPLEMENT_ALLOCATION_HOOKS) && ! defined(MSGPLUS_ALLOCATION_HOOKS_IMPLEMENTED)
+#define MSGPLUS_ALLOCATION_HOOKS_IMPLEMENTED
+
+#include <cstdlib>
+#if defined(_MSC_VER)
+#include <malloc.h> // _aligned_malloc, _aligned_free
+#endif
+
+namespace msgplus
+{
+namespace detail
 {
-    if(const auto b = reader.read_byte())
+
+// The size of a block is stored in a header of `align` bytes in front of it.
+inline void* counted_allocate(const std::size_t n, const std::size_t align) noexcept
+{
+    const std::size_t header = std::max(align, std::size_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+    const std::size_t total  = header + (n + header - 1) / header * header;
+    while(true)
     {
-        const auto tag = static_cast<std::uint8_t>(b.value());
-        if(tag <= 0x7F) // positive fixint
-        {
-            return value(tag);
-        }
-        else if(0xE0 <= tag) // negative fixint
-        {
-            const auto fixint = std::bit_cast<std::int8_t>(tag);
-            return value(fixint);
-        }
-        else if((tag & 0b1110'0000) == 0b1010'0000) // fixstr
-        {
-            const auto len = tag & 0b0001'1111;
-            return detail::read_str(reader, len);
-        }
-        else if((tag & 0b1111'0000) == 0b1001'0000) // fixarray
-        {
-            const auto len = tag & 0b0000'1111;
-            return detail::read_array(reader, len);
-        }
-        else if((tag & 0b1111'0000) == 0b1000'0000) // fixmap
-        {
-            const auto len = tag & 0b0000'1111;
-            return detail::read_map(reader, len);
-        }
-
-        switch(tag)
-        {
-            case 0xC0: {return value(nil_type{});}
-            //   0xC1: {never used}
-            case 0xC2: {return value(false);}
-            case 0xC3: {return value(true);}
-            case 0xC4: {return detail::read_bin(reader, detail::read_as_big_endian<std::uint8_t >(reader));}
-            case 0xC5: {return detail::read_bin(reader, detail::read_as_big_endian<std::uint16_t>(reader));}
-            case 0xC6: {return detail::read_bin(reader, detail::read_as_big_endian<std::uint32_t>(reader));}
-            case 0xC7: {return detail::read_ext(reader, detail::read_as_big_endian<std::uint8_t >(reader));}
-            case 0xC8: {return detail::read_ext(reader, detail::read_as_big_endian<std::uint16_t>(reader));}
-            case 0xC9: {return detail::read_ext(reader, detail::read_as_big_endian<std::uint32_t>(reader));}
-            case 0xCA: {return detail::read_as_big_endian<float32_type >(reader);}
-            case 0xCB: {return detail::read_as_big_endian<float64_type >(reader);}
-            case 0xCC: {return detail::read_as_big_endian<std::uint8_t >(reader);}
-            case 0xCD: {return detail::read_as_big_endian<std::uint16_t>(reader);}
-            case 0xCE: {return detail::read_as_big_endian<std::uint32_t>(reader);}
-            case 0xCF: {return detail::read_as_big_endian<std::uint64_t>(reader);}
-            case 0xD0: {return detail::read_as_big_endian<std::int8_t  >(reader);}
-            case 0xD1: {return detail::read_as_big_endian<std::int16_t >(reader);}
-            case 0xD2: {return detail::read_as_big_endian<std::int32_t >(reader);}
-            case 0xD3: {return detail::read_as_big_endian<std::int64_t >(reader);}
-            case 0xD4: {return detail::read_ext(reader,  1);}
-            case 0xD5: {return detail::read_ext(reader,  2);}
-            case 0xD6: {return detail::read_ext(reader,  4);}
-            case 0xD7: {return detail::read_ext(reader,  8);}
-            case 0xD8: {return detail::read_ext(reader, 16);}
-            case 0xD9: {return detail::read_str(reader, detail::read_as_big_endian<std::uint8_t >(reader));}
-            case 0xDA: {return detail::read_str(reader, detail::read_as_big_endian<std::uint16_t>(reader));}
-            case 0xDB: {return detail::read_str(reader, detail::read_as_big_endian<std::uint32_t>(reader));}
-            case 0xDC: {return detail::read_array(reader, detail::read_as_big_endian<std::uint16_t>(reader));}
-            case 0xDD: {return detail::read_array(reader, detail::read_as_big_endian<std::uint32_t>(reader));}
-            case 0xDE: {return detail::read_map(reader, detail::read_as_big_endian<std::uint16_t>(reader));}
-            case 0xDF: {return detail::read_map(reader, detail::read_as_big_endian<std::uint32_t>(reader));}
-            default: return std::nullopt;
+#if defined(_MSC_VER)
+        void* base = _aligned_malloc(total, header);
+#else
+        void* base = std::aligned_alloc(header, total);
+#endif
+        if(base != nullptr)
+        {
+            auto* block = static_cast<std::byte*>(base) + header;
+            *reinterpret_cast<std::size_t*>(block - sizeof(std::size_t)) = n;
+            record_allocation(n);
+            return block;
+        }
+        const auto handler = std::get_new_handler();
+        if( ! handler) {return nullptr;}
+        try
+        {
+            handler();
+        }
+        catch(...)
+        {
+            return nullptr;
         }
     }
-    else
-    {
-        return std::nullopt;
-    }
 }
 
+inline void counted_deallocate(void* p, const std::size_t align) noexcept
+{
+    if(p == nullptr) {return;}
+
+    const std::size_t header = std::max(align, std::size_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+    auto* block = static_cast<std::byte*>(p);
+    record_deallocation(*reinterpret_cast<std::size_t*>(block - sizeof(std::size_t)));
+#if defined(_MSC_VER)
+    _aligned_free(block - header);
+#else
+    std::free(block - header);
+#endif
+    return;
+}
+
+inline void* counted_allocate_or_throw(const std::size_t n, const std::size_t align)
+{
+    if(void* p = counted_allocate(n, align)) {return p;}
+    throw std::bad_alloc();
+}
+
+inline const bool allocation_hooks_registered = (allocation_hooks_installed = true);
+
+} // detail
 } // msgplus
-#endif//MSGPLUS_READ_HPP
+
+void* operator new  (std::size_t n) {return msgplus::detail::counted_allocate_or_throw(n, 0);}
+void* operator new[](std::size_t n) {return msgplus::detail::counted_allocate_or_throw(n, 0);}
+void* operator new  (std::size_t n, std::align_val_t a) {return msgplus::detail::counted_allocate_or_throw(n, static_cast<std::size_t>(a));}
+void* operator new[](std::size_t n, std::align_val_t a) {return msgplus::detail::counted_allocate_or_throw(n, static_cast<std::size_t>(a));}
+void* operator new  (std::size_t n, const std::nothrow_t&) noexcept {return msgplus::detail::counted_allocate(n, 0);}
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept {return msgplus::detail::counted_allocate(n, 0);}
+void* operator new  (std::size_t n, std::align_val_t a, const std::nothrow_t&) noexcept {return msgplus::detail::counted_allocate(n, static_cast<std::size_t>(a));}
+void* operator new[](std::size_t n, std::align_val_t a, const std::nothrow_t&) noexcept {return msgplus::detail::counted_allocate(n, static_cast<std::size_t>(a));}
+
+void operator delete  (void* p) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete[](void* p) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete  (void* p, std::size_t) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete[](void* p, std::size_t) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete  (void* p, const std::nothrow_t&) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {msgplus::detail::counted_deallocate(p, 0);}
+void operator delete  (void* p, std::align_val_t a) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+void operator delete[](void* p, std::align_val_t a) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+void operator delete  (void* p, std::size_t, std::align_val_t a) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+void operator delete[](void* p, std::size_t, std::align_val_t a) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+void operator delete  (void* p, std::align_val_t a, const std::nothrow_t&) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+void operator delete[](void* p, std::align_val_t a, const std::nothrow_t&) noexcept {msgplus::detail::counted_deallocate(p, static_cast<std::size_t>(a));}
+
+#endif // MSGPLUS_IMPLEMENT_ALLOCATION_HOOKS
 #ifndef MSGPLUS_HPP
 #define MSGPLUS_HPP
 